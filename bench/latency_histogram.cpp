@@ -0,0 +1,48 @@
+#include <bit>
+#include <algorithm>
+#include <cmath>
+
+#include "latency_histogram.hpp"
+
+
+void LatencyHistogram::record(std::uint64_t value) {
+  counts[bucketOf(value)]++;
+  total++;
+  sum += value;
+  largest = std::max(largest, value);
+}
+
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (std::size_t i = 0; i < bucketCount; i++) { counts[i] += other.counts[i]; }
+  total += other.total;
+  sum += other.sum;
+  largest = std::max(largest, other.largest);
+}
+
+
+std::uint64_t LatencyHistogram::percentile(double fraction) const {
+  if (total == 0) { return 0; }
+  std::uint64_t wanted = std::max<std::uint64_t>(1, std::ceil(fraction * total)); //the rank of the sample we're after
+  std::uint64_t seen = 0;
+  for (std::size_t bucket = 0; bucket < bucketCount; bucket++) {
+    seen += counts[bucket];
+    if (seen >= wanted) { return std::min(highestIn(bucket), largest); }
+  }
+  return largest;
+}
+
+
+std::size_t LatencyHistogram::bucketOf(std::uint64_t value) {
+  if (value < subBuckets) { return value; }
+  unsigned shift = std::bit_width(value) - 1 - subBucketBits; //how many low bits this power of two's buckets ignore
+  return (shift + 1) * subBuckets + ((value >> shift) - subBuckets);
+} //32-63 are buckets 32-63, 64-127 are 64-95 in steps of 2, 128-255 are 96-127 in steps of 4...
+
+
+std::uint64_t LatencyHistogram::highestIn(std::size_t bucket) {
+  if (bucket < subBuckets) { return bucket; }
+  unsigned shift = bucket / subBuckets - 1;
+  std::uint64_t top = bucket % subBuckets + subBuckets;
+  return ((top + 1) << shift) - 1;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+ * Counts latencies into buckets instead of keeping every sample, so a run of millions of requests takes a few KiB and
+ *    merging the load generator's threads is adding up arrays.
+ *
+ * Values below 32 get a bucket each. Above that, every power of two is split into 32 buckets, so a percentile is off by
+ *    at most 1/32 (about 3%) of its value - the same idea as HdrHistogram, with a fixed precision.
+*/
+class LatencyHistogram {
+  public:
+    void record(std::uint64_t value);
+    void merge(const LatencyHistogram& other);
+
+    std::uint64_t count() const { return total; }
+    std::uint64_t max() const { return largest; }
+    double mean() const { return total == 0 ? 0 : static_cast<double>(sum) / total; }
+    std::uint64_t percentile(double fraction) const; //the highest value in the bucket that fraction of the samples fit into. 0 if empty
+
+  private:
+    static constexpr unsigned subBucketBits = 5;
+    static constexpr std::size_t subBuckets = std::size_t(1) << subBucketBits;
+    static constexpr std::size_t bucketCount = (64 - subBucketBits + 1) * subBuckets; //enough for any 64 bit value
+
+    std::array<std::uint64_t, bucketCount> counts{};
+    std::uint64_t total = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t largest = 0;
+
+    static std::size_t bucketOf(std::uint64_t value);
+    static std::uint64_t highestIn(std::size_t bucket);
+};
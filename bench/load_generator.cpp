@@ -0,0 +1,476 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <array>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <cstdint>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "latency_histogram.hpp"
+
+
+/**
+ * A load generator for the server. bench/run.sh runs it for every scenario we track and collects the results.
+ *
+ *    bench --path /echo/abc --connections 64 --pipeline 8 --duration 10
+ *    bench --method POST --path /files/upload.bin --body-size 65536 --rate 2000
+ *
+ * Closed loop (the default): every connection keeps --pipeline requests in flight, and sends the next one as soon as a
+ *    response comes back. That finds the most the server can do - but a server that stalls also stops the clock, since
+ *    the requests that would have been sent meanwhile never are, and their latency is never counted.
+ * Open loop (--rate): requests are due on a fixed schedule whether or not the server keeps up, and their latency is
+ *    measured from when they were due. A stall then shows up in the percentiles as the queue it built.
+ *
+ * With --keep-alive off every request gets a connection of its own, closed once the response is in.
+ *
+ * The result is one JSON object on stdout: requests per second and latency percentiles in microseconds over the
+ *    --duration after --warmup, the status codes seen, and transport errors (failed connects, resets, early closes).
+*/
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  struct BenchConfig {
+    std::string host = "127.0.0.1";
+    std::string port = "4221";
+    std::string scenario = "custom"; //--scenario, only a label for the JSON
+    std::string method = "GET";
+    std::string path = "/";
+    std::vector<std::string> headers; //--header, may be given several times
+    std::size_t bodySize = 0; //--body-size, bytes sent with every request
+    long connections = 64;
+    long pipeline = 1; //--pipeline, requests in flight per connection
+    bool keepAlive = true; //--keep-alive, "on" or "off"
+    double rate = 0; //--rate, requests per second over all connections. 0 is closed loop
+    long threads = 0; //--threads, 0 is one per CPU (but not more than connections)
+    double duration = 10; //--duration, seconds measured
+    double warmup = 1; //--warmup, seconds of load before measuring starts
+  };
+
+  struct Results {
+    LatencyHistogram latency; //microseconds
+    std::uint64_t requests = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t bytes = 0; //received, headers included
+    std::array<std::uint64_t, 600> statuses{};
+
+    void merge(const Results& other) {
+      latency.merge(other.latency);
+      requests += other.requests;
+      errors += other.errors;
+      bytes += other.bytes;
+      for (std::size_t i = 0; i < statuses.size(); i++) { statuses[i] += other.statuses[i]; }
+    }
+  };
+
+  struct Connection {
+    int fd = -1;
+    std::uint32_t generation = 0; //bumped for every socket, so events for a closed one aren't taken for the next
+    bool connected = false;
+    Clock::time_point connectAt; //when to (re)connect, once fd is -1
+    std::string out; //requests not sent yet
+    std::size_t outSent = 0;
+    std::string in; //response bytes not parsed yet
+    bool inBody = false; //the head of the response being read has been parsed
+    std::size_t bodyLeft = 0;
+    int status = 0;
+    std::deque<Clock::time_point> inFlight; //when each request we wait for was sent - or was due, in open loop
+    std::deque<Clock::time_point> waiting; //open loop: requests that are due, but the pipeline is full
+    Clock::time_point nextDue; //open loop: when the next request is due
+  };
+
+  /* One thread's share of the connections, all on one epoll instance. */
+  class LoadWorker {
+    public:
+      LoadWorker(const BenchConfig& config, const struct addrinfo* address, const std::string& request)
+        : config(config), address(address), request(request) {}
+
+      void run(std::size_t firstConnection, std::size_t connectionCount, Clock::time_point start,
+        Clock::time_point measureFrom, Clock::time_point stopAt);
+      const Results& results() const { return measured; }
+
+    private:
+      const BenchConfig& config;
+      const struct addrinfo* address;
+      const std::string& request;
+      int epoll_fd = -1;
+      std::vector<Connection> connections;
+      Clock::duration interval{}; //open loop: between one connection's requests
+      Clock::time_point measureFrom;
+      Results measured;
+
+      bool openLoop() const { return config.rate > 0; }
+      void open(Connection& connection, Clock::time_point now);
+      void fail(Connection& connection, Clock::time_point now); //an error - counted, and the connection starts over
+      void drop(Connection& connection);
+      void fill(Connection& connection, Clock::time_point now); //queues requests until the pipeline is full
+      void flush(Connection& connection, Clock::time_point now);
+      void receive(Connection& connection, Clock::time_point now);
+      bool parse(Connection& connection, Clock::time_point now); //false once the connection was closed
+  };
+}
+
+static bool parseArguments(int argc, char** argv, BenchConfig& config);
+static std::string buildRequest(const BenchConfig& config);
+static std::size_t contentLength(std::string_view head);
+static void printResults(const BenchConfig& config, const Results& results, double seconds);
+
+
+int main(int argc, char** argv) {
+  BenchConfig config;
+  if (!parseArguments(argc, argv, config)) { return 1; }
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* address = nullptr;
+  int status = getaddrinfo(config.host.c_str(), config.port.c_str(), &hints, &address);
+  if (status != 0) {
+    std::cerr << "Can't resolve " << config.host << ":" << config.port << ": " << gai_strerror(status) << "\n";
+    return 1;
+  }
+
+  if (config.threads == 0) { config.threads = std::max(1u, std::thread::hardware_concurrency()); }
+  config.threads = std::min(config.threads, config.connections);
+  std::string request = buildRequest(config);
+
+  auto start = Clock::now();
+  auto measureFrom = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.warmup));
+  auto stopAt = measureFrom + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.duration));
+  std::vector<LoadWorker> workers(config.threads, LoadWorker(config, address, request));
+  std::vector<std::thread> threads;
+  for (long i = 0; i < config.threads; i++) {
+    std::size_t first = config.connections * i / config.threads;
+    std::size_t count = config.connections * (i + 1) / config.threads - first;
+    threads.emplace_back(&LoadWorker::run, &workers[i], first, count, start, measureFrom, stopAt);
+  }
+  for (std::thread& thread : threads) { thread.join(); }
+  freeaddrinfo(address);
+
+  Results results;
+  for (const LoadWorker& worker : workers) { results.merge(worker.results()); }
+  printResults(config, results, config.duration);
+  return 0;
+}
+
+
+
+
+void LoadWorker::run(std::size_t firstConnection, std::size_t connectionCount, Clock::time_point start,
+    Clock::time_point measureFrom, Clock::time_point stopAt) {
+  this->measureFrom = measureFrom;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    std::cerr << "epoll_create1 failed: " << std::strerror(errno) << "\n";
+    return;
+  }
+
+  connections.resize(connectionCount);
+  if (openLoop()) {
+    interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.connections / config.rate));
+    for (std::size_t i = 0; i < connectionCount; i++) { //spread out over the first interval, so they don't all fire at once
+      connections[i].nextDue = start + interval * (firstConnection + i) / config.connections;
+    }
+  }
+  for (Connection& connection : connections) { open(connection, start); }
+
+  std::array<struct epoll_event, 256> events;
+  while (true) {
+    auto now = Clock::now();
+    if (now >= stopAt) { break; }
+
+    auto wakeAt = std::min(stopAt, now + std::chrono::milliseconds(100));
+    for (Connection& connection : connections) {
+      if (openLoop()) {
+        while (connection.nextDue <= now) {
+          connection.waiting.push_back(connection.nextDue);
+          connection.nextDue += interval;
+        }
+        wakeAt = std::min(wakeAt, connection.nextDue);
+      }
+      if (connection.fd < 0) {
+        if (connection.connectAt <= now) { open(connection, now); }
+        else { wakeAt = std::min(wakeAt, connection.connectAt); }
+      }
+      if (openLoop() && connection.connected) { fill(connection, now); }
+    }
+
+    int timeout = std::chrono::ceil<std::chrono::milliseconds>(wakeAt - now).count();
+    int ready = epoll_wait(epoll_fd, events.data(), events.size(), std::max(timeout, 0));
+    if (ready < 0 && errno != EINTR) {
+      std::cerr << "epoll_wait failed: " << std::strerror(errno) << "\n";
+      break;
+    }
+    now = Clock::now();
+    for (int i = 0; i < ready; i++) {
+      Connection& connection = connections[events[i].data.u64 & 0xffffffff];
+      std::uint32_t flags = events[i].events;
+      if (connection.fd < 0 || connection.generation != events[i].data.u64 >> 32) { continue; } //closed by an earlier event in this batch
+      if (!connection.connected && (flags & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+          fail(connection, now);
+          continue;
+        }
+        connection.connected = true;
+        fill(connection, now);
+      }
+      if (flags & EPOLLOUT) { flush(connection, now); }
+      if (connection.fd >= 0 && (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) { receive(connection, now); }
+    }
+  }
+
+  for (Connection& connection : connections) { drop(connection); } //requests still in flight aren't counted either way
+  close(epoll_fd);
+}
+
+
+void LoadWorker::open(Connection& connection, Clock::time_point now) {
+  connection.fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+  if (connection.fd < 0) {
+    fail(connection, now);
+    return;
+  }
+  int one = 1;
+  setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); //small requests go out when they're written
+  if (connect(connection.fd, address->ai_addr, address->ai_addrlen) != 0 && errno != EINPROGRESS) {
+    fail(connection, now);
+    return;
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.u64 = (std::uint64_t(++connection.generation) << 32) | std::uint64_t(&connection - connections.data());
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection.fd, &event) != 0) { fail(connection, now); }
+} //connected once the socket turns writable
+
+
+void LoadWorker::fail(Connection& connection, Clock::time_point now) {
+  if (now >= measureFrom) { measured.errors++; }
+  drop(connection);
+  connection.connectAt = now + std::chrono::milliseconds(10); //a server that refuses us shouldn't make us spin
+}
+
+
+void LoadWorker::drop(Connection& connection) {
+  if (connection.fd >= 0) { close(connection.fd); } //which also takes it out of the epoll set
+  connection.fd = -1;
+  connection.connected = false;
+  connection.out.clear();
+  connection.outSent = 0;
+  connection.in.clear();
+  connection.inBody = false;
+  connection.inFlight.clear(); //open loop: lost with the connection, what's waiting is still due
+}
+
+
+void LoadWorker::fill(Connection& connection, Clock::time_point now) {
+  std::size_t depth = config.keepAlive ? config.pipeline : 1;
+  bool queued = false;
+  while (connection.inFlight.size() < depth) {
+    if (openLoop() && connection.waiting.empty()) { break; }
+    Clock::time_point sent = now;
+    if (openLoop()) {
+      sent = connection.waiting.front();
+      connection.waiting.pop_front();
+    }
+    connection.out += request;
+    connection.inFlight.push_back(sent);
+    queued = true;
+  }
+  if (queued) { flush(connection, now); }
+}
+
+
+void LoadWorker::flush(Connection& connection, Clock::time_point now) {
+  while (connection.connected && connection.outSent < connection.out.size()) {
+    ssize_t bytes_sent = send(connection.fd, connection.out.data() + connection.outSent, connection.out.size() - connection.outSent, MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) { fail(connection, now); }
+      return; //EPOLLOUT says when there's room again
+    }
+    connection.outSent += bytes_sent;
+  }
+  if (connection.outSent == connection.out.size()) {
+    connection.out.clear();
+    connection.outSent = 0;
+  }
+}
+
+
+void LoadWorker::receive(Connection& connection, Clock::time_point now) {
+  std::array<char, 64 * 1024> buffer;
+  while (connection.fd >= 0) {
+    ssize_t bytes_received = recv(connection.fd, buffer.data(), buffer.size(), 0);
+    if (bytes_received < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) { fail(connection, now); }
+      return;
+    }
+    if (bytes_received == 0) { //the server closed the connection, with requests still unanswered
+      fail(connection, now);
+      return;
+    }
+    now = Clock::now(); //a large response takes many reads, and the next request may go out in between
+    if (now >= measureFrom) { measured.bytes += bytes_received; }
+    connection.in.append(buffer.data(), bytes_received);
+    if (!parse(connection, now)) { return; }
+  }
+} //edge triggered, so until EAGAIN
+
+
+bool LoadWorker::parse(Connection& connection, Clock::time_point now) {
+  std::string& in = connection.in;
+  std::size_t consumed = 0;
+  while (true) {
+    if (!connection.inBody) {
+      std::size_t end = in.find("\r\n\r\n", consumed);
+      if (end == std::string::npos) { break; }
+      std::string_view head = std::string_view(in).substr(consumed, end + 4 - consumed);
+      connection.status = 0;
+      if (head.size() > 12) { std::from_chars(head.data() + 9, head.data() + 12, connection.status); } //"HTTP/1.1 200 OK"
+      connection.bodyLeft = contentLength(head);
+      connection.inBody = true;
+      consumed = end + 4;
+    }
+    std::size_t taken = std::min(connection.bodyLeft, in.size() - consumed);
+    consumed += taken;
+    connection.bodyLeft -= taken;
+    if (connection.bodyLeft > 0) { break; }
+
+    connection.inBody = false;
+    if (connection.status == 100) { continue; } //an interim response - the real one follows
+    if (connection.inFlight.empty()) { //a response we didn't ask for
+      fail(connection, now);
+      return false;
+    }
+    if (now >= measureFrom) {
+      measured.latency.record(std::chrono::duration_cast<std::chrono::microseconds>(now - connection.inFlight.front()).count());
+      measured.requests++;
+      measured.statuses[std::clamp(connection.status, 0, int(measured.statuses.size()) - 1)]++;
+    }
+    connection.inFlight.pop_front();
+    if (!config.keepAlive) { //the connection was only for this request
+      drop(connection);
+      open(connection, now);
+      return false;
+    }
+    if (!openLoop()) {
+      fill(connection, now);
+      if (connection.fd < 0) { return false; } //the send failed
+    }
+  }
+  in.erase(0, consumed);
+  return true;
+}
+
+
+
+
+static bool parseArguments(int argc, char** argv, BenchConfig& config) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    std::string value = argv[i+1];
+    if (flag == "--host") { config.host = value; }
+    else if (flag == "--port") { config.port = value; }
+    else if (flag == "--scenario") { config.scenario = value; }
+    else if (flag == "--method") { config.method = value; }
+    else if (flag == "--path") { config.path = value; }
+    else if (flag == "--header") { config.headers.push_back(value); }
+    else if (flag == "--body-size") { config.bodySize = std::strtoul(value.c_str(), nullptr, 10); }
+    else if (flag == "--connections") { config.connections = std::strtol(value.c_str(), nullptr, 10); }
+    else if (flag == "--pipeline") { config.pipeline = std::strtol(value.c_str(), nullptr, 10); }
+    else if (flag == "--rate") { config.rate = std::strtod(value.c_str(), nullptr); }
+    else if (flag == "--threads") { config.threads = std::strtol(value.c_str(), nullptr, 10); }
+    else if (flag == "--duration") { config.duration = std::strtod(value.c_str(), nullptr); }
+    else if (flag == "--warmup") { config.warmup = std::strtod(value.c_str(), nullptr); }
+    else if (flag == "--keep-alive") {
+      if (value != "on" && value != "off") {
+        std::cerr << "Unknown --keep-alive " << value << ". Use on or off\n";
+        return false;
+      }
+      config.keepAlive = value == "on";
+    }
+    else { std::cerr << "Unknown argument " << flag << " ignored\n"; }
+  }
+  if (config.connections < 1 || config.pipeline < 1 || config.threads < 0) {
+    std::cerr << "--connections and --pipeline must be at least 1\n";
+    return false;
+  }
+  if (config.duration <= 0 || config.warmup < 0 || config.rate < 0) {
+    std::cerr << "--duration must be positive, --warmup and --rate can't be negative\n";
+    return false;
+  }
+  return true;
+}
+
+
+static std::string buildRequest(const BenchConfig& config) {
+  std::string request = config.method + " " + config.path + " HTTP/1.1\r\nHost: " + config.host + ":" + config.port + "\r\n";
+  bool userAgent = false;
+  for (const std::string& header : config.headers) {
+    request += header + "\r\n";
+    userAgent = userAgent || header.starts_with("User-Agent:");
+  }
+  if (!userAgent) { request += "User-Agent: bench/1.0\r\n"; }
+  if (!config.keepAlive) { request += "Connection: close\r\n"; }
+  if (config.bodySize > 0 || config.method == "POST") { request += "Content-Length: " + std::to_string(config.bodySize) + "\r\n"; }
+  request += "\r\n";
+  request.append(config.bodySize, 'x');
+  return request;
+} //every request is the same, so it's built once
+
+
+static std::size_t contentLength(std::string_view head) {
+  constexpr std::string_view name = "content-length:";
+  while (!head.empty()) {
+    std::size_t end = std::min(head.find("\r\n"), head.size());
+    std::string_view line = head.substr(0, end);
+    head.remove_prefix(std::min(end + 2, head.size()));
+    if (line.size() <= name.size()) { continue; }
+    bool matches = std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); });
+    if (!matches) { continue; }
+    std::string_view value = line.substr(name.size());
+    while (!value.empty() && value.front() == ' ') { value.remove_prefix(1); }
+    std::size_t length = 0;
+    std::from_chars(value.data(), value.data() + value.size(), length);
+    return length;
+  }
+  return 0;
+} //0 without one - the server always sends it, except on a 304
+
+
+static void printResults(const BenchConfig& config, const Results& results, double seconds) {
+  const LatencyHistogram& latency = results.latency;
+  std::cout << "{\"scenario\": \"" << config.scenario << "\", \"method\": \"" << config.method << "\", \"path\": \"" << config.path << "\""
+    << ", \"connections\": " << config.connections << ", \"pipeline\": " << config.pipeline
+    << ", \"keep_alive\": " << (config.keepAlive ? "true" : "false") << ", \"rate\": " << config.rate
+    << ", \"duration_s\": " << seconds << ", \"requests\": " << results.requests << ", \"errors\": " << results.errors
+    << ", \"rps\": " << static_cast<std::uint64_t>(results.requests / seconds)
+    << ", \"bytes_per_s\": " << static_cast<std::uint64_t>(results.bytes / seconds)
+    << ", \"latency_us\": {\"p50\": " << latency.percentile(0.5) << ", \"p99\": " << latency.percentile(0.99)
+    << ", \"p999\": " << latency.percentile(0.999) << ", \"max\": " << latency.max()
+    << ", \"mean\": " << static_cast<std::uint64_t>(latency.mean()) << "}, \"statuses\": {";
+  bool first = true;
+  for (std::size_t status = 0; status < results.statuses.size(); status++) {
+    if (results.statuses[status] == 0) { continue; }
+    std::cout << (first ? "" : ", ") << "\"" << status << "\": " << results.statuses[status];
+    first = false;
+  }
+  std::cout << "}}\n";
+} //one line, so a run of scenarios is easy to collect and diff
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Runs every benchmark scenario against a freshly started server and prints the results as a JSON array, one
+#   scenario per line - save it per commit and compare the rps and latency_us of two runs to catch regressions.
+#
+#   bench/run.sh > before.json
+#   BENCH_DURATION=30 SERVER_ARGS="--io epoll --workers 4" bench/run.sh > after.json
+#
+# BUILD_DIR (default build-bench) is configured as a Release build. The server gets the port BENCH_PORT (default
+#   4321) and a temporary --directory with the files the scenarios fetch, plus whatever is in SERVER_ARGS. Its log
+#   goes to server.log in that directory, and is only shown if it doesn't start.
+#
+set -e
+cd "$(dirname "$0")/.."
+
+BUILD_DIR=${BUILD_DIR:-build-bench}
+PORT=${BENCH_PORT:-4321}
+DURATION=${BENCH_DURATION:-10}
+WARMUP=${BENCH_WARMUP:-2}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+
+cmake -S . -B "$BUILD_DIR" -DCMAKE_BUILD_TYPE=Release >/dev/null
+cmake --build "$BUILD_DIR" --target server bench -j"$(nproc)" >/dev/null
+
+FILES=$(mktemp -d)
+head -c 1024 /dev/urandom > "$FILES/small.bin" #served from the file cache
+head -c $((10 * 1024 * 1024)) /dev/urandom > "$FILES/large.bin" #too big for the cache, sent with sendfile()
+
+"$BUILD_DIR/server" --port "$PORT" --directory "$FILES" --log-level error $SERVER_ARGS > "$FILES/server.log" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; wait $SERVER 2>/dev/null; rm -rf "$FILES"' EXIT
+for _ in $(seq 50); do #until it's listening
+  (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+  sleep 0.1
+done
+if ! kill -0 $SERVER 2>/dev/null; then
+  cat "$FILES/server.log" >&2
+  exit 1
+fi
+
+scenario() {
+  local name=$1
+  shift
+  "$BUILD_DIR/bench" --port "$PORT" --scenario "$name" --duration "$DURATION" --warmup "$WARMUP" --connections "$CONNECTIONS" "$@"
+}
+
+echo "["
+scenario root --path / | sed 's/$/,/'
+scenario echo --path /echo/benchmark | sed 's/$/,/'
+scenario user-agent --path /user-agent | sed 's/$/,/'
+scenario echo-pipelined --path /echo/benchmark --pipeline 16 | sed 's/$/,/'
+scenario echo-close --path /echo/benchmark --keep-alive off | sed 's/$/,/'
+scenario echo-open-loop --path /echo/benchmark --rate 20000 | sed 's/$/,/'
+scenario small-file --path /files/small.bin | sed 's/$/,/'
+scenario large-file --path /files/large.bin --connections 8 | sed 's/$/,/'
+scenario missing-file --path /files/missing.bin | sed 's/$/,/'
+scenario upload --method POST --path /files/upload.bin --body-size 65536 --connections 16
+echo "]"
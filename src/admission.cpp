@@ -0,0 +1,67 @@
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "admission.hpp"
+
+
+Admission& admission() {
+  static Admission instance;
+  return instance;
+}
+
+
+void Admission::configure(std::size_t maxConnections, std::size_t maxPerAddress) {
+  this->maxConnections = maxConnections;
+  this->maxPerAddress = maxPerAddress;
+  if (maxConnections == 0 && maxPerAddress == 0) { return; }
+  struct rlimit limit = {};
+  admittedSize = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) { admittedSize = limit.rlim_cur; }
+  admitted = std::make_unique<std::atomic<std::uint64_t>[]>(admittedSize); //no fd can be at or above the limit
+}
+
+
+bool Admission::admit(int client_fd) {
+  if (admitted == nullptr) { return true; }
+  if (client_fd < 0 || static_cast<std::size_t>(client_fd) >= admittedSize) { return true; } //only if the limit was raised since
+
+  if (total.fetch_add(1, std::memory_order_relaxed) >= maxConnections && maxConnections != 0) {
+    total.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  std::uint32_t address = 0;
+  if (maxPerAddress != 0) {
+    struct sockaddr_in peer = {};
+    socklen_t length = sizeof(peer);
+    if (getpeername(client_fd, reinterpret_cast<struct sockaddr*>(&peer), &length) == 0 && peer.sin_family == AF_INET) {
+      address = peer.sin_addr.s_addr;
+    } //and if it's gone already, it's counted under 0 until it's released - which comes right after the first read fails
+    Shard& shard = shardOf(address);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    std::uint32_t& open = shard.open[address];
+    if (open >= maxPerAddress) {
+      total.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    open++;
+  }
+  admitted[client_fd].store(admittedFlag | address, std::memory_order_relaxed);
+  return true;
+}
+
+
+void Admission::release(int client_fd) {
+  if (admitted == nullptr || client_fd < 0 || static_cast<std::size_t>(client_fd) >= admittedSize) { return; }
+  std::uint64_t entry = admitted[client_fd].exchange(0, std::memory_order_relaxed);
+  if (entry == 0) { return; } //never admitted - turned away, or accepted before a limit applied to it
+  total.fetch_sub(1, std::memory_order_relaxed);
+  if (maxPerAddress == 0) { return; }
+
+  std::uint32_t address = static_cast<std::uint32_t>(entry);
+  Shard& shard = shardOf(address);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto found = shard.open.find(address);
+  if (found != shard.open.end() && --found->second == 0) { shard.open.erase(found); } //so the maps only hold addresses that are connected
+}
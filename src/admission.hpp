@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Who gets in: at most --max-connections clients open at once, and at most --max-connections-per-ip of them from any
+ *    one address. Whatever --io is, a connection is admitted right after it's accepted, and one that isn't gets a 503
+ *    from rejectClient() - so one busy client, or a flood of them, can't take every fd and thread there is.
+ *
+ * The total is one atomic counter. Connections per address are counted in maps split into shards by address, each
+ *    under its own lock, so workers accepting at the same moment rarely wait on each other. What a fd was admitted as
+ *    is kept in a table indexed by the fd, which is how release() finds its address again without a getpeername().
+ *
+ * With neither limit set (the default) nothing is counted, and admit() and release() return straight away.
+*/
+class Admission {
+  public:
+    Admission() = default;
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+
+    void configure(std::size_t maxConnections, std::size_t maxPerAddress); //0 for no limit. Before any connection is accepted
+    bool admit(int client_fd); //false if the client would be one too many, and then it isn't counted
+    void release(int client_fd); //before the fd is closed - once it's closed, the number may come back for another client. Fine for fds that weren't admitted
+
+  private:
+    static constexpr std::size_t shardCount = 16;
+
+    struct alignas(64) Shard {
+      std::mutex lock;
+      std::unordered_map<std::uint32_t, std::uint32_t> open; //by IPv4 address - the listeners are IPv4, refer openListeningSocket()
+    };
+
+    std::size_t maxConnections = 0;
+    std::size_t maxPerAddress = 0;
+    alignas(64) std::atomic<std::size_t> total{0};
+    std::array<Shard, shardCount> shards;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> admitted; //by fd: 0, or admittedFlag | the address
+    std::size_t admittedSize = 0;
+
+    static constexpr std::uint64_t admittedFlag = std::uint64_t(1) << 32;
+    Shard& shardOf(std::uint32_t address) { return shards[(address * 0x9e3779b1u) >> 28]; } //the top 4 bits of a Fibonacci hash
+};
+
+Admission& admission();
@@ -0,0 +1,106 @@
+#include <atomic>
+#include <array>
+#include <cstdlib>
+#include <cstddef>
+#include <algorithm>
+#include <new>
+
+#include "allocation_counter.hpp"
+
+
+/* Counts can't be kept in anything that allocates - operator new is what's being counted. So the slots are a fixed
+  array, handed out to threads in the order they first allocate. Threads beyond that share the last slot, which is
+  then updated with atomic adds instead. */
+
+namespace {
+  struct alignas(64) Slot { //a cache line per thread
+    std::atomic<std::uint64_t> allocations{0};
+    std::atomic<std::uint64_t> frees{0};
+    std::atomic<std::uint64_t> bytes{0};
+  };
+
+  constexpr std::size_t slotCount = 512;
+  std::array<Slot, slotCount> slots;
+  std::atomic<std::size_t> slotsClaimed{0};
+  thread_local Slot* slot = nullptr;
+  thread_local bool sharedSlot = false;
+
+  Slot& threadSlot() {
+    if (slot == nullptr) {
+      std::size_t index = slotsClaimed.fetch_add(1, std::memory_order_relaxed);
+      sharedSlot = index >= slotCount - 1;
+      slot = &slots[sharedSlot ? slotCount - 1 : index];
+    }
+    return *slot;
+  }
+
+  void add(std::atomic<std::uint64_t>& counter, std::uint64_t amount) {
+    if (sharedSlot) {
+      counter.fetch_add(amount, std::memory_order_relaxed);
+    } else {
+      counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); //only we write it
+    }
+  }
+
+  void* allocate(std::size_t size, std::size_t alignment, bool nothrow) {
+    Slot& counts = threadSlot();
+    add(counts.allocations, 1);
+    add(counts.bytes, size);
+    if (size == 0) { size = 1; }
+    void* memory = nullptr;
+    if (alignment <= alignof(std::max_align_t)) {
+      memory = std::malloc(size);
+    } else {
+      memory = std::aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1)); //size has to be a multiple
+    }
+    if (memory == nullptr && !nothrow) { throw std::bad_alloc(); }
+    return memory;
+  }
+
+  void deallocate(void* memory) {
+    if (memory == nullptr) { return; }
+    add(threadSlot().frees, 1);
+    std::free(memory);
+  }
+}
+
+
+AllocationCounts threadAllocations() {
+  Slot& counts = threadSlot();
+  return { counts.allocations.load(std::memory_order_relaxed), counts.frees.load(std::memory_order_relaxed), counts.bytes.load(std::memory_order_relaxed) };
+}
+
+
+AllocationCounts processAllocations() {
+  AllocationCounts total;
+  std::size_t claimed = std::min(slotsClaimed.load(std::memory_order_relaxed), slotCount);
+  for (std::size_t i = 0; i < claimed; i++) {
+    total.allocations += slots[i].allocations.load(std::memory_order_relaxed);
+    total.frees += slots[i].frees.load(std::memory_order_relaxed);
+    total.bytes += slots[i].bytes.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+
+void* operator new(std::size_t size) { return allocate(size, alignof(std::max_align_t), false); }
+void* operator new[](std::size_t size) { return allocate(size, alignof(std::max_align_t), false); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size, alignof(std::max_align_t), true); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size, alignof(std::max_align_t), true); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment), false); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment), false); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, static_cast<std::size_t>(alignment), true); }
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, static_cast<std::size_t>(alignment), true); }
+
+void operator delete(void* memory) noexcept { deallocate(memory); }
+void operator delete[](void* memory) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::size_t) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::size_t) noexcept { deallocate(memory); }
+void operator delete(void* memory, const std::nothrow_t&) noexcept { deallocate(memory); }
+void operator delete[](void* memory, const std::nothrow_t&) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept { deallocate(memory); }
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+
+struct AllocationCounts {
+  std::uint64_t allocations = 0; //calls to operator new
+  std::uint64_t frees = 0; //calls to operator delete
+  std::uint64_t bytes = 0; //bytes asked for by operator new
+};
+
+/**
+ * Counts heap allocations, by replacing the global operator new and delete (refer allocation_counter.cpp).
+ * 
+ * Every thread counts into its own slot, so counting costs a couple of uncontended stores. threadAllocations() is how
+ *    answerRequests() reports how many allocations answering a request took (the heap= field of the access log).
+*/
+AllocationCounts threadAllocations(); //made by the calling thread so far
+AllocationCounts processAllocations(); //made by every thread so far
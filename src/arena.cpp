@@ -0,0 +1,150 @@
+#include <new>
+#include <vector>
+
+#include "arena.hpp"
+
+
+static void* acquireBlock();
+static void releaseBlock(void* block);
+
+thread_local std::pmr::memory_resource* currentResource = nullptr;
+
+constexpr std::size_t pooledBlocks = 256; //per thread - 2 MiB of arena blocks
+constexpr std::size_t pooledBuffers = 64; //per thread
+constexpr std::size_t maxPooledBufferSize = 64 * 1024; //buffers that grew bigger (for a large request) are freed instead
+
+
+Arena::~Arena() {
+  reset();
+  while (first != nullptr) {
+    Block* next = first->next;
+    releaseBlock(first);
+    first = next;
+  }
+}
+
+
+void Arena::reset() {
+  while (oversized != nullptr) {
+    Block* next = oversized->next;
+    ::operator delete(oversized);
+    oversized = next;
+  }
+  current = first;
+  offset = sizeof(Block);
+  usedBytes = 0;
+}
+
+
+void* Arena::do_allocate(std::size_t bytes, std::size_t alignment) {
+  /* Offsets are aligned relative to the start of the block, and operator new aligns that for any standard type -
+    enough for everything strings and containers ask for. */
+  usedBytes += bytes;
+  if (bytes + alignment + sizeof(Block) > blockSize) { //would never fit in a normal block
+    std::size_t size = sizeof(Block) + alignment + bytes;
+    Block* block = static_cast<Block*>(::operator new(size));
+    *block = { oversized, size };
+    oversized = block;
+    std::size_t start = (sizeof(Block) + alignment - 1) & ~(alignment - 1);
+    return reinterpret_cast<char*>(block) + start;
+  }
+
+  while (true) {
+    if (current != nullptr) {
+      std::size_t start = (offset + alignment - 1) & ~(alignment - 1); //alignment is always a power of two
+      if (start + bytes <= current->size) {
+        offset = start + bytes;
+        return reinterpret_cast<char*>(current) + start;
+      }
+      if (current->next != nullptr) { //kept from before the last reset()
+        current = current->next;
+        offset = sizeof(Block);
+        continue;
+      }
+    }
+
+    Block* block = static_cast<Block*>(acquireBlock());
+    *block = { nullptr, blockSize };
+    if (current == nullptr) {
+      first = block;
+    } else {
+      current->next = block;
+    }
+    current = block;
+    offset = sizeof(Block);
+  }
+}
+
+
+ArenaScope::ArenaScope(Arena& arena) : previous(currentResource) {
+  currentResource = &arena;
+}
+
+
+ArenaScope::~ArenaScope() {
+  currentResource = previous;
+}
+
+
+std::pmr::memory_resource* requestMemory() {
+  return currentResource != nullptr ? currentResource : std::pmr::new_delete_resource();
+}
+
+
+static std::vector<void*>& blockPool() {
+  thread_local struct Blocks {
+    std::vector<void*> pooled;
+    Blocks() { pooled.reserve(pooledBlocks); }
+    ~Blocks() { for (void* block : pooled) { ::operator delete(block); } } //once a drained worker's thread exits
+  } blocks;
+  return blocks.pooled;
+}
+
+
+static void* acquireBlock() {
+  auto& pool = blockPool();
+  if (pool.empty()) {
+    return ::operator new(Arena::blockSize); //counted like any other allocation, refer allocation_counter.cpp
+  }
+  void* block = pool.back();
+  pool.pop_back();
+  return block;
+}
+
+
+static void releaseBlock(void* block) {
+  auto& pool = blockPool();
+  if (pool.size() < pooledBlocks) {
+    pool.push_back(block);
+  } else {
+    ::operator delete(block);
+  }
+}
+
+
+static std::vector<std::string>& bufferPool() {
+  thread_local std::vector<std::string> buffers = [] {
+    std::vector<std::string> reserved;
+    reserved.reserve(pooledBuffers);
+    return reserved;
+  }();
+  return buffers;
+}
+
+
+std::string acquireBuffer() {
+  auto& pool = bufferPool();
+  if (pool.empty()) { return std::string(); }
+  std::string buffer = std::move(pool.back());
+  pool.pop_back();
+  return buffer;
+}
+
+
+void releaseBuffer(std::string&& buffer) {
+  auto& pool = bufferPool();
+  if (pool.size() >= pooledBuffers || buffer.capacity() > maxPooledBufferSize) { return; }
+  if (buffer.capacity() <= std::string().capacity()) { return; } //it never left the small string buffer, nothing to keep
+  buffer.clear();
+  pool.push_back(std::move(buffer));
+}
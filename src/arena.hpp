@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <memory_resource>
+#include <cstddef>
+
+
+/**
+ * A bump allocator for everything that lives only as long as one request: response heads, paths, cache hit copies.
+ * 
+ * Allocating is moving a pointer forward in the current block, and freeing does nothing - reset() takes the whole
+ *    arena back to empty in one go once the connection's responses have been sent. The blocks are kept for the next
+ *    request on the connection, and when the connection closes they go back to a per-thread pool for the next one.
+ *    So once a worker has warmed up, answering a request doesn't touch the heap.
+ * 
+ * It's a std::pmr::memory_resource, so std::pmr::string and friends can allocate from it.
+*/
+class Arena : public std::pmr::memory_resource {
+  public:
+    static constexpr std::size_t blockSize = 8 * 1024; //including the block's header
+    
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() override;
+
+    void reset(); //everything allocated from the arena is gone after this
+    std::size_t used() const { return usedBytes; } //bytes handed out since the last reset
+
+  private:
+    struct Block {
+      Block* next;
+      std::size_t size; //including this header
+    };
+
+    Block* first = nullptr; //blocks of blockSize, reused after reset()
+    Block* current = nullptr; //where allocations come from
+    Block* oversized = nullptr; //dedicated blocks for allocations too big for a normal one, freed by reset()
+    std::size_t offset = 0; //into current
+    std::size_t usedBytes = 0;
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void*, std::size_t, std::size_t) override {} //all at once, in reset()
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+/**
+ * Makes an arena the one requestMemory() returns on this thread, until the scope ends. answerRequests() opens one
+ *    around each batch of requests, so code building a response doesn't need the arena passed down to it.
+*/
+class ArenaScope {
+  public:
+    explicit ArenaScope(Arena& arena);
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+    ~ArenaScope();
+
+  private:
+    std::pmr::memory_resource* previous;
+};
+
+std::pmr::memory_resource* requestMemory(); //the current request's arena, or the ordinary heap outside of one
+
+std::string acquireBuffer(); //an empty receive buffer, with capacity left over from an earlier connection if there is one
+void releaseBuffer(std::string&& buffer); //gives a buffer back to this thread's pool
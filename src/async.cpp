@@ -0,0 +1,408 @@
+#include <iostream>
+#include <array>
+#include <deque>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "async.hpp"
+#include "server.hpp"
+#include "metrics.hpp"
+#include "drain.hpp"
+#include "tls.hpp"
+#include "proxy.hpp"
+
+
+namespace {
+  constexpr std::size_t frameGranularity = 64; //frames are pooled by size, rounded up to this
+  constexpr std::size_t frameClasses = 64; //so frames up to 4 KiB are pooled
+  constexpr std::size_t framesPerClass = 64; //kept per size and thread, the rest go back to the heap
+  constexpr std::size_t fileChunkSize = 64 * 1024; //bytes of a file read and sent at a time
+  constexpr std::size_t blockingThreads = 4;
+
+  struct FreeFrame {
+    FreeFrame* next;
+  };
+
+  struct FramePool {
+    std::array<FreeFrame*, frameClasses> free{};
+    std::array<std::size_t, frameClasses> count{};
+
+    ~FramePool() {
+      for (FreeFrame* frame : free) {
+        while (frame != nullptr) { ::operator delete(std::exchange(frame, frame->next)); }
+      }
+    }
+  };
+  thread_local FramePool framePool;
+
+  /* The threads AsyncFile reads run on. Never destroyed, like the logger - a read may still be running while the
+    process exits. */
+  class BlockingPool {
+    public:
+      BlockingPool() {
+        for (std::size_t i = 0; i < blockingThreads; i++) { std::thread(&BlockingPool::work, this).detach(); }
+      }
+
+      void submit(AsyncFile::Read* read) {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          reads.push_back(read);
+        }
+        wake.notify_one();
+      }
+
+    private:
+      std::mutex lock;
+      std::condition_variable wake;
+      std::deque<AsyncFile::Read*> reads;
+
+      void work() {
+        while (true) {
+          AsyncFile::Read* read;
+          {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this] { return !reads.empty(); });
+            read = reads.front();
+            reads.pop_front();
+          }
+          do {
+            read->result = pread(read->file_fd, read->buffer, read->length, read->offset);
+          } while (read->result < 0 && errno == EINTR);
+          read->error = errno;
+          Reactor& reactor = read->reactor;
+          std::coroutine_handle<> waiting = read->waiting;
+          reactor.post(waiting); //read lives in the waiting coroutine's frame, which may be gone as soon as this returns
+        }
+      }
+  };
+
+  BlockingPool& blockingPool() {
+    static BlockingPool* pool = new BlockingPool();
+    return *pool;
+  }
+}
+
+static bool setNonBlocking(int fd);
+
+
+void* allocateFrame(std::size_t size) {
+  std::size_t sizeClass = (size + frameGranularity - 1) / frameGranularity - 1;
+  if (sizeClass >= frameClasses) { return ::operator new(size); }
+  if (FreeFrame* frame = framePool.free[sizeClass]) {
+    framePool.free[sizeClass] = frame->next;
+    framePool.count[sizeClass]--;
+    return frame;
+  }
+  return ::operator new((sizeClass + 1) * frameGranularity); //the whole class, so it fits any frame that reuses it
+}
+
+
+void freeFrame(void* frame, std::size_t size) {
+  std::size_t sizeClass = (size + frameGranularity - 1) / frameGranularity - 1;
+  if (sizeClass >= frameClasses || framePool.count[sizeClass] >= framesPerClass) {
+    ::operator delete(frame);
+    return;
+  }
+  framePool.free[sizeClass] = new (frame) FreeFrame{ framePool.free[sizeClass] };
+  framePool.count[sizeClass]++;
+} //frames are freed on the thread that allocated them - a coroutine never leaves its reactor
+
+
+
+
+Reactor::Reactor() {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (!valid()) { return; }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr; //tells the wake up apart from the sockets
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+    close(wake_fd);
+    wake_fd = -1;
+    return;
+  }
+  notice.fd = drainNotice();
+  if (notice.fd < 0) { return; } //no drain configured - the microbenchmarks
+  event.events = EPOLLIN; //level-triggered: it stays readable, and every reactor waits on it
+  event.data.ptr = &notice;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notice.fd, &event) != 0) { notice.fd = -1; }
+}
+
+
+Reactor::~Reactor() {
+  if (wake_fd >= 0) { close(wake_fd); }
+  if (epoll_fd >= 0) { close(epoll_fd); }
+}
+
+
+void Reactor::run() {
+  std::array<struct epoll_event, 128> events;
+  constexpr int tickMilliseconds = TimerWheel::tickLength.count();
+
+  while (!drained || watched != nullptr) {
+    int ready = epoll_wait(epoll_fd, events.data(), events.size(), wheel.empty() ? -1 : tickMilliseconds); //every tick while anyone has a deadline
+    if (ready < 0) {
+      if (errno == EINTR) { continue; }
+      std::cerr << "epoll_wait failed\n";
+      return;
+    }
+
+    bool woken = false, draining = false;
+    for (int i = 0; i < ready; i++) {
+      auto* pollable = static_cast<Pollable*>(events[i].data.ptr);
+      if (pollable == nullptr) {
+        woken = true;
+        continue;
+      }
+      if (pollable == &notice) {
+        draining = true;
+        continue;
+      }
+      /* Every connection is one coroutine doing one thing at a time, so at most one of them is waiting - and resuming
+        it may end it and free the pollable, which mustn't be touched afterwards. */
+      std::uint32_t flags = events[i].events;
+      if (pollable->reader && (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) { pollable->reader.resume(); }
+      else if (pollable->writer && (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR))) { pollable->writer.resume(); }
+    }
+    if (woken) { resumePosted(); } //after the events - a posted coroutine may free a pollable that's further down the list
+    if (draining) { beginDrain(); } //so too the idle readers it resumes
+
+    wheel.advance(std::chrono::steady_clock::now(), expire);
+  }
+}
+
+
+bool Reactor::watch(Pollable& pollable) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = &pollable;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pollable.fd, &event) != 0) { return false; }
+  pollable.deadline.owner = reinterpret_cast<std::uintptr_t>(&pollable);
+  pollable.next = watched;
+  if (watched != nullptr) { watched->previous = &pollable; }
+  watched = &pollable;
+  return true;
+}
+
+
+void Reactor::unwatch(Pollable& pollable) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pollable.fd, nullptr);
+  pollable.deadline.cancel();
+  if (pollable.previous != nullptr) { pollable.previous->next = pollable.next; }
+  else { watched = pollable.next; }
+  if (pollable.next != nullptr) { pollable.next->previous = pollable.previous; }
+  pollable.previous = pollable.next = nullptr;
+}
+
+
+void Reactor::post(std::coroutine_handle<> coroutine) {
+  {
+    std::lock_guard<std::mutex> guard(postedLock);
+    posted.push_back(coroutine);
+  }
+  std::uint64_t one = 1;
+  ssize_t written = write(wake_fd, &one, sizeof(one));
+  (void) written; //can only fail if the counter is about to overflow, and then the loop is woken anyway
+}
+
+
+void Reactor::resumePosted() {
+  std::uint64_t count;
+  ssize_t drained = ::read(wake_fd, &count, sizeof(count));
+  (void) drained;
+  {
+    std::lock_guard<std::mutex> guard(postedLock);
+    std::swap(posted, resuming);
+  }
+  for (std::coroutine_handle<> coroutine : resuming) { coroutine.resume(); }
+  resuming.clear(); //keeps its capacity for next time
+}
+
+
+void Reactor::beginDrain() {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, notice.fd, nullptr);
+  drained = true;
+  for (Pollable* pollable = watched; pollable != nullptr;) {
+    Pollable* next = pollable->next; //resuming the reader may free pollable - only its own, though
+    if (pollable->reader && pollable->idle) {
+      pollable->timedOut = true;
+      pollable->reader.resume();
+    }
+    pollable = next;
+  }
+}
+
+
+void Reactor::expire(TimerWheel::Timer& deadline) {
+  auto* pollable = reinterpret_cast<Pollable*>(deadline.owner);
+  if (!pollable->reader && !pollable->writer) { return; }
+  pollable->timedOut = true;
+  (pollable->reader ? pollable->reader : pollable->writer).resume();
+} //resuming it may free the pollable - the wheel doesn't touch the timer again
+
+
+
+
+AsyncSocket::AsyncSocket(Reactor& reactor, int fd) : reactor(reactor) {
+  pollable.fd = fd;
+  registered = setNonBlocking(fd) && reactor.watch(pollable);
+}
+
+
+AsyncSocket::~AsyncSocket() {
+  if (registered) { reactor.unwatch(pollable); }
+  close(pollable.fd);
+}
+
+
+Async<ssize_t> AsyncSocket::read(std::string& buffer, std::size_t readSize, std::chrono::steady_clock::time_point deadline,
+                                  bool idle) {
+  while (true) {
+    ssize_t bytes_received = receiveInto(pollable.fd, buffer, readSize);
+    if (bytes_received >= 0) { co_return bytes_received; }
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) { co_return -1; }
+    if (idle && reactor.draining()) {
+      errno = ETIMEDOUT;
+      co_return -1;
+    }
+
+    reactor.timers().schedule(pollable.deadline, deadline);
+    pollable.idle = idle;
+    bool ready = co_await ReadyAwaiter{ pollable, true };
+    pollable.idle = false;
+    if (!ready) {
+      errno = ETIMEDOUT;
+      co_return -1;
+    }
+  }
+}
+
+
+Async<bool> AsyncSocket::write(ClientSession& session, ResponseQueue& responses, std::chrono::seconds stallTimeout) {
+  while (!responses.empty()) {
+    HttpResponse& front = responses.front();
+    if (front.proxied) {
+      if (!co_await ProxyRelay{ reactor, *front.proxied, pollable.fd }) { co_return false; }
+      finishRelay(session, responses);
+      continue;
+    }
+    if (front.headSent == front.head.size() && front.bodySent == front.body.size() && front.fileLength > 0) {
+      if (fileChunk == nullptr) { fileChunk = std::make_unique<char[]>(fileChunkSize); }
+      std::size_t length = std::min(front.fileLength, fileChunkSize);
+      ssize_t bytes_read = co_await AsyncFile(reactor, front.file_fd).read(fileChunk.get(), length, front.fileOffset);
+      if (bytes_read <= 0) { co_return false; } //0 if the file got shorter since we sent its Content-Length
+      if (!co_await write(std::string_view(fileChunk.get(), bytes_read), stallTimeout)) { co_return false; }
+      metrics().bytesSent(bytes_read);
+      front.fileOffset += bytes_read;
+      front.fileLength -= bytes_read;
+      responses.popFinished();
+      continue;
+    }
+
+    std::array<struct iovec, 64> parts;
+    bool everything;
+    std::size_t partCount = gatherResponses(responses, parts, everything);
+    if (partCount == 0) { co_return false; } //a deferred response - those are only made for the io_uring workers
+
+    ssize_t bytes_sent = sendParts(pollable.fd, parts.data(), partCount, !everything);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) { co_return false; }
+      reactor.timers().schedule(pollable.deadline, std::chrono::steady_clock::now() + stallTimeout);
+      if (!co_await ReadyAwaiter{ pollable, false }) { co_return false; }
+      continue;
+    }
+    markSent(responses, bytes_sent);
+    responses.popFinished();
+  }
+  co_return true;
+} //the queue isn't touched by anyone else meanwhile - the handler waits for this before answering anything else
+
+
+Async<bool> AsyncSocket::write(std::string_view bytes, std::chrono::seconds stallTimeout) {
+  while (!bytes.empty()) {
+    struct iovec part = { const_cast<char*>(bytes.data()), bytes.size() };
+    ssize_t bytes_sent = sendParts(pollable.fd, &part, 1);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) { co_return false; }
+      reactor.timers().schedule(pollable.deadline, std::chrono::steady_clock::now() + stallTimeout);
+      if (!co_await ReadyAwaiter{ pollable, false }) { co_return false; }
+      continue;
+    }
+    bytes.remove_prefix(bytes_sent);
+  }
+  co_return true;
+}
+
+
+
+
+AsyncListener::AsyncListener(Reactor& reactor, int listen_fd) : reactor(reactor) {
+  pollable.fd = listen_fd;
+  pollable.idle = true; //it only ever waits for the next connection
+  registered = setNonBlocking(listen_fd) && reactor.watch(pollable);
+}
+
+
+AsyncListener::~AsyncListener() {
+  if (registered) { reactor.unwatch(pollable); }
+}
+
+
+Async<int> AsyncListener::accept() {
+  if (std::exchange(failed, false) && !co_await ReadyAwaiter{ pollable, true }) { co_return -1; } //retrying straight away would spin on EMFILE
+  while (!reactor.draining()) {
+    int client_fd = accept4(pollable.fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (client_fd >= 0) { co_return client_fd; }
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      failed = true;
+      co_return -1;
+    }
+    if (!co_await ReadyAwaiter{ pollable, true }) { co_return -1; } //woken by the drain
+  }
+  co_return -1;
+}
+
+
+
+
+void AsyncFile::Read::await_suspend(std::coroutine_handle<> coroutine) {
+  waiting = coroutine;
+  blockingPool().submit(this);
+}
+
+
+void TlsHandshake::await_suspend(std::coroutine_handle<> coroutine) {
+  tls().acceptLater(client_fd, deadline, [this, coroutine](bool shookHands) {
+    succeeded = shookHands;
+    Reactor& waiting = reactor; //this is gone as soon as the coroutine resumes
+    waiting.post(coroutine);
+  });
+}
+
+
+void ProxyRelay::await_suspend(std::coroutine_handle<> coroutine) {
+  proxy().relayLater(exchange, client_fd, [this, coroutine](bool carriesOn) {
+    relayed = carriesOn;
+    Reactor& waiting = reactor; //this is gone as soon as the coroutine resumes
+    waiting.post(coroutine);
+  });
+}
+
+
+static bool setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) { return false; }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
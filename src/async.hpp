@@ -0,0 +1,311 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <coroutine>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cerrno>
+#include <exception>
+#include <type_traits>
+#include <sys/types.h>
+
+#include "response.hpp"
+#include "timer_wheel.hpp"
+
+struct ClientSession;
+
+
+/**
+ * Coroutines for writing a connection's handler as straight-line code - read, answer, write, repeat, like
+ *    handleClient() - while one thread serves thousands of connections, as the epoll workers do.
+ *
+ * A coroutine that has to wait for a socket (or a file) doesn't block its thread: co_await suspends it, and the
+ *    Reactor running on that thread resumes it once epoll says the socket is ready. Only the coroutine's frame is
+ *    kept meanwhile - the locals it uses after the co_await - not a stack of its own.
+ *
+ *    Detached serve(AsyncSocket& client) {
+ *      ssize_t bytes = co_await client.read(buffer, 4096, std::chrono::steady_clock::now() + std::chrono::seconds(5));
+ *      bool sent = co_await client.write(responses, std::chrono::seconds(30));
+ *    }
+ *
+ * Everything runs on the reactor's thread. Frames come from a per-thread pool (refer allocateFrame()), so starting
+ *    a coroutine for every read or write doesn't go to the heap once a worker has warmed up.
+*/
+
+void* allocateFrame(std::size_t size);
+void freeFrame(void* frame, std::size_t size);
+
+struct PooledFrame {
+  static void* operator new(std::size_t size) { return allocateFrame(size); }
+  static void operator delete(void* frame, std::size_t size) { freeFrame(frame, size); }
+}; //promise types derive from this to have their coroutine frames allocated from the pool
+
+
+/**
+ * A coroutine that produces a T for the coroutine co_awaiting it.
+ *
+ * It's lazy: nothing runs until it's co_awaited, and then the awaiting coroutine is suspended while it runs. When it
+ *    co_returns, the awaiting coroutine carries on right away (symmetric transfer - no trip through the reactor, and
+ *    no stack growing with every level of co_await).
+*/
+template <typename T = void>
+class [[nodiscard]] Async {
+  private:
+    struct ResumeContinuation {
+      bool await_ready() noexcept { return false; }
+      template <typename Promise>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> self) noexcept { return self.promise().continuation; }
+      void await_resume() noexcept {}
+    };
+
+    struct PromiseBase : PooledFrame {
+      std::coroutine_handle<> continuation = std::noop_coroutine();
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      ResumeContinuation final_suspend() noexcept { return {}; }
+      void unhandled_exception() { std::terminate(); } //nothing in here throws - and if it did, there'd be nobody to catch it
+    };
+
+    struct ValuePromise : PromiseBase {
+      T value{};
+      void return_value(T result) { value = std::move(result); }
+    };
+    struct VoidPromise : PromiseBase {
+      void return_void() {}
+    };
+
+  public:
+    struct promise_type : std::conditional_t<std::is_void_v<T>, VoidPromise, ValuePromise> {
+      Async get_return_object() { return Async(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Async(Async&& other) noexcept : coroutine(std::exchange(other.coroutine, nullptr)) {}
+    Async(const Async&) = delete;
+    Async& operator=(const Async&) = delete;
+    ~Async() { if (coroutine) { coroutine.destroy(); } }
+
+    auto operator co_await() && noexcept {
+      struct Awaiter {
+        std::coroutine_handle<promise_type> coroutine;
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+          coroutine.promise().continuation = awaiting;
+          return coroutine; //start it
+        }
+        T await_resume() noexcept {
+          if constexpr (!std::is_void_v<T>) { return std::move(coroutine.promise().value); }
+        }
+      };
+      return Awaiter{ coroutine };
+    }
+
+  private:
+    explicit Async(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+    std::coroutine_handle<promise_type> coroutine;
+};
+
+/**
+ * A coroutine nobody waits for - one per connection, and the accept loop. It starts running as soon as it's called,
+ *    and frees itself when it's done.
+*/
+struct Detached {
+  struct promise_type : PooledFrame {
+    Detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+
+/* What a Reactor knows about one file descriptor: which coroutine waits to read from it and which to write, and until
+  when it's willing to wait - a timer on the reactor's wheel, scheduled while it waits. An idle reader - a connection
+  between requests, or the accept loop - is woken as though it timed out when the reactor starts draining. */
+struct Pollable {
+  int fd = -1;
+  std::coroutine_handle<> reader;
+  std::coroutine_handle<> writer;
+  TimerWheel::Timer deadline;
+  bool timedOut = false;
+  bool idle = false;
+  Pollable* previous = nullptr;
+  Pollable* next = nullptr;
+};
+
+/**
+ * One epoll instance, and the loop that resumes the coroutines waiting on it. Every --io coroutines worker runs one.
+ *
+ * Sockets are registered edge-triggered once, when they are wrapped, and stay registered until they are closed. A
+ *    coroutine only waits after a read or write failed with EAGAIN, so an edge always comes after it starts waiting.
+ *
+ * post() is the only thing other threads may call: it queues a coroutine to be resumed on the reactor's thread, and
+ *    wakes the loop through an eventfd. That's how the blocking pool hands back finished file reads.
+ *
+ * Once drainNotice() turns readable (refer drain.hpp), the idle readers are woken to give up, and run() returns as
+ *    soon as nothing is watched any more.
+*/
+class Reactor {
+  public:
+    Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+    ~Reactor();
+
+    bool valid() const { return epoll_fd >= 0 && wake_fd >= 0; }
+    void run(); //until epoll_wait() fails, or it has drained
+    bool draining() const { return drained; }
+
+    bool watch(Pollable& pollable);
+    void unwatch(Pollable& pollable);
+    void post(std::coroutine_handle<> coroutine); //from any thread
+    TimerWheel& timers() { return wheel; } //for the pollables' deadlines
+
+  private:
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    TimerWheel wheel;
+    Pollable* watched = nullptr; //head of the list of everything registered
+    Pollable notice; //drainNotice(), told apart from the sockets by its address
+    bool drained = false;
+    std::mutex postedLock;
+    std::vector<std::coroutine_handle<>> posted; //resumed after the next epoll_wait()
+    std::vector<std::coroutine_handle<>> resuming; //posted, swapped out under the lock
+
+    void resumePosted();
+    void beginDrain();
+    static void expire(TimerWheel::Timer& deadline); //resumes whoever waits on the pollable, with timedOut set
+};
+
+/* Suspends the coroutine until pollable's fd is readable (or writable). The deadline must have been scheduled, if
+  there is one - see AsyncSocket. */
+struct ReadyAwaiter {
+  Pollable& pollable;
+  bool reading;
+
+  bool await_ready() noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> coroutine) noexcept { (reading ? pollable.reader : pollable.writer) = coroutine; }
+  bool await_resume() noexcept { //false if the deadline passed
+    (reading ? pollable.reader : pollable.writer) = nullptr;
+    pollable.deadline.cancel();
+    return !std::exchange(pollable.timedOut, false);
+  }
+};
+
+/**
+ * A connected client socket, watched by a reactor. It owns the fd and closes it.
+ *
+ * read() and write() behave like receiveInto() and sendResponses(), except that where those would fail with EAGAIN
+ *    they wait for the socket instead. File bodies aren't sent with sendfile() - which can block on a disk read
+ *    without us noticing - but read on the blocking pool and sent from a buffer (refer AsyncFile).
+*/
+class AsyncSocket {
+  public:
+    AsyncSocket(Reactor& reactor, int fd); //makes fd non-blocking
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+    ~AsyncSocket();
+
+    int fd() const { return pollable.fd; }
+    bool valid() const { return registered; }
+
+    Async<ssize_t> read(std::string& buffer, std::size_t readSize, std::chrono::steady_clock::time_point deadline,
+                        bool idle = false); /*appends up to readSize bytes to buffer. 0 once the client closed the connection,
+      -1 on errors - with errno ETIMEDOUT if nothing came by deadline, or the reactor drains while an idle read waits*/
+    Async<bool> write(ClientSession& session, ResponseQueue& responses, std::chrono::seconds stallTimeout); /*sends and
+      pops every queued response - the session is for a proxied one's, refer finishRelay(). false if the client went
+      away, or took nothing in for stallTimeout*/
+    Async<bool> write(std::string_view bytes, std::chrono::seconds stallTimeout);
+
+  private:
+    Reactor& reactor;
+    Pollable pollable;
+    bool registered = false;
+    std::unique_ptr<char[]> fileChunk; //a file body's bytes on their way to the socket, allocated for the first file sent
+};
+
+/* A listening socket, watched by a reactor. Doesn't own the fd. */
+class AsyncListener {
+  public:
+    AsyncListener(Reactor& reactor, int listen_fd); //makes listen_fd non-blocking
+    AsyncListener(const AsyncListener&) = delete;
+    AsyncListener& operator=(const AsyncListener&) = delete;
+    ~AsyncListener();
+
+    bool valid() const { return registered; }
+    Async<int> accept(); /*the next client's socket, already non-blocking. -1 on errors, and then the next call waits for
+      the next connection - or once the reactor drains*/
+
+  private:
+    Reactor& reactor;
+    Pollable pollable;
+    bool registered = false;
+    bool failed = false;
+};
+
+/**
+ * co_await file.read(...) runs a pread() on a small pool of blocking threads shared by every reactor, and resumes the
+ *    coroutine on its own reactor once the bytes are there. epoll can't wait for files (they're always "ready", and
+ *    then a read blocks on the disk), so this keeps a slow disk from stalling every connection on the thread.
+ *
+ * The file isn't owned - it's usually an HttpResponse's file_fd.
+*/
+class AsyncFile {
+  public:
+    AsyncFile(Reactor& reactor, int file_fd) : reactor(reactor), file_fd(file_fd) {}
+
+    struct Read {
+      Reactor& reactor;
+      int file_fd;
+      char* buffer;
+      std::size_t length;
+      off_t offset;
+      ssize_t result = 0;
+      int error = 0;
+      std::coroutine_handle<> waiting = nullptr; //set by await_suspend()
+
+      bool await_ready() noexcept { return length == 0; }
+      void await_suspend(std::coroutine_handle<> coroutine);
+      ssize_t await_resume() noexcept { //what pread() returned, with its errno restored
+        if (result < 0) { errno = error; }
+        return result;
+      }
+    };
+
+    Read read(char* buffer, std::size_t length, off_t offset) { return Read{ reactor, file_fd, buffer, length, offset }; }
+
+  private:
+    Reactor& reactor;
+    int file_fd;
+};
+
+/* co_await TlsHandshake{ reactor, client_fd, deadline } shakes hands with a TLS client on the handshake threads (refer
+  Tls::acceptLater()), and resumes the coroutine on its own reactor once that's done - true if it worked out. */
+struct TlsHandshake {
+  Reactor& reactor;
+  int client_fd;
+  std::chrono::steady_clock::time_point deadline;
+  bool succeeded = false;
+
+  bool await_ready() noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> coroutine);
+  bool await_resume() noexcept { return succeeded; }
+};
+
+/* co_await ProxyRelay{ reactor, exchange, client_fd } relays a proxied response on the relay threads (refer
+  Proxy::relayLater()), and resumes the coroutine on its own reactor once it's sent - true if the connection carries on. */
+struct ProxyRelay {
+  Reactor& reactor;
+  ProxyExchange& exchange;
+  int client_fd;
+  bool relayed = false;
+
+  bool await_ready() noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> coroutine);
+  bool await_resume() noexcept { return relayed; }
+};
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "compression.hpp"
+#include "http_parser.hpp"
+
+
+constexpr int gzipLevel = 6; //zlib's default - level 9 is a lot slower for a few percent
+constexpr int brotliQuality = 6; //about gzip -9's speed, and still smaller. Precompressed siblings can use 11
+
+static std::atomic<std::size_t> compressMinSize{0}; //set at startup, and again on SIGHUP
+
+static std::string_view trimSpaces(std::string_view text);
+static bool isZeroQuality(std::string_view parameters);
+static bool compressGzip(std::string_view contents, std::string& compressed);
+static bool compressBrotli(std::string_view contents, std::string& compressed);
+
+
+AcceptedCodings parseAcceptEncoding(std::string_view header) {
+  // https://www.rfc-editor.org/rfc/rfc9110#name-accept-encoding
+  AcceptedCodings accepted;
+  bool anyOther = false; //"*" covers the codings that aren't listed, listed ones keep their own q
+  bool gzipListed = false;
+  bool brotliListed = false;
+  while (!header.empty()) {
+    std::size_t comma = std::min(header.find(','), header.size());
+    std::string_view element = header.substr(0, comma);
+    header.remove_prefix(std::min(comma + 1, header.size()));
+
+    std::size_t semicolon = std::min(element.find(';'), element.size());
+    std::string_view coding = trimSpaces(element.substr(0, semicolon));
+    bool acceptable = !isZeroQuality(element.substr(semicolon));
+    if (equalsIgnoreCase(coding, "gzip") || equalsIgnoreCase(coding, "x-gzip")) {
+      accepted.gzip = acceptable;
+      gzipListed = true;
+    } else if (equalsIgnoreCase(coding, "br")) {
+      accepted.brotli = acceptable;
+      brotliListed = true;
+    } else if (coding == "*") {
+      anyOther = acceptable;
+    }
+  }
+  if (anyOther && !gzipListed) { accepted.gzip = true; }
+  if (anyOther && !brotliListed) { accepted.brotli = true; }
+  return accepted;
+} //a client preferring gzip over br by q still gets br - we only care whether it can decode it
+
+
+std::string_view codingName(ContentCoding coding) {
+  switch (coding) {
+    case ContentCoding::Gzip: return "gzip";
+    case ContentCoding::Brotli: return "br";
+    default: return "";
+  }
+}
+
+
+std::string_view precompressedSuffix(ContentCoding coding) {
+  switch (coding) {
+    case ContentCoding::Gzip: return ".gz";
+    case ContentCoding::Brotli: return ".br";
+    default: return "";
+  }
+}
+
+
+std::string_view uncompressedPath(std::string_view path) {
+  for (ContentCoding coding : { ContentCoding::Gzip, ContentCoding::Brotli }) {
+    std::string_view suffix = precompressedSuffix(coding);
+    if (path.size() > suffix.size() && path.ends_with(suffix)) { return path.substr(0, path.size() - suffix.size()); }
+  }
+  return {};
+}
+
+
+bool isCompressible(std::string_view contentType) {
+  constexpr auto compressibleTypes = std::to_array<std::string_view>({
+    "application/javascript", "application/json", "application/manifest+json", "application/wasm",
+    "application/x-sh", "application/xml", "application/yaml", "image/svg+xml",
+  });
+  contentType = contentType.substr(0, contentType.find(';')); //a type loaded with --mime-types may carry a charset
+  if (contentType.starts_with("text/") || contentType.ends_with("+json") || contentType.ends_with("+xml")) { return true; }
+  return std::find(compressibleTypes.begin(), compressibleTypes.end(), contentType) != compressibleTypes.end();
+}
+
+
+void configureCompression(std::size_t minSize) {
+  compressMinSize.store(minSize, std::memory_order_relaxed);
+}
+
+
+bool shouldCompress(std::string_view contentType, std::size_t fileSize) {
+  std::size_t minSize = compressMinSize.load(std::memory_order_relaxed);
+  return minSize > 0 && fileSize >= minSize && isCompressible(contentType);
+} //tiny files barely shrink, and the Content-Encoding header eats up what they do
+
+
+bool compress(std::string_view contents, ContentCoding coding, std::string& compressed) {
+  switch (coding) {
+    case ContentCoding::Gzip: return compressGzip(contents, compressed);
+    case ContentCoding::Brotli: return compressBrotli(contents, compressed);
+    default: return false;
+  }
+}
+
+
+static std::string_view trimSpaces(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) { text.remove_prefix(1); }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) { text.remove_suffix(1); }
+  return text;
+}
+
+
+static bool isZeroQuality(std::string_view parameters) {
+  std::size_t q = parameters.find("q=");
+  if (q == std::string_view::npos) { q = parameters.find("Q="); }
+  if (q == std::string_view::npos) { return false; } //no q means q=1
+  std::string_view value = trimSpaces(parameters.substr(q + 2));
+  return !value.empty() && value.find_first_not_of("0.") == std::string_view::npos;
+} //"q=0", "q=0.0", "q=0.000" - anything else is some preference above 0
+
+
+static bool compressGzip(std::string_view contents, std::string& compressed) {
+  z_stream stream = {};
+  //windowBits 15 + 16 asks zlib for a gzip header and trailer instead of a bare zlib stream
+  if (deflateInit2(&stream, gzipLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { return false; }
+  compressed.resize(deflateBound(&stream, contents.size()));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(contents.data()));
+  stream.avail_in = contents.size();
+  stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+  stream.avail_out = compressed.size();
+  int status = deflate(&stream, Z_FINISH); //deflateBound() is enough room to do it in one go
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  return status == Z_STREAM_END;
+}
+
+
+static bool compressBrotli(std::string_view contents, std::string& compressed) {
+#ifdef HAVE_BROTLI
+  std::size_t size = BrotliEncoderMaxCompressedSize(contents.size());
+  if (size == 0) { return false; } //too big for brotli to promise anything
+  compressed.resize(size);
+  bool done = BrotliEncoderCompress(brotliQuality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, contents.size(),
+    reinterpret_cast<const std::uint8_t*>(contents.data()), &size, reinterpret_cast<std::uint8_t*>(compressed.data()));
+  compressed.resize(done ? size : 0);
+  return done;
+#else
+  (void) contents;
+  (void) compressed;
+  return false; //built without libbrotlienc - br clients that also take gzip get that, refer openedFileResponse()
+#endif
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+
+/**
+ * Content codings for static files (Content-Encoding: gzip or br).
+ *
+ * Text compresses to a fraction of its size, so clients that say they can decode it (Accept-Encoding) get CSS, JS,
+ *    JSON, SVG and friends compressed. A file's precompressed sibling on disk (style.css.br, style.css.gz) is sent
+ *    if there is one - those can be made offline with the slowest, best settings. Otherwise cacheable files are
+ *    compressed on the fly, once, and the compressed copy is kept in the file cache next to the plain one
+ *    (refer FileCache::lookup()). Files too big for the cache are sent as they are, unless they have a sibling.
+ *
+ * Brotli is preferred over gzip when a client takes both: it's smaller for text, and every browser that sends "br"
+ *    means it. Ranges are always of the plain file, so a request with a Range header isn't compressed.
+*/
+
+enum class ContentCoding {
+  Identity, //sent as it is on disk
+  Gzip,
+  Brotli
+};
+
+struct AcceptedCodings {
+  bool gzip = false;
+  bool brotli = false;
+
+  bool none() const { return !gzip && !brotli; }
+  ContentCoding best() const { return brotli ? ContentCoding::Brotli : gzip ? ContentCoding::Gzip : ContentCoding::Identity; }
+  unsigned char variant() const { return gzip + 2 * brotli; } /*which of the file cache's copies of a file such a client
+    gets - 0 for the plain file*/
+};
+
+constexpr unsigned char codingVariants = 4; //AcceptedCodings::variant() is below this
+
+AcceptedCodings parseAcceptEncoding(std::string_view header); //"gzip, deflate, br;q=0.8" - codings with q=0 aren't accepted
+std::string_view codingName(ContentCoding coding); //for Content-Encoding. "" for identity
+std::string_view precompressedSuffix(ContentCoding coding); //".gz" or ".br", of a file's precompressed sibling
+std::string_view uncompressedPath(std::string_view path); //the file a precompressed sibling belongs to, "" if path isn't one
+bool isCompressible(std::string_view contentType); //text, JSON, XML, JS, SVG... - not images, audio, video or archives
+
+void configureCompression(std::size_t minSize); //files smaller than minSize aren't compressed on the fly, 0 turns it off
+bool shouldCompress(std::string_view contentType, std::size_t fileSize);
+bool compress(std::string_view contents, ContentCoding coding, std::string& compressed); //false if the encoder failed
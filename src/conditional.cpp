@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+#include "conditional.hpp"
+#include "arena.hpp"
+
+
+static std::string_view headerIn(std::string_view head, std::string_view nameAndColon);
+static bool matchesAnyTag(std::string_view tags, std::string_view etag);
+
+
+FileConditions::FileConditions(const HttpRequest& request, std::pmr::memory_resource* memory)
+  : range(request.header("Range"), memory), ifRange(request.header("If-Range"), memory),
+    ifNoneMatch(request.header("If-None-Match"), memory), ifModifiedSince(request.header("If-Modified-Since"), memory) {}
+
+
+std::pmr::string entityTag(const struct stat& info, ContentCoding coding) {
+  char tag[80]; //four 64 bit numbers in hex (16 digits at most, each), their separators and the coding
+  char* end = tag;
+  *end++ = '"';
+  end = std::to_chars(end, end + 16, static_cast<unsigned long long>(info.st_ino), 16).ptr;
+  *end++ = '-';
+  end = std::to_chars(end, end + 16, static_cast<unsigned long long>(info.st_size), 16).ptr;
+  *end++ = '-';
+  end = std::to_chars(end, end + 16, static_cast<unsigned long long>(info.st_mtim.tv_sec), 16).ptr;
+  *end++ = '.';
+  end = std::to_chars(end, end + 16, static_cast<unsigned long long>(info.st_mtim.tv_nsec), 16).ptr;
+  std::string_view name = codingName(coding);
+  if (!name.empty()) {
+    *end++ = '-';
+    end = std::copy(name.begin(), name.end(), end);
+  }
+  *end++ = '"';
+  return std::pmr::string(tag, end, requestMemory());
+} /*a file that's replaced or written to gets a new mtime (and usually a new inode or size), so it gets a new tag without
+us ever hashing its contents*/
+
+
+std::pmr::string lastModifiedDate(const struct stat& info) {
+  std::tm parts;
+  gmtime_r(&info.st_mtim.tv_sec, &parts);
+  char date[32];
+  std::size_t length = std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+  return std::pmr::string(date, length, requestMemory());
+}
+
+
+FileValidators cachedValidators(std::string_view head) {
+  return FileValidators{ headerIn(head, "\r\nETag: "), headerIn(head, "\r\nLast-Modified: ") };
+}
+
+
+bool isNotModified(const FileConditions& conditions, const FileValidators& validators) {
+  if (!conditions.ifNoneMatch.empty()) { return matchesAnyTag(conditions.ifNoneMatch, validators.etag); }
+  if (conditions.ifModifiedSince.empty()) { return false; }
+  std::time_t since;
+  std::time_t modified;
+  return parseHttpDate(conditions.ifModifiedSince, since) && parseHttpDate(validators.lastModified, modified) && modified <= since;
+} //If-Modified-Since is ignored when If-None-Match is there - the tag is the more precise of the two
+
+
+bool rangeApplies(const FileConditions& conditions, const FileValidators& validators) {
+  std::string_view ifRange = conditions.ifRange;
+  if (ifRange.empty()) { return true; }
+  if (ifRange.starts_with('"')) { return ifRange == validators.etag; } //a strong comparison, so a weak W/ tag never matches
+  return ifRange == validators.lastModified;
+} //the part the client has is of the version it names - if that's not the current one, it needs the whole file
+
+
+bool parseHttpDate(std::string_view date, std::time_t& time) {
+  char text[64];
+  if (date.size() >= sizeof(text)) { return false; }
+  std::memcpy(text, date.data(), date.size());
+  text[date.size()] = '\0';
+  std::tm parts = {};
+  const char* end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &parts);
+  if (end == nullptr || *end != '\0') { return false; }
+  time = timegm(&parts);
+  return true;
+} //the obsolete RFC 850 and asctime() formats are allowed too, but nothing sends them anymore
+
+
+static std::string_view headerIn(std::string_view head, std::string_view nameAndColon) {
+  std::size_t start = head.find(nameAndColon);
+  if (start == std::string_view::npos) { return {}; }
+  start += nameAndColon.size();
+  return head.substr(start, head.find("\r\n", start) - start);
+}
+
+
+static bool matchesAnyTag(std::string_view tags, std::string_view etag) {
+  while (!tags.empty()) {
+    std::size_t comma = std::min(tags.find(','), tags.size());
+    std::string_view tag = tags.substr(0, comma);
+    tags.remove_prefix(std::min(comma + 1, tags.size()));
+    while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) { tag.remove_prefix(1); }
+    while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) { tag.remove_suffix(1); }
+    if (tag == "*") { return true; }
+    if (tag.starts_with("W/")) { tag.remove_prefix(2); } //If-None-Match compares weakly
+    if (!etag.empty() && tag == etag) { return true; }
+  }
+  return false;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory_resource>
+#include <ctime>
+#include <sys/stat.h>
+
+#include "http_parser.hpp"
+#include "compression.hpp"
+
+
+/**
+ * Conditional requests - https://www.rfc-editor.org/rfc/rfc9110#name-conditional-requests
+ *
+ * Every file response carries two validators: a strong ETag made of the file's inode, size and mtime (plus the
+ *    coding, since a compressed variant is a different representation), and Last-Modified. Neither needs the file's
+ *    contents - a stat() is enough, and the file cache keeps them in its copy of the head.
+ * A client that already has the file sends them back in If-None-Match / If-Modified-Since, and gets a 304 without a
+ *    body if the file hasn't changed since. If-Range turns a Range request back into one for the whole file if it has.
+*/
+
+struct FileValidators {
+  std::string_view etag; //with its quotes, eg. "4a1f-3e8-6710d2c8.1a2b3c"
+  std::string_view lastModified; //an HTTP date
+};
+
+/* The parts of a request that decide what of a file is sent, if anything. Copied, because the io_uring workers build
+  the response after the request is gone (refer HttpResponse::DeferredOpen). */
+struct FileConditions {
+  FileConditions(const HttpRequest& request, std::pmr::memory_resource* memory);
+
+  std::pmr::string range;
+  std::pmr::string ifRange;
+  std::pmr::string ifNoneMatch;
+  std::pmr::string ifModifiedSince;
+  AcceptedCodings codings; //what the file may be compressed with, none for ranges (refer compression.hpp)
+};
+
+std::pmr::string entityTag(const struct stat& info, ContentCoding coding); //in the request's arena, like the rest of the head
+std::pmr::string lastModifiedDate(const struct stat& info);
+FileValidators cachedValidators(std::string_view head); //the ones in a head built by fileResponseHead()
+bool isNotModified(const FileConditions& conditions, const FileValidators& validators); //the client's copy is current - 304
+bool rangeApplies(const FileConditions& conditions, const FileValidators& validators); //false if If-Range says the file changed
+bool parseHttpDate(std::string_view date, std::time_t& time); //the IMF-fixdate format, which is what clients send
@@ -0,0 +1,271 @@
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <charconv>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include "config.hpp"
+#include "log.hpp"
+#include "file_cache.hpp"
+#include "path_resolver.hpp"
+#include "compression.hpp"
+#include "trace.hpp"
+#include "proxy.hpp"
+
+
+static bool loadConfigFile(const std::string& path, ServerConfig& config, std::string& error);
+static bool applySetting(ServerConfig& config, const std::string& name, const std::string& value, std::string& error);
+template <typename Number>
+static bool parseNumber(const std::string& text, Number& number);
+static void copyReloadable(const ServerConfig& from, ServerConfig& to);
+static void onReloadSignal(int);
+static void reloadOnSignal(int argc, char** argv, ServerConfig running);
+
+static int reload_fd = -1;
+
+
+bool parseConfig(int argc, char** argv, ServerConfig& config, std::string& error) {
+  config = ServerConfig();
+  config.workerCount = sysconf(_SC_NPROCESSORS_ONLN); //one epoll worker per online CPU unless set
+  if (argc % 2 == 0) { //flags come in pairs, after the program's name
+    error = std::string(argv[argc - 1]) + " needs a value";
+    return false;
+  }
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::string_view(argv[i]) == "--config") { config.configFile = argv[i+1]; }
+  }
+  if (config.configFile != "" && !loadConfigFile(config.configFile, config, error)) { return false; }
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--config") { continue; }
+    if (!flag.starts_with("--")) {
+      error = "Unknown argument " + flag;
+      return false;
+    }
+    if (!applySetting(config, flag.substr(2), argv[i+1], error)) { return false; }
+  }
+  return true;
+}
+
+
+bool validateConfig(const ServerConfig& config, std::string& error) {
+  struct in_addr address;
+  if (config.ioMode != "threads" && config.ioMode != "epoll" && config.ioMode != "uring" && config.ioMode != "coroutines") {
+    error = "Unknown --io mode " + config.ioMode + ". Use threads, epoll, uring or coroutines";
+  }
+  else if (inet_pton(AF_INET, config.bindAddress.c_str(), &address) != 1) {
+    error = "--bind must be an IPv4 address, like 0.0.0.0 (every interface) or 127.0.0.1, not " + config.bindAddress;
+  }
+  else if (config.port < 1 || config.port > 65535) { error = "--port must be between 1 and 65535"; }
+  else if (config.adminPort < 0 || config.adminPort > 65535 || config.adminPort == config.port) {
+    error = "--admin-port must be between 1 and 65535, and not the same as --port";
+  }
+  else if ((config.tlsCertificate == "") != (config.tlsKey == "")) { error = "--tls-cert and --tls-key go together"; }
+  else if (config.tlsThreads < 1) { error = "--tls-threads must be at least 1"; }
+  else if (config.workerCount < 1) { error = "--workers must be at least 1"; }
+  else if (config.threadCount < 1) { error = "--threads must be at least 1"; }
+  else if (config.queueSize < 1) { error = "--queue-size must be at least 1"; }
+  else if (config.keepAliveTimeout < 1) { error = "--keep-alive-timeout must be at least 1 second"; }
+  else if (config.headerTimeout < 1 || config.bodyTimeout < 1) {
+    error = "--header-timeout and --body-timeout must be at least 1 second";
+  }
+  else if (config.drainTimeout < 0) { error = "--drain-timeout can't be negative. Use 0 to exit as soon as the signal comes"; }
+  else if (config.connectionBacklog < 1) { error = "--backlog must be at least 1"; }
+  else if (config.readSize < 1024 || config.readSize > 1024 * 1024) { error = "--read-size must be between 1024 and 1048576 bytes"; }
+  else if (config.largeFileMode != "sendfile" && config.largeFileMode != "mmap") {
+    error = "Unknown --large-files mode " + config.largeFileMode + ". Use sendfile or mmap";
+  }
+  else if (config.statCacheTtl < 0) { error = "--stat-cache-ttl can't be negative. Use 0 to turn the stat cache off"; }
+  else if (config.maxHeaderSize < 64) { error = "--max-header-size must be at least 64 bytes"; }
+  else if (config.traceFile != "" && !tracingAvailable()) { error = "--trace-file needs a build with tracing: cmake -DTRACING=ON"; }
+  else if (config.traceSample < 1) { error = "--trace-sample must be at least 1"; }
+  else if (config.proxyTimeout < 1) { error = "--proxy-timeout must be at least 1 second"; }
+  else if (config.proxyThreads < 1) { error = "--proxy-threads must be at least 1"; }
+  else {
+    return std::all_of(config.proxyRoutes.begin(), config.proxyRoutes.end(),
+                       [&error](const std::string& route) { return checkProxyRoute(route, error); }); //error says which isn't
+  }
+  return false;
+}
+
+
+bool watchReloads(int argc, char** argv, const ServerConfig& running) {
+  reload_fd = eventfd(0, EFD_CLOEXEC);
+  if (reload_fd < 0) { return false; }
+  struct sigaction action = {};
+  action.sa_handler = onReloadSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGHUP, &action, nullptr);
+  std::thread(reloadOnSignal, argc, argv, running).detach();
+  return true;
+}
+
+
+static bool loadConfigFile(const std::string& path, ServerConfig& config, std::string& error) {
+  std::ifstream file(path);
+  if (!file.good()) {
+    error = "Can't read --config " + path + ": " + std::strerror(errno);
+    return false;
+  }
+
+  std::string line;
+  for (std::size_t number = 1; std::getline(file, line); number++) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string name, value;
+    if (!(words >> name)) { continue; } //blank line
+    std::getline(words >> std::ws, value);
+    value.erase(value.find_last_not_of(" \t\r") + 1); //the rest of the line, so a path may have spaces in it
+
+    std::string where = path + ":" + std::to_string(number) + ": ";
+    if (value.empty()) {
+      error = where + name + " needs a value";
+      return false;
+    }
+    if (name == "config") {
+      error = where + "a config file can't name another one";
+      return false;
+    }
+    if (!applySetting(config, name, value, error)) {
+      error = where + error;
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static bool applySetting(ServerConfig& config, const std::string& name, const std::string& value, std::string& error) {
+  bool parsed = true; //for the settings that take a number
+  if (name == "directory") { config.directory = value; }
+  else if (name == "port") { parsed = parseNumber(value, config.port); }
+  else if (name == "bind") { config.bindAddress = value; }
+  else if (name == "tls-cert") { config.tlsCertificate = value; }
+  else if (name == "tls-key") { config.tlsKey = value; }
+  else if (name == "tls-threads") { parsed = parseNumber(value, config.tlsThreads); }
+  else if (name == "admin-port") { parsed = parseNumber(value, config.adminPort); }
+  else if (name == "io") { config.ioMode = value; }
+  else if (name == "workers") { parsed = parseNumber(value, config.workerCount); }
+  else if (name == "threads") { parsed = parseNumber(value, config.threadCount); }
+  else if (name == "queue-size") { parsed = parseNumber(value, config.queueSize); }
+  else if (name == "keep-alive-timeout") { parsed = parseNumber(value, config.keepAliveTimeout); }
+  else if (name == "header-timeout") { parsed = parseNumber(value, config.headerTimeout); }
+  else if (name == "body-timeout") { parsed = parseNumber(value, config.bodyTimeout); }
+  else if (name == "drain-timeout") { parsed = parseNumber(value, config.drainTimeout); }
+  else if (name == "control-socket") { config.controlSocket = value; }
+  else if (name == "take-over") { config.takeOver = value; }
+  else if (name == "backlog") { parsed = parseNumber(value, config.connectionBacklog); }
+  else if (name == "max-connections") { parsed = parseNumber(value, config.maxConnections); }
+  else if (name == "max-connections-per-ip") { parsed = parseNumber(value, config.maxConnectionsPerAddress); }
+  else if (name == "max-header-size") { parsed = parseNumber(value, config.maxHeaderSize); }
+  else if (name == "max-body-size") { parsed = parseNumber(value, config.maxBodySize); }
+  else if (name == "read-size") { parsed = parseNumber(value, config.readSize); }
+  else if (name == "cache-size") { parsed = parseNumber(value, config.cacheSize); }
+  else if (name == "cache-max-file-size") { parsed = parseNumber(value, config.cacheMaxFileSize); }
+  else if (name == "large-files") { config.largeFileMode = value; }
+  else if (name == "mmap-min-size") { parsed = parseNumber(value, config.mmapMinSize); }
+  else if (name == "stat-cache-ttl") { parsed = parseNumber(value, config.statCacheTtl); }
+  else if (name == "compress-min-size") { parsed = parseNumber(value, config.compressMinSize); }
+  else if (name == "log-level") {
+    if (!parseLogLevel(value, config.logLevel)) {
+      error = "Unknown --log-level " + value + ". Use debug, info, warning, error or off";
+      return false;
+    }
+  }
+  else if (name == "mime-types") { config.mimeTypesFile = value; }
+  else if (name == "log-file") { config.logFile = value; }
+  else if (name == "trace-file") { config.traceFile = value; }
+  else if (name == "trace-sample") { parsed = parseNumber(value, config.traceSample); }
+  else if (name == "max-upload-size") { parsed = parseNumber(value, config.maxUploadSize); }
+  else if (name == "upload-sync") {
+    if (value == "none") { config.uploadSync = UploadSync::None; }
+    else if (value == "file") { config.uploadSync = UploadSync::File; }
+    else if (value == "full") { config.uploadSync = UploadSync::Full; }
+    else {
+      error = "Unknown --upload-sync policy " + value + ". Use none, file or full";
+      return false;
+    }
+  }
+  else if (name == "proxy") { config.proxyRoutes.push_back(value); } //may be given more than once
+  else if (name == "proxy-balance") {
+    if (value == "round-robin") { config.proxyBalance = ProxyBalance::RoundRobin; }
+    else if (value == "least-connections") { config.proxyBalance = ProxyBalance::LeastConnections; }
+    else {
+      error = "Unknown --proxy-balance " + value + ". Use round-robin or least-connections";
+      return false;
+    }
+  }
+  else if (name == "proxy-timeout") { parsed = parseNumber(value, config.proxyTimeout); }
+  else if (name == "proxy-pool-size") { parsed = parseNumber(value, config.proxyPoolSize); }
+  else if (name == "proxy-threads") { parsed = parseNumber(value, config.proxyThreads); }
+  else {
+    error = "Unknown setting --" + name;
+    return false;
+  }
+
+  if (!parsed) { error = "--" + name + " takes a whole number, not " + value; }
+  return parsed;
+}
+
+
+template <typename Number>
+static bool parseNumber(const std::string& text, Number& number) {
+  const char* end = text.data() + text.size();
+  auto [stopped, result] = std::from_chars(text.data(), end, number);
+  return result == std::errc() && stopped == end;
+} //unlike strtol(), "80x", "" and "-1" for a size are rejected rather than read as something else
+
+
+static void copyReloadable(const ServerConfig& from, ServerConfig& to) {
+  to.logLevel = from.logLevel;
+  to.cacheSize = from.cacheSize;
+  to.cacheMaxFileSize = from.cacheMaxFileSize;
+  to.statCacheTtl = from.statCacheTtl;
+  to.compressMinSize = from.compressMinSize;
+} //the settings SIGHUP applies, refer config.hpp
+
+
+static void onReloadSignal(int) {
+  std::uint64_t one = 1;
+  ssize_t written = write(reload_fd, &one, sizeof(one));
+  (void) written; //a reload is already pending if the counter is that full
+}
+
+
+static void reloadOnSignal(int argc, char** argv, ServerConfig running) {
+  while (true) {
+    std::uint64_t signals;
+    if (read(reload_fd, &signals, sizeof(signals)) != sizeof(signals)) { continue; } //interrupted
+    ServerConfig reloaded;
+    std::string error;
+    if (!parseConfig(argc, argv, reloaded, error) || !validateConfig(reloaded, error)) {
+      logError("reload failed, nothing changed: ", error);
+      continue;
+    }
+
+    ServerConfig restartOnly = running;
+    copyReloadable(reloaded, restartOnly);
+    if (!(restartOnly == reloaded)) {
+      logWarning("reload: only log-level, cache-size, cache-max-file-size, stat-cache-ttl and compress-min-size change "
+                 "while running, the other changes wait for a restart");
+    }
+    copyReloadable(reloaded, running);
+    logger().setLevel(running.logLevel);
+    fileCache().configure(running.cacheSize, running.cacheMaxFileSize);
+    statCache().configure(std::chrono::milliseconds(running.statCacheTtl));
+    configureCompression(running.compressMinSize);
+    logInfo("reloaded ", running.configFile != "" ? running.configFile : "the command line");
+  }
+} //argv is main()'s, which lives as long as the process
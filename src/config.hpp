@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+#include "server.hpp"
+
+
+/**
+ * Where ServerConfig comes from. Every setting has a flag, and can be put in a --config file instead:
+ *
+ *    # /etc/http-server.conf
+ *    port 8080
+ *    io epoll
+ *    cache-size 268435456
+ *
+ * One setting per line, named like its flag without the dashes, followed by its value. Blank lines and everything
+ *    after a '#' are skipped. Flags given on the command line win over the file, wherever they come.
+ *
+ * All of it is checked before the server starts - an unknown name, a number that isn't one, a value out of range -
+ *    and the server refuses to start rather than run with something it wasn't asked for.
+ *
+ * On SIGHUP the file is read again, the command line applied over it again, and if all of it is valid, the settings
+ *    that can change under running workers take effect: log-level, cache-size, cache-max-file-size, stat-cache-ttl
+ *    and compress-min-size. Changes to any other setting are logged and wait for a restart (refer takeover.hpp for one
+ *    that drops nothing). A file that doesn't load or validate changes nothing.
+*/
+bool parseConfig(int argc, char** argv, ServerConfig& config, std::string& error); /*--config's file, then the other
+  flags, over the defaults. false with error saying what's wrong*/
+bool validateConfig(const ServerConfig& config, std::string& error);
+bool watchReloads(int argc, char** argv, const ServerConfig& running); //installs the SIGHUP handler. false if its eventfd couldn't be made
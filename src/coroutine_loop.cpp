@@ -0,0 +1,120 @@
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "coroutine_loop.hpp"
+#include "event_loop.hpp"
+#include "async.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "admission.hpp"
+#include "tls.hpp"
+
+
+static Detached acceptClients(Reactor& reactor, int listen_fd, const ServerConfig& config);
+static Detached serveClient(Reactor& reactor, int client_fd, const ServerConfig& config);
+static void coroutineLoop(int listen_fd, ServerConfig config);
+
+
+int runCoroutineLoops(const std::vector<int>& listeners, const ServerConfig& config) {
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpuCount < 1) { cpuCount = 1; }
+
+  logInfo("server ", listeners[0], " is running ", listeners.size(), " coroutine worker(s) on port ", config.port);
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < listeners.size(); i++) {
+    workers.emplace_back(coroutineLoop, listeners[i], config);
+    pinToCore(workers.back(), i % cpuCount);
+  }
+  for (std::thread& worker : workers) { worker.join(); }
+  for (std::size_t i = 1; i < listeners.size(); i++) { close(listeners[i]); }
+  return 0;
+}
+
+
+static void coroutineLoop(int listen_fd, ServerConfig config) {
+  Reactor reactor;
+  if (!reactor.valid()) {
+    std::cerr << "Failed to set up the reactor of listening socket " << listen_fd << "\n";
+    return;
+  }
+  acceptClients(reactor, listen_fd, config); //runs until its first co_await, then the reactor takes over
+  reactor.run();
+} //config is the copy every coroutine on this thread refers to, and neither it nor the reactor outlives them
+
+
+static Detached acceptClients(Reactor& reactor, int listen_fd, const ServerConfig& config) {
+  AsyncListener listener(reactor, listen_fd);
+  if (!listener.valid()) {
+    std::cerr << "Failed to register listening socket " << listen_fd << " with epoll\n";
+    co_return;
+  }
+
+  while (true) {
+    int client_fd = co_await listener.accept();
+    if (client_fd < 0 && reactor.draining()) { co_return; } //the next server, or nobody, accepts the rest
+    if (client_fd < 0) {
+      logError("accept failed on listening socket ", listen_fd, ": ", std::strerror(errno));
+      continue; //accept() waits for the next connection before trying again
+    }
+    if (!admission().admit(client_fd)) {
+      logWarning("too many connections for client ", client_fd, ", sending 503");
+      rejectClient(client_fd);
+      continue;
+    }
+    logDebug("client ", client_fd, " connected");
+    serveClient(reactor, client_fd, config); //runs until it has to wait for the client, then comes back here
+  }
+}
+
+
+/* The same as handleClient(), one co_await at a time, except that waiting for the client doesn't take a thread. */
+static Detached serveClient(Reactor& reactor, int client_fd, const ServerConfig& config) {
+  AsyncSocket client(reactor, client_fd); //closes client_fd at the end, so it goes first, and is destroyed last
+  struct Admitted {
+    int fd;
+    ~Admitted() {
+      tls().release(fd);
+      admission().release(fd);
+    }
+  } admitted{ client_fd }; //released just before client closes the fd, refer Admission::release()
+  if (!client.valid()) {
+    logError("failed to register client ", client_fd, " with epoll");
+    co_return;
+  }
+  auto handshakeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(config.headerTimeout);
+  if (tls().enabled() && !co_await TlsHandshake{ reactor, client_fd, handshakeDeadline }) {
+    co_return; //on the handshake threads, refer tls.hpp. Tls::accept() counted and logged it
+  }
+  ClientSession session(config);
+  ResponseQueue responses; //after session - the responses are built in its arena, so they have to go first
+  metrics().connectionOpened();
+
+  while (session.keepAlive) {
+    auto deadline = session.readDeadline(std::chrono::steady_clock::now(), config);
+    ssize_t bytes_received = co_await client.read(session.pending, config.readSize, deadline, session.betweenRequests());
+    if (bytes_received == 0) { break; } //client closed the connection
+    if (bytes_received < 0) {
+      if (errno != ETIMEDOUT) { //ETIMEDOUT just means a timeout expired
+        logError("failed to get contents of HTTP request of client ", client_fd, ": ", std::strerror(errno));
+      }
+      break;
+    }
+
+    {
+      TraceSample sample("connection"); //not across the co_awaits, refer trace.hpp
+      answerRequests(client_fd, session, responses, config);
+    }
+
+    if (!co_await client.write(session, responses, std::chrono::seconds(config.bodyTimeout))) {
+      logDebug("error sending HTTP response to client ", client_fd); //almost always the client hanging up early
+      break;
+    }
+  }
+
+  metrics().connectionClosed();
+  logDebug("closed client ", client_fd);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <vector>
+
+#include "server.hpp"
+
+
+int runCoroutineLoops(const std::vector<int>& listeners, const ServerConfig& config); //a worker per listener. Blocks until every worker has exited
@@ -0,0 +1,61 @@
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "drain.hpp"
+#include "log.hpp"
+
+
+static void onStopSignal(int);
+static void enforceDrainTimeout(std::chrono::seconds timeout);
+
+static std::atomic<bool> drainStarted{false}; //lock free, so it may be touched from a signal handler
+static int notice_fd = -1;
+
+
+bool configureDrain(std::chrono::seconds timeout) {
+  notice_fd = eventfd(0, EFD_CLOEXEC);
+  if (notice_fd < 0) { return false; }
+  struct sigaction action = {};
+  action.sa_handler = onStopSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART; //nothing waits for the signal itself - the loops wait on notice_fd
+  sigaction(SIGTERM, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+  std::thread(enforceDrainTimeout, timeout).detach();
+  return true;
+}
+
+
+void beginDrain() {
+  if (drainStarted.exchange(true)) { return; }
+  std::uint64_t one = 1;
+  ssize_t written = write(notice_fd, &one, sizeof(one));
+  (void) written; //a fresh eventfd can't overflow
+}
+
+
+bool draining() { return drainStarted.load(std::memory_order_relaxed); }
+int drainNotice() { return notice_fd; }
+
+
+static void onStopSignal(int) {
+  if (draining()) { _exit(1); } //asked twice - whoever sent it doesn't want to wait
+  beginDrain();
+}
+
+
+static void enforceDrainTimeout(std::chrono::seconds timeout) {
+  struct pollfd notice = { notice_fd, POLLIN, 0 };
+  while (poll(&notice, 1, -1) < 0 && errno == EINTR) {}
+  logInfo("draining: not accepting any more connections, waiting up to ", timeout.count(), "s for the open ones");
+  std::this_thread::sleep_for(timeout);
+  logWarning("drain timeout passed with connections still open, exiting anyway");
+  logger().flush();
+  _exit(0);
+} //main() returns long before this wakes up, if the connections finish in time
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+
+
+/**
+ * Stopping without dropping requests. On SIGTERM or SIGINT - or once a new server has taken over the listeners, refer
+ *    takeover.hpp - the server drains:
+ *  - no worker accepts another connection
+ *  - connections waiting for their next request are closed straight away - in the threads mode, once their recv()
+ *    times out, as nothing can wake a thread blocked in it. A new connection's first request is still waited for
+ *  - a request that has (partly) arrived is answered with Connection: close, and its connection closed after - the
+ *    client retries anything it pipelined behind it, as it would for any server closing the connection
+ *  - each worker returns once it has no connections left, and main() once they all have
+ * Whatever is still open after --drain-timeout is dropped - the process exits anyway. A second signal exits at once.
+ *
+ * The workers learn of it from drainNotice(), an eventfd that turns readable when the drain begins and is never read
+ *    - so any number of epoll instances and rings can wait on the one fd without waking each other up.
+*/
+bool configureDrain(std::chrono::seconds timeout); //installs the signal handlers. false if the eventfd couldn't be made
+void beginDrain(); //async-signal-safe. Only the first call does anything
+bool draining();
+int drainNotice();
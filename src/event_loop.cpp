@@ -0,0 +1,454 @@
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+#include <sys/eventfd.h>
+
+#include "event_loop.hpp"
+#include "server.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "admission.hpp"
+#include "timer_wheel.hpp"
+#include "drain.hpp"
+#include "tls.hpp"
+#include "proxy.hpp"
+
+
+/**
+ * epoll based reactor, selected with --io epoll.
+ * 
+ * epoll(7) lets one thread watch many file descriptors at once: we register every socket with an epoll instance, and
+ *    epoll_wait() hands back only the ones that are ready.
+ * 
+ * We run one worker thread per core (--workers). Every worker is pinned to its core, binds its *own* listening socket
+ *    to the port (possible because of SO_REUSEPORT) and runs its own epoll instance. The kernel hashes each new
+ *    connection onto one of the listeners, so workers never contend on a shared accept queue and a connection lives
+ *    its whole life on the core that accepted it.
+ * 
+ * All sockets are registered edge-triggered (EPOLLET) - the kernel only reports a socket again once *new* data arrives
+ *    or buffer space frees up. So whenever we are told a socket is ready we must keep calling recv()/send()/accept()
+ *    until they fail with EAGAIN, otherwise the remaining data would sit there unnoticed.
+ * 
+ * Every connection has a deadline on the worker's timer wheel (refer timer_wheel.hpp), moved along whenever something
+ *    happens on it: the keep-alive, header or body timeout while we wait for the client (refer
+ *    ClientSession::readDeadline()), the body timeout while a response waits for it to make room. A connection whose
+ *    deadline passes is closed.
+ * 
+ * Draining (refer drain.hpp), a worker takes its listener out of its epoll instance, closes the connections that are
+ *    between requests, and keeps going until the rest have been answered and closed too.
+ * 
+ * With --tls-cert, a connection is handed to the TLS handshake threads as soon as it's accepted (refer tls.hpp), and
+ *    comes back through the worker's Handoffs once it's ready for requests - only then is it registered.
+ * 
+ * A client pipelining requests faster than it reads the responses isn't read from once its out is backedUp() (refer
+ *    response.hpp), and nor is any connection that has had its readsPerEvent - both are left with bytes in the kernel
+ *    that edge triggering won't report again, so they're unread: served again once EPOLLOUT says out has room, or
+ *    after the rest of the batch if nothing is keeping them waiting. One busy client can't take up all of the
+ *    worker's memory or time.
+ * 
+ * A proxied response (refer proxy.hpp) is relayed by the relay threads in the same way: once it's at the front of out,
+ *    the connection is handed to them, and its events are ignored until it comes back - an upstream taking its time
+ *    would otherwise hold up every other connection on the worker.
+ * 
+*/
+
+struct Connection {
+  Connection(int fd, const ServerConfig& config) : fd(fd), session(config) {}
+
+  int fd;
+  ClientSession session; //received bytes, the parser (which resumes where it stopped) and any upload in progress
+  ResponseQueue out; //responses waiting to be sent, in request order
+  bool closeAfterFlush = false; //close once out has been sent
+  bool relaying = false; //the relay threads have it, for the proxied response at the front of out
+  bool unread = false; //stopped reading before recv() ran dry, refer readFromClient()
+  bool resuming = false; //in the worker's resume list
+  TimerWheel::Timer deadline; //owned by the fd
+};
+
+static constexpr int readsPerEvent = 16; //recv()s a connection gets before the others on its worker have their turn
+
+/* Connections a worker handed to other threads - the TLS handshake threads, or the proxy's relay threads. They post
+  them back here when they're done, and the eventfd wakes the worker to take them in. */
+struct Handoffs {
+  int notice_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  std::size_t running = 0; //only touched by the worker
+  std::mutex lock;
+  std::vector<std::pair<int, bool>> done; //the client, and whether it can carry on
+  std::vector<std::pair<int, bool>> taking; //done, swapped out under the lock
+
+  ~Handoffs() { close(notice_fd); }
+  void finished(int client_fd, bool ok); //from the other threads
+  void take(); //done into taking, once notice_fd is readable
+};
+
+static bool setNonBlocking(int fd);
+static void scheduleDeadline(TimerWheel& timers, Connection& connection, const ServerConfig& config);
+static void acceptClients(int epoll_fd, int listen_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers,
+                          Handoffs& handshakes, const ServerConfig& config);
+static void addConnection(int epoll_fd, int client_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, const ServerConfig& config);
+static void takeHandshaken(int epoll_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, Handoffs& handshakes,
+                           const ServerConfig& config);
+static void serveConnection(int epoll_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, Handoffs& relays,
+                            std::vector<int>& resume, Connection& connection, std::uint32_t events, bool accepting, const ServerConfig& config); //after events on it
+static void takeRelayed(int epoll_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, Handoffs& relays,
+                        std::vector<int>& resume, bool accepting, const ServerConfig& config);
+static bool readFromClient(Connection& connection, const ServerConfig& config);
+static void closeConnection(int epoll_fd, std::unordered_map<int, Connection>& connections, int fd);
+static void stopAccepting(int epoll_fd, int listen_fd, std::unordered_map<int, Connection>& connections);
+static void eventLoop(int listen_fd, ServerConfig config);
+
+
+int runEventLoops(const std::vector<int>& listeners, const ServerConfig& config) {
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpuCount < 1) { cpuCount = 1; }
+
+  for (int listen_fd : listeners) {
+    if (!setNonBlocking(listen_fd)) {
+      std::cerr << "Failed to make listening socket " << std::to_string(listen_fd) << " non-blocking\n";
+      return 1;
+    }
+  }
+
+  logInfo("server ", listeners[0], " is running ", listeners.size(), " epoll worker(s) on port ", config.port);
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < listeners.size(); i++) {
+    workers.emplace_back(eventLoop, listeners[i], config);
+    pinToCore(workers.back(), i % cpuCount);
+  }
+  for (std::thread& worker : workers) { worker.join(); }
+  for (std::size_t i = 1; i < listeners.size(); i++) { close(listeners[i]); }
+  return 0;
+}
+
+
+std::vector<int> openWorkerListeners(std::vector<int> listeners, const ServerConfig& config) {
+  for (long i = listeners.size(); i < config.workerCount; i++) {
+    int listen_fd = openListeningSocket(config.bindAddress, config.port, config.connectionBacklog);
+    if (listen_fd < 0) { break; }
+    listeners.push_back(listen_fd);
+  }
+  return listeners;
+} //fewer listeners than workers if the port runs out of them, and then fewer workers
+
+
+static void eventLoop(int listen_fd, ServerConfig config) {
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    std::cerr << "epoll_create1 failed\n";
+    return;
+  }
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = listen_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+    std::cerr << "Failed to register server socket with epoll\n";
+    close(epoll_fd);
+    return;
+  }
+  event.events = EPOLLIN; //level triggered - it stays readable, and is taken out again once seen
+  event.data.fd = drainNotice();
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, drainNotice(), &event) != 0) {
+    std::cerr << "Failed to register the drain notice with epoll\n";
+    close(epoll_fd);
+    return;
+  }
+  Handoffs handshakes;
+  event.data.fd = handshakes.notice_fd;
+  if (handshakes.notice_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handshakes.notice_fd, &event) != 0) {
+    std::cerr << "Failed to register the TLS handshakes' eventfd with epoll\n";
+    close(epoll_fd);
+    return;
+  }
+  Handoffs relays;
+  event.data.fd = relays.notice_fd;
+  if (relays.notice_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, relays.notice_fd, &event) != 0) {
+    std::cerr << "Failed to register the proxy relays' eventfd with epoll\n";
+    close(epoll_fd);
+    return;
+  }
+  bool accepting = true;
+
+  TimerWheel timers; //before connections, which take their timers off it as they go
+  std::unordered_map<int, Connection> connections;
+  std::array<struct epoll_event, 128> events;
+  std::vector<int> resume, resuming; //unread connections to serve again after the batch, refer serveConnection()
+  constexpr int tickMilliseconds = TimerWheel::tickLength.count();
+
+  while (accepting || !connections.empty() || handshakes.running > 0 || relays.running > 0) {
+    //with connections open, wake up every tick so their deadlines pass even when nothing else happens
+    int ready = epoll_wait(epoll_fd, events.data(), events.size(), !resume.empty() ? 0 : timers.empty() ? -1 : tickMilliseconds);
+    if (ready < 0) {
+      if (errno == EINTR) { continue; }
+      std::cerr << "epoll_wait failed\n";
+      break;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        if (accepting) { acceptClients(epoll_fd, listen_fd, connections, timers, handshakes, config); }
+        continue;
+      }
+      if (fd == handshakes.notice_fd) {
+        takeHandshaken(epoll_fd, connections, timers, handshakes, config);
+        continue;
+      }
+      if (fd == relays.notice_fd) {
+        takeRelayed(epoll_fd, connections, timers, relays, resume, accepting, config);
+        continue;
+      }
+      if (fd == drainNotice()) {
+        stopAccepting(epoll_fd, listen_fd, connections);
+        accepting = false;
+        continue;
+      }
+
+      auto found = connections.find(fd);
+      if (found == connections.end() || found->second.relaying) { continue; } //a relayed one is looked at once it's back
+      serveConnection(epoll_fd, connections, timers, relays, resume, found->second, events[i].events, accepting, config);
+    }
+
+    resuming.swap(resume); //one that runs out of turns again goes back on resume, for after the next batch
+    for (int fd : resuming) {
+      auto found = connections.find(fd);
+      if (found == connections.end() || !found->second.resuming) { continue; } //closed since
+      found->second.resuming = false;
+      if (found->second.relaying) { continue; } //takeRelayed() reads on once it's back
+      serveConnection(epoll_fd, connections, timers, relays, resume, found->second, 0, accepting, config);
+    }
+    resuming.clear();
+
+    timers.advance(std::chrono::steady_clock::now(), [&](TimerWheel::Timer& timer) {
+      int fd = static_cast<int>(timer.owner);
+      logDebug("client ", fd, " timed out");
+      closeConnection(epoll_fd, connections, fd);
+    });
+  }
+
+  for (auto& [fd, connection] : connections) { close(fd); }
+  close(epoll_fd);
+}
+
+
+static void serveConnection(int epoll_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, Handoffs& relays,
+                            std::vector<int>& resume, Connection& connection, std::uint32_t events, bool accepting, const ServerConfig& config) {
+  int fd = connection.fd;
+  TraceSample sample("connection"); //reading, answering and sending, refer trace.hpp
+
+  if (events & EPOLLERR) {
+    closeConnection(epoll_fd, connections, fd);
+    return;
+  }
+
+  if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) || connection.unread) {
+    bool open = readFromClient(connection, config);
+    if (!open || !connection.session.keepAlive) { connection.closeAfterFlush = true; } //still send whatever was asked for before leaving
+  }
+
+  SendResult sent = sendResponses(fd, connection.out);
+  if (sent == SendResult::Proxied) {
+    connection.deadline.cancel(); //the relay has its own timeouts
+    connection.relaying = true;
+    relays.running++;
+    proxy().relayLater(*connection.out.front().proxied, fd, [&relays, fd](bool relayed) { relays.finished(fd, relayed); });
+    return;
+  }
+  if (sent == SendResult::Error || (sent == SendResult::Done && connection.closeAfterFlush)) {
+    closeConnection(epoll_fd, connections, fd);
+    return;
+  } //WouldBlock - wait for EPOLLOUT
+  if (!accepting && connection.out.empty() && connection.session.betweenRequests()) {
+    closeConnection(epoll_fd, connections, fd); //draining, and done with its last request
+    return;
+  }
+  if (connection.unread && !connection.out.backedUp() && !connection.resuming) {
+    connection.resuming = true; //there's room for more responses, but epoll won't say there are more requests
+    resume.push_back(fd);
+  } //backed up - EPOLLOUT brings it back here once some of out has gone
+  scheduleDeadline(timers, connection, config);
+}
+
+
+static void acceptClients(int epoll_fd, int listen_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers,
+                          Handoffs& handshakes, const ServerConfig& config) {
+  while (true) {
+    //accept4 lets us get the client socket already non-blocking, saving a fcntl() call per client
+    int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (client_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        logError("accept failed on listener ", listen_fd, ": ", std::strerror(errno));
+      }
+      if (errno == EINTR) { continue; }
+      return; //EAGAIN - no more pending connections for now
+    }
+    if (!admission().admit(client_fd)) {
+      logWarning("too many connections for client ", client_fd, ", sending 503");
+      rejectClient(client_fd);
+      continue;
+    }
+    if (tls().enabled()) {
+      handshakes.running++;
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(config.headerTimeout);
+      tls().acceptLater(client_fd, deadline, [&handshakes, client_fd](bool shookHands) { handshakes.finished(client_fd, shookHands); });
+      continue;
+    }
+    addConnection(epoll_fd, client_fd, connections, timers, config);
+  }
+}
+
+
+static void addConnection(int epoll_fd, int client_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, const ServerConfig& config) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.fd = client_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) != 0) {
+    logError("failed to register client ", client_fd, " with epoll");
+    tls().release(client_fd);
+    admission().release(client_fd);
+    close(client_fd);
+    return;
+  }
+  Connection& connection = connections.try_emplace(client_fd, client_fd, config).first->second;
+  connection.deadline.owner = client_fd;
+  scheduleDeadline(timers, connection, config);
+  metrics().connectionOpened();
+  logDebug("client ", client_fd, " connected");
+} //epoll reports whatever the client sent meanwhile as soon as it's registered
+
+
+static void takeHandshaken(int epoll_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, Handoffs& handshakes,
+                           const ServerConfig& config) {
+  handshakes.take();
+  for (auto [client_fd, shookHands] : handshakes.taking) {
+    handshakes.running--;
+    if (shookHands) { addConnection(epoll_fd, client_fd, connections, timers, config); }
+    else {
+      admission().release(client_fd);
+      close(client_fd);
+    }
+  }
+  handshakes.taking.clear();
+} //taken in while draining too - like any new connection, refer drain.hpp
+
+
+static void takeRelayed(int epoll_fd, std::unordered_map<int, Connection>& connections, TimerWheel& timers, Handoffs& relays,
+                        std::vector<int>& resume, bool accepting, const ServerConfig& config) {
+  relays.take();
+  for (auto [client_fd, relayed] : relays.taking) {
+    relays.running--;
+    Connection& connection = connections.at(client_fd); //nothing closes a connection while it's relaying
+    connection.relaying = false;
+    finishRelay(connection.session, connection.out);
+    if (!relayed) {
+      closeConnection(epoll_fd, connections, client_fd);
+      continue;
+    }
+    serveConnection(epoll_fd, connections, timers, relays, resume, connection, EPOLLIN | EPOLLOUT, accepting, config); /*whatever
+      came meanwhile - edge triggered, epoll won't say again*/
+  }
+  relays.taking.clear();
+}
+
+
+void Handoffs::finished(int client_fd, bool ok) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done.emplace_back(client_fd, ok);
+  }
+  std::uint64_t one = 1;
+  ssize_t written = write(notice_fd, &one, sizeof(one));
+  (void) written; //the worker is already due to wake if the counter is that full
+}
+
+
+void Handoffs::take() {
+  std::uint64_t count;
+  ssize_t drained = read(notice_fd, &count, sizeof(count));
+  (void) drained; //the next finished() writes it again
+  std::lock_guard<std::mutex> guard(lock);
+  taking.swap(done);
+}
+
+
+static bool readFromClient(Connection& connection, const ServerConfig& config) {
+  connection.unread = false;
+  for (int reads = 0; connection.session.keepAlive; reads++) {
+    if (reads == readsPerEvent || connection.out.backedUp()) {
+      connection.unread = true; //whatever's left, the kernel keeps - refer serveConnection()
+      return true;
+    }
+    ssize_t bytes_received = receiveInto(connection.fd, connection.session.pending, config.readSize);
+    if (bytes_received > 0) {
+      answerRequests(connection.fd, connection.session, connection.out, config); //after every recv(), so an upload never piles up in memory
+      continue;
+    }
+    if (bytes_received == 0) { return false; } //orderly shutdown by the client
+    if (errno == EINTR) { continue; }
+    return errno == EAGAIN || errno == EWOULDBLOCK; //drained everything the kernel had for us
+  }
+  return true; //the connection is closing anyway, no point reading any more
+} //answers requests as they arrive. returns false if the client closed the connection or an error occurred
+
+
+static void scheduleDeadline(TimerWheel& timers, Connection& connection, const ServerConfig& config) {
+  auto now = std::chrono::steady_clock::now();
+  if (!connection.out.empty()) { timers.schedule(connection.deadline, now + std::chrono::seconds(config.bodyTimeout)); } //waiting for room to send
+  else { timers.schedule(connection.deadline, connection.session.readDeadline(now, config)); }
+} //after anything happened on the connection
+
+
+static void stopAccepting(int epoll_fd, int listen_fd, std::unordered_map<int, Connection>& connections) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr); //left open - main() closes it, and a server taking over has its own copy
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, drainNotice(), nullptr);
+  std::vector<int> idle;
+  for (auto& [fd, connection] : connections) {
+    if (connection.out.empty() && connection.session.betweenRequests()) { idle.push_back(fd); }
+  }
+  for (int fd : idle) { closeConnection(epoll_fd, connections, fd); }
+} //refer drain.hpp
+
+
+static void closeConnection(int epoll_fd, std::unordered_map<int, Connection>& connections, int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  tls().release(fd);
+  admission().release(fd);
+  close(fd);
+  connections.erase(fd);
+  metrics().connectionClosed();
+  logDebug("closed client ", fd);
+}
+
+
+static bool setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) { return false; }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+void pinToCore(std::thread& worker, long core) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core, &cpus);
+  if (pthread_setaffinity_np(worker.native_handle(), sizeof(cpus), &cpus) != 0) {
+    std::cerr << "Failed to pin worker to core " << core << ", it will float between cores\n";
+  }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+
+#include "server.hpp"
+
+
+int runEventLoops(const std::vector<int>& listeners, const ServerConfig& config); //a worker per listener. Blocks until every worker has exited
+std::vector<int> openWorkerListeners(std::vector<int> listeners, const ServerConfig& config); /*adds a SO_REUSEPORT
+  listener on the same port for every worker that hasn't got one - listeners holds main()'s, or the ones taken over*/
+void pinToCore(std::thread& worker, long core);
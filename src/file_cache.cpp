@@ -0,0 +1,217 @@
+#include <string>
+#include <thread>
+#include <functional>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <climits>
+#include <cerrno>
+
+#include "file_cache.hpp"
+#include "log.hpp"
+#include "path_resolver.hpp"
+
+
+static std::string_view variantKey(std::string_view path, unsigned char variant, std::string& key);
+
+
+FileCache& fileCache() {
+  static FileCache cache;
+  return cache;
+}
+
+
+void FileCache::configure(std::size_t budget, std::size_t maxFileSize) {
+  if (watcherStopped) { budget = 0; }
+  if (budget > 0 && inotify_fd < 0) { //before the budget is set, so every entry is inserted after its directory is watched
+    int watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd < 0) { logWarning("inotify unavailable, cached files will be revalidated with stat()"); }
+    else {
+      inotify_fd = watch_fd;
+      std::thread watcher(&FileCache::watchChanges, this);
+      watcher.detach();
+    }
+  }
+  this->maxFileSize.store(maxFileSize, std::memory_order_relaxed);
+  this->budget.store(budget, std::memory_order_relaxed);
+  trim(budget / shardCount);
+} //only ever called from one thread at a time - main(), then the reload thread
+
+
+bool FileCache::lookup(std::string_view path, unsigned char variant, std::string_view contentType, Hit& hit) {
+  if (!enabled()) { return false; }
+  thread_local std::string scratch; //keeps its capacity, so building a variant's key doesn't allocate after the first few
+  std::string_view key = variantKey(path, variant, scratch);
+  Shard& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+
+  auto found = shard.entries.find(key);
+  if (found == shard.entries.end()) { return false; }
+  auto entry = found->second;
+  if (entry->contentType != contentType) { return false; }
+
+  if (inotify_fd < 0) {
+    struct stat info;
+    bool unchanged = stat(entry->source.c_str(), &info) == 0 && info.st_ino == entry->inode && info.st_size == entry->size
+      && info.st_mtim.tv_sec == entry->mtime.tv_sec && info.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+    if (!unchanged) {
+      eraseEntry(shard, entry);
+      return false;
+    }
+  }
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, entry); //mark as most recently used
+  hit.head = entry->head;
+  hit.body = entry->body;
+  return true;
+}
+
+
+void FileCache::insert(const std::string& path, unsigned char variant, const std::string& source, const std::string& contentType,
+    std::string head, std::shared_ptr<const std::string> body, const struct stat& info, std::uint64_t watched) {
+  std::string scratch;
+  std::string key(variantKey(path, variant, scratch));
+  std::size_t entrySize = key.size() + head.size() + body->size();
+  std::size_t shardBudget = budget.load(std::memory_order_relaxed) / shardCount;
+  if (entrySize > shardBudget) { return; }
+
+  Shard& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  if (invalidations.load() != watched) { return; } /*under the lock - an invalidate() counted after this waits for it, and
+    then erases what's inserted here*/
+
+  auto found = shard.entries.find(key);
+  if (found != shard.entries.end()) { eraseEntry(shard, found->second); }
+  while (!shard.lru.empty() && shard.bytes + entrySize > shardBudget) {
+    eraseEntry(shard, std::prev(shard.lru.end())); //evict the least recently used
+  }
+
+  shard.lru.push_front(Entry{ key, source, contentType, std::move(head), std::move(body),
+    info.st_ino, info.st_size, info.st_mtim });
+  shard.entries[std::move(key)] = shard.lru.begin();
+  shard.bytes += entrySize;
+} //a compressed variant that shares the plain file's body is counted twice, which errs on the side of evicting early
+
+
+void FileCache::invalidate(const std::string& path) {
+  invalidations++; //before erasing, refer insert()
+  std::string key;
+  for (unsigned char variant = 0; variant < codingVariants; variant++) { eraseKey(variantKey(path, variant, key)); }
+  std::string_view original = uncompressedPath(path); //style.css.gz changing makes what we compressed from it stale
+  for (unsigned char variant = 1; !original.empty() && variant < codingVariants; variant++) {
+    eraseKey(variantKey(original, variant, key));
+  }
+}
+
+
+void FileCache::trim(std::size_t shardBudget) {
+  for (Shard& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard.lock);
+    while (!shard.lru.empty() && shard.bytes > shardBudget) { eraseEntry(shard, std::prev(shard.lru.end())); }
+  }
+}
+
+
+void FileCache::clear() {
+  invalidations++; //the same as invalidating everything
+  for (Shard& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.lru.clear();
+    shard.entries.clear();
+    shard.bytes = 0;
+  }
+}
+
+
+std::uint64_t FileCache::watchDirectoryOf(const std::string& path) {
+  std::size_t slash = path.find_last_of('/');
+  std::string prefix = (slash == std::string::npos) ? "" : path.substr(0, slash + 1); //"files/a.txt" -> "files/"
+
+  std::lock_guard<std::mutex> guard(watchLock);
+  if (inotify_fd >= 0 && !watches.count(prefix)) {
+    std::string directory = prefix.empty() ? "." : prefix;
+    int wd = inotify_add_watch(inotify_fd, directory.c_str(),
+      IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd >= 0) {
+      watches[prefix] = wd;
+      watchedPrefixes[wd] = prefix;
+    }
+  }
+  return invalidations.load();
+} //once the directory is watched, so every change from then on is counted
+
+
+void FileCache::watchChanges() {
+  alignas(struct inotify_event) char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+  while (true) {
+    ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) { continue; }
+    if (length <= 0) {
+      logError("inotify watcher stopped, cache disabled");
+      watcherStopped = true;
+      budget = 0;
+      clear();
+      return;
+    }
+
+    for (char* p = buffer; p < buffer + length; ) {
+      const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        /* we missed events, or a whole directory went away - simplest to start again. The watch for a removed
+          directory is dropped so it gets re-added if the directory comes back. */
+        if (event->mask & IN_IGNORED) {
+          std::lock_guard<std::mutex> guard(watchLock);
+          auto found = watchedPrefixes.find(event->wd);
+          if (found != watchedPrefixes.end()) {
+            watches.erase(found->second);
+            watchedPrefixes.erase(found);
+          }
+        }
+        clear();
+        continue;
+      }
+      if (event->len == 0) { continue; }
+
+      std::string prefix;
+      {
+        std::lock_guard<std::mutex> guard(watchLock);
+        auto found = watchedPrefixes.find(event->wd);
+        if (found == watchedPrefixes.end()) { continue; }
+        prefix = found->second;
+      }
+      std::string path = prefix + event->name;
+      invalidate(path);
+      statCache().forget(path); //a file created where there was none shouldn't stay a 404 until its entry expires
+    }
+  }
+} //runs on its own thread for the lifetime of the server
+
+
+FileCache::Shard& FileCache::shardFor(std::string_view key) {
+  return shards[PathHash{}(key) % shardCount];
+} //a file's variants have different keys, so they usually land in different shards
+
+
+void FileCache::eraseEntry(Shard& shard, std::list<Entry>::iterator entry) {
+  shard.bytes -= entry->key.size() + entry->head.size() + entry->body->size();
+  shard.entries.erase(entry->key);
+  shard.lru.erase(entry);
+}
+
+
+void FileCache::eraseKey(std::string_view key) {
+  Shard& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto found = shard.entries.find(key);
+  if (found != shard.entries.end()) { eraseEntry(shard, found->second); }
+}
+
+
+static std::string_view variantKey(std::string_view path, unsigned char variant, std::string& key) {
+  if (variant == 0) { return path; }
+  key.assign(path);
+  key += '\0'; //can't be part of a path, so a key never clashes with another file's
+  key += static_cast<char>('0' + variant);
+  return key;
+} //the plain file's key is its path, so looking it up needs no copy
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <memory_resource>
+#include <list>
+#include <unordered_map>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "compression.hpp"
+
+
+/**
+ * Keeps small, frequently requested files in memory as ready-to-send responses (headers + body), so a hit never
+ *    opens, stats or reads the file.
+ * 
+ * The cache is split into shards, each with its own lock and its own least-recently-used list, so workers serving
+ *    different files rarely wait on each other. Each shard gets an equal part of the byte budget and evicts from the
+ *    tail of its LRU list when full.
+ * 
+ * Entries are invalidated by an inotify watcher thread watching the directories of cached files. If inotify isn't
+ *    available, every hit falls back to a stat() comparing inode, size and mtime against the cached copy.
+ * 
+ * A file can have several entries, one per variant: the plain file, and what clients accepting gzip, br or both get
+ *    (refer AcceptedCodings::variant()) - each compressed once, when it's first asked for. A compressed entry may come
+ *    from a precompressed sibling (style.css.gz), which is then its source - the file that's watched and stat()'ed.
+*/
+class FileCache {
+  public:
+    struct Hit {
+      explicit Hit(std::pmr::memory_resource* memory) : head(memory) {}
+      std::pmr::string head; //status line and headers, copied (into memory) so the caller can add to them
+      std::shared_ptr<const std::string> body; //shared with the cache, never copied
+    };
+
+    void configure(std::size_t budget, std::size_t maxFileSize); /*budget 0 disables the cache. May be called again while
+      serving - on SIGHUP, refer config.hpp - and entries beyond a smaller budget are evicted right away*/
+    bool enabled() const { return budget.load(std::memory_order_relaxed) > 0; }
+    bool cacheable(std::size_t fileSize) const {
+      std::size_t shardBudget = budget.load(std::memory_order_relaxed) / shardCount;
+      return shardBudget > 0 && fileSize <= maxFileSize.load(std::memory_order_relaxed) && fileSize <= shardBudget;
+    }
+
+    bool lookup(std::string_view path, unsigned char variant, std::string_view contentType, Hit& hit);
+    void insert(const std::string& path, unsigned char variant, const std::string& source, const std::string& contentType,
+      std::string head, std::shared_ptr<const std::string> body, const struct stat& info, std::uint64_t watched); /*info
+      is source's, watched what watchDirectoryOf() returned. Nothing is inserted if anything was invalidated since - the
+      file may have changed while it was read, and its change has nothing left to invalidate*/
+    std::uint64_t watchDirectoryOf(const std::string& path); //call before reading a file that is about to be inserted
+    void invalidate(const std::string& path); //every variant of path, and the compressed ones of the file it's a sibling of
+    void clear();
+
+  private:
+    static constexpr std::size_t shardCount = 16;
+
+    struct Entry {
+      std::string key; //the path, followed by the variant for compressed ones
+      std::string source; //the file the body was read from
+      std::string contentType;
+      std::string head;
+      std::shared_ptr<const std::string> body;
+      ino_t inode;
+      off_t size;
+      struct timespec mtime;
+    };
+
+    struct PathHash {
+      using is_transparent = void; //lets lookup() find a std::string key with a string_view, without building a string
+      std::size_t operator()(std::string_view path) const { return std::hash<std::string_view>{}(path); }
+    };
+
+    struct Shard {
+      std::mutex lock;
+      std::list<Entry> lru; //most recently used at the front
+      std::unordered_map<std::string, std::list<Entry>::iterator, PathHash, std::equal_to<>> entries;
+      std::size_t bytes = 0;
+    };
+
+    std::atomic<std::size_t> budget{0};
+    std::atomic<std::size_t> maxFileSize{0};
+    std::array<Shard, shardCount> shards;
+    std::atomic<std::uint64_t> invalidations{0}; //refer insert()
+
+    std::atomic<int> inotify_fd{-1}; //set up the first time the cache is enabled
+    std::atomic<bool> watcherStopped{false}; //and then the cache is off for good - nothing would invalidate it
+    std::mutex watchLock;
+    std::unordered_map<int, std::string> watchedPrefixes; //inotify watch descriptor -> path prefix of its directory
+    std::unordered_map<std::string, int> watches; //path prefix -> watch descriptor
+
+    Shard& shardFor(std::string_view key);
+    void eraseEntry(Shard& shard, std::list<Entry>::iterator entry);
+    void eraseKey(std::string_view key);
+    void trim(std::size_t shardBudget);
+    void watchChanges();
+};
+
+FileCache& fileCache(); //the cache shared by every worker
@@ -0,0 +1,339 @@
+#include <array>
+#include <algorithm>
+
+#include "hpack.hpp"
+
+
+namespace {
+  struct StaticEntry {
+    std::string_view name;
+    std::string_view value;
+  };
+
+  constexpr std::array<StaticEntry, HeaderTable::staticEntries> staticTable = {{
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" }, { ":path", "/index.html" },
+    { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" }, { ":status", "206" },
+    { ":status", "304" }, { ":status", "400" }, { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" }, { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" },
+    { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" }, { "authorization", "" },
+    { "cache-control", "" }, { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" },
+    { "content-length", "" }, { "content-location", "" }, { "content-range", "" }, { "content-type", "" },
+    { "cookie", "" }, { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+    { "host", "" }, { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" }, { "if-range", "" },
+    { "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" }, { "location", "" }, { "max-forwards", "" },
+    { "proxy-authenticate", "" }, { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" }, { "www-authenticate", "" },
+  }}; //RFC 7541 appendix A
+
+  struct HuffmanCode {
+    std::uint32_t bits;
+    std::uint8_t length;
+  };
+
+  constexpr std::array<HuffmanCode, 257> huffmanCodes = {{
+  { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+  { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 }, { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+  { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+  { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+  { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+  { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+  { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+  { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+  { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+  { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+  { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+  { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+  { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+  { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 }, { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+  { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+  { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+  { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 }, { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+  { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+  { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+  { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 }, { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+  { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+  { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+  { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 }, { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+  { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+  { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+  { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 }, { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+  { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+  { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+  { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 }, { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+  { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+  { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+  { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 }, { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+  { 0x3fffffff, 30 },
+  }}; //RFC 7541 appendix B, by symbol. The last one is EOS, which must never be decoded
+
+  constexpr std::size_t entryOverhead = 32; //what the RFC adds to each entry's size, for the bookkeeping
+  constexpr std::size_t maxEncoderTable = 4096;
+
+  /* The Huffman code as a binary tree, for decoding a bit at a time. Leaves have no children, and hold a symbol. */
+  struct HuffmanTree {
+    struct Node {
+      std::array<std::int16_t, 2> child = {{ -1, -1 }};
+      std::int16_t symbol = -1;
+    };
+    std::vector<Node> nodes;
+
+    HuffmanTree() : nodes(1) {
+      for (std::size_t symbol = 0; symbol < huffmanCodes.size(); symbol++) {
+        std::size_t node = 0;
+        for (int bit = huffmanCodes[symbol].length - 1; bit >= 0; bit--) {
+          int branch = (huffmanCodes[symbol].bits >> bit) & 1;
+          if (nodes[node].child[branch] < 0) {
+            nodes[node].child[branch] = static_cast<std::int16_t>(nodes.size());
+            nodes.emplace_back();
+          }
+          node = nodes[node].child[branch];
+        }
+        nodes[node].symbol = static_cast<std::int16_t>(symbol);
+      }
+    }
+  };
+}
+
+static bool decodeInteger(std::string_view& block, unsigned prefixBits, std::size_t& value);
+static bool decodeString(std::string_view& block, std::string& text);
+static bool decodeHuffman(std::string_view coded, std::string& text);
+static void encodeInteger(std::pmr::string& block, std::uint8_t flags, unsigned prefixBits, std::size_t value);
+static void encodeString(std::pmr::string& block, std::string_view text);
+
+
+
+
+bool HeaderTable::get(std::size_t index, std::string_view& name, std::string_view& value) const {
+  if (index == 0) { return false; }
+  if (index <= staticEntries) {
+    name = staticTable[index - 1].name;
+    value = staticTable[index - 1].value;
+    return true;
+  }
+  index -= staticEntries + 1;
+  if (index >= entries.size()) { return false; }
+  name = entries[index].first;
+  value = entries[index].second;
+  return true;
+}
+
+
+std::size_t HeaderTable::find(std::string_view name, std::string_view value, bool& valueMatches) const {
+  std::size_t named = 0;
+  valueMatches = false;
+  for (std::size_t i = 0; i < staticEntries; i++) {
+    if (staticTable[i].name != name) { continue; }
+    if (staticTable[i].value == value) {
+      valueMatches = true;
+      return i + 1;
+    }
+    if (named == 0) { named = i + 1; }
+  }
+  for (std::size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].first != name) { continue; }
+    if (entries[i].second == value) {
+      valueMatches = true;
+      return staticEntries + 1 + i;
+    }
+    if (named == 0) { named = staticEntries + 1 + i; }
+  }
+  return named;
+}
+
+
+void HeaderTable::add(std::string_view name, std::string_view value) {
+  std::size_t entrySize = name.size() + value.size() + entryOverhead;
+  if (entrySize > maxSize) { //empties the table, and isn't added itself - RFC 7541 section 4.4
+    entries.clear();
+    size = 0;
+    return;
+  }
+  while (size + entrySize > maxSize) { evict(); }
+  entries.emplace_front(std::string(name), std::string(value));
+  size += entrySize;
+}
+
+
+void HeaderTable::resize(std::size_t size) {
+  maxSize = size;
+  while (this->size > maxSize) { evict(); }
+}
+
+
+void HeaderTable::evict() {
+  size -= entries.back().first.size() + entries.back().second.size() + entryOverhead;
+  entries.pop_back();
+}
+
+
+
+
+HpackResult HpackDecoder::decode(std::string_view block, std::string& text, std::vector<DecodedHeader>& headers,
+                                 std::size_t maxListSize) {
+  bool fieldSeen = false;
+  std::size_t listSize = 0;
+  bool tooLarge = false; //from then on, fields only go as far as the table
+  auto keep = [&](const DecodedHeader& header) {
+    listSize += header.nameLength + header.valueLength + entryOverhead;
+    tooLarge = tooLarge || listSize > maxListSize;
+    if (tooLarge) { text.resize(header.nameOffset); }
+    else { headers.push_back(header); }
+  };
+
+  while (!block.empty()) {
+    std::uint8_t first = block[0];
+    std::size_t index;
+    if (first & 0x80) { //indexed field
+      std::string_view name, value;
+      if (!decodeInteger(block, 7, index) || !table.get(index, name, value)) { return HpackResult::Malformed; }
+      fieldSeen = true;
+      listSize += name.size() + value.size() + entryOverhead;
+      tooLarge = tooLarge || listSize > maxListSize;
+      if (tooLarge) { continue; } //never copied out - this is what a block of them would blow up on
+      headers.push_back({ text.size(), name.size(), text.size() + name.size(), value.size() });
+      text.append(name).append(value);
+      continue;
+    }
+    if ((first & 0xe0) == 0x20) { //dynamic table size update, only ever before the first field
+      if (fieldSeen || !decodeInteger(block, 5, index) || index > maxTableSize) { return HpackResult::Malformed; }
+      table.resize(index);
+      continue;
+    }
+
+    bool indexing = (first & 0xc0) == 0x40; //otherwise without indexing (0000) or never indexed (0001) - the same to us
+    if (!decodeInteger(block, indexing ? 6 : 4, index)) { return HpackResult::Malformed; }
+    DecodedHeader header = { text.size(), 0, 0, 0 };
+    if (index != 0) {
+      std::string_view name, value;
+      if (!table.get(index, name, value)) { return HpackResult::Malformed; }
+      text.append(name);
+    }
+    else if (!decodeString(block, text)) { return HpackResult::Malformed; }
+    header.nameLength = text.size() - header.nameOffset;
+    header.valueOffset = text.size();
+    if (!decodeString(block, text)) { return HpackResult::Malformed; }
+    header.valueLength = text.size() - header.valueOffset;
+    if (indexing) {
+      table.add(std::string_view(text).substr(header.nameOffset, header.nameLength),
+                std::string_view(text).substr(header.valueOffset, header.valueLength));
+    }
+    keep(header); //a literal is no bigger than the block it came in, but it's dropped too once past the limit
+    fieldSeen = true;
+  }
+  return tooLarge ? HpackResult::TooLarge : HpackResult::Decoded;
+}
+
+
+
+
+void HpackEncoder::resize(std::size_t size) {
+  size = std::min(size, maxEncoderTable);
+  if (size == table.capacity()) { return; }
+  table.resize(size);
+  resized = true;
+}
+
+
+void HpackEncoder::begin(std::pmr::string& block) {
+  if (!resized) { return; }
+  encodeInteger(block, 0x20, 5, table.capacity());
+  resized = false;
+}
+
+
+void HpackEncoder::encode(std::pmr::string& block, std::string_view name, std::string_view value, bool index) {
+  bool valueMatches;
+  std::size_t found = table.find(name, value, valueMatches);
+  if (valueMatches) {
+    encodeInteger(block, 0x80, 7, found);
+    return;
+  }
+  if (index) { encodeInteger(block, 0x40, 6, found); }
+  else { encodeInteger(block, 0x00, 4, found); }
+  if (found == 0) { encodeString(block, name); }
+  encodeString(block, value);
+  if (index) { table.add(name, value); }
+}
+
+
+
+
+static bool decodeInteger(std::string_view& block, unsigned prefixBits, std::size_t& value) {
+  if (block.empty()) { return false; }
+  std::size_t prefixMax = (std::size_t(1) << prefixBits) - 1;
+  value = static_cast<std::uint8_t>(block[0]) & prefixMax;
+  block.remove_prefix(1);
+  if (value < prefixMax) { return true; }
+  for (unsigned shift = 0; shift < 28; shift += 7) { //no index or length we'd take is anywhere near 2^28
+    if (block.empty()) { return false; }
+    std::uint8_t next = block[0];
+    block.remove_prefix(1);
+    value += std::size_t(next & 0x7f) << shift;
+    if (!(next & 0x80)) { return true; }
+  }
+  return false;
+} //RFC 7541 section 5.1
+
+
+static bool decodeString(std::string_view& block, std::string& text) {
+  if (block.empty()) { return false; }
+  bool huffman = block[0] & 0x80;
+  std::size_t length;
+  if (!decodeInteger(block, 7, length) || length > block.size()) { return false; }
+  std::string_view coded = block.substr(0, length);
+  block.remove_prefix(length);
+  if (!huffman) {
+    text.append(coded);
+    return true;
+  }
+  return decodeHuffman(coded, text);
+}
+
+
+static bool decodeHuffman(std::string_view coded, std::string& text) {
+  static const HuffmanTree tree;
+  std::size_t node = 0;
+  unsigned depth = 0; //bits since the last symbol
+  bool allOnes = true; //and whether they were all 1s, as padding must be
+  for (unsigned char byte : coded) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int branch = (byte >> bit) & 1;
+      std::int16_t next = tree.nodes[node].child[branch];
+      if (next < 0) { return false; }
+      node = next;
+      depth++;
+      allOnes = allOnes && branch == 1;
+      std::int16_t symbol = tree.nodes[node].symbol;
+      if (symbol < 0) { continue; }
+      if (symbol == 256) { return false; } //EOS
+      text += static_cast<char>(symbol);
+      node = 0;
+      depth = 0;
+      allOnes = true;
+    }
+  }
+  return depth < 8 && allOnes; //padding is the start of EOS, shorter than a byte
+}
+
+
+static void encodeInteger(std::pmr::string& block, std::uint8_t flags, unsigned prefixBits, std::size_t value) {
+  std::size_t prefixMax = (std::size_t(1) << prefixBits) - 1;
+  if (value < prefixMax) {
+    block += static_cast<char>(flags | value);
+    return;
+  }
+  block += static_cast<char>(flags | prefixMax);
+  value -= prefixMax;
+  while (value >= 0x80) {
+    block += static_cast<char>(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  block += static_cast<char>(value);
+}
+
+
+static void encodeString(std::pmr::string& block, std::string_view text) {
+  encodeInteger(block, 0x00, 7, text.size()); //not Huffman coded, refer hpack.hpp
+  block.append(text);
+}
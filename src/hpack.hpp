@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory_resource>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * HPACK (RFC 7541), the header compression HTTP/2 uses - refer http2.hpp.
+ *
+ * A header block is a list of fields, each either an index into a table of fields seen before, or a literal name and
+ *    value - which may be added to the table for the next time. The table is the 61 entries of the static table every
+ *    peer knows, followed by a dynamic table each side keeps for what the other side's encoder added to it. Literal
+ *    strings may be Huffman coded, with a code made for HTTP headers.
+ *
+ * The decoder handles all of it. The encoder indexes what it sends (so the Content-Type and Date of a page's assets
+ *    are a byte each after the first response), but doesn't Huffman code literals - most of the bytes are in values
+ *    that are only sent once, like Content-Length, and Huffman coding those would save little for its cost.
+*/
+class HeaderTable {
+  public:
+    static constexpr std::size_t staticEntries = 61;
+
+    explicit HeaderTable(std::size_t maxSize = 4096) : maxSize(maxSize) {}
+
+    bool get(std::size_t index, std::string_view& name, std::string_view& value) const; /*1 to 61 is the static table,
+      after that the dynamic one, newest first. false if there's nothing at index. The views last until the next add()*/
+    std::size_t find(std::string_view name, std::string_view value, bool& valueMatches) const; /*the index of a field with
+      name and value, or if there's none, of one with name. 0 if neither*/
+    void add(std::string_view name, std::string_view value); //evicts the oldest entries to make room
+    void resize(std::size_t size); //evicts what no longer fits
+    std::size_t capacity() const { return maxSize; }
+
+  private:
+    std::deque<std::pair<std::string, std::string>> entries; //newest first
+    std::size_t size = 0; //as the RFC counts it: every entry's name and value, and 32 on top for each
+    std::size_t maxSize;
+
+    void evict();
+};
+
+struct DecodedHeader {
+  std::size_t nameOffset;
+  std::size_t nameLength;
+  std::size_t valueOffset;
+  std::size_t valueLength;
+}; //a field of a decoded block, as offsets into the text it was decoded into
+
+enum class HpackResult {
+  Decoded,
+  TooLarge, //more than the limit decoded - what's past it was dropped, but the table kept up with the whole block
+  Malformed //and then the connection can't go on, the table may be off
+};
+
+class HpackDecoder {
+  public:
+    explicit HpackDecoder(std::size_t maxTableSize = 4096) : table(maxTableSize), maxTableSize(maxTableSize) {}
+
+    HpackResult decode(std::string_view block, std::string& text, std::vector<DecodedHeader>& headers,
+                       std::size_t maxListSize); /*appends the block's fields to text and headers, as long as they come to
+      no more than maxListSize - counted like SETTINGS_MAX_HEADER_LIST_SIZE, every name and value and 32 on top for each.
+      One byte can stand for a 4 KiB field from the table, so a block is never expanded further than that*/
+
+  private:
+    HeaderTable table;
+    std::size_t maxTableSize; //what we allow the client's encoder, SETTINGS_HEADER_TABLE_SIZE
+};
+
+class HpackEncoder {
+  public:
+    void resize(std::size_t size); //the client's SETTINGS_HEADER_TABLE_SIZE. The encoder uses up to 4 KiB of it
+    void begin(std::pmr::string& block); //before a block's first field - says if the table size changed
+    void encode(std::pmr::string& block, std::string_view name, std::string_view value, bool index = true); //name in lower case
+
+  private:
+    HeaderTable table;
+    bool resized = false;
+};
@@ -0,0 +1,641 @@
+#include <string>
+#include <array>
+#include <algorithm>
+#include <charconv>
+#include <utility>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "http2.hpp"
+#include "server.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "arena.hpp"
+#include "drain.hpp"
+#include "proxy.hpp"
+
+
+enum FrameType : std::uint8_t { Data = 0x0, Headers = 0x1, Priority = 0x2, ResetStream = 0x3, Settings = 0x4,
+  PushPromise = 0x5, Ping = 0x6, GoAway = 0x7, WindowUpdate = 0x8, Continuation = 0x9 };
+enum FrameFlag : std::uint8_t { EndStream = 0x1, Ack = 0x1, EndHeaders = 0x4, Padded = 0x8, PriorityFlag = 0x20 };
+
+static std::uint32_t readNumber(std::string_view bytes, std::size_t count); //big endian, like every number in a frame
+static void appendNumber(std::pmr::string& frame, std::uint32_t number, std::size_t count);
+static void writeFrameHeader(char* header, std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t streamId);
+static void queueFrame(ResponseQueue& responses, std::uint8_t type, std::uint8_t flags, std::uint32_t streamId, std::string_view payload);
+static void queueReset(ResponseQueue& responses, std::uint32_t streamId, std::uint32_t error);
+static void queueWindowUpdate(ResponseQueue& responses, std::uint32_t streamId, std::size_t increment);
+static bool removePadding(std::uint8_t flags, std::string_view& payload); //false if the padding is longer than the frame
+static bool connectionSpecific(std::string_view name); //headers HTTP/2 has no use for, lower case
+static bool indexable(std::string_view name); //whether a response header's value is worth a place in the HPACK table
+
+static constexpr std::size_t frameHeaderSize = 9;
+static constexpr std::size_t maxFrameSize = 16384; //what we take - SETTINGS_MAX_FRAME_SIZE is left at its default
+static constexpr std::uint32_t maxStreams = 100; //SETTINGS_MAX_CONCURRENT_STREAMS
+static constexpr std::int64_t streamWindow = 1024 * 1024; /*SETTINGS_INITIAL_WINDOW_SIZE, and the connection's window -
+  what a client may send before we've told it we took it in*/
+static constexpr std::int64_t maxWindow = 0x7fffffff;
+
+
+Http2Session::OpenFile::~OpenFile() {
+  close(fd);
+}
+
+
+Http2Session::~Http2Session() = default;
+
+
+void Http2Session::answer(int client_fd, ClientSession& session, ResponseQueue& responses, const ServerConfig& config) {
+  this->client_fd = client_fd;
+  std::string& pending = session.pending;
+  if (failed) { pending.clear(); } //nothing after the GOAWAY counts
+  std::size_t position = 0;
+
+  if (!prefaceReceived && !failed) {
+    std::string_view start = std::string_view(pending).substr(0, preface.size());
+    if (!preface.starts_with(start)) {
+      logDebug("client ", client_fd, " didn't start with the HTTP/2 connection preface");
+      connectionError(Error::Protocol, responses);
+    }
+    else if (start.size() == preface.size()) {
+      prefaceReceived = true;
+      position = preface.size();
+      int noDelay = 1; /*DATA goes out as far as the client's window allows, and then nothing until it says it took it in -
+        which it can't if Nagle holds the last packet back, waiting for an ACK the client delays*/
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+      std::pmr::string settings(requestMemory());
+      for (auto [id, value] : std::array<std::pair<std::uint16_t, std::uint32_t>, 3>{{
+             { 0x3, maxStreams }, { 0x4, streamWindow }, { 0x6, static_cast<std::uint32_t>(config.maxHeaderSize) } }}) {
+        appendNumber(settings, id, 2);
+        appendNumber(settings, value, 4);
+      } //MAX_CONCURRENT_STREAMS, INITIAL_WINDOW_SIZE, MAX_HEADER_LIST_SIZE
+      queueFrame(responses, Settings, 0, 0, settings);
+      queueWindowUpdate(responses, 0, streamWindow - receiveWindow); //the connection's window, which SETTINGS doesn't set
+      receiveWindow = streamWindow;
+    }
+  }
+
+  while (prefaceReceived && !failed && pending.size() - position >= frameHeaderSize) {
+    std::string_view header = std::string_view(pending).substr(position, frameHeaderSize);
+    std::size_t length = readNumber(header, 3);
+    if (length > maxFrameSize) {
+      connectionError(Error::FrameSize, responses);
+      break;
+    }
+    if (pending.size() - position < frameHeaderSize + length) { break; } //wait for the rest of it
+    std::string_view payload = std::string_view(pending).substr(position + frameHeaderSize, length);
+    position += frameHeaderSize + length;
+    if (!handleFrame(header[3], header[4], readNumber(header.substr(5), 4) & 0x7fffffff, payload, responses, config)) { break; }
+  }
+  pending.erase(0, failed ? pending.size() : position);
+
+  if (!failed) {
+    topUpWindows(responses);
+    queueData(responses);
+    if (!goAwaySent && (draining() || clientGoingAway)) { goAway(Error::None, responses); } //refer drain.hpp
+  }
+  if (answeredAny) { session.answered = true; }
+  if (failed || (goAwaySent && streams.empty())) { session.keepAlive = false; }
+} /*frames are handled as they come, one at a time - a request is answered as soon as it's complete, whatever else the
+  same read brought in*/
+
+
+bool Http2Session::handleFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t streamId, std::string_view payload,
+                               ResponseQueue& responses, const ServerConfig& config) {
+  if (continuing != 0 && (type != Continuation || streamId != continuing)) { return connectionError(Error::Protocol, responses); } /*a
+    header block's frames come one right after the other*/
+
+  switch (type) {
+    case Data: return handleData(flags, streamId, payload, responses, config);
+    case Headers: return handleHeaders(flags, streamId, payload, responses, config);
+    case Priority:
+      if (streamId == 0) { return connectionError(Error::Protocol, responses); }
+      if (payload.size() != 5) { queueReset(responses, streamId, static_cast<std::uint32_t>(Error::FrameSize)); }
+      return true; //priorities are only a hint, refer http2.hpp
+    case ResetStream: {
+      if (streamId == 0) { return connectionError(Error::Protocol, responses); }
+      if (payload.size() != 4) { return connectionError(Error::FrameSize, responses); }
+      if (streamId > lastStreamId) { return connectionError(Error::Protocol, responses); } //it was never opened
+      auto found = streams.find(streamId);
+      if (found != streams.end()) {
+        logDebug("client ", client_fd, " reset stream ", streamId, " with error ", readNumber(payload, 4));
+        streams.erase(found); //an upload in progress is abandoned with it
+      }
+      return true;
+    }
+    case Settings: return handleSettings(flags, streamId, payload, responses);
+    case PushPromise: return connectionError(Error::Protocol, responses); //only servers push
+    case Ping:
+      if (streamId != 0) { return connectionError(Error::Protocol, responses); }
+      if (payload.size() != 8) { return connectionError(Error::FrameSize, responses); }
+      if (!(flags & Ack)) { queueFrame(responses, Ping, Ack, 0, payload); }
+      return true;
+    case GoAway:
+      if (streamId != 0) { return connectionError(Error::Protocol, responses); }
+      if (payload.size() < 8) { return connectionError(Error::FrameSize, responses); }
+      clientGoingAway = true; //what's open runs to the end, refer answer()
+      return true;
+    case WindowUpdate: return handleWindowUpdate(streamId, payload, responses);
+    case Continuation:
+      if (continuing == 0) { return connectionError(Error::Protocol, responses); }
+      headerBlock.append(payload);
+      if (headerBlock.size() > 4 * config.maxHeaderSize + maxFrameSize) { return connectionError(Error::EnhanceYourCalm, responses); }
+      return (flags & EndHeaders) ? finishHeaderBlock(responses, config) : true;
+    default: return true; //extensions we don't know, which RFC 9113 says to ignore
+  }
+}
+
+
+bool Http2Session::handleHeaders(std::uint8_t flags, std::uint32_t streamId, std::string_view payload,
+                                 ResponseQueue& responses, const ServerConfig& config) {
+  if (streamId == 0 || !removePadding(flags, payload)) { return connectionError(Error::Protocol, responses); }
+  if (flags & PriorityFlag) {
+    if (payload.size() < 5) { return connectionError(Error::FrameSize, responses); }
+    payload.remove_prefix(5);
+  }
+
+  auto found = streams.find(streamId);
+  if (found != streams.end()) { //trailers, which have to end the request
+    if (found->second.remoteClosed || !(flags & EndStream)) { return connectionError(Error::Protocol, responses); }
+    found->second.remoteClosed = true;
+  }
+  else if (streamId > lastStreamId) { //a new stream
+    if (streamId % 2 == 0) { return connectionError(Error::Protocol, responses); } //the client's are odd
+    lastStreamId = streamId;
+    if (goAwaySent) {} //not answered, as the GOAWAY said. Its block is still decoded below, for the HPACK table
+    else if (streams.size() >= maxStreams) { queueReset(responses, streamId, static_cast<std::uint32_t>(Error::RefusedStream)); }
+    else {
+      Stream& stream = streams[streamId];
+      stream.id = streamId;
+      stream.started = std::chrono::steady_clock::now();
+      stream.remoteClosed = flags & EndStream;
+      stream.receiveWindow = streamWindow;
+      stream.sendWindow = initialSendWindow;
+    }
+  } //else one that's closed - most likely reset, by us or the client, while its trailers were on their way. Decoded and dropped
+
+  continuing = streamId;
+  headerBlock.assign(payload);
+  return (flags & EndHeaders) ? finishHeaderBlock(responses, config) : true;
+}
+
+
+bool Http2Session::finishHeaderBlock(ResponseQueue& responses, const ServerConfig& config) {
+  std::uint32_t streamId = std::exchange(continuing, 0);
+  auto found = streams.find(streamId);
+  if (found == streams.end() || found->second.headersDone) { //refused, closed or trailers
+    std::string fields;
+    std::vector<DecodedHeader> decoded;
+    if (decoder.decode(headerBlock, fields, decoded, config.maxHeaderSize) == HpackResult::Malformed) {
+      return connectionError(Error::Compression, responses);
+    }
+    if (found != streams.end() && !found->second.responded) { answerStream(found->second, responses, config); } /*trailers
+      end the request. Whatever's in them is ignored*/
+    return true;
+  }
+
+  Stream& stream = found->second;
+  HpackResult decoded = decoder.decode(headerBlock, stream.fields, stream.decoded, config.maxHeaderSize); //what we said in SETTINGS
+  if (decoded == HpackResult::Malformed) { return connectionError(Error::Compression, responses); }
+  stream.headersDone = true;
+  return readRequest(stream, decoded == HpackResult::TooLarge, responses, config);
+}
+
+
+bool Http2Session::readRequest(Stream& stream, bool tooLarge, ResponseQueue& responses, const ServerConfig& config) {
+  HttpRequest& request = stream.request;
+  std::string_view scheme, authority;
+  bool regularSeen = false, malformed = false;
+  for (const DecodedHeader& field : stream.decoded) {
+    std::string_view name(stream.fields.data() + field.nameOffset, field.nameLength);
+    std::string_view value(stream.fields.data() + field.valueOffset, field.valueLength);
+    if (name.starts_with(':')) {
+      std::string_view* pseudo = name == ":method" ? &request.method : name == ":path" ? &request.target
+                               : name == ":scheme" ? &scheme : name == ":authority" ? &authority : nullptr;
+      if (regularSeen || pseudo == nullptr || !pseudo->empty() || value.empty()) { malformed = true; }
+      else { *pseudo = value; }
+      continue;
+    }
+    regularSeen = true;
+    if (std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; }) || connectionSpecific(name)
+        || (name == "te" && value != "trailers")) {
+      malformed = true;
+    }
+    else if (request.headerCount == HttpRequest::maxHeaders) { tooLarge = true; }
+    else { request.headers[request.headerCount++] = { name, value }; }
+  }
+  if (!tooLarge && (malformed || request.method.empty() || request.target.empty() || scheme.empty())) { /*a block cut
+    short may well have lost its pseudo-headers, and gets its 431 below*/
+    logWarning("rejected malformed HTTP/2 request from client ", client_fd, " on stream ", stream.id);
+    resetStream(stream, Error::Protocol, responses);
+    return true; //just the stream
+  }
+  if (authority != "" && !request.hasHeader("host") && request.headerCount < HttpRequest::maxHeaders) {
+    request.headers[request.headerCount++] = { "host", authority }; //routes look for Host, which :authority stands in for
+  }
+  request.version = "HTTP/2";
+  logDebug("client ", client_fd, "'s request headers on stream ", stream.id, ": ", request.method, ' ', request.target);
+
+  std::string_view length = request.header("content-length");
+  std::from_chars(length.data(), length.data() + length.size(), request.contentLength);
+  bool upload = isFileUpload(request);
+  if (tooLarge || request.contentLength > (upload ? config.maxUploadSize : config.maxBodySize)) {
+    metrics().countResponse(upload ? uploadRoute : 0, tooLarge ? 431 : 413);
+    respond(stream, HttpResponse(emptyResponse(tooLarge ? HTTP431 : HTTP413)), responses);
+    return true;
+  }
+  if (upload) {
+    FilePath destination(requestMemory());
+    std::string_view failure;
+    bool beneath = uploadPath(request.target.substr(1), destination);
+    bool begun = beneath && stream.upload.begin(destination, config.uploadSync);
+    if (!begun && (!beneath || errno == EXDEV)) { //as in answerRequests()
+      logWarning("rejected upload from client ", client_fd, " to ", request.target);
+      failure = HTTP404;
+    }
+    else if (!begun) {
+      logError("error saving file ", request.target, ": ", std::strerror(errno));
+      failure = HTTP500;
+    }
+    if (!failure.empty()) {
+      HttpResponse rejection(emptyResponse(failure));
+      rejection.route = uploadRoute;
+      metrics().countResponse(uploadRoute, statusCode(rejection.head));
+      respond(stream, std::move(rejection), responses);
+      return true;
+    }
+  }
+
+  if (stream.remoteClosed) { answerStream(stream, responses, config); }
+  else if (equalsIgnoreCase(request.header("expect"), "100-continue")) {
+    std::pmr::string block(frameHeaderSize, '\0', requestMemory());
+    encoder.begin(block);
+    encoder.encode(block, ":status", "100");
+    writeFrameHeader(block.data(), block.size() - frameHeaderSize, Headers, EndHeaders, stream.id);
+    responses.emplace_back(std::move(block)); //headers were fine, so tell the client to go ahead with the body
+  }
+  return true;
+} /*the request's fields are views into stream.fields, like an HTTP/1.1 request's are into pending. Headers that would
+  be a 400 for HTTP/1.1 reset the stream instead, as RFC 9113 has it*/
+
+
+bool Http2Session::handleData(std::uint8_t flags, std::uint32_t streamId, std::string_view payload,
+                              ResponseQueue& responses, const ServerConfig& config) {
+  if (streamId == 0) { return connectionError(Error::Protocol, responses); }
+  receiveWindow -= payload.size(); //padding included
+  consumed += payload.size();
+  if (receiveWindow < 0) { return connectionError(Error::FlowControl, responses); }
+  if (!removePadding(flags, payload)) { return connectionError(Error::Protocol, responses); }
+
+  auto found = streams.find(streamId);
+  if (found == streams.end()) {
+    if (streamId > lastStreamId) { return connectionError(Error::Protocol, responses); } //it was never opened
+    return true; //closed - the client may not have seen our RST_STREAM yet
+  }
+  Stream& stream = found->second;
+  if (stream.remoteClosed) {
+    resetStream(stream, Error::StreamClosed, responses);
+    return true;
+  }
+  stream.remoteClosed = flags & EndStream;
+  if (stream.responded) { return true; } //answered early (413, 404...) - whatever else comes is dropped
+  stream.receiveWindow -= payload.size();
+  stream.consumed += payload.size();
+  if (stream.receiveWindow < 0) {
+    resetStream(stream, Error::FlowControl, responses);
+    return true;
+  }
+
+  bool tooLarge;
+  if (stream.upload.active()) {
+    stream.upload.write(payload);
+    stream.uploaded += payload.size();
+    tooLarge = stream.uploaded > config.maxUploadSize;
+  }
+  else {
+    stream.body.append(payload);
+    tooLarge = stream.body.size() > config.maxBodySize;
+  }
+  if (tooLarge) {
+    logWarning("rejected HTTP/2 request from client ", client_fd, " on stream ", stream.id, ": 413");
+    bool upload = stream.upload.active();
+    stream.upload.abort();
+    metrics().countResponse(upload ? uploadRoute : 0, 413);
+    respond(stream, HttpResponse(emptyResponse(HTTP413)), responses);
+    return true;
+  }
+  if (stream.remoteClosed) { answerStream(stream, responses, config); }
+  return true;
+}
+
+
+bool Http2Session::handleSettings(std::uint8_t flags, std::uint32_t streamId, std::string_view payload, ResponseQueue& responses) {
+  if (streamId != 0) { return connectionError(Error::Protocol, responses); }
+  if (flags & Ack) { return payload.empty() ? true : connectionError(Error::FrameSize, responses); }
+  if (payload.size() % 6 != 0) { return connectionError(Error::FrameSize, responses); }
+
+  for (; !payload.empty(); payload.remove_prefix(6)) {
+    std::uint32_t id = readNumber(payload, 2), value = readNumber(payload.substr(2), 4);
+    if (id == 0x1) { encoder.resize(value); } //HEADER_TABLE_SIZE
+    else if (id == 0x2 && value > 1) { return connectionError(Error::Protocol, responses); } //ENABLE_PUSH - we never do
+    else if (id == 0x4) { //INITIAL_WINDOW_SIZE, which changes the windows of the open streams too
+      if (value > maxWindow) { return connectionError(Error::FlowControl, responses); }
+      for (auto& entry : streams) { entry.second.sendWindow += std::int64_t(value) - initialSendWindow; }
+      initialSendWindow = value;
+    }
+    else if (id == 0x5) { //MAX_FRAME_SIZE
+      if (value < 16384 || value > 16777215) { return connectionError(Error::Protocol, responses); }
+      peerMaxFrameSize = value;
+    }
+  } //the rest (MAX_CONCURRENT_STREAMS - we never open any, MAX_HEADER_LIST_SIZE - advisory) don't change what we do
+  queueFrame(responses, Settings, Ack, 0, {});
+  return true;
+}
+
+
+bool Http2Session::handleWindowUpdate(std::uint32_t streamId, std::string_view payload, ResponseQueue& responses) {
+  if (payload.size() != 4) { return connectionError(Error::FrameSize, responses); }
+  std::int64_t increment = readNumber(payload, 4) & 0x7fffffff;
+  if (streamId == 0) {
+    if (increment == 0) { return connectionError(Error::Protocol, responses); }
+    sendWindow += increment;
+    return sendWindow <= maxWindow ? true : connectionError(Error::FlowControl, responses);
+  }
+
+  auto found = streams.find(streamId);
+  if (found == streams.end()) {
+    return streamId > lastStreamId ? connectionError(Error::Protocol, responses) : true; //closed ones may still get them
+  }
+  Stream& stream = found->second;
+  stream.sendWindow += increment;
+  if (increment == 0) { resetStream(stream, Error::Protocol, responses); }
+  else if (stream.sendWindow > maxWindow) { resetStream(stream, Error::FlowControl, responses); }
+  return true;
+} //queueData() sends what the new room allows, once the frames that came with it are handled
+
+
+void Http2Session::answerStream(Stream& stream, ResponseQueue& responses, const ServerConfig& config) {
+  stream.request.body = stream.body;
+  stream.request.contentLength = stream.upload.active() ? stream.uploaded : stream.body.size();
+  bool deferred = deferFileOpens(false); //the io_uring workers' files are opened right away - refer HttpResponse::deferred
+  HttpResponse response = stream.upload.active() ? finishUpload(stream.upload, stream.request)
+                                                 : routeRequest(stream.request, stream.request.body, config.directory);
+  deferFileOpens(deferred);
+  if (response.proxied) { //fetched whole, elsewhere - refer proxy.hpp
+    response.proxied->fetchFor(stream.id, config.maxBodySize);
+    responses.push_back(std::move(response));
+    return;
+  }
+  answered(stream, std::move(response), responses);
+}
+
+
+void Http2Session::fetched(ClientSession& session, ProxyExchange& exchange, ResponseQueue& responses) {
+  auto found = streams.find(exchange.http2Stream());
+  if (found == streams.end()) { return; } //reset meanwhile
+  answered(found->second, exchange.fetched(), responses);
+  queueData(responses);
+  if (goAwaySent && streams.empty()) { session.keepAlive = false; } //as answer() would
+}
+
+
+void Http2Session::answered(Stream& stream, HttpResponse response, ResponseQueue& responses) {
+  metrics().countResponse(response.route, statusCode(response.head));
+  metrics().recordLatency(response.route, std::chrono::steady_clock::now() - stream.started);
+  if (logger().enabled(LogLevel::Info)) { //access log, like HTTP/1.1's with the stream the request came on
+    logInfo("access client=", client_fd, " stream=", stream.id, ' ', stream.request.method, ' ', stream.request.target, ' ',
+      std::string_view(response.head).substr(9, 3), ' ', response.head.size() + response.body.size() + response.fileLength);
+  }
+  answeredAny = true;
+  respond(stream, std::move(response), responses);
+}
+
+
+void Http2Session::respond(Stream& stream, HttpResponse response, ResponseQueue& responses) {
+  /** routeRequest() builds HTTP/1.1 responses, which are taken apart here: the status line's code becomes :status, and
+   *    every header a field of the HEADERS frame's block, with its name in lower case. The body is left where it is -
+   *    in the cache, in the file - and goes out in DATA frames as the windows allow, refer queueData().
+   *
+   * echo/ and user-agent put their small bodies in the head itself. Those are copied out, as the head is in the arena
+   *    and the frames may only go out long after it's been reset.
+  */
+  std::string_view head = response.head;
+  std::size_t headEnd = head.find("\r\n\r\n");
+  std::pmr::string block(frameHeaderSize, '\0', requestMemory());
+  encoder.begin(block);
+  encoder.encode(block, ":status", head.substr(9, 3));
+  std::array<char, 64> lowered;
+  for (std::size_t line = head.find("\r\n") + 2; line < headEnd + 2;) {
+    std::size_t end = head.find("\r\n", line);
+    std::string_view field = head.substr(line, end - line);
+    line = end + 2;
+    std::size_t colon = field.find(':');
+    if (colon == std::string_view::npos || colon > lowered.size()) { continue; } //not something routeRequest() makes
+    std::transform(field.begin(), field.begin() + colon, lowered.begin(), [](char c) { return (c >= 'A' && c <= 'Z') ? c + 32 : c; });
+    std::string_view name(lowered.data(), colon);
+    std::string_view value = field.substr(colon + 1);
+    value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+    if (!connectionSpecific(name)) { encoder.encode(block, name, value, indexable(name)); }
+  }
+
+  if (headEnd + 4 < head.size()) {
+    auto inlineBody = std::make_shared<const std::string>(head.substr(headEnd + 4));
+    stream.responseBody = *inlineBody;
+    stream.responseBodyOwner = std::move(inlineBody);
+  }
+  else if (!response.body.empty()) {
+    stream.responseBody = response.body;
+    stream.responseBodyOwner = std::move(response.bodyOwner);
+  }
+  else if (response.fileLength > 0) {
+    stream.file.reset(new OpenFile{ std::exchange(response.file_fd, -1) }); //not make_shared(), whose temporary would close it
+    stream.fileOffset = response.fileOffset;
+    stream.fileLength = response.fileLength;
+  }
+  stream.responded = true;
+
+  std::uint8_t endStream = stream.unsent() == 0 ? EndStream : 0;
+  std::string_view fragments = std::string_view(block).substr(frameHeaderSize);
+  if (fragments.size() <= peerMaxFrameSize) {
+    writeFrameHeader(block.data(), fragments.size(), Headers, endStream | EndHeaders, stream.id);
+    responses.emplace_back(std::move(block));
+  }
+  else { //a few KiB of headers would have to be something else than what routeRequest() makes, but the RFC allows for it
+    queueFrame(responses, Headers, endStream, stream.id, fragments.substr(0, peerMaxFrameSize));
+    for (fragments.remove_prefix(peerMaxFrameSize); !fragments.empty(); fragments.remove_prefix(std::min(fragments.size(), peerMaxFrameSize))) {
+      queueFrame(responses, Continuation, fragments.size() <= peerMaxFrameSize ? EndHeaders : 0, stream.id,
+                 fragments.substr(0, peerMaxFrameSize));
+    }
+  }
+
+  if (endStream) { finishStream(stream, responses); }
+  else { sending.push_back(stream.id); }
+}
+
+
+void Http2Session::queueData(ResponseQueue& responses) {
+  bool queued = true;
+  while (queued && sendWindow > 0 && !sending.empty()) {
+    queued = false;
+    for (std::size_t i = 0; i < sending.size() && sendWindow > 0;) {
+      auto found = streams.find(sending[i]);
+      if (found == streams.end()) { //reset meanwhile
+        sending.erase(sending.begin() + i);
+        continue;
+      }
+      Stream& stream = found->second;
+      bool fromBody = stream.responseBodySent < stream.responseBody.size();
+      std::size_t left = fromBody ? stream.responseBody.size() - stream.responseBodySent : stream.fileLength;
+      std::int64_t length = std::min<std::int64_t>({ std::int64_t(peerMaxFrameSize), std::int64_t(left), stream.sendWindow, sendWindow });
+      if (length <= 0) { //waiting for its WINDOW_UPDATE
+        i++;
+        continue;
+      }
+
+      std::uint8_t endStream = std::size_t(length) == stream.unsent() ? EndStream : 0;
+      std::pmr::string header(frameHeaderSize, '\0', requestMemory());
+      writeFrameHeader(header.data(), length, Data, endStream, stream.id);
+      if (fromBody) {
+        responses.emplace_back(std::move(header), stream.responseBody.substr(stream.responseBodySent, length), stream.responseBodyOwner);
+        stream.responseBodySent += length;
+      }
+      else {
+        HttpResponse frame(std::move(header), stream.file->fd, stream.fileOffset, length);
+        frame.fileOwner = stream.file;
+        responses.push_back(std::move(frame));
+        stream.fileOffset += length;
+        stream.fileLength -= length;
+      }
+      stream.sendWindow -= length;
+      sendWindow -= length;
+      queued = true;
+
+      if (endStream) {
+        sending.erase(sending.begin() + i);
+        finishStream(stream, responses);
+      }
+      else { i++; }
+    }
+  }
+} /*one frame per stream per round, so streams share the connection evenly. Whatever the windows allow is queued - with
+  file and cached bodies, a frame costs only its 9 byte header until it's sent*/
+
+
+void Http2Session::finishStream(Stream& stream, ResponseQueue& responses) {
+  if (!stream.remoteClosed) { queueReset(responses, stream.id, static_cast<std::uint32_t>(Error::None)); } /*answered before
+    the client was done sending, which it can stop now - RFC 9113 section 8.1*/
+  streams.erase(stream.id);
+}
+
+
+void Http2Session::resetStream(Stream& stream, Error error, ResponseQueue& responses) {
+  queueReset(responses, stream.id, static_cast<std::uint32_t>(error));
+  streams.erase(stream.id); //queueData() forgets it lazily
+}
+
+
+bool Http2Session::connectionError(Error error, ResponseQueue& responses) {
+  logWarning("HTTP/2 error ", static_cast<std::uint32_t>(error), " on client ", client_fd, ", closing the connection");
+  goAway(error, responses);
+  return false;
+}
+
+
+void Http2Session::goAway(Error error, ResponseQueue& responses) {
+  std::pmr::string payload(requestMemory());
+  appendNumber(payload, lastStreamId, 4); //what's above it wasn't and won't be answered - the client may retry it elsewhere
+  appendNumber(payload, static_cast<std::uint32_t>(error), 4);
+  queueFrame(responses, GoAway, 0, 0, payload);
+  goAwaySent = true;
+  if (error != Error::None) {
+    failed = true;
+    streams.clear(); //uploads in progress are abandoned
+    sending.clear();
+  }
+}
+
+
+void Http2Session::topUpWindows(ResponseQueue& responses) {
+  if (consumed >= static_cast<std::size_t>(streamWindow / 2)) {
+    queueWindowUpdate(responses, 0, consumed);
+    receiveWindow += consumed;
+    consumed = 0;
+  }
+  for (auto& [id, stream] : streams) {
+    if (stream.remoteClosed || stream.responded || stream.consumed < static_cast<std::size_t>(streamWindow / 2)) { continue; }
+    queueWindowUpdate(responses, id, stream.consumed);
+    stream.receiveWindow += stream.consumed;
+    stream.consumed = 0;
+  }
+} /*every body is taken in as it arrives, so the windows could be topped up after every frame. Waiting until half of
+  one is used sends far fewer WINDOW_UPDATEs, and the client still never runs out*/
+
+
+
+
+static std::uint32_t readNumber(std::string_view bytes, std::size_t count) {
+  std::uint32_t number = 0;
+  for (std::size_t i = 0; i < count; i++) { number = number << 8 | static_cast<std::uint8_t>(bytes[i]); }
+  return number;
+}
+
+
+static void appendNumber(std::pmr::string& frame, std::uint32_t number, std::size_t count) {
+  for (std::size_t i = count; i-- > 0;) { frame += static_cast<char>(number >> (8 * i) & 0xff); }
+}
+
+
+static void writeFrameHeader(char* header, std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t streamId) {
+  header[0] = static_cast<char>(length >> 16 & 0xff);
+  header[1] = static_cast<char>(length >> 8 & 0xff);
+  header[2] = static_cast<char>(length & 0xff);
+  header[3] = static_cast<char>(type);
+  header[4] = static_cast<char>(flags);
+  for (int i = 0; i < 4; i++) { header[5 + i] = static_cast<char>(streamId >> (8 * (3 - i)) & 0xff); }
+} //RFC 9113 section 4.1
+
+
+static void queueFrame(ResponseQueue& responses, std::uint8_t type, std::uint8_t flags, std::uint32_t streamId, std::string_view payload) {
+  std::pmr::string frame(frameHeaderSize, '\0', requestMemory());
+  writeFrameHeader(frame.data(), payload.size(), type, flags, streamId);
+  frame += payload;
+  responses.emplace_back(std::move(frame));
+} //in the arena, like an HTTP/1.1 head
+
+
+static void queueReset(ResponseQueue& responses, std::uint32_t streamId, std::uint32_t error) {
+  std::pmr::string payload(requestMemory());
+  appendNumber(payload, error, 4);
+  queueFrame(responses, ResetStream, 0, streamId, payload);
+}
+
+
+static void queueWindowUpdate(ResponseQueue& responses, std::uint32_t streamId, std::size_t increment) {
+  std::pmr::string payload(requestMemory());
+  appendNumber(payload, static_cast<std::uint32_t>(increment), 4);
+  queueFrame(responses, WindowUpdate, 0, streamId, payload);
+}
+
+
+static bool removePadding(std::uint8_t flags, std::string_view& payload) {
+  if (!(flags & Padded)) { return true; }
+  if (payload.empty()) { return false; }
+  std::size_t padding = static_cast<std::uint8_t>(payload[0]);
+  if (padding >= payload.size()) { return false; }
+  payload = payload.substr(1, payload.size() - 1 - padding);
+  return true;
+}
+
+
+static bool connectionSpecific(std::string_view name) {
+  return name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade";
+} //RFC 9113 section 8.2.2 - a request with them is malformed, and a response doesn't get them
+
+
+static bool indexable(std::string_view name) {
+  return name != "content-length" && name != "etag" && name != "last-modified" && name != "content-range";
+} //these are different for every file, and would only push out the ones that repeat - Content-Type, Cache-Control, Date
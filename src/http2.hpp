@@ -0,0 +1,139 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "hpack.hpp"
+#include "http_parser.hpp"
+#include "response.hpp"
+#include "upload.hpp"
+
+struct ServerConfig;
+struct ClientSession;
+class ProxyExchange;
+
+
+/**
+ * HTTP/2 (RFC 9113): any number of requests at once over one connection, each on a stream of its own, their responses
+ *    cut into frames and interleaved - so a page's assets don't queue up behind each other, or take a connection (and a
+ *    TLS handshake) each.
+ *
+ * A connection speaks it from its first byte. Over TLS, it's what the client and we agreed on in the handshake (ALPN
+ *    "h2", refer tls.hpp); over plaintext, a client that knows we speak it starts with the connection preface ("prior
+ *    knowledge" - the HTTP/1.1 Upgrade: h2c dance isn't supported). answerRequests() tells which, and hands the bytes of
+ *    an HTTP/2 connection here rather than to HttpParser. Nothing else changes: frames are queued on the connection's
+ *    ResponseQueue like HTTP/1.1 responses, and every --io mode sends them the way it sends those.
+ *
+ * Requests are answered by routeRequest(), like HTTP/1.1 ones, once they're complete. The response's head becomes a
+ *    HEADERS frame (HPACK compressed, refer hpack.hpp) and its body DATA frames: a cached body's frames point into the
+ *    cache, and a file's are sent with sendfile() - nothing is copied, as for HTTP/1.1. A POST to files/ streams to
+ *    disk as its DATA frames come in. A proxied one is queued for the relay threads to fetch, and answered once it's
+ *    back - refer fetched().
+ *
+ * Flow control: DATA only goes out as far as the stream's window and the connection's allow, and the rest waits for
+ *    the client's WINDOW_UPDATE. The streams take turns a frame at a time, so a big file doesn't hold up the small ones
+ *    requested next to it. What the client sends is taken in straight away, so its windows are topped up as soon as
+ *    its frames have been handled.
+ *
+ * Priorities are ignored, as RFC 9113 lets us, and we never push. An error in a stream resets just the stream; one in
+ *    the connection (a malformed frame, HPACK that doesn't decode) sends GOAWAY and closes it once that's out.
+*/
+class Http2Session {
+  public:
+    static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+    Http2Session() = default;
+    Http2Session(const Http2Session&) = delete;
+    Http2Session& operator=(const Http2Session&) = delete;
+    ~Http2Session();
+
+    void answer(int client_fd, ClientSession& session, ResponseQueue& responses, const ServerConfig& config); /*handles
+      the whole frames at the front of session.pending and removes them, and queues what they call for. Clears
+      session.keepAlive once the connection is done*/
+    void fetched(ClientSession& session, ProxyExchange& exchange, ResponseQueue& responses); /*once a proxied stream's
+      response has been fetched, refer proxy.hpp - queues it*/
+    bool idle() const { return streams.empty(); } //no request in progress
+
+  private:
+    struct OpenFile {
+      int fd;
+      ~OpenFile();
+    }; //a file body, shared by its stream's DATA frames - refer HttpResponse::fileOwner
+
+    struct Stream {
+      std::uint32_t id = 0;
+      std::chrono::steady_clock::time_point started;
+      bool headersDone = false; //the request's header block is in
+      bool remoteClosed = false; //END_STREAM came from the client - the request is complete
+      bool responded = false; //the response's HEADERS are queued. Anything more the client sends is dropped
+      std::string fields; //the decoded header block, which request's views point into
+      std::vector<DecodedHeader> decoded;
+      HttpRequest request;
+      std::string body; //the request's, unless it's an upload
+      FileUpload upload; //a POST to files/, whose body goes to disk as it arrives
+      std::size_t uploaded = 0;
+      std::int64_t receiveWindow = 0; //DATA the client may still send us
+      std::size_t consumed = 0; //DATA taken in since receiveWindow was last topped up
+
+      std::int64_t sendWindow = 0; //DATA we may still send, as the client last said
+      std::string_view responseBody; //a cached body, or what came after the response's head (refer respond())
+      std::shared_ptr<const void> responseBodyOwner;
+      std::size_t responseBodySent = 0;
+      std::shared_ptr<OpenFile> file;
+      off_t fileOffset = 0;
+      std::size_t fileLength = 0; //bytes of the file still to send
+
+      std::size_t unsent() const { return responseBody.size() - responseBodySent + fileLength; }
+    };
+
+    enum class Error : std::uint32_t { //RFC 9113 section 7
+      None = 0x0, Protocol = 0x1, Internal = 0x2, FlowControl = 0x3, StreamClosed = 0x5, FrameSize = 0x6,
+      RefusedStream = 0x7, Cancel = 0x8, Compression = 0x9, EnhanceYourCalm = 0xb
+    };
+
+    int client_fd = -1; //for logging
+    bool prefaceReceived = false;
+    bool goAwaySent = false;
+    bool failed = false; //a connection error - its GOAWAY is the last thing sent
+    bool clientGoingAway = false; //its GOAWAY came
+    bool answeredAny = false; //for ClientSession::answered
+    std::uint32_t lastStreamId = 0; //the highest the client opened
+    std::uint32_t continuing = 0; //the stream a header block is being continued for, 0 if none is
+    std::string headerBlock; //its HEADERS and CONTINUATION fragments so far
+    std::unordered_map<std::uint32_t, Stream> streams;
+    std::vector<std::uint32_t> sending; //streams with DATA to send, in the order they take turns
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    std::int64_t receiveWindow = 65535; //the connection's, DATA the client may still send us
+    std::size_t consumed = 0; //DATA taken in since receiveWindow was last topped up
+    std::int64_t sendWindow = 65535; //the connection's, DATA we may still send
+    std::int64_t initialSendWindow = 65535; //the client's SETTINGS_INITIAL_WINDOW_SIZE
+    std::size_t peerMaxFrameSize = 16384; //the client's SETTINGS_MAX_FRAME_SIZE
+
+    bool handleFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t streamId, std::string_view payload,
+                     ResponseQueue& responses, const ServerConfig& config); //false once it's a connection error
+    bool handleHeaders(std::uint8_t flags, std::uint32_t streamId, std::string_view payload, ResponseQueue& responses,
+                       const ServerConfig& config);
+    bool finishHeaderBlock(ResponseQueue& responses, const ServerConfig& config); //once END_HEADERS came
+    bool readRequest(Stream& stream, bool tooLarge, ResponseQueue& responses, const ServerConfig& config); /*from the
+      first header block. tooLarge if it decoded to more than --max-header-size, and then it's answered 431*/
+    bool handleData(std::uint8_t flags, std::uint32_t streamId, std::string_view payload, ResponseQueue& responses,
+                    const ServerConfig& config);
+    bool handleSettings(std::uint8_t flags, std::uint32_t streamId, std::string_view payload, ResponseQueue& responses);
+    bool handleWindowUpdate(std::uint32_t streamId, std::string_view payload, ResponseQueue& responses);
+    void answerStream(Stream& stream, ResponseQueue& responses, const ServerConfig& config); //once the request is complete
+    void answered(Stream& stream, HttpResponse response, ResponseQueue& responses); //counted, logged and responded with
+    void respond(Stream& stream, HttpResponse response, ResponseQueue& responses); //HEADERS now, DATA as the windows allow
+    void queueData(ResponseQueue& responses); //a frame per stream in turn, for as long as the windows allow
+    void finishStream(Stream& stream, ResponseQueue& responses); //once all of the response is queued
+    void resetStream(Stream& stream, Error error, ResponseQueue& responses);
+    bool connectionError(Error error, ResponseQueue& responses); //GOAWAY, and false
+    void goAway(Error error, ResponseQueue& responses);
+    void topUpWindows(ResponseQueue& responses);
+};
@@ -0,0 +1,403 @@
+#include <string_view>
+#include <charconv>
+#include <algorithm>
+
+#include "http_parser.hpp"
+
+
+static bool isTokenChar(char c);
+static bool isFieldChar(char c);
+static char toLower(char c);
+static int hexValue(char c);
+
+
+HttpParser::HttpParser(std::size_t maxHeaderSize, std::size_t maxBodySize, bool responses)
+  : maxHeaderSize(maxHeaderSize), maxBodySize(maxBodySize), start(responses ? State::StatusVersion : State::Method), state(start) {}
+
+
+ParseResult HttpParser::parse(std::string_view buffer, HttpRequest& request) {
+  std::size_t end = std::min(buffer.size(), maxHeaderSize); //never scan past the limit, however much the client sent
+  for (; position < end && state != State::Done && state != State::Error; position++) {
+    char c = buffer[position];
+    switch (state) {
+      case State::Method: //GET
+        if (c == ' ' && position > tokenStart) {
+          method = { tokenStart, position };
+          tokenStart = position + 1;
+          state = State::Target;
+        } else if (!isTokenChar(c)) {
+          state = State::Error;
+        }
+        break;
+
+      case State::Target: //  /echo/abc
+        if (c == ' ' && position > tokenStart) {
+          target = { tokenStart, position };
+          tokenStart = position + 1;
+          state = State::Version;
+        } else if (c <= ' ' || c == 0x7f) {
+          state = State::Error;
+        }
+        break;
+
+      case State::Version: //  HTTP/1.1
+        if (c == '\r') {
+          version = { tokenStart, position };
+          std::string_view v = buffer.substr(version.start, version.end - version.start);
+          bool valid = v.size() == 8 && v.starts_with("HTTP/1.") && (v[7] == '0' || v[7] == '1');
+          state = valid ? State::RequestLineEnd : State::Error;
+        } else if (position - tokenStart >= 8) {
+          state = State::Error;
+        }
+        break;
+
+      case State::StatusVersion: //HTTP/1.1, then the status code
+        if (c == ' ') {
+          version = { tokenStart, position };
+          std::string_view v = buffer.substr(version.start, version.end - version.start);
+          bool valid = v.size() == 8 && v.starts_with("HTTP/1.") && (v[7] == '0' || v[7] == '1');
+          tokenStart = position + 1;
+          state = valid ? State::StatusCode : State::Error;
+        } else if (position - tokenStart >= 8) {
+          state = State::Error;
+        }
+        break;
+
+      case State::StatusCode: //  404
+        if ((c == ' ' || c == '\r') && position - tokenStart == 3) {
+          target = { tokenStart, position };
+          tokenStart = (c == ' ') ? position + 1 : position;
+          method = { tokenStart, tokenStart };
+          state = (c == ' ') ? State::Reason : State::RequestLineEnd; //the reason phrase may be left out
+        } else if (c < '0' || c > '9' || position - tokenStart >= 3) {
+          state = State::Error;
+        }
+        break;
+
+      case State::Reason: //  Not Found - which nobody should act on, but it goes back to the client as it was
+        if (c == '\r') {
+          method = { tokenStart, position };
+          state = State::RequestLineEnd;
+        } else if (!isFieldChar(c)) {
+          state = State::Error;
+        }
+        break;
+
+      case State::RequestLineEnd:
+        state = (c == '\n') ? State::HeaderStart : State::Error;
+        break;
+
+      case State::HeaderStart: //either a new "Name: value" line, or the blank line ending the headers
+        if (c == '\r') {
+          state = State::HeadersEnd;
+        } else if (headerCount == headerNames.size()) {
+          error = ParseResult::HeadersTooLarge;
+          state = State::Error;
+        } else if (isTokenChar(c)) {
+          tokenStart = position;
+          state = State::HeaderName;
+        } else {
+          state = State::Error; //also rejects obsolete line folding (a line starting with whitespace)
+        }
+        break;
+
+      case State::HeaderName:
+        if (c == ':') {
+          headerNames[headerCount] = { tokenStart, position };
+          state = State::HeaderValueStart;
+        } else if (!isTokenChar(c)) {
+          state = State::Error;
+        }
+        break;
+
+      case State::HeaderValueStart: //skip the optional whitespace after the colon
+        if (c == ' ' || c == '\t') { break; }
+        tokenStart = position;
+        state = State::HeaderValue;
+        [[fallthrough]];
+
+      case State::HeaderValue:
+        if (c == '\r') {
+          std::size_t end = position;
+          while (end > tokenStart && (buffer[end-1] == ' ' || buffer[end-1] == '\t')) { end--; }
+          headerValues[headerCount++] = { tokenStart, end };
+          state = State::HeaderLineEnd;
+        } else if (!isFieldChar(c)) {
+          state = State::Error;
+        }
+        break;
+
+      case State::HeaderLineEnd:
+        state = (c == '\n') ? State::HeaderStart : State::Error;
+        break;
+
+      case State::HeadersEnd:
+        if (c == '\n') {
+          bodyOffset = position + 1;
+          state = State::Done;
+        } else {
+          state = State::Error;
+        }
+        break;
+
+      case State::Done:
+      case State::Error:
+        break;
+    }
+  }
+
+  if (state != State::Done && state != State::Error && position == maxHeaderSize) {
+    bool inRequestLine = state == State::Method || state == State::Target || state == State::Version || state == State::Reason;
+    error = inRequestLine ? ParseResult::UriTooLong : ParseResult::HeadersTooLarge;
+    state = State::Error;
+  }
+  if (state == State::Error) { return error; }
+  if (state != State::Done) { return ParseResult::Incomplete; }
+
+  ParseResult result = finishHeaders(buffer, request);
+  if (result != ParseResult::Complete) {
+    error = result;
+    state = State::Error;
+  }
+  return result;
+}
+
+
+ParseResult HttpParser::parseBody(std::string_view buffer, HttpRequest& request) {
+  if (state != State::Done) { return state == State::Error ? error : ParseResult::Incomplete; }
+  bodyLimit = maxBodySize;
+
+  if (request.chunked) {
+    ParseResult result = parseChunks(buffer, [this](std::string_view data) { chunkedBody.append(data); });
+    if (result == ParseResult::Complete) {
+      request.body = chunkedBody;
+      request.contentLength = chunkedBody.size();
+    }
+    return result;
+  }
+
+  if (request.contentLength > bodyLimit) { return ParseResult::BodyTooLarge; }
+  if (buffer.size() - bodyOffset < request.contentLength) { return ParseResult::Incomplete; }
+  request.body = buffer.substr(bodyOffset, request.contentLength);
+  messageEnd = bodyOffset + request.contentLength;
+  return ParseResult::Complete;
+}
+
+
+ParseResult HttpParser::streamBody(std::string& buffer, HttpRequest& request, std::size_t limit, const BodySink& sink) {
+  /* Whatever part of the body has arrived is handed to sink and then cut out of the buffer, so the buffer never holds
+    more than one recv() worth of body. Anything after the body (a pipelined request) moves up to bodyOffset. */
+  if (state != State::Done) { return state == State::Error ? error : ParseResult::Incomplete; }
+  bodyLimit = limit;
+
+  ParseResult result = ParseResult::Incomplete;
+  if (request.chunked) {
+    result = parseChunks(buffer, sink);
+    buffer.erase(bodyOffset, position - bodyOffset); //chunk framing and data alike
+    position = bodyOffset;
+    if (result == ParseResult::Complete) { request.contentLength = bodyReceived; }
+  } else {
+    if (request.contentLength > bodyLimit) { return ParseResult::BodyTooLarge; }
+    std::size_t available = std::min(request.contentLength - bodyReceived, buffer.size() - bodyOffset);
+    if (available > 0) {
+      sink(std::string_view(buffer).substr(bodyOffset, available));
+      buffer.erase(bodyOffset, available);
+      bodyReceived += available;
+    }
+    if (bodyReceived == request.contentLength) { result = ParseResult::Complete; }
+  }
+
+  if (result == ParseResult::Complete) { messageEnd = bodyOffset; } //the body is gone from the buffer, only the headers are left
+  return result;
+}
+
+
+ParseResult HttpParser::parseChunks(std::string_view buffer, const BodySink& sink) {
+  /* A chunked body is a series of chunks, each one a hex size line followed by that many bytes and a CRLF:
+      5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n
+    A zero sized chunk ends the body, optionally followed by trailer header lines and a blank line.
+    Extensions, trailers and leading zeros are skipped, but they still take up the buffer (parseBody() keeps the whole
+    message in it), so together they get no more room than the headers did.
+    https://www.rfc-editor.org/rfc/rfc9112#name-chunked-transfer-coding */
+  if (position < bodyOffset) { position = bodyOffset; }
+
+  while (position < buffer.size() && chunkState != ChunkState::Done) {
+    char c = buffer[position];
+    switch (chunkState) {
+      case ChunkState::Size: {
+        int digit = hexValue(c);
+        if (digit >= 0) {
+          if (chunkRemaining > (bodyLimit - bodyReceived) / 16) { return ParseResult::BodyTooLarge; }
+          if (chunkRemaining == 0 && chunkSizeSeen && ++chunkExtras > maxHeaderSize) { return ParseResult::HeadersTooLarge; }
+          chunkRemaining = chunkRemaining * 16 + digit;
+          chunkSizeSeen = true;
+        } else if (chunkSizeSeen && (c == ';' || c == '\r')) {
+          chunkState = (c == ';') ? ChunkState::Extension : ChunkState::SizeLineEnd;
+        } else {
+          return ParseResult::Invalid;
+        }
+        break;
+      }
+      case ChunkState::Extension: //chunk extensions are allowed but we don't use any
+        if (c == '\r') { chunkState = ChunkState::SizeLineEnd; }
+        else if (++chunkExtras > maxHeaderSize) { return ParseResult::HeadersTooLarge; }
+        break;
+      case ChunkState::SizeLineEnd:
+        if (c != '\n') { return ParseResult::Invalid; }
+        if (chunkRemaining > bodyLimit - bodyReceived) { return ParseResult::BodyTooLarge; }
+        chunkState = (chunkRemaining == 0) ? ChunkState::TrailerStart : ChunkState::Data;
+        break;
+      case ChunkState::Data: {
+        std::size_t available = std::min(chunkRemaining, buffer.size() - position);
+        sink(buffer.substr(position, available));
+        bodyReceived += available;
+        chunkRemaining -= available;
+        position += available;
+        if (chunkRemaining == 0) { chunkState = ChunkState::DataEnd; }
+        continue; //position already moved past the data
+      }
+      case ChunkState::DataEnd:
+        if (c != '\r') { return ParseResult::Invalid; }
+        chunkState = ChunkState::DataLineEnd;
+        break;
+      case ChunkState::DataLineEnd:
+        if (c != '\n') { return ParseResult::Invalid; }
+        chunkState = ChunkState::Size;
+        chunkSizeSeen = false;
+        break;
+      case ChunkState::TrailerStart:
+        chunkState = (c == '\r') ? ChunkState::TrailerEnd : ChunkState::Trailer;
+        if (chunkState == ChunkState::Trailer && ++chunkExtras > maxHeaderSize) { return ParseResult::HeadersTooLarge; }
+        break;
+      case ChunkState::Trailer: //trailer fields are skipped
+        if (c == '\n') { chunkState = ChunkState::TrailerStart; }
+        else if (++chunkExtras > maxHeaderSize) { return ParseResult::HeadersTooLarge; }
+        break;
+      case ChunkState::TrailerEnd:
+        if (c != '\n') { return ParseResult::Invalid; }
+        chunkState = ChunkState::Done;
+        break;
+      case ChunkState::Done:
+        break;
+    }
+    position++;
+  }
+
+  if (chunkState != ChunkState::Done) { return ParseResult::Incomplete; }
+  messageEnd = position;
+  return ParseResult::Complete;
+}
+
+
+std::size_t HttpParser::messageLength() const {
+  return messageEnd;
+}
+
+
+bool HttpParser::shouldSendContinue(const HttpRequest& request) {
+  if (continueSent || !equalsIgnoreCase(request.header("Expect"), "100-continue")) { return false; }
+  continueSent = true;
+  return true;
+} /*clients sending a large body may first send just the headers with "Expect: 100-continue", and wait for an interim
+"HTTP/1.1 100 Continue" before sending the body - https://www.rfc-editor.org/rfc/rfc9110#name-expect */
+
+
+void HttpParser::reset() {
+  state = start;
+  position = 0;
+  tokenStart = 0;
+  error = ParseResult::Invalid;
+  headerCount = 0;
+  bodyOffset = 0;
+  messageEnd = 0;
+  continueSent = false;
+  chunkState = ChunkState::Size;
+  chunkRemaining = 0;
+  chunkSizeSeen = false;
+  chunkExtras = 0;
+  bodyReceived = 0;
+  chunkedBody.clear(); //keeps its capacity for the next chunked request on this connection
+}
+
+
+ParseResult HttpParser::finishHeaders(std::string_view buffer, HttpRequest& request) {
+  auto view = [&buffer](Span span) { return buffer.substr(span.start, span.end - span.start); };
+
+  request.method = view(method);
+  request.target = view(target);
+  request.version = view(version);
+  request.headerCount = headerCount;
+  for (std::size_t i = 0; i < headerCount; i++) {
+    request.headers[i] = { view(headerNames[i]), view(headerValues[i]) };
+  }
+  request.bodyOffset = bodyOffset;
+  request.body = {};
+
+  request.contentLength = 0;
+  bool seenContentLength = false;
+  for (std::size_t i = 0; i < headerCount; i++) {
+    if (!equalsIgnoreCase(request.headers[i].name, "Content-Length")) { continue; }
+    std::string_view value = request.headers[i].value;
+    std::size_t length = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), length);
+    if (value.empty() || error != std::errc() || end != value.data() + value.size()) { return ParseResult::Invalid; }
+    if (seenContentLength && length != request.contentLength) { return ParseResult::Invalid; } //conflicting lengths - request smuggling
+    request.contentLength = length;
+    seenContentLength = true;
+  }
+
+  request.chunked = false;
+  if (request.hasHeader("Transfer-Encoding")) {
+    if (!equalsIgnoreCase(request.header("Transfer-Encoding"), "chunked")) { return ParseResult::NotImplemented; }
+    if (seenContentLength) { return ParseResult::Invalid; } //both framings at once is a classic request smuggling trick
+    request.chunked = true;
+  }
+
+  return ParseResult::Complete;
+} //fills the request's views over the buffer and validates how the body is framed
+
+
+std::string_view HttpRequest::header(std::string_view name) const {
+  for (std::size_t i = 0; i < headerCount; i++) {
+    if (equalsIgnoreCase(headers[i].name, name)) { return headers[i].value; }
+  }
+  return {};
+}
+
+bool HttpRequest::hasHeader(std::string_view name) const {
+  for (std::size_t i = 0; i < headerCount; i++) {
+    if (equalsIgnoreCase(headers[i].name, name)) { return true; }
+  }
+  return false;
+}
+
+
+static bool isTokenChar(char c) {
+  // https://www.rfc-editor.org/rfc/rfc9110#name-tokens
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) { return true; }
+  return std::string_view("!#$%&'*+-.^_`|~").find(c) != std::string_view::npos;
+}
+
+static bool isFieldChar(char c) {
+  unsigned char u = c;
+  return u == '\t' || (u >= 0x20 && u != 0x7f); //visible characters, spaces, and obs-text (bytes >= 0x80)
+}
+
+static char toLower(char c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) { return false; }
+  for (std::size_t i = 0; i < a.size(); i++) {
+    if (toLower(a[i]) != toLower(b[i])) { return false; }
+  }
+  return true;
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') { return c - '0'; }
+  if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+  if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+  return -1;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <array>
+#include <cstddef>
+#include <functional>
+
+
+struct HttpHeader {
+  std::string_view name;
+  std::string_view value;
+};
+
+/**
+ * A parsed request. Nothing is copied - every field is a view into the receive buffer the parser was given,
+ *    so a request is only valid while that buffer is unchanged. The one exception is a chunked body, which has to be
+ *    reassembled - body then points into the parser instead.
+ *
+ * An upstream's responses are parsed into one too (refer proxy.hpp). The status line's parts are then in version,
+ *    target and method: "HTTP/1.1", "404" and "Not Found".
+*/
+struct HttpRequest {
+  static constexpr std::size_t maxHeaders = 64;
+
+  std::string_view method; //eg. GET
+  std::string_view target; //eg. /echo/abc
+  std::string_view version; //eg. HTTP/1.1
+  std::array<HttpHeader, maxHeaders> headers;
+  std::size_t headerCount = 0;
+  std::size_t bodyOffset = 0; //where the body starts in the buffer, right after the blank line ending the headers
+  std::size_t contentLength = 0; //for chunked requests this is only known once the whole body has arrived
+  bool chunked = false; //Transfer-Encoding: chunked
+  std::string_view body; //set once HttpParser::parseBody() returns Complete
+
+  std::string_view header(std::string_view name) const; //case-insensitive lookup, empty if the header wasn't sent
+  bool hasHeader(std::string_view name) const;
+};
+
+enum class ParseResult {
+  Incomplete, //need more bytes
+  Complete, //see parse() and parseBody()
+  Invalid, //malformed request - 400
+  UriTooLong, //request line longer than the header size limit - 414
+  HeadersTooLarge, //headers longer than the header size limit, or too many of them, or a chunked body's trailers and extensions - 431
+  BodyTooLarge, //body longer than the body size limit - 413
+  NotImplemented //a Transfer-Encoding other than chunked - 501
+};
+
+/**
+ * Single pass state machine over the request line, headers and body.
+ * 
+ * parse() and parseBody() can be called again every time more bytes arrive in the buffer - they remember where they
+ *    stopped and carry on from there, so a request split over several recv() calls is only ever scanned once.
+ *    Positions are stored as offsets rather than pointers, so it's fine if the buffer was reallocated in between calls.
+ * Bodies either wait in the buffer until they're complete (parseBody), or are passed on as they arrive (streamBody) -
+ *    handy for uploads that are too big to keep in memory.
+ * Anything other than Incomplete or Complete means the connection can't be trusted any more and should be closed.
+ * Call reset() before parsing the next request.
+ *
+ * Made with responses set, it parses responses instead: a status line where the request line would be, and then
+ *    the same headers and body framing.
+*/
+class HttpParser {
+  public:
+    explicit HttpParser(std::size_t maxHeaderSize = 8192, std::size_t maxBodySize = 16 * 1024 * 1024, bool responses = false);
+
+    ParseResult parse(std::string_view buffer, HttpRequest& request); //Complete once the request line and headers are in
+    using BodySink = std::function<void(std::string_view)>;
+
+    ParseResult parseBody(std::string_view buffer, HttpRequest& request); //Complete once the whole body is in request.body
+    ParseResult streamBody(std::string& buffer, HttpRequest& request, std::size_t limit, const BodySink& sink); //passes the body on piece by piece
+    std::size_t messageLength() const; //bytes of the buffer the request took up, once parseBody() returned Complete
+    bool shouldSendContinue(const HttpRequest& request); //true once per request if the client is waiting for "100 Continue"
+    bool headersParsed() const { return state == State::Done; } //parse() has returned Complete, and reset() hasn't been called since
+    void reset();
+
+  private:
+    struct Span {
+      std::size_t start = 0;
+      std::size_t end = 0;
+    };
+
+    enum class State {
+      Method, Target, Version, RequestLineEnd,
+      StatusVersion, StatusCode, Reason, //a response's status line, which ends with RequestLineEnd too
+      HeaderStart, HeaderName, HeaderValueStart, HeaderValue, HeaderLineEnd,
+      HeadersEnd, Done, Error
+    };
+
+    enum class ChunkState {
+      Size, Extension, SizeLineEnd, Data, DataEnd, DataLineEnd,
+      TrailerStart, Trailer, TrailerEnd, Done
+    };
+
+    std::size_t maxHeaderSize;
+    std::size_t maxBodySize; //for bodies kept in memory (parseBody)
+    State start; //Method, or StatusVersion for responses
+    std::size_t bodyLimit = 0; //the limit for the body being parsed right now
+    std::size_t bodyReceived = 0; //body bytes seen so far, without any chunk framing
+
+    State state;
+    ParseResult error = ParseResult::Invalid; //what to report once state is Error
+    std::size_t position = 0; //next byte of the buffer to look at
+    std::size_t tokenStart = 0;
+    Span method, target, version;
+    std::array<Span, HttpRequest::maxHeaders> headerNames, headerValues;
+    std::size_t headerCount = 0;
+    std::size_t bodyOffset = 0;
+    std::size_t messageEnd = 0;
+    bool continueSent = false;
+
+    ChunkState chunkState = ChunkState::Size;
+    std::size_t chunkRemaining = 0; //chunk-size while reading the size line, then bytes of chunk data still to come
+    bool chunkSizeSeen = false;
+    std::size_t chunkExtras = 0; //extension, trailer and leading zero bytes so far, which say nothing - held to maxHeaderSize
+    std::string chunkedBody; //chunk data with the chunk framing removed, for parseBody()
+
+    ParseResult finishHeaders(std::string_view buffer, HttpRequest& request);
+    ParseResult parseChunks(std::string_view buffer, const BodySink& sink);
+};
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b); //ASCII only, which is all HTTP header names and tokens use
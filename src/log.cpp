@@ -0,0 +1,193 @@
+#include "log.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
+
+
+/* A ring is one thread's buffer of formatted lines. head and tail count bytes ever written/read, so head - tail is how
+  much is waiting, and position % capacity is where in data it is. Only the owning thread moves head and only the
+  writer thread moves tail. */
+struct Logger::Ring {
+  static constexpr std::size_t capacity = 64 * 1024; //a power of two
+
+  std::unique_ptr<char[]> data = std::make_unique<char[]>(capacity);
+  alignas(64) std::atomic<std::size_t> head{0};
+  alignas(64) std::atomic<std::size_t> tail{0};
+  std::atomic<std::size_t> dropped{0}; //lines that didn't fit
+  std::atomic<bool> orphaned{false}; //its thread has exited, so it can go once it's empty
+};
+
+namespace {
+  struct RingHandle {
+    std::shared_ptr<void> ring; //a Logger::Ring, shared with the logger's list
+    std::atomic<bool>* orphaned = nullptr;
+    ~RingHandle() { if (orphaned != nullptr) { orphaned->store(true, std::memory_order_release); } }
+  };
+  constexpr std::size_t batchSize = 64 * 1024; //write() once this much has been collected
+}
+
+
+Logger& logger() {
+  static Logger* instance = [] {
+    Logger* created = new Logger();
+    created->writer = std::thread(&Logger::run, created);
+    created->writer.detach();
+    return created;
+  }();
+  return *instance;
+} /*never destroyed - threads that are still serving clients while the process exits may log, and would find the
+  logger gone otherwise*/
+
+
+void Logger::configure(LogLevel level, int output_fd) {
+  threshold.store(level, std::memory_order_relaxed);
+  this->output_fd.store(output_fd, std::memory_order_relaxed);
+}
+
+
+void Logger::flush() {
+  std::unique_lock<std::mutex> lock(flushMutex);
+  std::size_t ticket = ++flushesRequested;
+  wake.notify_one();
+  flushed.wait(lock, [&] { return flushesDone >= ticket; });
+}
+
+
+void Logger::appendPrefix(std::string& line, LogLevel level) {
+  thread_local std::time_t lastSecond = -1;
+  thread_local char timestamp[32];
+  std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  if (now != lastSecond) { //formatting the date is the expensive part, and it only changes once a second
+    std::tm parts;
+    gmtime_r(&now, &parts);
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ ", &parts);
+    lastSecond = now;
+  }
+  line += timestamp;
+
+  switch (level) {
+    case LogLevel::Debug: line += "debug "; break;
+    case LogLevel::Info: line += "info "; break;
+    case LogLevel::Warning: line += "warning "; break;
+    case LogLevel::Error: line += "error "; break;
+    case LogLevel::Off: break;
+  }
+}
+
+
+void Logger::submit(std::string_view line) {
+  Ring& ring = threadRing();
+  std::size_t head = ring.head.load(std::memory_order_relaxed);
+  std::size_t tail = ring.tail.load(std::memory_order_acquire);
+  if (Ring::capacity - (head - tail) < line.size()) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  std::size_t start = head % Ring::capacity;
+  std::size_t first = std::min(line.size(), Ring::capacity - start); //up to the end of data, the rest wraps around
+  std::memcpy(ring.data.get() + start, line.data(), first);
+  std::memcpy(ring.data.get(), line.data() + first, line.size() - first);
+  ring.head.store(head + line.size(), std::memory_order_release);
+}
+
+
+Logger::Ring& Logger::threadRing() {
+  thread_local RingHandle handle;
+  if (handle.ring == nullptr) {
+    auto ring = std::make_shared<Ring>();
+    handle.orphaned = &ring->orphaned;
+    handle.ring = ring;
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    rings.push_back(std::move(ring));
+  }
+  return *static_cast<Ring*>(handle.ring.get());
+}
+
+
+bool Logger::drain(std::string& batch) {
+  std::size_t before = batch.size();
+  std::lock_guard<std::mutex> lock(ringsMutex);
+  for (auto ring = rings.begin(); ring != rings.end();) {
+    Ring& current = **ring;
+    bool orphaned = current.orphaned.load(std::memory_order_acquire); //read first, so nothing it logged is missed below
+    std::size_t tail = current.tail.load(std::memory_order_relaxed);
+    std::size_t head = current.head.load(std::memory_order_acquire);
+
+    std::size_t start = tail % Ring::capacity;
+    std::size_t waiting = head - tail;
+    std::size_t first = std::min(waiting, Ring::capacity - start);
+    batch.append(current.data.get() + start, first);
+    batch.append(current.data.get(), waiting - first);
+    current.tail.store(head, std::memory_order_release);
+
+    std::size_t dropped = current.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      batch += "log: " + std::to_string(dropped) + " line(s) dropped, the log couldn't keep up\n";
+    }
+
+    if (orphaned) {
+      ring = rings.erase(ring);
+    } else {
+      ++ring;
+    }
+  }
+  return batch.size() > before;
+}
+
+
+void Logger::writeOut(std::string_view batch) {
+  int fd = output_fd.load(std::memory_order_relaxed);
+  while (!batch.empty()) {
+    ssize_t written = write(fd, batch.data(), batch.size());
+    if (written < 0) {
+      if (errno == EINTR) { continue; }
+      return; //nowhere to report it - the log is the place errors go
+    }
+    batch.remove_prefix(written);
+  }
+}
+
+
+void Logger::run() {
+  std::string batch;
+  batch.reserve(batchSize);
+  while (true) {
+    std::size_t flushTarget;
+    {
+      std::lock_guard<std::mutex> lock(flushMutex);
+      flushTarget = flushesRequested;
+    }
+
+    while (drain(batch) && batch.size() < batchSize) {} //keep collecting while there's more, up to one batch
+    bool full = batch.size() >= batchSize;
+    if (!batch.empty()) {
+      writeOut(batch);
+      batch.clear();
+    }
+
+    std::unique_lock<std::mutex> lock(flushMutex);
+    if (flushTarget > flushesDone) {
+      flushesDone = flushTarget;
+      flushed.notify_all();
+    }
+    if (!full && flushesRequested == flushesDone) {
+      wake.wait_for(lock, std::chrono::milliseconds(10)); //let lines pile up for a bit, unless we're falling behind
+    }
+  }
+} /* a flush is done once a pass that started after it was asked for has written what it found. Batching up to 10ms
+  of lines into one write() is what makes the access log cheap */
+
+
+bool parseLogLevel(std::string_view name, LogLevel& level) {
+  if (name == "debug") { level = LogLevel::Debug; }
+  else if (name == "info") { level = LogLevel::Info; }
+  else if (name == "warning") { level = LogLevel::Warning; }
+  else if (name == "error") { level = LogLevel::Error; }
+  else if (name == "off") { level = LogLevel::Off; }
+  else { return false; }
+  return true;
+}
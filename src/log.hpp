@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+
+enum class LogLevel {
+  Debug, //every request's headers, connects and closes - very chatty
+  Info, //one access log line per response, startup/shutdown
+  Warning, //rejected requests, clients we had no room for
+  Error, //things that went wrong on our side
+  Off
+};
+
+/**
+ * Log lines are written by a background thread, never by the thread that logs them.
+ *
+ * Writing to stdout from every client thread meant every request took turns on the iostream lock, and paid for a
+ *    write() (std::endl flushes) while holding it. Instead each thread formats its line into its own ring buffer -
+ *    single producer, single consumer, so no lock - and the writer thread collects what's in all of them every
+ *    few milliseconds and writes it out in one go.
+ * If a thread logs faster than the writer keeps up and its ring fills, lines are dropped (and counted) rather than
+ *    making request handling wait for the disk.
+ *
+ * Lines are checked against the level before anything is formatted, so a disabled level costs one atomic load.
+*/
+class Logger {
+  public:
+    Logger() = default;
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void configure(LogLevel level, int output_fd); //lines logged before this use Info and stdout
+    void setLevel(LogLevel level) { threshold.store(level, std::memory_order_relaxed); } //while running, on SIGHUP
+    bool enabled(LogLevel level) const { return level >= threshold.load(std::memory_order_relaxed); }
+    void flush(); //blocks until everything logged so far has been written
+
+    template <typename... Parts>
+    void log(LogLevel level, const Parts&... parts) {
+      if (!enabled(level)) { return; }
+      thread_local std::string line;
+      line.clear();
+      appendPrefix(line, level);
+      (append(line, parts), ...);
+      line += '\n';
+      submit(line);
+    } //parts can be anything convertible to a string_view, integers or chars
+
+  private:
+    struct Ring;
+
+    std::atomic<LogLevel> threshold{LogLevel::Info};
+    std::atomic<int> output_fd{1};
+    std::mutex ringsMutex; //guards rings - only taken when a thread logs for the first time, and by the writer
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::thread writer;
+    std::mutex flushMutex;
+    std::condition_variable flushed;
+    std::condition_variable wake;
+    std::size_t flushesRequested = 0;
+    std::size_t flushesDone = 0;
+
+    static void appendPrefix(std::string& line, LogLevel level);
+    static void append(std::string& line, std::string_view part) { line += part; }
+    static void append(std::string& line, char part) { line += part; }
+    template <std::integral Number>
+    static void append(std::string& line, Number part) {
+      char digits[24];
+      auto [end, error] = std::to_chars(digits, digits + sizeof(digits), part);
+      line.append(digits, end);
+    }
+
+    void submit(std::string_view line);
+    Ring& threadRing();
+    bool drain(std::string& batch); //moves everything in the rings into batch, returns false if there was nothing
+    void writeOut(std::string_view batch);
+    void run();
+
+    friend Logger& logger();
+};
+
+Logger& logger();
+
+template <typename... Parts> void logDebug(const Parts&... parts) { logger().log(LogLevel::Debug, parts...); }
+template <typename... Parts> void logInfo(const Parts&... parts) { logger().log(LogLevel::Info, parts...); }
+template <typename... Parts> void logWarning(const Parts&... parts) { logger().log(LogLevel::Warning, parts...); }
+template <typename... Parts> void logError(const Parts&... parts) { logger().log(LogLevel::Error, parts...); }
+
+bool parseLogLevel(std::string_view name, LogLevel& level); //"debug", "info", "warning", "error" or "off"
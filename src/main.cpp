@@ -0,0 +1,298 @@
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <thread>
+#include <array>
+#include <vector>
+
+#include "server.hpp"
+#include "event_loop.hpp"
+#include "uring_loop.hpp"
+#include "coroutine_loop.hpp"
+#include "file_cache.hpp"
+#include "mapped_file.hpp"
+#include "worker_pool.hpp"
+#include "log.hpp"
+#include "mime_types.hpp"
+#include "compression.hpp"
+#include "path_resolver.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "admission.hpp"
+#include "drain.hpp"
+#include "takeover.hpp"
+#include "config.hpp"
+#include "tls.hpp"
+#include "proxy.hpp"
+
+
+/**
+ * Use this link to bring up the search in the documentation: https://pubs.opengroup.org/onlinepubs/9699919799/
+ * curl commands for testing: 
+ *  curl -v -X GET http://localhost:4221/files/237_dooby_Coo_vanilla
+ *  curl -vvv -d "hello world" localhost:4221/files/postfile.txt
+*/
+
+int main(int argc, char **argv) {
+
+  //codecrafters test the get file functionality by passing in a directory path
+  //as an argument in the terminal. eg: ./your_server.sh --directory <directory path>.
+  // ./your_server.sh is a bash script used to compile the source code using cmake, and then run the compiled executable.
+  //every other setting has a flag too, and may come from a --config file instead - refer config.hpp
+  ServerConfig config;
+  std::string configError;
+  if (!parseConfig(argc, argv, config, configError) || !validateConfig(config, configError)) {
+    std::cerr << configError << "\n";
+    return 1;
+  }
+  
+
+  signal(SIGPIPE, SIG_IGN); /*sendResponses() sends with MSG_NOSIGNAL, but sendfile() has no such flag - a client hanging up
+  in the middle of a file would kill the server*/
+
+  int log_fd = 1; //stdout
+  if (config.logFile != "") {
+    log_fd = open(config.logFile.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+      std::cerr << "Can't open --log-file " << config.logFile << ": " << std::strerror(errno) << "\n";
+      return 1;
+    }
+  }
+  logger().configure(config.logLevel, log_fd);
+
+  if (config.mimeTypesFile != "" && !loadMimeTypes(config.mimeTypesFile)) {
+    std::cerr << "Can't read --mime-types " << config.mimeTypesFile << "\n";
+    return 1;
+  }
+
+  if (config.directory != "") {
+    mkdir(config.directory.c_str(), 0777); //https://pubs.opengroup.org/onlinepubs/009695299/functions/mkdir.html
+    //0777 refers to the permissions, in this case wrx for user,group,others. Fails harmlessly if it already exists
+  }
+  if (!filesRoot().open(config.directory) || !workingRoot().open("")) { //files are only ever opened beneath these, refer path_resolver.hpp
+    std::cerr << "Can't open --directory " << config.directory << ": " << std::strerror(errno) << "\n";
+    return 1;
+  }
+  statCache().configure(std::chrono::milliseconds(config.statCacheTtl));
+  fileCache().configure(config.cacheSize, config.cacheMaxFileSize);
+  mappedFiles().configure(config.largeFileMode == "mmap" ? config.mmapMinSize : 0);
+  configureCompression(config.compressMinSize);
+  admission().configure(config.maxConnections, config.maxConnectionsPerAddress);
+  std::string tlsError;
+  if (config.tlsCertificate != "" && !tls().configure(config.tlsCertificate, config.tlsKey, config.tlsThreads, tlsError)) {
+    std::cerr << "Can't set up TLS: " << tlsError << "\n";
+    return 1;
+  }
+  std::string proxyError;
+  if (!proxy().configure(config.proxyRoutes, config.proxyBalance, config.proxyTimeout, config.bodyTimeout, config.proxyPoolSize,
+                         config.proxyThreads, proxyError)) {
+    std::cerr << "Can't set up --proxy: " << proxyError << "\n";
+    return 1;
+  }
+  if (!configureTracing(config.traceFile, config.traceSample)) {
+    std::cerr << "Can't open --trace-file " << config.traceFile << ": " << std::strerror(errno) << "\n";
+    return 1;
+  }
+  if (!configureDrain(std::chrono::seconds(config.drainTimeout))) {
+    std::cerr << "Can't set up draining: " << std::strerror(errno) << "\n";
+    return 1;
+  }
+  if (!watchReloads(argc, argv, config)) { //before anything below changes config - a reload compares against it
+    std::cerr << "Can't set up reloading: " << std::strerror(errno) << "\n";
+    return 1;
+  }
+
+
+  /** 1-4. Create the listening socket. Refer openListeningSocket().
+   * 
+   * Or, with --take-over, take the running server's listening sockets instead - refer takeover.hpp. It keeps
+   *    accepting until we're ready to, so we tell it only right before the workers start.
+  */
+
+  std::vector<int> listeners;
+  int takeover_fd = -1;
+  if (config.takeOver != "") {
+    takeover_fd = requestTakeover(config.takeOver, listeners);
+    if (takeover_fd < 0) { return 1; }
+    struct sockaddr_in bound = {};
+    socklen_t boundLength = sizeof(bound);
+    struct in_addr wanted = {};
+    inet_pton(AF_INET, config.bindAddress.c_str(), &wanted);
+    if (getsockname(listeners[0], reinterpret_cast<struct sockaddr*>(&bound), &boundLength) != 0 || ntohs(bound.sin_port) != config.port
+        || bound.sin_addr.s_addr != wanted.s_addr) {
+      std::cerr << "The server at --take-over " << config.takeOver << " doesn't listen on --bind " << config.bindAddress
+                << " --port " << config.port << "\n";
+      return 1;
+    }
+    if (config.ioMode == "threads" && listeners.size() > 1) { //the connections queued on the others would be reset
+      std::cerr << "--io threads accepts on one socket, and the server at --take-over " << config.takeOver << " has "
+                << listeners.size() << ". Take it over with --io epoll, uring or coroutines\n";
+      return 1;
+    }
+    logInfo("took over ", listeners.size(), " listening socket(s) from the server at ", config.takeOver);
+  }
+  else {
+    int listen_fd = openListeningSocket(config.bindAddress, config.port, config.connectionBacklog);
+    if (listen_fd < 0) { return 1; }
+    listeners.push_back(listen_fd);
+  }
+  int server_fd = listeners[0];
+
+  /* The metrics (refer metrics.hpp) get a port of their own, so scrapes never queue up behind clients, and the port
+    can be kept away from them with a firewall. It isn't taken over: both servers bind it, SO_REUSEPORT, and a scrape
+    may get either one's numbers for a moment. */
+  if (config.adminPort != 0) {
+    int admin_fd = openListeningSocket(config.bindAddress, config.adminPort, config.connectionBacklog);
+    if (admin_fd < 0) { return 1; }
+    nameRouteMetrics();
+    std::thread(serveMetrics, admin_fd).detach();
+    logInfo("metrics on port ", config.adminPort, ", at /metrics");
+  }
+
+
+  /** 5. Now we must prepare and allow potential client connections.
+   * 
+   * So we define a blank struct to store the client address properties, and also get its length cuz for some reason
+   *    you can't use sizeof like we did with the bind method. 
+   *    Exact reason: " argument of type "unsigned long" is incompatible with parameter of type "socklen_t *" "
+   * The accept function will create a socket for the client.
+   * 
+  */
+
+  struct sockaddr_in client_addr;
+  int client_addr_len = sizeof(client_addr);
+  
+  logInfo("server ", server_fd, " has started waiting for clients to connect on port ", config.port);
+
+  /** 6. We may have to handle multiple clients concurrently.
+   * 
+   * The accept function will create a socket for the client.
+   * Refer handleClient() for remaining comments.
+   * 
+   * std::thread is used for concurrency. Rather than starting a thread per client (which a flood of connections turns
+   *    into thousands of threads, until the process can't create any more), a fixed pool of threads is started up
+   *    front and accept() hands them the client sockets through a queue. Refer worker_pool.cpp.
+   * When the queue is full too, the client gets a 503 straight away - better than having it wait on a connection
+   *    nobody will get to in time. So does a client over --max-connections or --max-connections-per-ip, in every
+   *    --io mode (refer admission.hpp).
+   * 
+   * Had to add the following line to the CMakeLists.txt, to make my program compile on codecrafters,
+   *    even tho it compiled fine on my macbook. Codecrafters gave the error: "Cmake error undefined reference to `pthread_create'"
+   *    SET(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -pthread")
+   * 
+  */
+
+  /** 6a. Alternatively, the sockets can be multiplexed with epoll (--io epoll).
+   * 
+   * Instead of a thread blocking in recv() for every client, a few event loop threads wait on epoll_wait() and only
+   *    touch a socket once the kernel says it is readable/writable. Refer event_loop.cpp.
+   * Each worker binds its own SO_REUSEPORT listener on the same port, and the kernel spreads new connections between them.
+   * 
+  */
+
+  /** 6b. Or with io_uring (--io uring), where the kernel does the accepts, receives, sends and file reads we queue up
+   *    for it, and tells us once they're done. Refer uring_loop.cpp. Kernels without it (or with it turned off) get
+   *    the epoll workers instead.
+   * 
+  */
+
+  /** 6c. Or with coroutines (--io coroutines), which read like handleClient() - wait for a request, answer it, send
+   *    the response - but co_await the socket instead of blocking on it, so a handful of threads (one epoll reactor
+   *    each) serve thousands of clients without a thread or stack per client. Refer async.hpp and coroutine_loop.cpp.
+   * 
+  */
+
+  if (config.ioMode == "uring" && tls().enabled()) { //the ring receives and sends without us in between, refer tls.hpp
+    logWarning("--io uring can't do TLS, running epoll workers instead");
+    config.ioMode = "epoll";
+  }
+  if (config.ioMode == "uring" && proxy().enabled()) { //the same - refer proxy.hpp
+    logWarning("--io uring can't relay proxied responses, running epoll workers instead");
+    config.ioMode = "epoll";
+  }
+  if (config.ioMode == "uring" && !uringAvailable()) { config.ioMode = "epoll"; } //uringAvailable() logs why
+  if (config.ioMode != "threads") { listeners = openWorkerListeners(listeners, config); }
+
+  if (takeover_fd >= 0 && !confirmTakeover(takeover_fd)) {
+    std::cerr << "The server at --take-over " << config.takeOver << " went away before it could be told to drain\n";
+    return 1; //we'd both be accepting - better only it, as it was
+  }
+  if (config.controlSocket != "") { /*a replacement may take these over from us in turn. Failing to is fatal only when
+    we've taken nothing over, and the running server is still there to fall back on*/
+    int control_fd = openControlSocket(config.controlSocket);
+    if (control_fd >= 0) { std::thread(serveTakeovers, control_fd, listeners).detach(); }
+    else if (takeover_fd < 0) {
+      std::cerr << "Can't open --control-socket " << config.controlSocket << ": " << std::strerror(errno) << "\n";
+      return 1;
+    }
+    else { logError("can't open --control-socket ", config.controlSocket, ": ", std::strerror(errno), ", carrying on without"); }
+  }
+
+  if (config.ioMode == "coroutines") {
+    int status = runCoroutineLoops(listeners, config);
+    close(server_fd);
+    logInfo("server ", server_fd, " shut down!");
+    logger().flush();
+    return status;
+  }
+
+  if (config.ioMode == "uring") {
+    int status = runUringLoops(listeners, config);
+    close(server_fd);
+    logInfo("server ", server_fd, " shut down!");
+    logger().flush();
+    return status;
+  }
+
+  if (config.ioMode == "epoll") {
+    int status = runEventLoops(listeners, config);
+    close(server_fd);
+    logInfo("server ", server_fd, " shut down!");
+    logger().flush();
+    return status;
+  }
+
+  /* poll() for the listener and the drain notice both, as accept() can't be interrupted. The listener is
+    non-blocking, as a server taking over from us (or that we took over from) may accept the client poll() saw first.
+    The pool is destroyed before main() returns, and that waits for the clients it has to finish. */
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+  std::array<struct pollfd, 2> waiting = {{ { server_fd, POLLIN, 0 }, { drainNotice(), POLLIN, 0 } }};
+  {
+    WorkerPool pool(config.threadCount, config.queueSize, [&config](int client_fd) { handleClient(client_fd, config); });
+
+    while (!draining()) {
+      if (poll(waiting.data(), waiting.size(), -1) < 0 || !(waiting[0].revents & POLLIN)) { continue; }
+      int client_fd = accept(server_fd, (struct sockaddr *) &client_addr, (socklen_t *) &client_addr_len);
+      if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { logError("accept failed: ", std::strerror(errno)); }
+        continue;
+      }
+      logDebug("client ", client_fd, " connected");
+      if (!admission().admit(client_fd)) {
+        logWarning("too many connections for client ", client_fd, ", sending 503");
+        rejectClient(client_fd);
+        continue;
+      }
+      if (!pool.submit(client_fd)) {
+        logWarning("no room for client ", client_fd, ", sending 503");
+        rejectClient(client_fd);
+      }
+    }
+  }
+
+  close(server_fd);
+  logInfo("server ", server_fd, " shut down!");
+  logger().flush();
+  return 0;
+  
+}
@@ -0,0 +1,45 @@
+#include <memory>
+#include <sys/mman.h>
+
+#include "mapped_file.hpp"
+
+
+MappedFileTable& mappedFiles() {
+  static MappedFileTable table;
+  return table;
+}
+
+
+MappedFile::~MappedFile() {
+  munmap(address, size);
+}
+
+
+void MappedFileTable::configure(std::size_t minSize) {
+  this->minSize = minSize;
+}
+
+
+std::shared_ptr<const MappedFile> MappedFileTable::map(int file_fd, const struct stat& info) {
+  Key key = { info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec };
+  std::lock_guard<std::mutex> guard(lock);
+
+  auto found = mappings.find(key);
+  if (found != mappings.end()) {
+    if (auto mapping = found->second.lock()) { return mapping; }
+  }
+
+  void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+  if (address == MAP_FAILED) { return nullptr; }
+  madvise(address, info.st_size, MADV_SEQUENTIAL); //downloads read front to back - read ahead aggressively, drop pages behind
+
+  auto mapping = std::make_shared<const MappedFile>(address, info.st_size);
+  mappings[key] = mapping;
+
+  //forget mappings nobody uses any more, so the table doesn't grow with every version of every file
+  for (auto it = mappings.begin(); it != mappings.end(); ) {
+    it = it->second.expired() ? mappings.erase(it) : std::next(it);
+  }
+  return mapping;
+} /*the file descriptor can be closed once this returns, the mapping stays valid. If the file is truncated while mapped,
+sending the missing part fails with EFAULT and the connection is closed*/
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string_view>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+/**
+ * A whole file mapped into memory with mmap(). The mapping is removed when the last response using it is destroyed.
+*/
+class MappedFile {
+  public:
+    MappedFile(void* address, std::size_t size) : address(address), size(size) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    std::string_view contents() const { return std::string_view(static_cast<const char*>(address), size); }
+
+  private:
+    void* address;
+    std::size_t size;
+};
+
+/**
+ * Large files can be served from a memory mapping instead of with sendfile() (--large-files mmap).
+ * 
+ * The table hands out shared mappings, so any number of clients downloading the same file at once (or different
+ *    ranges of it) read from a single mapping. A mapping is identified by device, inode, size and mtime, so a file
+ *    that changes gets a fresh mapping while downloads of the old version finish from the old one.
+*/
+class MappedFileTable {
+  public:
+    void configure(std::size_t minSize); //files of at least minSize bytes get mapped, 0 turns mapping off
+    bool shouldMap(std::size_t fileSize) const { return minSize > 0 && fileSize >= minSize; }
+
+    std::shared_ptr<const MappedFile> map(int file_fd, const struct stat& info); //nullptr if mmap() failed
+
+  private:
+    using Key = std::tuple<dev_t, ino_t, off_t, time_t, long>;
+
+    std::size_t minSize = 0;
+    std::mutex lock;
+    std::map<Key, std::weak_ptr<const MappedFile>> mappings;
+};
+
+MappedFileTable& mappedFiles(); //the table shared by every worker
@@ -0,0 +1,285 @@
+#include <string>
+#include <array>
+#include <bit>
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.hpp"
+#include "server.hpp"
+#include "http_parser.hpp"
+#include "response.hpp"
+#include "allocation_counter.hpp"
+#include "log.hpp"
+
+
+static void answerScrape(int client_fd);
+static void appendNumber(std::string& page, std::uint64_t number);
+static void appendDecimal(std::string& page, double number);
+static void appendHeader(std::string& page, std::string_view name, std::string_view type, std::string_view help);
+
+/* Prometheus' buckets for http_request_duration_seconds, and the same in nanoseconds. */
+static constexpr std::array<std::string_view, 16> latencyBounds = {
+  "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "10" };
+static constexpr std::array<std::uint64_t, 16> latencyBoundsNs = {
+  100'000, 250'000, 500'000, 1'000'000, 2'500'000, 5'000'000, 10'000'000, 25'000'000, 50'000'000, 100'000'000,
+  250'000'000, 500'000'000, 1'000'000'000, 2'500'000'000, 5'000'000'000, 10'000'000'000 };
+
+
+Metrics& metrics() {
+  static Metrics instance;
+  return instance;
+}
+
+
+void Metrics::nameRoute(std::size_t route, std::string_view method, std::string_view pattern) {
+  if (route >= maxRoutes) { return; }
+  std::lock_guard<std::mutex> guard(slotsMutex);
+  routeLabels[route] = "method=\"" + std::string(method) + "\",route=\"/" + std::string(pattern) + "\"";
+}
+
+
+void Metrics::countResponse(std::size_t route, int status) {
+  add(threadSlot().responses[std::min(route, maxRoutes - 1)][statusIndex(status)], 1);
+}
+
+
+void Metrics::recordLatency(std::size_t route, std::chrono::nanoseconds took) {
+  Slot& slot = threadSlot();
+  route = std::min(route, maxRoutes - 1);
+  std::uint64_t nanoseconds = std::max<std::int64_t>(took.count(), 0);
+  add(slot.latency[route][bucketOf(nanoseconds)], 1);
+  add(slot.latencySum[route], nanoseconds);
+}
+
+
+void Metrics::connectionOpened() { add(threadSlot().connectionsOpened, 1); }
+void Metrics::connectionClosed() { add(threadSlot().connectionsClosed, 1); }
+void Metrics::connectionRejected() { add(threadSlot().connectionsRejected, 1); }
+void Metrics::bytesReceived(std::size_t bytes) { add(threadSlot().bytesReceived, bytes); }
+void Metrics::bytesSent(std::size_t bytes) { add(threadSlot().bytesSent, bytes); }
+void Metrics::countCacheLookup(bool hit) { add(hit ? threadSlot().cacheHits : threadSlot().cacheMisses, 1); }
+void Metrics::tlsHandshakeFailed() { add(threadSlot().tlsFailed, 1); }
+
+
+void Metrics::countTlsHandshake(bool resumed, bool kernelSend, bool kernelReceive) {
+  Slot& slot = threadSlot();
+  add(resumed ? slot.tlsResumed : slot.tlsFull, 1);
+  if (kernelSend) { add(slot.tlsKernelSend, 1); }
+  if (kernelReceive) { add(slot.tlsKernelReceive, 1); }
+}
+
+
+Metrics::Slot& Metrics::threadSlot() {
+  thread_local Slot* slot = nullptr;
+  if (slot == nullptr) {
+    auto made = std::make_unique<Slot>();
+    slot = made.get();
+    std::lock_guard<std::mutex> guard(slotsMutex);
+    slots.push_back(std::move(made));
+  }
+  return *slot;
+}
+
+
+std::string Metrics::page() {
+  /* Added up into one slot's worth of plain numbers first, so the formatting below reads each total once. */
+  std::array<std::array<std::uint64_t, statusCount>, maxRoutes> responses{};
+  std::array<std::array<std::uint64_t, latencyBuckets>, maxRoutes> latency{};
+  std::array<std::uint64_t, maxRoutes> latencySum{};
+  std::uint64_t opened = 0, closed = 0, rejected = 0, received = 0, sent = 0, hits = 0, misses = 0;
+  std::uint64_t tlsFull = 0, tlsResumed = 0, tlsFailed = 0, tlsKernelSend = 0, tlsKernelReceive = 0;
+  std::array<std::string, maxRoutes> labels;
+  {
+    std::lock_guard<std::mutex> guard(slotsMutex);
+    labels = routeLabels;
+    for (const auto& slot : slots) {
+      for (std::size_t route = 0; route < maxRoutes; route++) {
+        for (std::size_t i = 0; i < statusCount; i++) { responses[route][i] += slot->responses[route][i].load(std::memory_order_relaxed); }
+        for (std::size_t i = 0; i < latencyBuckets; i++) { latency[route][i] += slot->latency[route][i].load(std::memory_order_relaxed); }
+        latencySum[route] += slot->latencySum[route].load(std::memory_order_relaxed);
+      }
+      opened += slot->connectionsOpened.load(std::memory_order_relaxed);
+      closed += slot->connectionsClosed.load(std::memory_order_relaxed);
+      rejected += slot->connectionsRejected.load(std::memory_order_relaxed);
+      received += slot->bytesReceived.load(std::memory_order_relaxed);
+      sent += slot->bytesSent.load(std::memory_order_relaxed);
+      hits += slot->cacheHits.load(std::memory_order_relaxed);
+      misses += slot->cacheMisses.load(std::memory_order_relaxed);
+      tlsFull += slot->tlsFull.load(std::memory_order_relaxed);
+      tlsResumed += slot->tlsResumed.load(std::memory_order_relaxed);
+      tlsFailed += slot->tlsFailed.load(std::memory_order_relaxed);
+      tlsKernelSend += slot->tlsKernelSend.load(std::memory_order_relaxed);
+      tlsKernelReceive += slot->tlsKernelReceive.load(std::memory_order_relaxed);
+    }
+  }
+  for (std::string& label : labels) {
+    if (label.empty()) { label = "method=\"\",route=\"\""; } //requests no route answered - malformed, or nothing matched
+  }
+
+  std::string page;
+  page.reserve(16 * 1024);
+
+  appendHeader(page, "http_requests_total", "counter", "Requests answered, by route and status.");
+  for (std::size_t route = 0; route < maxRoutes; route++) {
+    for (std::size_t i = 0; i < statusCount; i++) {
+      if (responses[route][i] == 0) { continue; }
+      page.append("http_requests_total{").append(labels[route]).append(",status=\"");
+      if (i < statuses.size()) { appendNumber(page, statuses[i]); } else { page.append("other"); }
+      page.append("\"} ");
+      appendNumber(page, responses[route][i]);
+      page += '\n';
+    }
+  }
+
+  appendHeader(page, "http_request_duration_seconds", "histogram", "Time from parsing a request to queueing its response, not counting sending it.");
+  for (std::size_t route = 0; route < maxRoutes; route++) {
+    std::uint64_t count = 0;
+    for (std::uint64_t bucket : latency[route]) { count += bucket; }
+    if (count == 0) { continue; }
+    std::size_t bucket = 0;
+    std::uint64_t below = 0;
+    for (std::size_t bound = 0; bound < latencyBounds.size(); bound++) { //a bucket is counted under the first bound it fits under whole
+      for (; bucket < latencyBuckets && highestIn(bucket) <= latencyBoundsNs[bound]; bucket++) { below += latency[route][bucket]; }
+      page.append("http_request_duration_seconds_bucket{").append(labels[route]).append(",le=\"").append(latencyBounds[bound]).append("\"} ");
+      appendNumber(page, below);
+      page += '\n';
+    }
+    page.append("http_request_duration_seconds_bucket{").append(labels[route]).append(",le=\"+Inf\"} ");
+    appendNumber(page, count);
+    page.append("\nhttp_request_duration_seconds_sum{").append(labels[route]).append("} ");
+    appendDecimal(page, latencySum[route] / 1e9);
+    page.append("\nhttp_request_duration_seconds_count{").append(labels[route]).append("} ");
+    appendNumber(page, count);
+    page += '\n';
+  }
+
+  auto single = [&page](std::string_view name, std::string_view type, std::string_view help, std::uint64_t value) {
+    appendHeader(page, name, type, help);
+    page.append(name).append(" ");
+    appendNumber(page, value);
+    page += '\n';
+  };
+  single("http_connections_open", "gauge", "Client connections open right now.", opened - std::min(closed, opened));
+  single("http_connections_total", "counter", "Client connections accepted.", opened);
+  single("http_connections_rejected_total", "counter", "Client connections turned away with a 503, for lack of room.", rejected);
+  single("http_received_bytes_total", "counter", "Bytes received from clients.", received);
+  single("http_sent_bytes_total", "counter", "Bytes sent to clients, heads and bodies.", sent);
+
+  appendHeader(page, "file_cache_lookups_total", "counter", "File cache lookups, by whether the file was in the cache.");
+  page.append("file_cache_lookups_total{result=\"hit\"} ");
+  appendNumber(page, hits);
+  page.append("\nfile_cache_lookups_total{result=\"miss\"} ");
+  appendNumber(page, misses);
+  page += '\n';
+  appendHeader(page, "file_cache_hit_ratio", "gauge", "Share of file cache lookups that were hits, since the server started.");
+  page.append("file_cache_hit_ratio ");
+  appendDecimal(page, hits + misses == 0 ? 0 : static_cast<double>(hits) / (hits + misses));
+  page += '\n';
+
+  if (tlsFull + tlsResumed + tlsFailed > 0) { //only with --tls-cert, refer tls.hpp
+    appendHeader(page, "tls_handshakes_total", "counter", "TLS handshakes, by whether they resumed a session or failed.");
+    page.append("tls_handshakes_total{result=\"full\"} ");
+    appendNumber(page, tlsFull);
+    page.append("\ntls_handshakes_total{result=\"resumed\"} ");
+    appendNumber(page, tlsResumed);
+    page.append("\ntls_handshakes_total{result=\"failed\"} ");
+    appendNumber(page, tlsFailed);
+    page += '\n';
+    appendHeader(page, "tls_kernel_offload_total", "counter", "TLS connections the kernel encrypts (send) or decrypts (receive) for, kTLS.");
+    page.append("tls_kernel_offload_total{direction=\"send\"} ");
+    appendNumber(page, tlsKernelSend);
+    page.append("\ntls_kernel_offload_total{direction=\"receive\"} ");
+    appendNumber(page, tlsKernelReceive);
+    page += '\n';
+  }
+
+  AllocationCounts heap = processAllocations(); //refer allocation_counter.hpp
+  single("heap_allocations_total", "counter", "Calls to operator new.", heap.allocations);
+  single("heap_frees_total", "counter", "Calls to operator delete.", heap.frees);
+  single("heap_allocated_bytes_total", "counter", "Bytes asked for by operator new.", heap.bytes);
+  return page;
+}
+
+
+std::size_t Metrics::statusIndex(int status) {
+  auto found = std::find(statuses.begin(), statuses.end(), status);
+  return found - statuses.begin(); //statuses.size(), the other statuses, if it isn't one of them
+}
+
+
+std::size_t Metrics::bucketOf(std::uint64_t nanoseconds) {
+  if (nanoseconds < subBuckets) { return nanoseconds; }
+  unsigned shift = std::bit_width(nanoseconds) - 1 - subBucketBits;
+  return std::min((shift + 1) * subBuckets + ((nanoseconds >> shift) - subBuckets), latencyBuckets - 1);
+} //the same buckets as LatencyHistogram::bucketOf(), with 16 instead of 32 per power of two
+
+std::uint64_t Metrics::highestIn(std::size_t bucket) {
+  if (bucket < subBuckets) { return bucket; }
+  unsigned shift = bucket / subBuckets - 1;
+  std::uint64_t top = bucket % subBuckets + subBuckets;
+  return ((top + 1) << shift) - 1;
+}
+
+
+void serveMetrics(int admin_fd) {
+  /* Scrapes come every few seconds at most, so one connection at a time on a blocking socket is plenty - and it keeps
+    the admin port off the workers, whatever --io is. */
+  while (true) {
+    int client_fd = accept4(admin_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno != EINTR) { logError("accept failed on admin listener ", admin_fd, ": ", std::strerror(errno)); }
+      continue;
+    }
+    struct timeval timeout = { 5, 0 }; //a scraper that stops halfway doesn't get to hold up the next one for longer
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    answerScrape(client_fd);
+    close(client_fd);
+  }
+}
+
+
+static void answerScrape(int client_fd) {
+  std::string pending;
+  HttpParser parser;
+  HttpRequest request;
+  ParseResult result = ParseResult::Incomplete;
+  while (result == ParseResult::Incomplete) {
+    if (receiveInto(client_fd, pending, 4096) <= 0) { return; }
+    result = parser.parse(pending, request);
+  }
+
+  ResponseQueue responses;
+  if (result != ParseResult::Complete) {
+    responses.emplace_back(markConnectionClose(parseErrorResponse(result)));
+  } else if (request.method != "GET" || (request.target != "/metrics" && !request.target.starts_with("/metrics?"))) {
+    responses.emplace_back(markConnectionClose(emptyResponse(HTTP404))); //the page is all there is
+  } else {
+    std::string page = metrics().page();
+    responses.emplace_back(markConnectionClose(ResponseHead(HTTP200, 128 + page.size())
+      .header("Content-Type: ", "text/plain; version=0.0.4; charset=utf-8").contentLength(page.size()).finish(page)));
+  }
+  sendResponses(client_fd, responses); //one request per connection - scrapers open a new one each time anyway
+}
+
+
+static void appendNumber(std::string& page, std::uint64_t number) {
+  char digits[24];
+  auto [end, error] = std::to_chars(digits, digits + sizeof(digits), number);
+  page.append(digits, end);
+}
+
+static void appendDecimal(std::string& page, double number) {
+  char digits[32];
+  auto [end, error] = std::to_chars(digits, digits + sizeof(digits), number);
+  page.append(digits, end);
+} //the shortest form that reads back as the same double
+
+static void appendHeader(std::string& page, std::string_view name, std::string_view type, std::string_view help) {
+  page.append("# HELP ").append(name).append(" ").append(help).append("\n# TYPE ").append(name).append(" ").append(type).append("\n");
+}
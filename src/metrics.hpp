@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Counters behind the /metrics page: requests by route and status, how long they took, connections, bytes on the
+ *    wire, file cache lookups and TLS handshakes. Refer serveMetrics() for the page itself.
+ *
+ * Every thread counts into its own slot, a cache line aligned block nobody else writes to - a count is a relaxed load
+ *    and store, with no atomic read-modify-write and no cache line bouncing between cores. Slots are only added up
+ *    when the page is asked for. A slot is made the first time a thread counts anything, and kept for as long as the
+ *    server runs, so what a thread counted stays in the totals after it has gone.
+ *
+ * Latencies go into log-linear buckets like bench/latency_histogram.hpp - every power of two split into 16 - so a
+ *    slot holds a histogram per route in a few KiB, and the page rounds them into Prometheus' fixed buckets.
+*/
+class Metrics {
+  public:
+    static constexpr std::size_t maxRoutes = 8; //refer HttpResponse::route. 0 is for requests no route answered
+
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void nameRoute(std::size_t route, std::string_view method, std::string_view pattern); //the labels route's requests get on the page
+
+    void countResponse(std::size_t route, int status);
+    void recordLatency(std::size_t route, std::chrono::nanoseconds took); //from parsing a request to queueing its response
+    void connectionOpened();
+    void connectionClosed();
+    void connectionRejected(); //turned away with a 503, refer rejectClient()
+    void bytesReceived(std::size_t bytes);
+    void bytesSent(std::size_t bytes);
+    void countCacheLookup(bool hit); //file cache lookups, only while the cache is enabled
+    void countTlsHandshake(bool resumed, bool kernelSend, bool kernelReceive); //refer tls.hpp
+    void tlsHandshakeFailed();
+
+    std::string page(); //all of the above in the Prometheus text format, added up over every thread
+
+  private:
+    static constexpr unsigned subBucketBits = 4;
+    static constexpr std::size_t subBuckets = std::size_t(1) << subBucketBits;
+    static constexpr unsigned maxBits = 40; //nanoseconds, about 18 minutes. Anything longer goes into the last bucket
+    static constexpr std::size_t latencyBuckets = (maxBits - subBucketBits + 1) * subBuckets;
+    static constexpr std::array<int, 13> statuses = { 200, 201, 206, 304, 400, 404, 413, 414, 416, 431, 500, 501, 503 };
+    static constexpr std::size_t statusCount = statuses.size() + 1; //the last one counts every other status
+
+    using Counter = std::atomic<std::uint64_t>;
+
+    struct alignas(64) Slot {
+      std::array<std::array<Counter, statusCount>, maxRoutes> responses{};
+      std::array<std::array<Counter, latencyBuckets>, maxRoutes> latency{};
+      std::array<Counter, maxRoutes> latencySum{}; //nanoseconds
+      Counter connectionsOpened{0};
+      Counter connectionsClosed{0};
+      Counter connectionsRejected{0};
+      Counter bytesReceived{0};
+      Counter bytesSent{0};
+      Counter cacheHits{0};
+      Counter cacheMisses{0};
+      Counter tlsFull{0};
+      Counter tlsResumed{0};
+      Counter tlsFailed{0};
+      Counter tlsKernelSend{0};
+      Counter tlsKernelReceive{0};
+    };
+
+    std::mutex slotsMutex; //guards slots and routeLabels - only taken when a thread counts for the first time, and by page()
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::array<std::string, maxRoutes> routeLabels;
+
+    Slot& threadSlot();
+    static void add(Counter& counter, std::uint64_t amount) {
+      counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); //only this thread writes it
+    }
+    static std::size_t statusIndex(int status);
+    static std::size_t bucketOf(std::uint64_t nanoseconds);
+    static std::uint64_t highestIn(std::size_t bucket);
+};
+
+Metrics& metrics();
+
+void serveMetrics(int admin_fd); //answers GET /metrics on the admin port's listening socket, forever. Run it on a thread of its own
@@ -0,0 +1,181 @@
+#include <array>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <utility>
+
+#include "mime_types.hpp"
+#include "log.hpp"
+
+
+/**
+ * Content types by file extension.
+ * 
+ * The built in table is a constexpr array sorted by extension, so a lookup is a binary search over string_views - about
+ *    seven comparisons, no allocations, and the table lives in read-only memory. Types loaded from a file with
+ *    --mime-types go into a second sorted table that is searched first; it's filled in once at startup and only read
+ *    afterwards, so no locking is needed.
+ * 
+ * https://developer.mozilla.org/en-US/docs/Web/HTTP/Headers/Content-Type
+ * https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types
+ * https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
+*/
+
+struct MimeType {
+  std::string_view extension; //lowercase, without the '.'
+  std::string_view type;
+};
+
+constexpr std::array builtinMimeTypes = std::to_array<MimeType>({
+  { "7z", "application/x-7z-compressed" },
+  { "aac", "audio/aac" },
+  { "apng", "image/apng" },
+  { "avi", "video/x-msvideo" },
+  { "avif", "image/avif" },
+  { "bin", "application/octet-stream" },
+  { "bmp", "image/bmp" },
+  { "bz2", "application/x-bzip2" },
+  { "cjs", "text/javascript" },
+  { "css", "text/css" },
+  { "csv", "text/csv" },
+  { "doc", "application/msword" },
+  { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+  { "eot", "application/vnd.ms-fontobject" },
+  { "epub", "application/epub+zip" },
+  { "flac", "audio/flac" },
+  { "gif", "image/gif" },
+  { "gz", "application/gzip" },
+  { "htm", "text/html" },
+  { "html", "text/html" },
+  { "ico", "image/vnd.microsoft.icon" },
+  { "ics", "text/calendar" },
+  { "jpeg", "image/jpeg" },
+  { "jpg", "image/jpeg" },
+  { "js", "text/javascript" },
+  { "json", "application/json" },
+  { "jsonld", "application/ld+json" },
+  { "m4a", "audio/mp4" },
+  { "map", "application/json" },
+  { "md", "text/markdown" },
+  { "mid", "audio/midi" },
+  { "midi", "audio/midi" },
+  { "mjs", "text/javascript" },
+  { "mp3", "audio/mpeg" },
+  { "mp4", "video/mp4" },
+  { "mpeg", "video/mpeg" },
+  { "oga", "audio/ogg" },
+  { "ogg", "audio/ogg" },
+  { "ogv", "video/ogg" },
+  { "opus", "audio/opus" },
+  { "otf", "font/otf" },
+  { "pdf", "application/pdf" },
+  { "php", "application/x-httpd-php" },
+  { "png", "image/png" },
+  { "ppt", "application/vnd.ms-powerpoint" },
+  { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+  { "rar", "application/vnd.rar" },
+  { "rtf", "application/rtf" },
+  { "sh", "application/x-sh" },
+  { "svg", "image/svg+xml" },
+  { "tar", "application/x-tar" },
+  { "tif", "image/tiff" },
+  { "tiff", "image/tiff" },
+  { "ts", "video/mp2t" },
+  { "ttf", "font/ttf" },
+  { "txt", "text/plain" },
+  { "wasm", "application/wasm" },
+  { "wav", "audio/wav" },
+  { "weba", "audio/webm" },
+  { "webm", "video/webm" },
+  { "webmanifest", "application/manifest+json" },
+  { "webp", "image/webp" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "xhtml", "application/xhtml+xml" },
+  { "xls", "application/vnd.ms-excel" },
+  { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+  { "xml", "application/xml" },
+  { "yaml", "application/yaml" },
+  { "yml", "application/yaml" },
+  { "zip", "application/zip" },
+});
+
+constexpr bool isLowercase(std::string_view text) {
+  return std::none_of(text.begin(), text.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+}
+static_assert(std::is_sorted(builtinMimeTypes.begin(), builtinMimeTypes.end(),
+  [](const MimeType& a, const MimeType& b) { return a.extension < b.extension; }), "keep builtinMimeTypes sorted by extension");
+static_assert(std::all_of(builtinMimeTypes.begin(), builtinMimeTypes.end(), [](const MimeType& mime) { return isLowercase(mime.extension); }));
+
+constexpr std::size_t maxExtensionLength = 32; //longer ones can't be in either table
+
+static std::vector<std::pair<std::string, std::string>>& loadedMimeTypes(); //sorted by extension
+
+
+std::string_view getFileExtension(std::string_view path) {
+  std::string_view file = path.substr(path.find_last_of('/') + 1); //npos + 1 is 0, the whole path
+  /* file has to be extracted first, instead of just searching for a "." to get the file extension
+  as it is possible for a file to not have an extension */
+  std::size_t dot = file.find_last_of('.');
+  if (dot == std::string_view::npos) { return ""; }
+  return file.substr(dot + 1);
+}
+
+
+std::string_view defaultContentType(std::string_view fileExtension) {
+  if (fileExtension.empty() || fileExtension.size() > maxExtensionLength) { return "application/octet-stream"; }
+  char lowered[maxExtensionLength];
+  std::transform(fileExtension.begin(), fileExtension.end(), lowered, [](char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; });
+  std::string_view extension(lowered, fileExtension.size());
+
+  const auto& loaded = loadedMimeTypes();
+  auto override = std::lower_bound(loaded.begin(), loaded.end(), extension, [](const auto& entry, std::string_view key) { return entry.first < key; });
+  if (override != loaded.end() && override->first == extension) { return override->second; }
+
+  auto builtin = std::lower_bound(builtinMimeTypes.begin(), builtinMimeTypes.end(), extension,
+    [](const MimeType& entry, std::string_view key) { return entry.extension < key; });
+  if (builtin != builtinMimeTypes.end() && builtin->extension == extension) { return builtin->type; }
+  return "application/octet-stream";
+}
+
+
+bool loadMimeTypes(const std::string& path) {
+  /* The same format as nginx's and Apache's mime.types, minus nginx's braces and semicolons - a type followed by its
+    extensions on each line, '#' starts a comment:
+      text/html    html htm
+      image/avif   avif */
+  std::ifstream file(path);
+  if (!file.good()) { return false; }
+
+  auto& loaded = loadedMimeTypes();
+  std::string line;
+  while (std::getline(file, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string type, extension;
+    if (!(words >> type)) { continue; } //blank line
+    while (words >> extension) {
+      std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; });
+      if (extension.starts_with('.')) { extension.erase(0, 1); }
+      if (extension.empty() || extension.size() > maxExtensionLength) {
+        logWarning("mime types: ignored extension ", extension, " for ", type);
+        continue;
+      }
+      loaded.emplace_back(extension, type);
+    }
+  }
+
+  //for an extension listed more than once, the last line wins
+  std::stable_sort(loaded.begin(), loaded.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+  auto last = std::unique(loaded.rbegin(), loaded.rend(), [](const auto& a, const auto& b) { return a.first == b.first; });
+  loaded.erase(loaded.begin(), last.base());
+  logInfo("mime types: ", loaded.size(), " extension(s) loaded from ", path);
+  return true;
+}
+
+
+static std::vector<std::pair<std::string, std::string>>& loadedMimeTypes() {
+  static std::vector<std::pair<std::string, std::string>> types;
+  return types;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+
+std::string_view getFileExtension(std::string_view path); //"" if the file name has no '.'
+std::string_view defaultContentType(std::string_view fileExtension); //any case, application/octet-stream if unknown
+bool loadMimeTypes(const std::string& path); //adds/overrides types from a mime.types file. Call before serving requests
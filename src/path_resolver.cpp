@@ -0,0 +1,205 @@
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "path_resolver.hpp"
+
+
+static int openBeneath(int directory_fd, const char* relative, int flags);
+
+
+FileRoot& filesRoot() {
+  static FileRoot root;
+  return root;
+}
+
+
+FileRoot& workingRoot() {
+  static FileRoot root;
+  return root;
+}
+
+
+bool FileRoot::open(const std::string& directory) {
+  int opened_fd = ::open(directory.empty() ? "." : directory.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (opened_fd < 0) { return false; }
+  if (directory_fd >= 0) { close(directory_fd); }
+  directory_fd = opened_fd;
+  prefix = directory;
+  if (!prefix.empty() && prefix.back() != '/') { prefix += '/'; }
+  return true;
+} //the fd is only used to open files beneath it (O_PATH), so a directory we may search but not list works too
+
+
+bool FileRoot::resolve(std::string_view requested, FilePath& file) const {
+  if (!canonicalizePath(requested, file.relative)) { return false; }
+  file.directory_fd = directory_fd;
+  file.full.assign(prefix);
+  file.full += file.relative;
+  return true;
+}
+
+
+bool canonicalizePath(std::string_view path, std::pmr::string& canonical) {
+  canonical.clear();
+  if (path.find('\0') != std::string_view::npos) { return false; } //open() would stop reading the path there
+  while (!path.empty()) {
+    std::size_t slash = std::min(path.find('/'), path.size());
+    std::string_view segment = path.substr(0, slash);
+    path.remove_prefix(std::min(slash + 1, path.size()));
+
+    if (segment.empty() || segment == ".") { continue; } //"a//b", "/a", "a/./b"
+    if (segment == "..") {
+      if (canonical.empty()) { return false; } //above the directory we started in
+      std::size_t parent = canonical.rfind('/');
+      canonical.resize(parent == std::pmr::string::npos ? 0 : parent);
+      continue;
+    }
+    if (!canonical.empty()) { canonical += '/'; }
+    canonical += segment;
+  }
+  return !canonical.empty();
+} //"web/../img/./a.png" is "img/a.png". Symlinks aren't followed here - openBeneath() leaves those to the kernel
+
+
+
+
+StatCache& statCache() {
+  static StatCache cache;
+  return cache;
+}
+
+
+void StatCache::configure(std::chrono::milliseconds ttl) {
+  this->ttl.store(ttl, std::memory_order_relaxed);
+  for (Shard& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.entries.clear(); //what was stored under the old ttl, or forgotten while the cache was off
+  }
+}
+
+
+StatCache::Result StatCache::lookup(std::string_view path, struct stat& info) {
+  if (ttl.load(std::memory_order_relaxed).count() <= 0) { return Result::Unknown; }
+  Shard& shard = shardFor(path);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto found = shard.entries.find(path);
+  if (found == shard.entries.end()) { return Result::Unknown; }
+  if (found->second.expires <= std::chrono::steady_clock::now()) {
+    shard.entries.erase(found);
+    return Result::Unknown;
+  }
+  if (!found->second.exists) { return Result::Missing; }
+  info = found->second.info;
+  return Result::Exists;
+}
+
+
+void StatCache::insert(std::string_view path, const struct stat& info) {
+  store(path, true, info);
+}
+
+
+void StatCache::insertMissing(std::string_view path) {
+  store(path, false, {});
+}
+
+
+void StatCache::forget(std::string_view path) {
+  if (ttl.load(std::memory_order_relaxed).count() <= 0) { return; }
+  Shard& shard = shardFor(path);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto found = shard.entries.find(path);
+  if (found != shard.entries.end()) { shard.entries.erase(found); }
+}
+
+
+void StatCache::store(std::string_view path, bool exists, const struct stat& info) {
+  auto ttl = this->ttl.load(std::memory_order_relaxed);
+  if (ttl.count() <= 0) { return; }
+  auto now = std::chrono::steady_clock::now();
+  Shard& shard = shardFor(path);
+  std::lock_guard<std::mutex> guard(shard.lock);
+
+  auto found = shard.entries.find(path);
+  if (found != shard.entries.end()) {
+    found->second = { exists, info, now + ttl };
+    return;
+  }
+  if (shard.entries.size() >= maxEntriesPerShard) {
+    std::erase_if(shard.entries, [now](const auto& entry) { return entry.second.expires <= now; });
+    if (shard.entries.size() >= maxEntriesPerShard) { shard.entries.clear(); } //every entry is younger than ttl - start over
+  }
+  shard.entries.emplace(std::string(path), Entry{ exists, info, now + ttl });
+}
+
+
+
+
+int openFile(const FilePath& file, struct stat& info) {
+  if (statCache().lookup(file.full, info) == StatCache::Result::Missing) {
+    errno = ENOENT;
+    return -1;
+  }
+  int file_fd = openBeneath(file.directory_fd, file.relative.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR) { statCache().insertMissing(file.full); }
+    return -1;
+  }
+  if (fstat(file_fd, &info) != 0) {
+    int error = errno;
+    close(file_fd);
+    errno = error;
+    return -1;
+  }
+  statCache().insert(file.full, info);
+  return file_fd;
+}
+
+
+bool statFile(const FilePath& file, struct stat& info) {
+  switch (statCache().lookup(file.full, info)) {
+    case StatCache::Result::Exists: return true;
+    case StatCache::Result::Missing:
+      errno = ENOENT;
+      return false;
+    default: break;
+  }
+  int path_fd = openBeneath(file.directory_fd, file.relative.c_str(), O_PATH | O_CLOEXEC); //stat() can't be told to stay beneath the directory, an O_PATH open can
+  if (path_fd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR) { statCache().insertMissing(file.full); }
+    return false;
+  }
+  bool found = fstat(path_fd, &info) == 0;
+  close(path_fd);
+  if (found) { statCache().insert(file.full, info); }
+  return found;
+}
+
+
+int openDirectoryOf(const FilePath& file) {
+  std::size_t slash = file.relative.rfind('/');
+  if (slash == std::pmr::string::npos) { return openBeneath(file.directory_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC); }
+  std::string parent(file.relative, 0, slash); //"img/a.png" -> "img"
+  return openBeneath(file.directory_fd, parent.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+} //what's created or renamed in it stays beneath, however the directory's path changes afterwards
+
+
+static int openBeneath(int directory_fd, const char* relative, int flags) {
+  static std::atomic<bool> openat2Missing = false;
+  if (!openat2Missing.load(std::memory_order_relaxed)) {
+    struct open_how how = {};
+    how.flags = flags;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS; //EXDEV for anything - a symlink too - leading out of the directory
+    int file_fd;
+    do {
+      file_fd = syscall(SYS_openat2, directory_fd, relative, &how, sizeof(how));
+    } while (file_fd < 0 && errno == EINTR);
+    if (file_fd >= 0 || errno != ENOSYS) { return file_fd; }
+    openat2Missing.store(true, std::memory_order_relaxed); //before Linux 5.6, or filtered out by a seccomp profile
+  }
+  return openat(directory_fd, relative, flags); //canonicalizePath() already keeps ".." out, but not symlinks
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory_resource>
+#include <unordered_map>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+/**
+ * Turns the path a client asked for into a file we may serve, and remembers for a moment what the filesystem said
+ *    about it.
+ *
+ * The path is canonicalized once - empty and "." segments dropped, ".." taking back the segment before it - and
+ *    refused if it would climb out of the directory it's relative to, so "files/../../etc/passwd" never gets near
+ *    open(). It's then opened with openat2(RESOLVE_BENEATH) relative to that directory, which was opened once at
+ *    startup (refer FileRoot): the kernel also refuses symlinks leading out of it, and doesn't walk the directory's
+ *    own path again for every request.
+ *
+ * The stat cache keeps what stat() said about a path - or that there's nothing there - for --stat-cache-ttl. A
+ *    client revalidating a file gets its 304 without the file being opened, and a storm of requests for files that
+ *    don't exist doesn't become a storm of failing opens. Uploads forget the path they write to, and so does the file
+ *    cache's inotify watcher; anything else changed behind our back is noticed once its entry expires.
+*/
+
+struct FilePath {
+  explicit FilePath(std::pmr::memory_resource* memory) : relative(memory), full(memory) {}
+  FilePath(const FilePath& other, std::pmr::memory_resource* memory)
+    : directory_fd(other.directory_fd), relative(other.relative, memory), full(other.full, memory) {}
+  int directory_fd = AT_FDCWD;
+  std::pmr::string relative; //canonical, relative to directory_fd. Never empty, never starts with '/' or has a ".." in it
+  std::pmr::string full; //the directory's path followed by relative - what the file cache, inotify and the logs know it by
+};
+
+/* A directory files are served from, opened once. */
+class FileRoot {
+  public:
+    FileRoot() = default;
+    FileRoot(const FileRoot&) = delete;
+    FileRoot& operator=(const FileRoot&) = delete;
+
+    bool open(const std::string& directory); //"" is the directory the server runs in. false (with errno) if it can't be opened
+    bool resolve(std::string_view requested, FilePath& file) const; //false if requested leads out of the directory, or is the directory itself
+
+  private:
+    int directory_fd = AT_FDCWD;
+    std::string prefix; //the directory as given, ending in '/' - "" for the one the server runs in
+};
+
+FileRoot& filesRoot(); //--directory, for files/
+FileRoot& workingRoot(); //the directory the server runs in, for every other file
+
+bool canonicalizePath(std::string_view path, std::pmr::string& canonical); //false if path climbs above where it starts
+
+class StatCache {
+  public:
+    enum class Result {
+      Unknown, //nothing cached, or it expired - ask the filesystem
+      Exists, //info is what stat() said
+      Missing //open() failed with ENOENT or ENOTDIR
+    };
+
+    void configure(std::chrono::milliseconds ttl); //0 turns the cache off. Forgets everything, so it may change while serving
+    Result lookup(std::string_view path, struct stat& info);
+    void insert(std::string_view path, const struct stat& info);
+    void insertMissing(std::string_view path);
+    void forget(std::string_view path);
+
+  private:
+    static constexpr std::size_t shardCount = 16;
+    static constexpr std::size_t maxEntriesPerShard = 4096; //enough for a site, and a 404 storm can't make it grow without end
+
+    struct Entry {
+      bool exists;
+      struct stat info;
+      std::chrono::steady_clock::time_point expires;
+    };
+
+    struct PathHash {
+      using is_transparent = void; //looked up with a string_view, without building a string
+      std::size_t operator()(std::string_view path) const { return std::hash<std::string_view>{}(path); }
+    };
+
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<std::string, Entry, PathHash, std::equal_to<>> entries;
+    };
+
+    std::atomic<std::chrono::milliseconds> ttl{std::chrono::milliseconds(0)};
+    std::array<Shard, shardCount> shards;
+
+    Shard& shardFor(std::string_view path) { return shards[PathHash{}(path) % shardCount]; }
+    void store(std::string_view path, bool exists, const struct stat& info);
+};
+
+StatCache& statCache(); //shared by every worker
+
+int openFile(const FilePath& file, struct stat& info); /*open() and fstat(), beneath file's directory. -1 with errno if it
+  can't be opened - ENOENT straight away if the stat cache knows it doesn't exist. Tells the stat cache what it found*/
+bool statFile(const FilePath& file, struct stat& info); //from the stat cache if it knows, otherwise from the filesystem. false with errno
+int openDirectoryOf(const FilePath& file); /*an O_PATH fd for the directory file is (or would be) in, opened beneath file's
+  directory like openFile(). -1 with errno - EXDEV if a symlink leads out of it*/
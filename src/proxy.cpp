@@ -0,0 +1,743 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <charconv>
+#include <limits>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "proxy.hpp"
+#include "server.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "tls.hpp"
+#include "arena.hpp"
+
+
+static bool hopByHop(std::string_view name, std::string_view connection); //connection is the message's Connection header
+static bool listsToken(std::string_view list, std::string_view token); //eg. "close" in "keep-alive, close"
+static bool waitFor(int fd, short events, std::chrono::seconds timeout);
+static bool sendAll(int fd, std::string_view bytes, std::chrono::seconds timeout, bool more = false);
+static bool sendAll(int fd, struct iovec* parts, std::size_t count, std::chrono::seconds timeout, bool more = false);
+static bool spliceBody(int upstream_fd, int client_fd, std::size_t& remaining, std::chrono::seconds timeout,
+                       std::chrono::seconds clientTimeout);
+static void appendChunk(std::string& out, std::string_view data);
+static std::string peerAddress(int client_fd);
+
+static constexpr std::size_t upstreamReadSize = 16 * 1024;
+
+
+/* A worker's idle keep-alive connections to the upstreams - only ever touched by its own thread, refer ProxyExchange. */
+class UpstreamPool {
+  public:
+    UpstreamPool() = default;
+    UpstreamPool(const UpstreamPool&) = delete;
+    UpstreamPool& operator=(const UpstreamPool&) = delete;
+    ~UpstreamPool() {
+      for (auto& [upstream, fds] : idle) {
+        for (int upstream_fd : fds) { close(upstream_fd); }
+      }
+    }
+
+    int take(const Upstream& upstream) {
+      std::vector<int>& fds = idle[&upstream];
+      while (!fds.empty()) {
+        int upstream_fd = fds.back(); //the most recently used, the least likely to have timed out on the upstream's side
+        fds.pop_back();
+        char byte;
+        if (recv(upstream_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          return upstream_fd;
+        }
+        close(upstream_fd); //closed by the upstream (0), or sending what nobody asked for
+      }
+      return -1;
+    } //an idle connection that's still open, -1 if there's none
+
+    void give(const Upstream& upstream, int upstream_fd, std::size_t limit) {
+      std::vector<int>& fds = idle[&upstream];
+      if (fds.size() < limit) { fds.push_back(upstream_fd); }
+      else { close(upstream_fd); }
+    }
+
+  private:
+    std::unordered_map<const Upstream*, std::vector<int>> idle;
+};
+
+static UpstreamPool& upstreamPool() {
+  thread_local UpstreamPool pool;
+  return pool;
+}
+
+
+/* The threads relayLater() runs relays on, refer proxy.hpp. */
+class Proxy::RelayPool {
+  public:
+    explicit RelayPool(std::size_t threads) {
+      for (std::size_t i = 0; i < threads; i++) { std::thread(&RelayPool::work, this).detach(); }
+    }
+
+    void submit(Relay relay) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        relays.push_back(std::move(relay));
+      }
+      wake.notify_one();
+    }
+
+  private:
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Relay> relays;
+
+    void work() {
+      while (true) {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return !relays.empty(); });
+        Relay relay = std::move(relays.front());
+        relays.pop_front();
+        guard.unlock();
+        relay.done(relay.exchange->relay(relay.client_fd));
+      }
+    } //one relay at a time, each waiting on its sockets with poll()
+};
+
+
+Proxy& proxy() {
+  static Proxy instance;
+  return instance;
+}
+
+
+bool Proxy::configure(const std::vector<std::string>& settings, ProxyBalance balance, int timeout, int clientTimeout,
+                      std::size_t poolSize, std::size_t relayThreads, std::string& error) {
+  for (const std::string& setting : settings) {
+    if (!checkProxyRoute(setting, error)) { return false; }
+    std::size_t equals = setting.find('=');
+    ProxyRoute& route = routes.emplace_back();
+    route.prefix = setting.substr(0, equals);
+
+    for (std::size_t start = equals + 1; start <= setting.size();) {
+      std::size_t end = std::min(setting.find(',', start), setting.size());
+      std::string name = setting.substr(start, end - start);
+      start = end + 1;
+      auto known = std::find_if(upstreams.begin(), upstreams.end(), [&name](const Upstream& upstream) { return upstream.name == name; });
+      if (known != upstreams.end()) {
+        route.upstreams.push_back(&*known);
+        continue;
+      }
+
+      std::size_t colon = name.rfind(':');
+      struct addrinfo hints = {};
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      struct addrinfo* found = nullptr;
+      int result = getaddrinfo(name.substr(0, colon).c_str(), name.substr(colon + 1).c_str(), &hints, &found);
+      if (result != 0) {
+        error = "can't find upstream " + name + ": " + gai_strerror(result);
+        return false;
+      }
+      Upstream& upstream = upstreams.emplace_back();
+      upstream.name = name;
+      std::memcpy(&upstream.address, found->ai_addr, sizeof(upstream.address)); //the first address - names are looked up once, here
+      freeaddrinfo(found);
+      route.upstreams.push_back(&upstream);
+    }
+  }
+
+  this->balance = balance;
+  this->timeout = std::chrono::seconds(timeout);
+  this->clientTimeout = std::chrono::seconds(clientTimeout);
+  this->poolSize = poolSize;
+  if (!routes.empty()) { pool = new RelayPool(relayThreads); }
+  return true;
+}
+
+
+const ProxyRoute* Proxy::route(std::string_view target) const {
+  const ProxyRoute* longest = nullptr;
+  for (const ProxyRoute& route : routes) {
+    if (target.starts_with(route.prefix) && (longest == nullptr || route.prefix.size() > longest->prefix.size())) { longest = &route; }
+  }
+  return longest;
+}
+
+
+HttpResponse Proxy::forward(const ProxyRoute& route, const HttpRequest& request, std::string_view body) {
+  HttpResponse response;
+  response.proxied = std::make_shared<ProxyExchange>(route, request, body);
+  return response;
+}
+
+
+void Proxy::relayLater(ProxyExchange& exchange, int client_fd, std::function<void(bool)> done) {
+  pool->submit(Relay{ &exchange, client_fd, std::move(done) });
+}
+
+
+Upstream& Proxy::pick(const ProxyRoute& route) {
+  std::size_t turn = route.next.fetch_add(1, std::memory_order_relaxed);
+  Upstream* picked = route.upstreams[turn % route.upstreams.size()];
+  if (balance == ProxyBalance::LeastConnections) { //starting from the round robin's turn, so ties are spread out
+    for (std::size_t i = 1; i < route.upstreams.size(); i++) {
+      Upstream* other = route.upstreams[(turn + i) % route.upstreams.size()];
+      if (other->active.load(std::memory_order_relaxed) < picked->active.load(std::memory_order_relaxed)) { picked = other; }
+    }
+  }
+  picked->active.fetch_add(1, std::memory_order_relaxed);
+  return *picked;
+} //counted as active until the exchange is destroyed
+
+
+bool checkProxyRoute(const std::string& route, std::string& error) {
+  std::size_t equals = route.find('=');
+  bool valid = equals != std::string::npos && equals > 0 && route[0] == '/' && equals + 1 < route.size();
+  for (std::size_t start = equals + 1; valid && start <= route.size();) {
+    std::size_t end = std::min(route.find(',', start), route.size());
+    std::string_view upstream = std::string_view(route).substr(start, end - start);
+    start = end + 1;
+    std::size_t colon = upstream.rfind(':');
+    int port = 0;
+    auto [stopped, result] = std::from_chars(upstream.data() + colon + 1, upstream.data() + upstream.size(), port);
+    valid = colon != std::string_view::npos && colon > 0 && result == std::errc() && stopped == upstream.data() + upstream.size()
+         && port >= 1 && port <= 65535;
+  }
+  if (!valid) { error = "--proxy " + route + " should be /prefix=host:port, with more upstreams after commas if there are"; }
+  return valid;
+}
+
+
+
+
+ProxyExchange::ProxyExchange(const ProxyRoute& route, const HttpRequest& request, std::string_view body)
+  : route(route), upstream(&proxy().pick(route)), pool(upstreamPool()), body(body) {
+  /** The request goes to the upstream as HTTP/1.1, whatever the client spoke, with the client's end-to-end headers.
+   *    The hop-by-hop ones (refer hopByHop()) were for us. The body is whole by now, so it always has a
+   *    Content-Length, even if it came chunked - and Expect: 100-continue was answered by answerRequests() already.
+  */
+  std::string_view method = request.method;
+  idempotent = method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+  headRequest = method == "HEAD";
+  clientHttp11 = request.version != "HTTP/1.0";
+  upstream_fd = pool.take(*upstream);
+  reused = upstream_fd >= 0;
+
+  std::string_view connection = request.header("Connection");
+  head.reserve(512);
+  head.append(method).append(" ").append(request.target).append(" HTTP/1.1\r\n");
+  bool hostSent = false;
+  for (std::size_t i = 0; i < request.headerCount; i++) {
+    auto [name, value] = request.headers[i];
+    if (hopByHop(name, connection) || equalsIgnoreCase(name, "Content-Length") || equalsIgnoreCase(name, "Expect")
+        || equalsIgnoreCase(name, "X-Forwarded-Proto")) {
+      continue;
+    }
+    if (equalsIgnoreCase(name, "X-Forwarded-For")) {
+      forwardedFor.append(forwardedFor.empty() ? "" : ", ").append(value);
+      continue;
+    }
+    hostSent = hostSent || equalsIgnoreCase(name, "Host");
+    head.append(name).append(": ").append(value).append("\r\n");
+  }
+  if (!hostSent) { head.append("Host: ").append(upstream->name).append("\r\n"); } //HTTP/1.1 needs one, HTTP/1.0 clients may leave it out
+  head.append("X-Forwarded-Proto: ").append(tls().enabled() ? "https" : "http").append("\r\n");
+  if (!body.empty() || request.chunked || request.hasHeader("Content-Length")) {
+    head.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+  }
+}
+
+
+ProxyExchange::~ProxyExchange() {
+  upstream->active.fetch_sub(1, std::memory_order_relaxed);
+  if (upstream_fd < 0) { return; }
+  if (reusable) { pool.give(*upstream, upstream_fd, proxy().poolSize); }
+  else { close(upstream_fd); }
+}
+
+
+bool ProxyExchange::relay(int client_fd) {
+  /** The upstream's body is passed on the way it ends. One with a Content-Length keeps it, and is spliced across. A
+   *    chunked one, or one that ends when the upstream closes the connection, goes to the client chunked - or, for an
+   *    HTTP/1.0 client, as it is, and then the client's connection has to end it too.
+  */
+  if (streamId != 0) { //HTTP/2's, which its session sends
+    fetchedResponse = fetch(client_fd, maxFetched);
+    return true;
+  }
+  Outcome outcome = exchange(client_fd);
+  if (outcome != Outcome::Answered) {
+    HttpResponse failed = failure(outcome);
+    metrics().countResponse(proxyRoute, statusCode(failed.head));
+    bool sent = sendAll(client_fd, failed.head, proxy().clientTimeout);
+    if (sent) { metrics().bytesSent(failed.head.size()); }
+    return sent && !closeConnection;
+  }
+  metrics().countResponse(proxyRoute, status);
+
+  bool unframed = framing == Framing::Chunked || framing == Framing::Close; //no length to tell the client
+  bool chunked = unframed && clientHttp11;
+  bool closing = closeConnection || (unframed && !chunked);
+  ResponseHead built = clientHead();
+  if (framing == Framing::Length || (framing == Framing::None && response.hasHeader("Content-Length"))) {
+    built.contentLength(response.contentLength); //a HEAD's is that of what a GET would get
+  }
+  if (chunked) { built.header("Transfer-Encoding: ", "chunked"); }
+  std::pmr::string finished = built.finish();
+  if (closing) { finished = markConnectionClose(std::move(finished)); }
+  std::string out(finished);
+
+  bool relayed = false;
+  switch (framing) {
+    case Framing::None:
+      reusable = reusable && buffer.size() == response.bodyOffset;
+      relayed = sendAll(client_fd, out, proxy().clientTimeout);
+      if (relayed) { metrics().bytesSent(out.size()); }
+      break;
+    case Framing::Length: relayed = relayLength(client_fd, out); break;
+    case Framing::Chunked: relayed = relayChunks(client_fd, out, chunked); break;
+    case Framing::Close: relayed = relayUntilClose(client_fd, out, chunked); break;
+  }
+  if (!relayed) {
+    reusable = false;
+    logDebug("relaying the response of upstream ", upstream->name, " to client ", client_fd, " was cut short");
+  }
+  return relayed && !closing;
+}
+
+
+void ProxyExchange::fetchFor(std::uint32_t stream, std::size_t maxBodySize) {
+  streamId = stream;
+  maxFetched = maxBodySize;
+}
+
+
+HttpResponse ProxyExchange::fetch(int client_fd, std::size_t maxBodySize) {
+  Outcome outcome = exchange(client_fd);
+  if (outcome != Outcome::Answered) {
+    return failure(outcome);
+  }
+  ResponseHead built = clientHead(); //before buffer changes, which response has views into
+  bool lengthSent = response.hasHeader("Content-Length");
+  std::size_t length = response.contentLength;
+  auto whole = std::make_shared<std::string>();
+
+  bool complete = true;
+  if (framing == Framing::Length || framing == Framing::Close) {
+    buffer.erase(0, response.bodyOffset);
+    if (framing == Framing::Length && remaining > maxBodySize) { complete = false; }
+    while (complete) {
+      std::size_t taken = framing == Framing::Length ? std::min(buffer.size(), remaining) : buffer.size();
+      if (whole->size() + taken > maxBodySize) {
+        complete = false;
+        break;
+      }
+      whole->append(buffer, 0, taken);
+      if (framing == Framing::Length) {
+        reusable = reusable && buffer.size() <= remaining;
+        remaining -= taken;
+      }
+      buffer.clear();
+      if (framing == Framing::Length && remaining == 0) { break; }
+      Outcome received = receive();
+      if (framing == Framing::Close && received == Outcome::Unreachable) { break; } //the end of the body
+      complete = received == Outcome::Answered;
+    }
+    if (framing == Framing::Close) { reusable = false; }
+  }
+  else if (framing == Framing::Chunked) {
+    while (true) {
+      ParseResult result = parser.streamBody(buffer, response, maxBodySize, [&whole](std::string_view data) { whole->append(data); });
+      if (result == ParseResult::Complete) {
+        reusable = reusable && buffer.size() == response.bodyOffset;
+        break;
+      }
+      if (result != ParseResult::Incomplete || receive() != Outcome::Answered) {
+        complete = false;
+        break;
+      }
+    }
+  }
+  else { reusable = reusable && buffer.size() == response.bodyOffset; }
+
+  if (!complete) {
+    reusable = false;
+    logWarning("the response of upstream ", upstream->name, " was cut short, or is over --max-body-size");
+    return failure(Outcome::Invalid);
+  }
+  if (framing != Framing::None) { built.contentLength(whole->size()); }
+  else if (lengthSent) { built.contentLength(length); }
+  std::string_view bytes = *whole;
+  HttpResponse fetched(built.finish(), bytes, std::move(whole));
+  fetched.route = proxyRoute;
+  return fetched;
+}
+
+
+ProxyExchange::Outcome ProxyExchange::exchange(int client_fd) {
+  while (true) {
+    if (upstream_fd < 0 && !connectUpstream()) { return Outcome::Unreachable; }
+    Outcome outcome = sendRequest(client_fd) ? receiveHead() : Outcome::Unreachable;
+    if (outcome != Outcome::Unreachable || !reused || !idempotent || !buffer.empty()) { return outcome; }
+    logDebug("upstream ", upstream->name, " closed pooled connection ", upstream_fd, ", sending the request again on a new one");
+    close(upstream_fd);
+    upstream_fd = -1;
+    reused = false;
+  }
+} //once the head is in, reusable says whether the upstream means to keep the connection - the body still has to be read first
+
+
+bool ProxyExchange::connectUpstream() {
+  for (std::size_t tried = 0; tried < route.upstreams.size(); tried++) {
+    if (tried > 0) { //on to the route's next upstream, which now has our request in flight instead
+      std::size_t at = std::find(route.upstreams.begin(), route.upstreams.end(), upstream) - route.upstreams.begin();
+      upstream->active.fetch_sub(1, std::memory_order_relaxed);
+      upstream = route.upstreams[(at + 1) % route.upstreams.size()];
+      upstream->active.fetch_add(1, std::memory_order_relaxed);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      logError("can't open a socket to upstream ", upstream->name, ": ", std::strerror(errno));
+      return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); //the request goes out in one send, and we wait for the answer
+    int result = connect(fd, reinterpret_cast<const struct sockaddr*>(&upstream->address), sizeof(upstream->address));
+    if (result != 0 && errno == EINPROGRESS) {
+      int error = ETIMEDOUT;
+      socklen_t length = sizeof(error);
+      if (waitFor(fd, POLLOUT, proxy().timeout)) { getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length); }
+      result = error == 0 ? 0 : -1;
+      errno = error;
+    }
+    if (result == 0) {
+      upstream_fd = fd;
+      return true;
+    }
+    logWarning("can't connect to upstream ", upstream->name, ": ", std::strerror(errno));
+    close(fd);
+  }
+  return false;
+}
+
+
+bool ProxyExchange::sendRequest(int client_fd) {
+  std::string forwarded = "X-Forwarded-For: " + forwardedFor + (forwardedFor.empty() ? "" : ", ") + peerAddress(client_fd) + "\r\n\r\n";
+  struct iovec parts[3] = { { head.data(), head.size() }, { forwarded.data(), forwarded.size() }, { body.data(), body.size() } };
+  return sendAll(upstream_fd, parts, 3, proxy().timeout);
+}
+
+
+ProxyExchange::Outcome ProxyExchange::receiveHead() {
+  while (true) {
+    ParseResult result = parser.parse(buffer, response);
+    if (result == ParseResult::Complete) {
+      std::from_chars(response.target.data(), response.target.data() + response.target.size(), status);
+      if (status >= 100 && status < 200) { //100 Continue, 103 Early Hints - the body's gone already, and hints are just that
+        buffer.erase(0, response.bodyOffset);
+        parser.reset();
+        continue;
+      }
+      break;
+    }
+    if (result != ParseResult::Incomplete) {
+      logWarning("upstream ", upstream->name, " sent a response head that doesn't parse");
+      return Outcome::Invalid;
+    }
+    Outcome received = receive();
+    if (received != Outcome::Answered) { return received; }
+  }
+
+  if (headRequest || status == 204 || status == 304) { framing = Framing::None; }
+  else if (response.chunked) { framing = Framing::Chunked; }
+  else if (response.hasHeader("Content-Length")) {
+    framing = Framing::Length;
+    remaining = response.contentLength;
+  }
+  else { framing = Framing::Close; }
+  reusable = response.version == "HTTP/1.1" && !listsToken(response.header("Connection"), "close") && framing != Framing::Close;
+  return Outcome::Answered;
+}
+
+
+ProxyExchange::Outcome ProxyExchange::receive() {
+  while (true) {
+    std::size_t used = buffer.size();
+    buffer.resize(used + upstreamReadSize);
+    ssize_t bytes_received = recv(upstream_fd, buffer.data() + used, upstreamReadSize, 0);
+    buffer.resize(used + std::max<ssize_t>(bytes_received, 0));
+    if (bytes_received > 0) { return Outcome::Answered; }
+    if (bytes_received == 0) { return Outcome::Unreachable; }
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) { return Outcome::Unreachable; }
+    if (!waitFor(upstream_fd, POLLIN, proxy().timeout)) { return Outcome::TimedOut; }
+  }
+}
+
+
+ResponseHead ProxyExchange::clientHead() {
+  std::string statusLine = "HTTP/1.1 ";
+  statusLine.append(response.target).append(" ").append(response.method).append("\r\n");
+  ResponseHead built(statusLine, response.bodyOffset + 64);
+  std::string_view connection = response.header("Connection");
+  for (std::size_t i = 0; i < response.headerCount; i++) {
+    auto [name, value] = response.headers[i];
+    if (hopByHop(name, connection) || equalsIgnoreCase(name, "Content-Length") || equalsIgnoreCase(name, "Date")) { continue; }
+    built.append(name).append(": ").append(value).append("\r\n");
+  }
+  return built;
+} //the Date is ResponseHead's own
+
+
+bool ProxyExchange::relayLength(int client_fd, std::string& out) {
+  buffer.erase(0, response.bodyOffset);
+  std::size_t first = std::min(buffer.size(), remaining); //what came with the head goes out with it
+  reusable = reusable && buffer.size() <= remaining;
+  out.append(buffer, 0, first);
+  remaining -= first;
+  buffer.clear();
+  if (!sendAll(client_fd, out, proxy().clientTimeout, remaining > 0)) { return false; }
+  metrics().bytesSent(out.size());
+
+  if (!tls().userlandSend(client_fd)) { return spliceBody(upstream_fd, client_fd, remaining, proxy().timeout, proxy().clientTimeout); }
+  while (remaining > 0) { //OpenSSL has to see the bytes to encrypt them
+    if (receive() != Outcome::Answered) { return false; }
+    std::size_t taken = std::min(buffer.size(), remaining);
+    reusable = reusable && buffer.size() <= remaining;
+    if (!sendAll(client_fd, std::string_view(buffer).substr(0, taken), proxy().clientTimeout, taken < remaining)) { return false; }
+    metrics().bytesSent(taken);
+    remaining -= taken;
+    buffer.clear();
+  }
+  return true;
+}
+
+
+bool ProxyExchange::relayChunks(int client_fd, std::string& out, bool chunked) {
+  while (true) {
+    ParseResult result = parser.streamBody(buffer, response, std::numeric_limits<std::size_t>::max(), [&out, chunked](std::string_view data) {
+      if (chunked) { appendChunk(out, data); }
+      else { out += data; }
+    });
+    if (result == ParseResult::Complete) {
+      if (chunked) { out += "0\r\n\r\n"; } //the upstream's trailers are dropped
+      reusable = reusable && buffer.size() == response.bodyOffset;
+    }
+    else if (result != ParseResult::Incomplete) {
+      logWarning("upstream ", upstream->name, " sent a chunked body that doesn't parse");
+      return false;
+    }
+    if (!out.empty()) {
+      if (!sendAll(client_fd, out, proxy().clientTimeout, result != ParseResult::Complete)) { return false; }
+      metrics().bytesSent(out.size());
+      out.clear();
+    }
+    if (result == ParseResult::Complete) { return true; }
+    if (receive() != Outcome::Answered) { return false; }
+  }
+}
+
+
+bool ProxyExchange::relayUntilClose(int client_fd, std::string& out, bool chunked) {
+  buffer.erase(0, response.bodyOffset);
+  while (true) {
+    if (chunked) { appendChunk(out, buffer); }
+    else { out += buffer; }
+    buffer.clear();
+    if (!out.empty()) {
+      if (!sendAll(client_fd, out, proxy().clientTimeout, true)) { return false; }
+      metrics().bytesSent(out.size());
+      out.clear();
+    }
+    Outcome received = receive();
+    if (received == Outcome::Unreachable) { break; } //the upstream closed the connection, which is where the body ends
+    if (received != Outcome::Answered) { return false; }
+  }
+  if (!chunked) { return true; }
+  bool sent = sendAll(client_fd, "0\r\n\r\n", proxy().clientTimeout);
+  if (sent) { metrics().bytesSent(5); }
+  return sent;
+}
+
+
+HttpResponse ProxyExchange::failure(Outcome outcome) {
+  bool timedOut = outcome == Outcome::TimedOut;
+  if (timedOut) { logWarning("upstream ", upstream->name, " took longer than --proxy-timeout to answer"); }
+  else if (outcome == Outcome::Unreachable && upstream_fd >= 0) { //connectUpstream() said why it couldn't connect
+    logWarning("upstream ", upstream->name, " went away without answering");
+  }
+  std::pmr::string head = emptyResponse(timedOut ? HTTP504 : HTTP502);
+  HttpResponse failed(closeConnection ? markConnectionClose(std::move(head)) : std::move(head));
+  failed.route = proxyRoute;
+  return failed;
+} //reusable is still false, so the upstream's connection is closed
+
+
+
+
+static bool hopByHop(std::string_view name, std::string_view connection) {
+  // https://www.rfc-editor.org/rfc/rfc9110#name-connection
+  for (std::string_view header : { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade" }) {
+    if (equalsIgnoreCase(name, header)) { return true; }
+  }
+  return listsToken(connection, name);
+} //headers for the connection they came on, not the next one - and whatever the Connection header names as such
+
+
+static bool listsToken(std::string_view list, std::string_view token) {
+  while (!list.empty()) {
+    std::size_t comma = std::min(list.find(','), list.size());
+    std::string_view item = list.substr(0, comma);
+    list.remove_prefix(std::min(comma + 1, list.size()));
+    while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) { item.remove_prefix(1); }
+    while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) { item.remove_suffix(1); }
+    if (equalsIgnoreCase(item, token)) { return true; }
+  }
+  return false;
+}
+
+
+static bool waitFor(int fd, short events, std::chrono::seconds timeout) {
+  struct pollfd waiting = { fd, events, 0 };
+  int ready;
+  do { ready = poll(&waiting, 1, std::chrono::milliseconds(timeout).count()); } while (ready < 0 && errno == EINTR);
+  if (ready == 0) { errno = ETIMEDOUT; }
+  return ready > 0;
+} //true once fd is ready - or has failed, which the next call on it finds out
+
+
+static bool sendAll(int fd, std::string_view bytes, std::chrono::seconds timeout, bool more) {
+  struct iovec part = { const_cast<char*>(bytes.data()), bytes.size() };
+  return sendAll(fd, &part, 1, timeout, more);
+}
+
+
+static bool sendAll(int fd, struct iovec* parts, std::size_t count, std::chrono::seconds timeout, bool more) {
+  /* sendParts(), so it's encrypted for a TLS client if the kernel doesn't - the upstreams are plain sockets. After
+    EAGAIN, the same bytes go again, as OpenSSL wants. A blocking socket (the threads mode's client) fails with
+    EAGAIN once SO_SNDTIMEO runs out, and gets the rest of timeout on top. */
+  std::size_t first = 0;
+  while (first < count) {
+    if (parts[first].iov_len == 0) {
+      first++;
+      continue;
+    }
+    ssize_t bytes_sent = sendParts(fd, parts + first, count - first, more);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) { continue; }
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) || !waitFor(fd, POLLOUT, timeout)) { return false; }
+      continue;
+    }
+    for (std::size_t left = bytes_sent; left > 0;) {
+      std::size_t taken = std::min(left, parts[first].iov_len);
+      parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + taken;
+      parts[first].iov_len -= taken;
+      left -= taken;
+      if (parts[first].iov_len == 0) { first++; }
+    }
+  }
+  return true;
+}
+
+
+static bool spliceBody(int upstream_fd, int client_fd, std::size_t& remaining, std::chrono::seconds timeout,
+                       std::chrono::seconds clientTimeout) {
+  /** splice() moves pages from one fd to another inside the kernel, but one of them has to be a pipe - so the body
+   *    goes upstream socket -> pipe -> client socket, without ever being copied into our memory. Each relay thread
+   *    keeps a pipe for it; one left holding bytes by a relay that failed is thrown away.
+  */
+  struct RelayPipe {
+    int read_fd = -1;
+    int write_fd = -1;
+    std::size_t capacity = 0;
+    std::size_t held = 0; //bytes in the pipe
+    ~RelayPipe() {
+      if (read_fd >= 0) {
+        close(read_fd);
+        close(write_fd);
+      }
+    }
+  };
+  thread_local RelayPipe through;
+  if (through.read_fd >= 0 && through.held > 0) {
+    close(through.read_fd);
+    close(through.write_fd);
+    through.read_fd = -1;
+  }
+  if (through.read_fd < 0) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) { return false; }
+    through.read_fd = fds[0];
+    through.write_fd = fds[1];
+    fcntl(through.write_fd, F_SETPIPE_SZ, 256 * 1024); //fewer round trips for a big body. The default 64 KiB if it's not allowed
+    through.capacity = std::max(fcntl(through.write_fd, F_GETPIPE_SZ), 4096);
+    through.held = 0;
+  }
+
+  while (remaining > 0 || through.held > 0) {
+    bool moved = false;
+    if (remaining > 0 && through.held < through.capacity) {
+      ssize_t in = splice(upstream_fd, nullptr, through.write_fd, nullptr, std::min(remaining, through.capacity - through.held),
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (in == 0) { return false; } //the upstream closed the connection before the end of the body
+      if (in < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { return false; }
+      if (in > 0) {
+        remaining -= in;
+        through.held += in;
+        moved = true;
+      }
+    }
+    if (through.held > 0) {
+      ssize_t out = splice(through.read_fd, nullptr, client_fd, nullptr, through.held,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (remaining > 0 ? SPLICE_F_MORE : 0));
+      if (out < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { return false; }
+      if (out > 0) {
+        through.held -= out;
+        metrics().bytesSent(out);
+        moved = true;
+      }
+    }
+    if (moved) { continue; }
+
+    struct pollfd waiting[2];
+    nfds_t count = 0;
+    if (remaining > 0 && through.held < through.capacity) { waiting[count++] = { upstream_fd, POLLIN, 0 }; }
+    if (through.held > 0) { waiting[count++] = { client_fd, POLLOUT, 0 }; }
+    auto wait = std::chrono::milliseconds(through.held > 0 ? clientTimeout : timeout);
+    int ready = poll(waiting, count, wait.count());
+    if (ready == 0) { return false; }
+    if (ready < 0 && errno != EINTR) { return false; }
+  }
+  return true;
+}
+
+
+static void appendChunk(std::string& out, std::string_view data) {
+  if (data.empty()) { return; } //an empty chunk would end the body
+  char size[16];
+  auto [end, error] = std::to_chars(size, size + sizeof(size), data.size(), 16);
+  out.append(size, end).append("\r\n").append(data).append("\r\n");
+}
+
+
+static std::string peerAddress(int client_fd) {
+  struct sockaddr_in address = {};
+  socklen_t length = sizeof(address);
+  char text[INET_ADDRSTRLEN] = "unknown";
+  if (getpeername(client_fd, reinterpret_cast<struct sockaddr*>(&address), &length) == 0) {
+    inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+  }
+  return text;
+}
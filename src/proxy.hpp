@@ -0,0 +1,171 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+
+#include "http_parser.hpp"
+#include "response.hpp"
+
+
+enum class ProxyBalance {
+  RoundRobin, //each of a route's upstreams in turn
+  LeastConnections //the one with the fewest requests in flight, from every worker
+};
+
+/**
+ * Reverse proxying: with --proxy /api/=10.0.0.5:8080,10.0.0.6:8080 every request whose path starts with /api/ is
+ *    forwarded to one of those upstreams (--proxy-balance picks which), and what it answers goes back to the client.
+ *    The path is passed on as it is, and the upstream is told who asked with X-Forwarded-For and X-Forwarded-Proto.
+ *
+ * Every worker keeps a pool of keep-alive connections to each upstream (--proxy-pool-size of them, idle), so a request
+ *    doesn't usually pay for a connect(). A pooled connection the upstream closed meanwhile is noticed before it's
+ *    used; one it closes while our request is on its way is retried on a new connection, if the request is idempotent.
+ *
+ * routeRequest() answers a proxied request with an HttpResponse that has no head yet, just how to make the request
+ *    (refer HttpResponse::proxied) - the request's body included, which arrives whole like any other. The exchange
+ *    with the upstream happens once the response reaches the front of the connection's queue: relay() sends the
+ *    request, parses the upstream's response head with HttpParser, rebuilds it with ResponseHead - hop-by-hop headers
+ *    dropped - and streams the body to the client as it comes. A body of known length goes from one socket to the
+ *    other with splice(), through a pipe, without being copied into our process (unless OpenSSL encrypts for the
+ *    client); a chunked one is taken apart by HttpParser and chunked again as it goes.
+ *
+ * The threads mode relays on the connection's own thread, as it does everything. The epoll and coroutine workers
+ *    hand the connection to the relay threads (--proxy-threads, refer relayLater()) for as long as the response takes,
+ *    and carry on with their other connections - an upstream's wait would stall all of them. Like TLS, it doesn't fit
+ *    the io_uring workers, which send without us in between, so main() starts the epoll workers instead.
+ * Over HTTP/2 the response's frames take turns with the other streams', so it can't be relayed as it comes: fetch()
+ *    reads all of it instead - on the relay threads too, outside of the threads mode - and the worker hands it back to
+ *    the stream (refer finishRelay()), which sends it like any other body. The connection waits for it meanwhile, as
+ *    an HTTP/1.1 one does, but the worker's other connections don't.
+ *
+ * An upstream that can't be reached, or answers with something that isn't HTTP, gets the client a 502, and one that
+ *    takes longer than --proxy-timeout between two steps a 504 - unless part of the response has gone out already,
+ *    and then the connection is closed.
+*/
+struct Upstream {
+  std::string name; //host:port, as configured
+  struct sockaddr_in address = {};
+  std::atomic<std::size_t> active{0}; //exchanges in flight
+};
+
+struct ProxyRoute {
+  std::string prefix; //of the paths forwarded, eg. /api/
+  std::vector<Upstream*> upstreams;
+  mutable std::atomic<std::size_t> next{0}; //for round robin
+};
+
+class ProxyExchange;
+class UpstreamPool;
+
+class Proxy {
+  public:
+    Proxy() = default;
+    Proxy(const Proxy&) = delete;
+    Proxy& operator=(const Proxy&) = delete;
+
+    bool configure(const std::vector<std::string>& settings, ProxyBalance balance, int timeout, int clientTimeout,
+                   std::size_t poolSize, std::size_t relayThreads, std::string& error); /*before any request. Resolves the
+      upstreams' names, false with error saying what's wrong*/
+    bool enabled() const { return !routes.empty(); }
+    const ProxyRoute* route(std::string_view target) const; //the route with the longest prefix of target. nullptr if none has one
+
+    HttpResponse forward(const ProxyRoute& route, const HttpRequest& request, std::string_view body); //refer HttpResponse::proxied
+    void relayLater(ProxyExchange& exchange, int client_fd, std::function<void(bool)> done); /*relay() on the relay
+      threads - done is called there, with what it returned*/
+
+  private:
+    struct Relay {
+      ProxyExchange* exchange;
+      int client_fd;
+      std::function<void(bool)> done;
+    };
+    class RelayPool;
+    friend class ProxyExchange;
+
+    std::deque<Upstream> upstreams; //every route's, each address once
+    std::deque<ProxyRoute> routes;
+    ProxyBalance balance = ProxyBalance::RoundRobin;
+    std::chrono::seconds timeout{10}; //--proxy-timeout
+    std::chrono::seconds clientTimeout{30}; //--body-timeout, for a client that stops taking in what it's relayed
+    std::size_t poolSize = 0;
+    RelayPool* pool = nullptr; //never destroyed, like Tls's handshake threads
+
+    Upstream& pick(const ProxyRoute& route);
+};
+
+Proxy& proxy();
+bool checkProxyRoute(const std::string& route, std::string& error); //that a --proxy is /prefix=host:port,...
+
+
+/**
+ * One proxied request, from the worker that answered it: the upstream it goes to, and the request as it's sent there.
+ *
+ * Whatever runs the exchange - relay() or fetch() - it's destroyed on the worker that made it, with the response
+ *    holding it. That gives the upstream connection back to the worker's pool, if it can carry another request.
+*/
+class ProxyExchange {
+  public:
+    ProxyExchange(const ProxyRoute& route, const HttpRequest& request, std::string_view body);
+    ProxyExchange(const ProxyExchange&) = delete;
+    ProxyExchange& operator=(const ProxyExchange&) = delete;
+    ~ProxyExchange();
+
+    bool closeConnection = false; //the client's connection closes after this response, like HttpResponse::DeferredOpen's
+
+    bool relay(int client_fd); /*the exchange, and the response sent to the client as it arrives. Blocks. false if the
+      client's connection can't carry on - it went away, the response was cut short, or it ends with the connection*/
+    HttpResponse fetch(int client_fd, std::size_t maxBodySize); /*the exchange, and the whole response read into one for
+      the client, in the request's arena. Blocks. 502 if the body is over maxBodySize*/
+
+    void fetchFor(std::uint32_t streamId, std::size_t maxBodySize); /*makes relay() fetch() instead, for an HTTP/2 stream,
+      and keep the response for fetched()*/
+    std::uint32_t http2Stream() const { return streamId; } //0 for an HTTP/1.1 request
+    HttpResponse fetched() { return std::move(fetchedResponse); } //once relay() returned
+
+  private:
+    enum class Outcome { Answered, Unreachable, Invalid, TimedOut };
+    enum class Framing { None, Length, Chunked, Close }; //how the upstream's body ends: not at all, after Content-Length, with the last chunk, with the connection
+
+    const ProxyRoute& route;
+    Upstream* upstream;
+    UpstreamPool& pool; //the worker's
+    int upstream_fd = -1;
+    bool reused = false; //upstream_fd came from the pool
+    bool reusable = false; //upstream_fd can go back to it
+    bool idempotent; //safe to send again, if a pooled connection turns out to be closed
+    bool headRequest;
+    bool clientHttp11; //the client understands a chunked response
+    std::string head; //the request line and headers, but for X-Forwarded-For and the blank line
+    std::string forwardedFor; //what the client sent as X-Forwarded-For, which our hop is added to
+    std::string body;
+
+    std::string buffer; //what the upstream sent that hasn't been passed on yet
+    HttpParser parser{64 * 1024, 0, true};
+    HttpRequest response; //the upstream's head - views into buffer, until more is received into it
+    int status = 0;
+    Framing framing = Framing::None;
+    std::size_t remaining = 0; //body bytes still to come, for Framing::Length
+
+    std::uint32_t streamId = 0; //refer fetchFor()
+    std::size_t maxFetched = 0;
+    HttpResponse fetchedResponse;
+
+    Outcome exchange(int client_fd); //sends the request and waits for the response's head
+    bool connectUpstream(); //a new connection, to this exchange's upstream or - if it can't be reached - the route's next
+    bool sendRequest(int client_fd);
+    Outcome receiveHead();
+    Outcome receive(); //more of the response into buffer. Unreachable once the upstream closed the connection
+    ResponseHead clientHead(); //the upstream's status line and end-to-end headers, for the client - the framing is up to the caller
+    bool relayLength(int client_fd, std::string& out); //out holds the head, which goes first
+    bool relayChunks(int client_fd, std::string& out, bool chunked); //chunked again, or as it is for an HTTP/1.0 client
+    bool relayUntilClose(int client_fd, std::string& out, bool chunked);
+    HttpResponse failure(Outcome outcome); //502 or 504
+};
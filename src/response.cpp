@@ -0,0 +1,226 @@
+#include <string>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "response.hpp"
+#include "arena.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "tls.hpp"
+
+
+HttpResponse::HttpResponse(std::pmr::string head) : head(std::move(head)) {}
+
+HttpResponse::HttpResponse(std::pmr::string head, std::string_view body, std::shared_ptr<const void> bodyOwner)
+  : head(std::move(head)), body(body), bodyOwner(std::move(bodyOwner)) {}
+
+HttpResponse::HttpResponse(std::pmr::string head, int file_fd, off_t fileOffset, std::size_t fileLength)
+  : head(std::move(head)), file_fd(file_fd), fileOffset(fileOffset), fileLength(fileLength) {}
+
+HttpResponse::HttpResponse(HttpResponse&& other) noexcept
+  : head(std::move(other.head)), headSent(other.headSent), body(other.body), bodyOwner(std::move(other.bodyOwner)), bodySent(other.bodySent), file_fd(std::exchange(other.file_fd, -1)),
+    fileOwner(std::move(other.fileOwner)), fileOffset(other.fileOffset), fileLength(other.fileLength), deferred(std::move(other.deferred)),
+    proxied(std::move(other.proxied)), route(other.route) {}
+
+HttpResponse& HttpResponse::operator=(HttpResponse&& other) noexcept {
+  if (this != &other) {
+    if (file_fd >= 0 && fileOwner == nullptr) { close(file_fd); }
+    head = std::move(other.head);
+    headSent = other.headSent;
+    body = other.body;
+    bodyOwner = std::move(other.bodyOwner);
+    bodySent = other.bodySent;
+    file_fd = std::exchange(other.file_fd, -1);
+    fileOwner = std::move(other.fileOwner);
+    fileOffset = other.fileOffset;
+    fileLength = other.fileLength;
+    deferred = std::move(other.deferred);
+    proxied = std::move(other.proxied);
+    route = other.route;
+  }
+  return *this;
+}
+
+HttpResponse::~HttpResponse() {
+  if (file_fd >= 0 && fileOwner == nullptr) { close(file_fd); }
+}
+
+
+void ResponseQueue::pop_front() {
+  responses[first++] = HttpResponse(); //lets go of the file and body now rather than when the queue is next cleared
+  if (first == responses.size()) {
+    responses.clear();
+    first = 0;
+  }
+}
+
+
+SendResult sendResponses(int client_fd, ResponseQueue& queue) {
+  /** Heads and cached bodies of consecutive responses (eg. pipelined echo/ requests) are gathered into an iovec array
+   *    and sent with a single writev() call - the cached bodies are never copied into the head. When a response with a file body reaches the front, its head goes out first and then the
+   *    file follows with sendfile().
+   * 
+   * sendmsg() is used in place of writev() so that MSG_NOSIGNAL can be passed - a client that hung up gives us EPIPE
+   *    instead of killing the server with SIGPIPE.
+   * 
+   * Over TLS, the kernel encrypts what sendmsg() and sendfile() send if it took the connection over (kTLS), and
+   *    nothing here changes. Otherwise OpenSSL encrypts it, a record at a time - refer tls.hpp.
+   * 
+  */
+  TraceSpan span("send");
+  while (!queue.empty()) {
+    if (queue.front().proxied) { return SendResult::Proxied; } //everything ahead of it is out
+    std::array<struct iovec, 64> parts;
+    bool everything;
+    std::size_t partCount = gatherResponses(queue, parts, everything);
+
+    if (partCount > 0) {
+      ssize_t bytes_sent = sendParts(client_fd, parts.data(), partCount, !everything);
+      if (bytes_sent < 0) {
+        if (errno == EINTR) { continue; }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? SendResult::WouldBlock : SendResult::Error;
+      }
+      markSent(queue, bytes_sent);
+    }
+
+    HttpResponse& front = queue.front();
+    if (front.headSent == front.head.size() && front.bodySent == front.body.size() && front.fileLength > 0) {
+      //sendfile() moves at most 0x7ffff000 bytes per call, so large files take a few rounds
+      ssize_t bytes_sent;
+      if (tls().userlandSend(client_fd)) { //a record at a time, refer Tls::sendFile()
+        bytes_sent = tls().sendFile(client_fd, front.file_fd, front.fileOffset, front.fileLength);
+        if (bytes_sent > 0) { front.fileOffset += bytes_sent; }
+      }
+      else { bytes_sent = sendfile(client_fd, front.file_fd, &front.fileOffset, std::min<std::size_t>(front.fileLength, 0x7ffff000)); }
+      if (bytes_sent < 0) {
+        if (errno == EINTR) { continue; }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? SendResult::WouldBlock : SendResult::Error;
+      }
+      if (bytes_sent == 0) { return SendResult::Error; } //the file got shorter since we sent its Content-Length
+      front.fileLength -= bytes_sent;
+      metrics().bytesSent(bytes_sent);
+    }
+
+    queue.popFinished();
+  }
+  return SendResult::Done;
+}
+
+
+ssize_t sendParts(int client_fd, const struct iovec* parts, std::size_t count, bool more) {
+  if (tls().userlandSend(client_fd)) { return tls().send(client_fd, parts, count); }
+  struct msghdr message = {};
+  message.msg_iov = const_cast<struct iovec*>(parts);
+  message.msg_iovlen = count;
+  return sendmsg(client_fd, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+}
+
+
+std::size_t gatherResponses(ResponseQueue& queue, std::span<struct iovec> parts, bool& everything) {
+  std::size_t partCount = 0;
+  everything = false;
+  for (HttpResponse& response : queue) {
+    if (partCount + 2 > parts.size() || response.deferred || response.proxied) { return partCount; } //nothing of a deferred response can go yet
+    if (response.headSent < response.head.size()) {
+      parts[partCount++] = { response.head.data() + response.headSent, response.head.size() - response.headSent };
+    }
+    if (response.bodySent < response.body.size()) {
+      parts[partCount++] = { const_cast<char*>(response.body.data()) + response.bodySent, response.body.size() - response.bodySent };
+    }
+    if (response.fileLength > 0) { return partCount; } //the file has to go before anything queued after it
+  }
+  everything = true;
+  return partCount;
+}
+
+
+void markSent(ResponseQueue& queue, std::size_t bytes) {
+  metrics().bytesSent(bytes);
+  for (HttpResponse& response : queue) {
+    std::size_t taken = std::min(bytes, response.head.size() - response.headSent);
+    response.headSent += taken;
+    bytes -= taken;
+    taken = std::min(bytes, response.body.size() - response.bodySent);
+    response.bodySent += taken;
+    bytes -= taken;
+    if (bytes == 0 || response.fileLength > 0) { break; }
+  }
+}
+
+
+ResponseHead::ResponseHead(std::string_view statusLine, std::size_t reserve) : head(requestMemory()) {
+  head.reserve(reserve);
+  head += statusLine;
+  head += "Date: ";
+  head += httpDate();
+  head += "\r\n";
+}
+
+
+ResponseHead& ResponseHead::header(std::string_view nameAndColon, std::string_view value) {
+  head += nameAndColon;
+  head += value;
+  head += "\r\n";
+  return *this;
+}
+
+
+ResponseHead& ResponseHead::header(std::string_view nameAndColon, std::size_t value) {
+  head += nameAndColon;
+  append(value);
+  head += "\r\n";
+  return *this;
+}
+
+
+ResponseHead& ResponseHead::append(std::size_t number) {
+  char digits[20]; //enough for any 64 bit number
+  auto [end, error] = std::to_chars(digits, digits + sizeof(digits), number);
+  head.append(digits, end);
+  return *this;
+}
+
+
+std::pmr::string ResponseHead::finish(std::string_view body) {
+  head += "\r\n"; //end of header
+  head += body;
+  return std::move(head);
+}
+
+
+std::string_view httpDate() {
+  thread_local std::time_t lastSecond = -1;
+  thread_local char date[32];
+  thread_local std::size_t length = 0;
+  std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  if (now != lastSecond) {
+    std::tm parts;
+    gmtime_r(&now, &parts);
+    length = std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &parts); //https://www.rfc-editor.org/rfc/rfc9110#name-date
+    lastSecond = now;
+  }
+  return std::string_view(date, length);
+} //every response needs one, but it only changes once a second - so most responses just copy the previous one
+
+
+void refreshDate(std::pmr::string& head) {
+  std::size_t date = head.find("\r\nDate: ");
+  if (date == std::string::npos) { return; }
+  std::string_view now = httpDate();
+  head.replace(date + 8, now.size(), now); //always the same length, so nothing moves
+}
+
+
+int statusCode(std::string_view head) {
+  int status = 0;
+  if (head.size() >= 12) { std::from_chars(head.data() + 9, head.data() + 12, status); }
+  return status;
+}
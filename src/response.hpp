@@ -0,0 +1,152 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <cstddef>
+#include <cstdint>
+#include <charconv>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "conditional.hpp"
+#include "path_resolver.hpp"
+
+class ProxyExchange;
+
+
+/**
+ * A response waiting to be sent.
+ * 
+ * head holds the status line and headers - and for small generated responses (echo/, user-agent) the body too.
+ * body is memory someone else owns - the file cache's copy of a file (refer file_cache.cpp) or a memory mapped file
+ *    (refer mapped_file.cpp). bodyOwner keeps that memory alive until the response has been sent; nothing is copied.
+ * A file body is never read into memory: the response keeps the open file and sendResponses() hands it to sendfile(),
+ *    which copies it from the page cache straight into the socket without passing through our process.
+ * 
+ * head is allocated from the request's arena (refer arena.hpp), like everything else built while answering.
+ * 
+ * The io_uring workers don't open files while answering (refer uring_loop.cpp). Their file responses start out
+ *    deferred - just the path and what's needed to build the head - and get replaced by a real response once the
+ *    ring has opened and stat'ed the file.
+ * 
+ * A proxied request's response (refer proxy.hpp) has nothing in it but the exchange to have with the upstream. Once
+ *    it's at the front of the queue, sendResponses() stops there and says so, and the caller relays it - or hands it
+ *    to the threads that do.
+ * 
+ * The response owns file_fd and closes it, so it can only be moved, not copied - unless fileOwner is set: then the
+ *    file is shared by several responses (an HTTP/2 stream's DATA frames, refer http2.hpp), and fileOwner closes it
+ *    once the last of them is gone.
+*/
+class HttpResponse {
+  public:
+    HttpResponse() = default;
+    HttpResponse(std::pmr::string head);
+    HttpResponse(std::pmr::string head, std::string_view body, std::shared_ptr<const void> bodyOwner);
+    HttpResponse(std::pmr::string head, int file_fd, off_t fileOffset, std::size_t fileLength);
+    HttpResponse(HttpResponse&& other) noexcept;
+    HttpResponse& operator=(HttpResponse&& other) noexcept;
+    HttpResponse(const HttpResponse&) = delete;
+    HttpResponse& operator=(const HttpResponse&) = delete;
+    ~HttpResponse();
+
+    std::pmr::string head;
+    std::size_t headSent = 0;
+    std::string_view body;
+    std::shared_ptr<const void> bodyOwner;
+    std::size_t bodySent = 0;
+    int file_fd = -1;
+    std::shared_ptr<const void> fileOwner;
+    off_t fileOffset = 0; //next byte of the file to send
+    std::size_t fileLength = 0; //bytes of the file still to send
+
+    struct DeferredOpen {
+      FilePath file; //the file to open, already resolved
+      std::string_view contentType; //one of the built in or loaded content types, which live as long as the server
+      FileConditions conditions; /*the request's Range and If- headers - the request is gone by the time the file is open.
+        Compressed on the fly if cacheable, precompressed siblings aren't looked for on the ring*/
+      bool closeConnection = false; //the head gets "Connection: close" once it's built
+    };
+    std::optional<DeferredOpen> deferred; //head is empty until the file has been opened
+    std::shared_ptr<ProxyExchange> proxied; //the upstream's response goes to the client in place of this one, refer proxy.hpp
+    std::uint8_t route = 0; //what answered the request, for the counts on /metrics - refer Metrics::nameRoute()
+
+    bool finished() const { return !deferred && !proxied && headSent == head.size() && bodySent == body.size() && fileLength == 0; }
+};
+
+/**
+ * The responses for one connection, in request order.
+ * 
+ * A vector that's consumed from the front rather than a deque: once every response has been sent it's cleared, which
+ *    keeps its capacity - a deque frees and allocates blocks as responses come and go.
+ * A client that pipelines requests without reading the responses would have it grow without end, so the reactors stop
+ *    reading from a connection once its queue is backedUp(), and carry on once it has gone out.
+*/
+class ResponseQueue {
+  public:
+    static constexpr std::size_t backlog = 64; //responses queued before the connection stops being read from
+
+    bool empty() const { return first == responses.size(); }
+    std::size_t size() const { return responses.size() - first; }
+    bool backedUp() const { return size() >= backlog; }
+    HttpResponse& front() { return responses[first]; }
+    auto begin() { return responses.begin() + first; }
+    auto end() { return responses.end(); }
+
+    template <typename... Arguments>
+    void emplace_back(Arguments&&... arguments) { responses.emplace_back(std::forward<Arguments>(arguments)...); }
+    void push_back(HttpResponse&& response) { responses.push_back(std::move(response)); }
+    void pop_front();
+    void popFinished() { while (!empty() && front().finished()) { pop_front(); } }
+
+  private:
+    std::vector<HttpResponse> responses;
+    std::size_t first = 0;
+};
+
+enum class SendResult {
+  Done, //the queue is empty
+  WouldBlock, //the socket buffer is full, try again once it's writable
+  Error, //the client went away
+  Proxied //the front response is a proxied one, to be relayed by the caller and then popped - refer HttpResponse::proxied
+};
+
+SendResult sendResponses(int client_fd, ResponseQueue& queue); //sends and pops as many queued responses as the socket takes
+ssize_t sendParts(int client_fd, const struct iovec* parts, std::size_t count, bool more = false); /*sendmsg() with
+  MSG_NOSIGNAL - or through OpenSSL, for a TLS connection the kernel doesn't encrypt for (refer tls.hpp). more is
+  MSG_MORE: what's next (a file) goes out in the same packets*/
+std::size_t gatherResponses(ResponseQueue& queue, std::span<struct iovec> parts, bool& everything); /*the unsent heads and
+  bodies at the front, up to the first file, deferred or proxied body, as iovecs. everything is set if nothing is left after them*/
+void markSent(ResponseQueue& queue, std::size_t bytes); //accounts for bytes sent from what gatherResponses() returned
+int statusCode(std::string_view head); //eg. 404 for "HTTP/1.1 404 Not Found...", 0 if head is too short to have one
+
+
+/**
+ * Builds a status line + headers in a single string, without the temporaries that chaining operator+ creates.
+ * 
+ * The string is reserved once up front in the request's arena, header names are string literals, and numbers are
+ *    written with to_chars() straight into it. Every head gets a Date header right after the status line (refer httpDate()).
+ * 
+ *    std::string head = ResponseHead(HTTP200).header("Content-Type: ", "text/plain").contentLength(5).finish();
+*/
+class ResponseHead {
+  public:
+    explicit ResponseHead(std::string_view statusLine, std::size_t reserve = 256);
+
+    ResponseHead& header(std::string_view nameAndColon, std::string_view value); //nameAndColon is eg. "Content-Type: "
+    ResponseHead& header(std::string_view nameAndColon, std::size_t value);
+    ResponseHead& contentLength(std::size_t length) { return header("Content-Length: ", length); }
+    ResponseHead& append(std::string_view text) { head += text; return *this; } //an already formatted header line, or part of one
+    ResponseHead& append(std::size_t number);
+    std::pmr::string finish(std::string_view body = {}); //ends the headers. A small body can be appended to go out in the same buffer
+
+  private:
+    std::pmr::string head;
+};
+
+std::string_view httpDate(); //the current time as an HTTP date, eg. "Tue, 14 Oct 2026 08:10:16 GMT". Formatted once a second per thread
+void refreshDate(std::pmr::string& head); //brings the Date header of a stored (cached) head up to date, in place
@@ -0,0 +1,120 @@
+#include <algorithm>
+
+#include "router.hpp"
+
+
+static void nameParams(std::string_view pattern, RouteParams& params);
+
+
+std::string_view RouteParams::get(std::string_view name) const {
+  for (std::size_t i = 0; i < count; i++) {
+    if (names[i] == name) { return values[i]; }
+  }
+  return {};
+}
+
+
+Router::Router(std::span<const Route> routes) : routes(routes.begin(), routes.end()) {
+  nodes.emplace_back(); //the root, for the empty path
+  for (std::uint32_t index = 0; index < this->routes.size(); index++) {
+    std::string_view pattern = this->routes[index].pattern;
+    std::uint32_t node = 0;
+    bool rest = false;
+    for (std::size_t i = 0; i < pattern.size(); i++) {
+      if (pattern[i] != '{') {
+        node = addLiteralChild(node, pattern[i]);
+        continue;
+      }
+      std::size_t close = pattern.find('}', i);
+      if (pattern[close - 1] == '*') {
+        rest = true;
+        break; //isValidRoutePattern() made sure it's the last thing in the pattern
+      }
+      if (nodes[node].segmentChild == none) {
+        nodes[node].segmentChild = nodes.size();
+        nodes.emplace_back();
+      }
+      node = nodes[node].segmentChild;
+      i = close;
+    }
+    (rest ? nodes[node].restRoutes : nodes[node].routes).push_back(index);
+  }
+}
+
+
+const Route* Router::match(std::string_view method, std::string_view path, RouteParams& params) const {
+  params.count = 0;
+  const Route* route = matchFrom(0, method, path, 0, params);
+  if (route != nullptr) { nameParams(route->pattern, params); }
+  return route;
+}
+
+
+bool Router::knowsMethod(std::string_view method) const {
+  return std::any_of(routes.begin(), routes.end(), [method](const Route& route) { return route.method == method; });
+}
+
+
+std::uint32_t Router::literalChild(std::uint32_t node, char c) const {
+  const auto& children = nodes[node].children;
+  auto found = std::lower_bound(children.begin(), children.end(), c, [](const auto& child, char c) { return child.first < c; });
+  return (found != children.end() && found->first == c) ? found->second : none;
+}
+
+
+std::uint32_t Router::addLiteralChild(std::uint32_t node, char c) {
+  std::uint32_t child = literalChild(node, c);
+  if (child != none) { return child; }
+  child = nodes.size();
+  nodes.emplace_back(); //may reallocate nodes, so look the parent up again afterwards
+  auto& children = nodes[node].children;
+  auto position = std::lower_bound(children.begin(), children.end(), c, [](const auto& child, char c) { return child.first < c; });
+  children.insert(position, { c, child });
+  return child;
+}
+
+
+const Route* Router::findMethod(const std::vector<std::uint32_t>& candidates, std::string_view method) const {
+  for (std::uint32_t index : candidates) {
+    if (routes[index].method == method) { return &routes[index]; }
+  }
+  return nullptr;
+}
+
+
+const Route* Router::matchFrom(std::uint32_t node, std::string_view method, std::string_view path, std::size_t position, RouteParams& params) const {
+  const Node& current = nodes[node];
+
+  if (position == path.size()) {
+    if (const Route* route = findMethod(current.routes, method)) { return route; }
+  } else if (std::uint32_t child = literalChild(node, path[position]); child != none) {
+    if (const Route* route = matchFrom(child, method, path, position + 1, params)) { return route; }
+  }
+
+  if (current.segmentChild != none && position < path.size() && params.count < RouteParams::maxParams) {
+    std::size_t end = std::min(path.find('/', position), path.size());
+    if (end > position) {
+      params.values[params.count++] = path.substr(position, end - position);
+      if (const Route* route = matchFrom(current.segmentChild, method, path, end, params)) { return route; }
+      params.count--; //that segment led nowhere, so it isn't a parameter after all
+    }
+  }
+
+  if (const Route* route = findMethod(current.restRoutes, method)) {
+    params.values[params.count++] = path.substr(position);
+    return route;
+  }
+  return nullptr;
+} /*only backtracks where a literal and a parameter both fit, which the few routes we have rarely do - for any one route
+  the path is walked once*/
+
+
+static void nameParams(std::string_view pattern, RouteParams& params) {
+  std::size_t param = 0;
+  for (std::size_t open = pattern.find('{'); open != std::string_view::npos && param < params.count; open = pattern.find('{', open + 1)) {
+    std::size_t close = pattern.find('}', open);
+    std::string_view name = pattern.substr(open + 1, close - open - 1);
+    if (name.ends_with('*')) { name.remove_suffix(1); }
+    params.names[param++] = name;
+  }
+} //a parameter's name comes from the route that matched, because different routes may name the same segment differently
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <array>
+#include <span>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "http_parser.hpp"
+#include "response.hpp"
+
+
+struct RouteParams {
+  static constexpr std::size_t maxParams = 4;
+  std::array<std::string_view, maxParams> names;
+  std::array<std::string_view, maxParams> values; //views into the request target
+  std::size_t count = 0;
+
+  std::string_view get(std::string_view name) const; //empty if the route has no such parameter
+};
+
+struct RouteContext {
+  const HttpRequest& request;
+  std::string_view body;
+  const std::string& directory;
+  RouteParams params;
+};
+
+using RouteHandler = HttpResponse (*)(const RouteContext& context);
+
+/**
+ * A route is a method, a path pattern and the function that answers it.
+ *
+ * Patterns are written without the leading '/'. Apart from literal characters they may contain
+ *    {name}  - one path segment, up to the next '/' (must not be empty)
+ *    {name*} - everything that's left of the path, possibly nothing. Only allowed at the end.
+ * So "files/{file*}" matches files/a/b.txt with file = "a/b.txt".
+*/
+struct Route {
+  std::string_view method;
+  std::string_view pattern;
+  RouteHandler handler;
+};
+
+constexpr bool isValidRoutePattern(std::string_view pattern) {
+  std::size_t params = 0;
+  for (std::size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] == '}') { return false; } //a '}' without its '{'
+    if (pattern[i] != '{') { continue; }
+    std::size_t close = pattern.find('}', i);
+    if (close == std::string_view::npos || close == i + 1) { return false; } //unterminated, or no name
+    std::string_view name = pattern.substr(i + 1, close - i - 1);
+    if (name.find('{') != std::string_view::npos) { return false; }
+    if (name.ends_with('*') && close != pattern.size() - 1) { return false; } //the rest of the path has to come last
+    if (++params > RouteParams::maxParams) { return false; }
+    i = close;
+  }
+  return true;
+} //lets a route table be checked with static_assert
+
+/**
+ * Finds the route for a request in one pass over its path, without allocating.
+ *
+ * The patterns are compiled into a trie with one node per literal character. A node can also have a child standing for
+ *    a {name} segment, and routes ending in a {name*} that takes whatever is left. When several routes could match,
+ *    literal characters win over a segment, and a segment wins over the rest of the path - so "echo/{text*}" is
+ *    preferred to a catch-all "{path*}" for echo/abc.
+*/
+class Router {
+  public:
+    explicit Router(std::span<const Route> routes);
+
+    const Route* match(std::string_view method, std::string_view path, RouteParams& params) const; //nullptr if nothing matches
+    bool knowsMethod(std::string_view method) const; //whether any route handles it, to tell 404 from 501
+    std::size_t indexOf(const Route& route) const { return &route - routes.data(); } //its place in the table, for a route match() returned
+
+  private:
+    static constexpr std::uint32_t none = UINT32_MAX;
+
+    struct Node {
+      std::vector<std::pair<char, std::uint32_t>> children; //sorted by character
+      std::uint32_t segmentChild = none; //for a {name} here
+      std::vector<std::uint32_t> routes; //routes whose pattern ends here
+      std::vector<std::uint32_t> restRoutes; //routes whose pattern ends with a {name*} here
+    };
+
+    std::vector<Route> routes;
+    std::vector<Node> nodes;
+
+    std::uint32_t literalChild(std::uint32_t node, char c) const;
+    std::uint32_t addLiteralChild(std::uint32_t node, char c);
+    const Route* findMethod(const std::vector<std::uint32_t>& candidates, std::string_view method) const;
+    const Route* matchFrom(std::uint32_t node, std::string_view method, std::string_view path, std::size_t position, RouteParams& params) const;
+};
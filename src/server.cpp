@@ -3,50 +3,66 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <array>
-#include <thread>
-#include <fstream>
+#include <algorithm>
+#include <charconv>
 #include <sys/stat.h>
-
-
-std::string parseBetween(std::string s, std::string firstMarker, std::string secondMarker);
-std::string parseFromThisToEnd (std::string s, std::string firstMarker);
-std::string getPath(std::string requestContents); //gets path from the HTTP request
-std::string getMethod(std::string requestContents); //gets method from the HTTP request
-std::string formulateEchoResponse(std::string path);
-std::string formulateUserAgentResponse(std::string requestContents);
-std::string fetchFileContents(std::string path, std::string contentType);
-std::string codeCraftersGetFile(std::string path, std::string directory); //exclusively a code crafters requirement if file is required from the "files" folder
-bool storeFile(std::string path, std::string directory, std::string requestContents); //for POSTing a file
-void handleClient(int client_fd, std::string directory);
-void shutdownServer(bool&);
-bool isValidFilePath(std::string path);
-std::string getFileExtension(std::string validPath);
-std::string defaultContentType(std::string fileExtension);
-
-const std::string CRLF = "\r\n";
-const std::string HTTP200 = "HTTP/1.1 200 OK" + CRLF;
-const std::string HTTP201 = "HTTP/1.1 201 Created" + CRLF;
-const std::string HTTP400 = "HTTP/1.1 400 Bad Request" + CRLF;
-const std::string HTTP404 = "HTTP/1.1 404 Not Found" + CRLF;
-const std::string HTTP414 = "HTTP/1.1 414 URI Too Long" + CRLF;
-const std::string HTTP500 = "HTTP/1.1 500 Internal Server Error" + CRLF;
-const std::string HTTP501 = "HTTP/1.1 501 Not Implemented" + CRLF;
-
-/**
- * Use this link to bring up the search in the documentation: https://pubs.opengroup.org/onlinepubs/9699919799/
- * curl commands for testing: 
- *  curl -v -X GET http://localhost:4221/files/237_dooby_Coo_vanilla
- *  curl -vvv -d "hello world" localhost:4221/files/postfile.txt
-*/
-
-int main(int argc, char **argv) {
-
-  std::string directory = (argc > 2) ? argv[2] : ""; //codecrafters test the get file functionality by passing in a directory path
-  //as an argument in the terminal. eg: ./your_server.sh --directory <directory path>. Hence argv[2]. 
-  // ./your_server.sh is a bash script used to compile the source code using cmake, and then run the compiled executable.
-  
-
+#include <fcntl.h>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <sys/time.h>
+#include <chrono>
+#include <utility>
+
+#include "server.hpp"
+#include "response.hpp"
+#include "file_cache.hpp"
+#include "mapped_file.hpp"
+#include "log.hpp"
+#include "router.hpp"
+#include "mime_types.hpp"
+#include "compression.hpp"
+#include "conditional.hpp"
+#include "path_resolver.hpp"
+#include "allocation_counter.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "admission.hpp"
+#include "drain.hpp"
+#include "tls.hpp"
+#include "proxy.hpp"
+
+
+static HttpResponse rootRoute(const RouteContext& context);
+static HttpResponse echoRoute(const RouteContext& context);
+static HttpResponse userAgentRoute(const RouteContext& context);
+static HttpResponse filesRoute(const RouteContext& context);
+static HttpResponse staticFileRoute(const RouteContext& context);
+static bool fetchPrecompressed(const FilePath& file, std::string_view contentType, const FileConditions& conditions, HttpResponse& response);
+static bool answerNotModified(const struct stat& info, std::string_view contentType, const FileConditions& conditions, std::pmr::string& response);
+static bool unchangedSince(int file_fd, const struct stat& info);
+static HttpResponse compressedResponse(std::string_view path, std::string_view contentType, AcceptedCodings codings,
+  std::pmr::string head, std::shared_ptr<const std::string> body, const struct stat& info, bool cache, std::uint64_t watched);
+static HttpResponse unreadFileResponse(std::pmr::string head, int file_fd, const struct stat& info, std::size_t start, std::size_t length);
+
+static thread_local bool fileOpensDeferred = false;
+
+constexpr std::array<Route, 5> routes = {{
+  { "GET", "", rootRoute },
+  { "GET", "echo/{text*}", echoRoute }, //to print what the client has entered after echo/
+  { "GET", "user-agent{ignored*}", userAgentRoute }, //to print the user-agent contents
+  { "GET", "files/{file*}", filesRoute }, //POSTs to files/ are streamed to disk by answerRequests() instead, refer upload.cpp
+  { "GET", "{path*}", staticFileRoute }, //anything else is looked up as a file relative to where the server runs
+}};
+static_assert(std::all_of(routes.begin(), routes.end(), [](const Route& route) { return isValidRoutePattern(route.pattern); }));
+constexpr std::uint8_t uploadRoute = routes.size() + 1; //0 is no route at all, 1 the first one above
+constexpr std::uint8_t proxyRoute = uploadRoute + 1;
+static_assert(proxyRoute < Metrics::maxRoutes);
+
+
+int openListeningSocket(const std::string& address, int port, int connection_backlog) {
   /** 1. First we create a socket.
    * 
    * A socket is an endpoint of a duplex communication link.
@@ -73,12 +89,13 @@ int main(int argc, char **argv) {
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
    std::cerr << "Failed to create server socket\n";
-   return 1;
+   return -1;
   }
   
 
   /* From CodeCrafters: Since the tester restarts your program quite often, setting REUSE_PORT
     ensures that we don't run into 'Address already in use' errors 
+    It also lets every epoll worker bind its own listening socket to the same port - refer event_loop.cpp.
   */
 
   /** 2. We can use the setsockopt method to change socket properties, and comply with the above requirement from CodeCrafters
@@ -94,7 +111,8 @@ int main(int argc, char **argv) {
   int reuse = 1;
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
     std::cerr << "setsockopt failed\n";
-    return 1;
+    close(server_fd);
+    return -1;
   }
   
   /** 3. We need to specifiy the address properties we want the socket to use, and then bind it to them.
@@ -114,6 +132,9 @@ int main(int argc, char **argv) {
    *    is "host to network long"
    * https://pubs.opengroup.org/onlinepubs/9699919799/functions/htons.html 
    * 
+   * --bind's address goes in s_addr - inet_pton() turns "127.0.0.1" into its 32 bits, already in network byte order.
+   *    The default, "0.0.0.0", is INADDR_ANY.
+   * 
    * The address is stored in the sockaddr_in struct (which is casted to sockaddr struct when used in methods - see the bind method below
    *    for an example)
    * 
@@ -123,12 +144,17 @@ int main(int argc, char **argv) {
  
   struct sockaddr_in server_addr;
   server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(4221);
+  if (inet_pton(AF_INET, address.c_str(), &server_addr.sin_addr) != 1) {
+    std::cerr << "Invalid bind address " << address << "\n";
+    close(server_fd);
+    return -1;
+  }
+  server_addr.sin_port = htons(port);
   
   if (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) != 0) {
-    std::cerr << "Failed to bind to port 4221\n";
-    return 1;
+    std::cerr << "Failed to bind to port " << port << "\n";
+    close(server_fd);
+    return -1;
   }
   
   /** 4. We indicate the socket is now ready to accept incoming connections.
@@ -137,342 +163,751 @@ int main(int argc, char **argv) {
    * The second argument is the max size of the queue of pending connections.
    * 
   */
-  int connection_backlog = 5;
   if (listen(server_fd, connection_backlog) != 0) {
     std::cerr << "listen failed\n";
-    return 1;
+    close(server_fd);
+    return -1;
   }
-  
 
-  /** 5. Now we must prepare and allow potential client connections.
-   * 
-   * So we define a blank struct to store the client address properties, and also get its length cuz for some reason
-   *    you can't use sizeof like we did with the bind method. 
-   *    Exact reason: " argument of type "unsigned long" is incompatible with parameter of type "socklen_t *" "
-   * The accept function will create a socket for the client.
-   * 
-  */
+  return server_fd;
+} //returns the listening socket, or -1 if any step failed
 
-  struct sockaddr_in client_addr;
-  int client_addr_len = sizeof(client_addr);
-  
-  std::cout << "Server " << std::to_string(server_fd) << " has started waiting for clients to connect...\n";
-  //std::cout << "Enter 'q' to exit program \n";  //in case I enable shutdownServer()
 
-  /** 6. We may have to handle multiple clients concurrently.
+
+
+void handleClient(int client_fd, const ServerConfig& config) {
+  /** 7. After that we want to get the HTTP request the client sent.
    * 
-   * The accept function will create a socket for the client.
-   * Refer handleClient() for remaining comments.
+   * For that we need to define an array as a character buffer which will be used by the recv() function.
    * 
-   * std::thread is used for concurrency, and it wraps around accept() and handleClient().
+   * recv() - https://pubs.opengroup.org/onlinepubs/9699919799/functions/recv.html#
+   * recv - receive a message from a connected socket
+   * Method signature - ssize_t recv(int socket, void *buffer, size_t length, int flags);
+   * The recv() function shall receive a message from a connection-mode or connectionless-mode socket. 
+   *    It is normally used with connected sockets because it does not permit the application to retrieve the source 
+   *    address of received data.
+   *    I'm guessing connection-mode is like TCP and connectionless-mode is like UDP.
+   * recv() will return the length of the message in bytes, 0 if the client closed the connection, or -1 if error.
+   * We recv() straight into the end of the pending string (refer receiveInto()), so a request can be any size 
+   *    instead of being cut off at a fixed buffer length.
    * 
-   * Had to add the following line to the CMakeLists.txt, to make my program compile on codecrafters,
-   *    even tho it compiled fine on my macbook. Codecrafters gave the error: "Cmake error undefined reference to `pthread_create'"
-   *    SET(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -pthread")
+   * With HTTP/1.1 the connection stays open after a response (keep-alive), so the client can send more requests.
+   *    A client may also send several requests without waiting for the responses (pipelining), so one recv() can
+   *    contain more than one request - or only part of one. That's why everything received is appended to pending,
+   *    and we answer every complete request at the front of it.
+   * 
+   * SO_RCVTIMEO makes recv() fail with EAGAIN once the client has kept us waiting for too long, so idle and slow
+   *    clients don't hold on to their thread forever. Too long is the keep-alive timeout between requests, and the
+   *    body timeout in the middle of a body. Headers have to be in by the header timeout however they trickle in, so
+   *    that timeout shrinks with every recv() (refer ClientSession::readDeadline()) - a client sending a byte now
+   *    and then would otherwise keep the thread for as long as it likes.
+   * SO_SNDTIMEO does the same for a client that stops taking in its response.
+   * 
+   * With --tls-cert, the client shakes hands first - on this thread, as it has nothing else to do. Refer tls.hpp.
+   *    So does a proxied response get relayed from its upstream, refer proxy.hpp.
    * 
   */
 
-  bool serverRunning = true;
-  
-  //in case I enable shutdownServer():
-  //if you the function you are putting in the thread takes variables by reference, wrap it in std::ref()
-  /*
-  std::thread s(shutdownServer, std::ref(serverRunning));
-  s.detach();
-  */
+  struct timeval sendTimeout = { config.bodyTimeout, 0 };
+  setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+  std::chrono::milliseconds receiveTimeout{0}; //what SO_RCVTIMEO is set to, so it's only set again when that changes
 
-  while (serverRunning) {
-    int client_fd = accept(server_fd, (struct sockaddr *) &client_addr, (socklen_t *) &client_addr_len);
-    if (client_fd < 0) {
-      std::cerr << "invalid client_fd " << client_fd << std::endl;
-      continue;
+  if (tls().enabled() && !tls().accept(client_fd, std::chrono::steady_clock::now() + std::chrono::seconds(config.headerTimeout))) {
+    admission().release(client_fd);
+    close(client_fd);
+    return; //accept() counted and logged it
+  }
+
+  ClientSession session(config); //pending grows as needed - the parser limits how big a request may get
+  ResponseQueue responses; //after session - the responses are built in its arena, so they have to go first
+  metrics().connectionOpened();
+
+  while (session.keepAlive) {
+    if (draining() && session.betweenRequests()) { break; } //refer drain.hpp
+    auto now = std::chrono::steady_clock::now();
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(session.readDeadline(now, config) - now);
+    if (wait <= std::chrono::milliseconds(0)) {
+      logDebug("client ", client_fd, " took too long to send its request headers");
+      break;
+    }
+    if (wait != receiveTimeout) {
+      struct timeval timeout = { static_cast<time_t>(wait.count() / 1000), static_cast<suseconds_t>(wait.count() % 1000 * 1000) };
+      setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      receiveTimeout = wait;
+    }
+
+    ssize_t bytes_received = receiveInto(client_fd, session.pending, config.readSize);
+    if (bytes_received == 0) { break; } //client closed the connection
+    if (bytes_received < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) { //EAGAIN just means a timeout expired
+        logError("failed to get contents of HTTP request of client ", client_fd, ": ", std::strerror(errno));
+      }
+      break;
+    }
+    TraceSample sample("connection"); //answering and sending, refer trace.hpp - not the wait for the next request
+
+
+    /** 8. Prepare the HTTP response(s). Refer answerRequests() and routeRequest().
+    */
+
+    answerRequests(client_fd, session, responses, config);
+
+
+    /** 9. We send the HTTP response(s) to the client
+     * 
+     * Message signature: ssize_t send(int socket, const void *buffer, size_t length, int flags);
+     * 
+     * It returns number of bytes sent, -1 if error.
+     * 
+     * Instead of calling send() directly, sendResponses() (refer response.cpp) uses its relatives writev()/sendmsg(),
+     *    which send several buffers in one call, and sendfile(), which sends a file without reading it into memory.
+     * 
+    */
+
+    SendResult sent = SendResult::Done;
+    bool relayed = true;
+    while (relayed && (sent = sendResponses(client_fd, responses)) == SendResult::Proxied) {
+      relayed = responses.front().proxied->relay(client_fd);
+      finishRelay(session, responses);
+    }
+    if (!relayed) { break; } //the client went away, or the response ends with the connection
+    if (sent != SendResult::Done) {
+      logDebug("error sending HTTP response to client ", client_fd); //almost always the client hanging up early
+      break;
     }
-    std::cout << "Client " << std::to_string(client_fd) << " connected" << std::endl;
-    std::thread t(handleClient, client_fd, directory);
-    t.detach();
   }
 
-  close(server_fd);
-  std::cout << "Server " << std::to_string(server_fd) << " shut down!" << std::endl;
-  return 0;
+  /** 10. Close the client socket.
+   * https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/unistd.h.html - includes POSIX terminal stuff, including close()
+  */
   
+  tls().release(client_fd);
+  admission().release(client_fd);
+  close(client_fd);
+  metrics().connectionClosed();
+  logDebug("closed client ", client_fd);
 }
 
 
+std::chrono::steady_clock::time_point ClientSession::readDeadline(std::chrono::steady_clock::time_point now, const ServerConfig& config) {
+  if (parser.headersParsed() || (http2 != nullptr && !http2->idle())) { //pending may well be empty - an upload's body goes straight to disk
+    readingHeaders = false;
+    return now + std::chrono::seconds(config.bodyTimeout);
+  }
+  if (idle()) {
+    readingHeaders = false;
+    return now + std::chrono::seconds(config.keepAliveTimeout);
+  }
+  if (!readingHeaders) {
+    readingHeaders = true;
+    headersStarted = now;
+  }
+  return headersStarted + std::chrono::seconds(config.headerTimeout);
+}
 
 
 
-void handleClient(int client_fd, std::string directory) {
-  /** 7. After that we want to get the HTTP request the client sent.
-   * 
-   * For that we need to define an array as a character buffer which will be used by the recv() function.
-   * 
-   * recv() - https://pubs.opengroup.org/onlinepubs/9699919799/functions/recv.html#
-   * recv - receive a message from a connected socket
-   * Method signature - ssize_t recv(int socket, void *buffer, size_t length, int flags);
-   * The recv() function shall receive a message from a connection-mode or connectionless-mode socket. 
-   *    It is normally used with connected sockets because it does not permit the application to retrieve the source 
-   *    address of received data.
-   *    I'm guessing connection-mode is like TCP and connectionless-mode is like UDP.
-   * recv() will return the length of the message in bytes, or -1 if error.
-   * 
-  */
 
-  std::string response = "";
 
 
-  std::array<char, 1024> buffer = { '\0' };
-  int bytes_received = recv(client_fd, buffer.data(), buffer.size(), 0);
-  if (bytes_received < 0) {
-    //throw std::runtime_error("Failed to get contents of HTTP request");
-    close(client_fd);
-    std::cerr << "Failed to get contents of HTTP request of client " << std::to_string(client_fd);
-    std::cerr << ". Connection closed.\n";
-    return;
-  }
-  if (bytes_received > buffer.size()) {
-    response = HTTP414 + CRLF;
-    std::cerr << "HTTP request buffer overflow for client " << std::to_string(client_fd) << std::endl;
+HttpResponse finishUpload(FileUpload& upload, const HttpRequest& request) {
+  bool saved = upload.finish();
+  statCache().forget(upload.path()); //even a failed upload may have replaced what was there
+  if (saved) { logDebug("file saved. Path: ", request.target); }
+  else { logError("error saving file ", request.target); }
+  HttpResponse response(emptyResponse(saved ? HTTP201 : HTTP500));
+  response.route = uploadRoute;
+  return response;
+}
+
+
+void rejectClient(int client_fd) {
+  if (!tls().enabled()) { //a TLS client would take plaintext for a broken handshake - and we won't shake hands with it first
+    std::pmr::string response = markConnectionClose(ResponseHead(HTTP503).header("Retry-After: ", "1").contentLength(0).finish());
+    send(client_fd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL); //never wait on a client we're turning away
   }
-  std::string requestContents = buffer.data();
-  std::cout << "Client " << client_fd << "'s request contents:\n" <<  "START\n" << requestContents << "END" << std::endl;
+  admission().release(client_fd); //if it was admitted, and then found no thread free
+  close(client_fd);
+  metrics().connectionRejected();
+} //the request itself is never read - the kernel may answer the unread bytes with a reset, which clients handle as a failure anyway
 
 
-  /** 8. Prepare the HTTP response. 
+void answerRequests(int client_fd, ClientSession& session, ResponseQueue& responses, const ServerConfig& config) {
+  /** 8a. The request is parsed by HttpParser (refer http_parser.cpp) in a single pass, producing string_views into
+   *    pending - so nothing is copied out of the receive buffer.
+   * 
+   * Responses to pipelined requests must go back in the same order the requests came in, so they're concatenated
+   *    and sent together.
+   * 
+   * A POST to files/ is the exception to keeping the whole request in pending: its body is written to disk as it
+   *    arrives (refer upload.cpp), so uploading a file bigger than memory is fine. Everything else is small enough
+   *    to wait for in full.
+   * 
+   * Responses are built in the connection's arena (refer arena.hpp). It can start over once nothing queued is
+   *    still using it, so a keep-alive connection keeps reusing the same few blocks of memory.
+   * 
+   * A connection that starts with the HTTP/2 preface, or agreed on h2 in its TLS handshake, is handed to its
+   *    Http2Session instead (refer http2.hpp), which answers through routeRequest() too.
    * 
   */
 
-  std::string path = getPath(requestContents);
-  std::string method = getMethod(requestContents);
-
-  if (response != "") { /*response was already formulated above - probably HTTP414 - URI too long*/ }
-  else if (method == "GET"){
-    if (path == "") {
-      response = HTTP200 + CRLF;
-    } else if (path.substr(0,5) == "echo/") {
-      response = formulateEchoResponse(path); //to print what the client has entered after echo/
-    } else if (path.substr(0,10) == "user-agent") {
-      response = formulateUserAgentResponse(requestContents); //to print the user-agent contents
-    } else if (path.substr(0,6) == "files/") {
-        response = codeCraftersGetFile(path, directory); /*if the user sends a URI of format file/<path>, the server
-        will return the file as content-type: application/octet-stream from the directory specified as a command-line
-        argument. This is a codecrafters requirement.*/
-    } else if (isValidFilePath(path)) {
-      response = fetchFileContents(path, defaultContentType(getFileExtension(path))); /*if path is a valid location in the server, 
-      the file will be returned as content-type: application/octet-stream*/
-    } else {
-      response = HTTP404 + CRLF;
+  std::string& pending = session.pending;
+  HttpParser& parser = session.parser;
+  if (responses.empty()) { session.arena.reset(); }
+  ArenaScope scope(session.arena);
+
+  if (session.http2 == nullptr && !session.answered && !parser.headersParsed()) { //one of the connection's first bytes, refer http2.hpp
+    std::string_view start = std::string_view(pending).substr(0, Http2Session::preface.size());
+    if (tls().negotiatedHttp2(client_fd) || start == Http2Session::preface) { session.http2 = std::make_unique<Http2Session>(); }
+    else if (!start.empty() && Http2Session::preface.starts_with(start)) { return; } //could still be either
+  }
+  if (session.http2 != nullptr) {
+    session.http2->answer(client_fd, session, responses, config);
+    return;
+  }
+
+  while (session.keepAlive) {
+    std::uint64_t heapBefore = threadAllocations().allocations;
+    auto started = std::chrono::steady_clock::now();
+    TraceSpan span("request");
+    HttpRequest request;
+    ParseResult result;
+    {
+      TraceSpan parsing("parse");
+      result = parser.parse(pending, request);
+    }
+    if (result == ParseResult::Complete) { span.describe(request.target); }
+    bool upload = result == ParseResult::Complete && isFileUpload(request);
+    if (upload && !session.upload.active()) {
+      FilePath destination(requestMemory());
+      bool beneath = uploadPath(request.target.substr(1), destination);
+      bool begun = beneath && session.upload.begin(destination, config.uploadSync);
+      if (!begun && (!beneath || errno == EXDEV)) { //named outside --directory, or a symlink leads out of it
+        logWarning("rejected upload from client ", client_fd, " to ", request.target);
+        metrics().countResponse(uploadRoute, 404);
+        responses.emplace_back(markConnectionClose(emptyResponse(HTTP404)));
+        session.keepAlive = false; //same as below
+        break;
+      }
+      if (!begun) {
+        logError("error saving file ", request.target, ": ", std::strerror(errno));
+        metrics().countResponse(uploadRoute, 500);
+        responses.emplace_back(markConnectionClose(emptyResponse(HTTP500)));
+        session.keepAlive = false; //the body is still on its way, and there's nowhere to put it
+        break;
+      }
     }
-  } else if (method == "POST"){
-    if (path.substr(0,6) == "files/") {
-      if (!storeFile(path, directory, requestContents)) {
-        std::cerr << "Error saving file. Specified path: " << path << std::endl;
-        response = HTTP500 + CRLF;
+    if (result == ParseResult::Complete) {
+      if (upload) {
+        result = parser.streamBody(pending, request, config.maxUploadSize, [&session](std::string_view data) { session.upload.write(data); });
       } else {
-        std::cout << "File saved. Path: " << path << std::endl;
-        response = HTTP201 + CRLF;
+        result = parser.parseBody(pending, request);
+      }
+      if (result == ParseResult::Incomplete && parser.shouldSendContinue(request)) {
+        std::pmr::string interim(HTTP100, requestMemory());
+        interim += CRLF;
+        responses.emplace_back(std::move(interim)); //headers were fine, so tell the client to go ahead with the body
       }
-    } else {
-      response = HTTP501 + CRLF; /* This is will also be the response for HEAD requests, even though the web docs at
-      https://developer.mozilla.org/en-US/docs/Web/HTTP/Status#server_error_responses specify that servers must support HEAD and GET.
-      But I haven't implemented the response formulation for HEAD yet. */
     }
+    if (result == ParseResult::Incomplete) { break; } //wait for more bytes
+    if (result != ParseResult::Complete) {
+      std::pmr::string rejection = markConnectionClose(parseErrorResponse(result));
+      logWarning("rejected HTTP request from client ", client_fd, ": ", std::string_view(rejection).substr(9, 3));
+      metrics().countResponse(upload ? uploadRoute : 0, statusCode(rejection));
+      session.upload.abort();
+      responses.emplace_back(std::move(rejection));
+      session.keepAlive = false; //we can't tell where the next request would start
+      break;
+    }
+
+    logDebug("client ", client_fd, "'s request headers:\n", "START\n", std::string_view(pending).substr(0, request.bodyOffset), "END");
+
+    session.answered = true;
+    session.keepAlive = wantsKeepAlive(request) && !draining(); //a draining server closes every connection once it's answered what's arrived
+    HttpResponse response = upload ? finishUpload(session.upload, request) : routeRequest(request, request.body, config.directory);
+    if (!session.keepAlive) {
+      if (response.deferred) { response.deferred->closeConnection = true; }
+      else if (response.proxied) { response.proxied->closeConnection = true; }
+      else { response.head = markConnectionClose(std::move(response.head)); }
+    }
+    if (logger().enabled(LogLevel::Info)) { /*access log: client, request line, status, bytes in the response, heap allocations it took.
+      A deferred file's status isn't known yet, nor a proxied request's, so it's logged as -*/
+      std::string_view status = response.deferred || response.proxied ? "-" : std::string_view(response.head).substr(9, 3);
+      logInfo("access client=", client_fd, ' ', request.method, ' ', request.target, ' ', status,
+        ' ', response.head.size() + response.body.size() + response.fileLength, " heap=", threadAllocations().allocations - heapBefore);
+    }
+    if (!response.deferred && !response.proxied) { /*the io_uring worker counts it once it's opened the file, the relay
+      once the upstream answered*/
+      metrics().countResponse(response.route, statusCode(response.head));
+    }
+    metrics().recordLatency(response.route, std::chrono::steady_clock::now() - started);
+    responses.push_back(std::move(response));
+
+    pending.erase(0, parser.messageLength());
+    parser.reset();
   }
-  
+} //queues a response for every complete request at the front of pending and removes them from it. keepAlive is cleared once the connection should close
 
-  /** 9. We send the HTTP response to the client
-   * 
-   * Message signature: ssize_t send(int socket, const void *buffer, size_t length, int flags);
+
+HttpResponse routeRequest(const HttpRequest& request, std::string_view body, const std::string& directory) {
+  /** 8b. Prepare the HTTP response. 
    * 
-   * Cuz of the format of the second argument, we use .c_str() on our string. 
-   *    (Returns a pointer to an array that contains a null-terminated sequence of characters (i.e., a C-string) 
-   *    representing the current value of the string object.)
+   * The route table at the top of this file is compiled into a trie once (refer router.cpp), which finds the handler
+   *    for a path in one pass over it, and hands over the parts of the path the handler cares about as string_views.
    * 
-   * It returns number of bytes sent, -1 if error.
+   * The --proxy routes come first, whatever the method - their paths belong to the upstreams. Refer proxy.hpp.
    * 
   */
-  
-  if ( send(client_fd, response.c_str(), response.length(), 0) == -1 ) {
-    std::cerr << "Error sending HTTP response to client " << std::to_string(client_fd) << std::endl;
-  }
 
-  /** 10. Close the client socket.
-   * https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/unistd.h.html - includes POSIX terminal stuff, including close()
-  */
-  
-  close(client_fd);
-  std::cout << "Closed client " << std::to_string(client_fd) << std::endl;
+  if (!request.target.starts_with("/")) { return emptyResponse(HTTP400); }
+  if (const ProxyRoute* proxied = proxy().route(request.target)) {
+    HttpResponse response = proxy().forward(*proxied, request, body);
+    response.route = proxyRoute;
+    return response;
+  }
+  std::string_view path = request.target.substr(1); //because the HTTP Request request-line is in the format: GET /<some path> HTTP/1.0
+
+  static const Router router(routes);
+  RouteContext context = { request, body, directory, {} };
+  const Route* route;
+  {
+    TraceSpan matching("route");
+    route = router.match(request.method, path, context.params);
+  }
+  if (route == nullptr) {
+    return emptyResponse(router.knowsMethod(request.method) ? HTTP404 : HTTP501); /* 501 is also the response for HEAD requests,
+    even though the web docs at https://developer.mozilla.org/en-US/docs/Web/HTTP/Status#server_error_responses specify that
+    servers must support HEAD and GET. But I haven't implemented the response formulation for HEAD yet. */
+  }
+  HttpResponse response = route->handler(context);
+  response.route = router.indexOf(*route) + 1;
+  return response;
 }
 
 
+void nameRouteMetrics() {
+  for (std::size_t i = 0; i < routes.size(); i++) { metrics().nameRoute(i + 1, routes[i].method, routes[i].pattern); }
+  metrics().nameRoute(uploadRoute, "POST", "files/{file*}");
+  metrics().nameRoute(proxyRoute, "*", "--proxy");
+}
 
 
+static HttpResponse rootRoute(const RouteContext&) {
+  return emptyResponse(HTTP200);
+}
 
-
-std::string parseBetween (std::string s, std::string firstMarker, std::string secondMarker) {
-  int i = firstMarker.length();
-  std::size_t pos = s.find(firstMarker);
-  std::string suffix = s.substr(pos+i);
-  std::size_t pos2 = suffix.find(secondMarker);
-  return s.substr(pos+i,pos2);
+static HttpResponse echoRoute(const RouteContext& context) {
+  return formulateEchoResponse(context.params.get("text"));
 }
 
-std::string parseFromThisToEnd (std::string s, std::string firstMarker) {
-  int i = firstMarker.length();
-  std::size_t pos = s.find(firstMarker);
-  return s.substr(pos+i,s.size());
+static HttpResponse userAgentRoute(const RouteContext& context) {
+  return formulateUserAgentResponse(context.request.header("User-Agent"));
 }
 
-std::string getPath (std::string requestContents) {
-  return parseBetween(requestContents," /"," "); //because the HTTP Request request-line is in the format: GET /<some path> HTTP/1.0
+static HttpResponse filesRoute(const RouteContext& context) {
+  return codeCraftersGetFile(context.params.get("file"), context.request); /*if the user sends a URI of
+  format file/<path>, the server will return the file as content-type: application/octet-stream from the directory specified
+  as a command-line argument. This is a codecrafters requirement.*/
 }
 
-std::string getMethod(std::string requestContents){
-  return parseBetween(requestContents,""," ");
+static HttpResponse staticFileRoute(const RouteContext& context) {
+  FilePath file(requestMemory());
+  {
+    TraceSpan validating("validate path");
+    if (!workingRoot().resolve(context.params.get("path"), file) || !isValidFilePath(file.relative)) { return emptyResponse(HTTP404); }
+  }
+  return fetchFileContents(file, defaultContentType(getFileExtension(file.relative)), context.request); /*if path is a valid
+  location in the server, the file will be returned with a content-type based on its file extension*/
 }
 
-std::string formulateEchoResponse(std::string path) {
-  path = "/" + path;
-  std::string body = path.substr(6);
-  std::string response = HTTP200 + "Content-Type: text/plain" + CRLF + "Content-Length: " + std::to_string(body.length()) + CRLF;
-  response += CRLF; //end of header
-  //start of body
-  response += body;
+
+
+
+bool wantsKeepAlive(const HttpRequest& request) {
+  std::string_view connection = request.header("Connection");
+  if (equalsIgnoreCase(connection, "close")) { return false; }
+  if (equalsIgnoreCase(connection, "keep-alive")) { return true; }
+  return request.version != "HTTP/1.0";
+} //HTTP/1.1 connections are persistent unless the client says "Connection: close". HTTP/1.0 is the other way round
+
+std::pmr::string emptyResponse(std::string_view statusLine) {
+  return ResponseHead(statusLine).contentLength(0).finish();
+} /*a response without a body still needs Content-Length: 0, otherwise on a persistent connection the client can't
+tell the response has ended and waits for us to close the connection*/
+
+std::pmr::string parseErrorResponse(ParseResult result) {
+  switch (result) {
+    case ParseResult::UriTooLong: return emptyResponse(HTTP414);
+    case ParseResult::HeadersTooLarge: return emptyResponse(HTTP431);
+    case ParseResult::BodyTooLarge: return emptyResponse(HTTP413);
+    case ParseResult::NotImplemented: return emptyResponse(HTTP501);
+    default: return emptyResponse(HTTP400);
+  }
+} //the response for a request the parser rejected
+
+ssize_t receiveInto(int client_fd, std::string& buffer, std::size_t readSize) {
+  TraceSpan span("recv");
+  std::size_t used = buffer.size();
+  buffer.resize(used + readSize);
+  ssize_t bytes_received = tls().userlandReceive(client_fd) ? tls().receive(client_fd, buffer.data() + used, readSize)
+                                                            : recv(client_fd, buffer.data() + used, readSize, 0);
+  buffer.resize(used + std::max<ssize_t>(bytes_received, 0));
+  if (bytes_received > 0) { metrics().bytesReceived(bytes_received); }
+  return bytes_received;
+} //appends up to readSize bytes from the socket to buffer - decrypted, if OpenSSL does that for it. returns what recv() returned
+
+std::pmr::string markConnectionClose(std::pmr::string response) {
+  response.insert(response.find(CRLF) + 2, "Connection: close\r\n");
   return response;
+} //tells the client we'll close the connection after this response
+
+std::pmr::string formulateEchoResponse(std::string_view text) {
+  std::string_view body = text;
+  return ResponseHead(HTTP200, 128 + body.size()).header("Content-Type: ", "text/plain").contentLength(body.size()).finish(body); /*the
+  body is a view into the receive buffer, which is reused once we're done answering - so it goes out along with the headers*/
 } //for echoing user URL after echo/ back to them
 
-std::string formulateUserAgentResponse(std::string requestContents) {
-  std::string body = parseBetween(requestContents,CRLF + "User-Agent: ",CRLF);
-  std::string response = HTTP200 + "Content-Type: text/plain" + CRLF + "Content-Length: " + std::to_string(body.length()) + CRLF;
-  response += CRLF; //end of header
-  //start of body
-  response += body;
-  return response;
+std::pmr::string formulateUserAgentResponse(std::string_view userAgent) {
+  std::string_view body = userAgent;
+  return ResponseHead(HTTP200, 128 + body.size()).header("Content-Type: ", "text/plain").contentLength(body.size()).finish(body);
 } //for echoing the user-agent content back to the user
 
 
-void shutdownServer(bool& serverRunning) {
-  std::string userInput = "";
-  while (true) {
-    std::cin >> userInput;
-    if (userInput == "q") { break; } 
-    else { userInput = ""; }
+bool isValidFilePath(std::string_view path) {
+  //prevent clients from accessing files at the level of the server executable
+  return path.find_first_of('/') != std::string_view::npos;
+} /*whether the file at path - already canonical, refer canonicalizePath() - may be served. Whether it exists is up to
+fetchFileContents(), which opens it anyway*/
+
+std::pmr::string fileResponseHead(std::string_view contentType, ContentCoding coding, const FileValidators& validators,
+    std::size_t fileSize, std::size_t start, std::size_t length, bool partial) {
+  ResponseHead head(partial ? HTTP206 : HTTP200, 384);
+  head.header("Content-Type: ", contentType);
+  if (coding != ContentCoding::Identity) { head.header("Content-Encoding: ", codingName(coding)); }
+  if (isCompressible(contentType)) { //so caches in between don't hand a compressed copy to a client that can't decode it
+    head.append("Vary: Accept-Encoding\r\n");
+  }
+  head.header("ETag: ", validators.etag).header("Last-Modified: ", validators.lastModified);
+  head.append("Accept-Ranges: bytes\r\n"); //lets clients know they can ask for parts of the file
+  if (partial) {
+    head.append("Content-Range: bytes ").append(start).append("-").append(start + length - 1).append("/").append(fileSize).append(CRLF);
   }
-  serverRunning = false;
+  return head.contentLength(length).finish();
+} /*Content-Type: text/plain will display the contents on the broswer
+Content-Type: application/octet-stream will offer the file as a download*/
+
+std::pmr::string notModifiedResponse(std::string_view contentType, const FileValidators& validators) {
+  ResponseHead head(HTTP304);
+  if (isCompressible(contentType)) { head.append("Vary: Accept-Encoding\r\n"); }
+  return head.header("ETag: ", validators.etag).header("Last-Modified: ", validators.lastModified).finish();
+} //no body, and no Content-Length - a 304 never has a body, so there's nothing for the client to wait for
+
+HttpResponse rangeNotSatisfiableResponse(std::size_t fileSize) {
+  return ResponseHead(HTTP416).append("Content-Range: bytes */").append(fileSize).append(CRLF).contentLength(0).finish();
 }
 
-bool isValidFilePath(std::string path) {
-  //prevent clients from accessing files at the level of the server executable
-  int index = path.find_first_of("/");
-  if (index > path.size()) { return false; }
+ByteRange parseByteRange(std::string_view header, std::size_t fileSize, std::size_t& start, std::size_t& length) {
+  // https://www.rfc-editor.org/rfc/rfc9110#name-range-requests
+  start = 0;
+  length = fileSize;
+  if (!header.starts_with("bytes=")) { return ByteRange::Whole; }
+  std::string_view spec = header.substr(6);
+  if (spec.find(',') != std::string_view::npos) { return ByteRange::Whole; } //several ranges - we just send the whole file
+
+  std::size_t dash = spec.find('-');
+  if (dash == std::string_view::npos) { return ByteRange::Whole; }
+  std::string_view first = spec.substr(0, dash);
+  std::string_view last = spec.substr(dash + 1);
+  auto toNumber = [](std::string_view digits, std::size_t& number) {
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), number);
+    return !digits.empty() && error == std::errc() && end == digits.data() + digits.size();
+  };
+
+  std::size_t from = 0;
+  std::size_t to = 0;
+  if (first.empty()) { //"bytes=-500" is the last 500 bytes
+    if (!toNumber(last, to)) { return ByteRange::Whole; }
+    if (to == 0 || fileSize == 0) { return ByteRange::Unsatisfiable; }
+    from = (to >= fileSize) ? 0 : fileSize - to;
+    to = fileSize - 1;
+  } else {
+    if (!toNumber(first, from)) { return ByteRange::Whole; }
+    if (last.empty()) { to = fileSize - 1; } //"bytes=1000-" is everything from byte 1000 on
+    else if (!toNumber(last, to) || to < from) { return ByteRange::Whole; }
+    if (from >= fileSize) { return ByteRange::Unsatisfiable; }
+    to = std::min(to, fileSize - 1);
+  }
 
-  std::ifstream file(path);
+  start = from;
+  length = to - from + 1;
+  return ByteRange::Partial;
+} //a missing or malformed Range header means the whole file, as the RFC asks
+
+bool readWholeFile(int file_fd, std::size_t size, std::string& contents) {
+  contents.resize(size);
+  std::size_t done = 0;
+  while (done < size) {
+    ssize_t bytes_read = pread(file_fd, contents.data() + done, size - done, done);
+    if (bytes_read < 0 && errno == EINTR) { continue; }
+    if (bytes_read <= 0) { return false; }
+    done += bytes_read;
+  }
+  return true;
+} //reads size bytes of the file into contents
+
+
+HttpResponse fetchFileContents(const FilePath& file, std::string_view contentType, const HttpRequest& request) {
+  /* A client resuming or splitting up a download asks for part of the file with eg. "Range: bytes=1000-1999",
+    and gets just those bytes back in a 206 Partial Content response - refer parseByteRange().
+    A client that already has the file asks whether it changed (If-None-Match, If-Modified-Since), and if it didn't
+    gets a 304 Not Modified without the file - refer conditional.hpp. */
+  TraceSpan span("file");
+  FileConditions conditions(request, requestMemory());
+  const std::pmr::string& path = file.full;
+
+  /* Text goes out compressed to clients that can decode it (refer compression.hpp): from the cache, from a
+    precompressed sibling on disk, or compressed once now. A range is always of the plain file. */
+  if (conditions.range.empty() && isCompressible(contentType)) { conditions.codings = parseAcceptEncoding(request.header("Accept-Encoding")); }
+
+  /* Small files are kept in memory by the file cache (refer file_cache.cpp) - a cache hit doesn't touch the filesystem. */
+  FileCache::Hit hit(requestMemory());
+  bool cacheHit = fileCache().lookup(path, conditions.codings.variant(), contentType, hit);
+  if (fileCache().enabled()) { metrics().countCacheLookup(cacheHit); }
+  if (cacheHit) {
+    FileValidators validators = cachedValidators(hit.head);
+    if (isNotModified(conditions, validators)) { return notModifiedResponse(contentType, validators); }
+
+    std::string_view contents = *hit.body;
+    std::size_t start = 0;
+    std::size_t length = 0;
+    ByteRange wanted = parseByteRange(rangeApplies(conditions, validators) ? conditions.range : "", contents.size(), start, length);
+    if (wanted == ByteRange::Whole) {
+      refreshDate(hit.head); //the rest of the cached head is still right
+      return HttpResponse(std::move(hit.head), contents, hit.body);
+    }
+    if (wanted == ByteRange::Unsatisfiable) { return rangeNotSatisfiableResponse(contents.size()); }
+    return HttpResponse(fileResponseHead(contentType, ContentCoding::Identity, validators, contents.size(), start, length, true),
+      contents.substr(start, length), hit.body);
+  }
 
-  if (file.good()) { return true; }
-  //std::cout << "Path not good" << std::endl;
-  return false;
-}
+  /* What stat() said a moment ago is remembered (refer path_resolver.hpp): a file that was just found missing is a 404
+    without asking the filesystem again, and one that was just stat'ed may not have changed since the client's copy. */
+  struct stat known;
+  StatCache::Result cached = statCache().lookup(path, known);
+  if (cached == StatCache::Result::Missing) { return emptyResponse(HTTP404); }
+  std::pmr::string notModified(requestMemory());
+  if (cached == StatCache::Result::Exists && answerNotModified(known, contentType, conditions, notModified)) { return notModified; }
+
+  /* The io_uring workers open the file on their ring instead, refer uring_loop.cpp. */
+  if (fileOpensDeferred) {
+    HttpResponse deferred;
+    deferred.deferred = HttpResponse::DeferredOpen{ FilePath(file, requestMemory()), contentType, std::move(conditions) };
+    return deferred;
+  }
 
+  HttpResponse precompressed;
+  if (!conditions.codings.none() && fetchPrecompressed(file, contentType, conditions, precompressed)) { return precompressed; }
 
-std::string fetchFileContents(std::string path, std::string contentType) {
-
-  std::ifstream file(path);
-  std::string line = "";
-  std::string contents = "";
-  while (file.good()) {
-      std::getline(file,line);
-      contents += line;
-      contents += "\n";
-  }
-  //std::cout << "Contents: " << contents << std::endl;
-  contents = contents.substr(0,contents.size()-1); //to remove additional new line character at the end
-  //std::cout << "Contents after removing additional new line character: " << contents << std::endl;
-  std::string response = HTTP200 + "Content-Type: " + contentType + CRLF + "Content-Length: " + std::to_string(contents.length()) + CRLF;
-  //Content-Type: text/plain will display the contents on the broswer
-  //Content-Type: application/octet-stream will offer the file as a download
-  response += CRLF; //end of header
-  //start of body
-  response += contents;
-  file.close();
-  return response;
+  /* Otherwise the file isn't read here - we only open it and fstat() it for its size (the Content-Length). The contents
+    are sent later by sendResponses() using sendfile(), byte for byte, so binary files arrive intact. */
+  struct stat info;
+  int file_fd = openFile(file, info);
+  if (file_fd < 0) { return emptyResponse(HTTP404); }
+  return openedFileResponse(file_fd, info, path, contentType, conditions);
 } /*for returning file contents to clients. Content-type is application/octet-stream. This causes the file to be offered
 as a download by a typical web broswer. If you want to print in the browser window, use Content-Type: text/plain*/
 
-std::string codeCraftersGetFile(std::string path, std::string directory){
-  std::string actualPath = path.substr(6,path.size());
-  actualPath = directory + actualPath;
-  //std::cout << "Actual Path: " << actualPath << std::endl;
-  if (!isValidFilePath(actualPath)) { return HTTP404 + CRLF; }
-  return fetchFileContents(actualPath, "application/octet-stream");
+HttpResponse openedFileResponse(int file_fd, const struct stat& info, std::string_view path, std::string_view contentType,
+    const FileConditions& conditions) {
+  if (!S_ISREG(info.st_mode)) { //directories and devices can't be served as files
+    close(file_fd);
+    return emptyResponse(HTTP404);
+  }
+
+  std::pmr::string notModified(requestMemory());
+  if (answerNotModified(info, contentType, conditions, notModified)) {
+    close(file_fd);
+    return notModified;
+  }
+  std::pmr::string etag = entityTag(info, ContentCoding::Identity);
+  std::pmr::string lastModified = lastModifiedDate(info);
+  FileValidators validators = { etag, lastModified };
+
+  std::size_t start = 0;
+  std::size_t length = 0;
+  ByteRange wanted = parseByteRange(rangeApplies(conditions, validators) ? conditions.range : "", info.st_size, start, length);
+  if (wanted == ByteRange::Unsatisfiable) {
+    close(file_fd);
+    return rangeNotSatisfiableResponse(info.st_size);
+  }
+  std::pmr::string head = fileResponseHead(contentType, ContentCoding::Identity, validators, info.st_size, start, length, wanted == ByteRange::Partial);
+
+  if (wanted == ByteRange::Whole && fileCache().cacheable(info.st_size)) {
+    std::uint64_t watched = fileCache().watchDirectoryOf(std::string(path)); /*before reading, so a change made while we
+      read keeps what we read out of the cache - refer FileCache::insert()*/
+    std::string contents;
+    if (readWholeFile(file_fd, info.st_size, contents)) {
+      bool cache = unchangedSince(file_fd, info); //and one made before the directory was watched, since info
+      close(file_fd);
+      auto body = std::make_shared<const std::string>(std::move(contents));
+      //the cache outlives the request, so not in its arena
+      if (cache) { fileCache().insert(std::string(path), 0, std::string(path), std::string(contentType), std::string(head), body, info, watched); }
+      if (!conditions.codings.none()) {
+        return compressedResponse(path, contentType, conditions.codings, std::move(head), std::move(body), info, cache, watched);
+      }
+      return HttpResponse(std::move(head), *body, body);
+    }
+  }
+  return unreadFileResponse(std::move(head), file_fd, info, start, length); //too big to compress on the fly
+} //takes over file_fd
+
+
+static bool answerNotModified(const struct stat& info, std::string_view contentType, const FileConditions& conditions, std::pmr::string& response) {
+  if (!S_ISREG(info.st_mode) || (conditions.ifNoneMatch.empty() && conditions.ifModifiedSince.empty())) { return false; }
+  std::pmr::string etag = entityTag(info, ContentCoding::Identity);
+  std::pmr::string lastModified = lastModifiedDate(info);
+  if (isNotModified(conditions, { etag, lastModified })) {
+    response = notModifiedResponse(contentType, { etag, lastModified });
+    return true;
+  }
+  if (conditions.codings.none()) { return false; }
+  etag = entityTag(info, conditions.codings.best()); //the client's copy may be the compressed variant we sent it
+  if (!isNotModified(conditions, { etag, lastModified })) { return false; }
+  response = notModifiedResponse(contentType, { etag, lastModified });
+  return true;
+} //the 304 for the plain file info is about, or for the variant compressed on the fly. Not for a precompressed sibling's tag
+
+
+static bool fetchPrecompressed(const FilePath& file, std::string_view contentType, const FileConditions& conditions, HttpResponse& response) {
+  const std::pmr::string& path = file.full;
+  struct stat original;
+  if (!statFile(file, original) || !S_ISREG(original.st_mode)) { return false; } //fetchFileContents() answers 404
+
+  AcceptedCodings codings = conditions.codings;
+  for (ContentCoding coding : { ContentCoding::Brotli, ContentCoding::Gzip }) {
+    if (coding == ContentCoding::Brotli ? !codings.brotli : !codings.gzip) { continue; }
+    FilePath sibling(requestMemory());
+    sibling.directory_fd = file.directory_fd;
+    sibling.relative.assign(file.relative).append(precompressedSuffix(coding));
+    sibling.full.assign(path).append(precompressedSuffix(coding));
+    struct stat info;
+    int file_fd = openFile(sibling, info); //a sibling that isn't there is remembered as such too
+    if (file_fd < 0) { continue; }
+
+    bool stale = !S_ISREG(info.st_mode) || info.st_mtim.tv_sec < original.st_mtim.tv_sec
+      || (info.st_mtim.tv_sec == original.st_mtim.tv_sec && info.st_mtim.tv_nsec < original.st_mtim.tv_nsec);
+    if (stale) { //left over from an older version of the file
+      close(file_fd);
+      continue;
+    }
+
+    std::pmr::string etag = entityTag(info, coding);
+    std::pmr::string lastModified = lastModifiedDate(info);
+    FileValidators validators = { etag, lastModified };
+    if (isNotModified(conditions, validators)) {
+      close(file_fd);
+      response = notModifiedResponse(contentType, validators);
+      return true;
+    }
+
+    std::pmr::string head = fileResponseHead(contentType, coding, validators, info.st_size, 0, info.st_size, false);
+    if (fileCache().cacheable(info.st_size)) {
+      std::uint64_t watched = fileCache().watchDirectoryOf(std::string(path)); //as in openedFileResponse()
+      std::string contents;
+      if (readWholeFile(file_fd, info.st_size, contents)) {
+        bool cache = unchangedSince(file_fd, info);
+        close(file_fd);
+        auto body = std::make_shared<const std::string>(std::move(contents));
+        if (cache) {
+          fileCache().insert(std::string(path), codings.variant(), std::string(sibling.full), std::string(contentType), std::string(head), body, info, watched);
+        }
+        response = HttpResponse(std::move(head), *body, body);
+        return true;
+      }
+    }
+    response = unreadFileResponse(std::move(head), file_fd, info, 0, info.st_size);
+    return true;
+  }
+  return false;
+} //path.br or path.gz, if the client takes it and it's at least as new as path. Only for files that exist uncompressed too
+
+
+static HttpResponse compressedResponse(std::string_view path, std::string_view contentType, AcceptedCodings codings,
+    std::pmr::string head, std::shared_ptr<const std::string> body, const struct stat& info, bool cache, std::uint64_t watched) {
+  if (shouldCompress(contentType, body->size())) {
+    ContentCoding coding = codings.best();
+    std::string compressed;
+    bool done = compress(*body, coding, compressed);
+    if (!done && coding == ContentCoding::Brotli && codings.gzip) { //built without brotli
+      coding = ContentCoding::Gzip;
+      done = compress(*body, coding, compressed);
+    }
+    if (done && compressed.size() < body->size()) {
+      std::pmr::string etag = entityTag(info, coding); //a different representation, so a different tag
+      std::pmr::string lastModified = lastModifiedDate(info);
+      head = fileResponseHead(contentType, coding, { etag, lastModified }, compressed.size(), 0, compressed.size(), false);
+      body = std::make_shared<const std::string>(std::move(compressed));
+    }
+  }
+  if (cache) {
+    fileCache().insert(std::string(path), codings.variant(), std::string(path), std::string(contentType), std::string(head), body, info, watched);
+  }
+  return HttpResponse(std::move(head), *body, body);
+} /*the plain file compressed for codings, and cached as such - unless it changed while it was read. One that's too small
+or doesn't get smaller is cached as it is for these clients, so it isn't tried again on every request*/
+
+
+static bool unchangedSince(int file_fd, const struct stat& info) {
+  struct stat now;
+  return fstat(file_fd, &now) == 0 && now.st_ino == info.st_ino && now.st_size == info.st_size
+    && now.st_mtim.tv_sec == info.st_mtim.tv_sec && now.st_mtim.tv_nsec == info.st_mtim.tv_nsec;
+} //what info says still holds - what was read since is what it describes
+
+
+static HttpResponse unreadFileResponse(std::pmr::string head, int file_fd, const struct stat& info, std::size_t start, std::size_t length) {
+  /* Large files can also be served from a shared memory mapping instead (--large-files mmap, refer mapped_file.cpp). */
+  if (mappedFiles().shouldMap(info.st_size)) {
+    auto mapping = mappedFiles().map(file_fd, info);
+    if (mapping) {
+      close(file_fd);
+      return HttpResponse(std::move(head), mapping->contents().substr(start, length), mapping);
+    }
+  }
+  return HttpResponse(std::move(head), file_fd, start, length);
+} //takes over file_fd. Sent with sendfile(), or from the mapping
+
+HttpResponse codeCraftersGetFile(std::string_view file, const HttpRequest& request){
+  FilePath actualPath(requestMemory());
+  {
+    TraceSpan validating("validate path");
+    if (!filesRoot().resolve(file, actualPath)) { return emptyResponse(HTTP404); } //files/../server.cpp and the like
+  }
+  //std::cout << "Actual Path: " << actualPath.full << std::endl;
+  return fetchFileContents(actualPath, "application/octet-stream", request); //404 if the file doesn't exist
 } /*if the user sends a URI of format file/<path>, the server
       will return the file as content-type: application/octet-stream from the directory specified as a command-line
       argument. This is a codecrafters requirement.*/
 
 
-bool storeFile(std::string path, std::string directory, std::string requestContents) {
-  path = path.substr(6,path.size()); //remove the leading /files/ from the path
-  if (directory == "") {
-    path = directory + path; //can customize here if needed with a default folder
-  } else {
-    path = directory + "/" + path;
-  }
-  
-  //std::cout << "Testing. Path to store file:" << path << std::endl;
-  mkdir(directory.c_str(), 0777); //https://pubs.opengroup.org/onlinepubs/009695299/functions/mkdir.html
-  //0777 refers to the permissions, in this case wrx for user,group,others
-
-  std::ofstream file(path);
-  if (!file.good()) { return false; }
-  requestContents = parseFromThisToEnd(requestContents,CRLF+CRLF);
-  file << requestContents;
-  return true;
+bool deferFileOpens(bool defer) {
+  return std::exchange(fileOpensDeferred, defer);
 }
 
-std::string getFileExtension(std::string validPath) {
-  std::size_t found = validPath.find_last_of("/");
-  std::string file = validPath.substr(found+1);
-  /* file has to be extracted first, instead of just searching for a "." to get the file extension
-  as it is possible for a file to not have an extension */
-  std::size_t found2 = file.find_last_of(".");
-  if (found2 == -1) { return ""; }
-  return file.substr(found2+1);
+
+void finishRelay(ClientSession& session, ResponseQueue& responses) {
+  std::shared_ptr<ProxyExchange> exchange = std::move(responses.front().proxied);
+  responses.pop_front();
+  if (exchange->http2Stream() != 0 && session.http2 != nullptr) { session.http2->fetched(session, *exchange, responses); }
+} //the exchange goes last, and its upstream connection back to this thread's pool
+
+
+bool isFileUpload(const HttpRequest& request) {
+  return request.method == "POST" && request.target.starts_with("/files/") && proxy().route(request.target) == nullptr;
 }
 
-std::string defaultContentType(std::string fileExtension) {
-  // https://developer.mozilla.org/en-US/docs/Web/HTTP/Headers/Content-Type
-  // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types
-  // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
-  if (fileExtension == "bmp") {
-    return "image/bmp";
-  } else if (fileExtension == "css") {
-    return "text/css";
-  } else if (fileExtension == "csv") {
-    return "text/csv";
-  } else if (fileExtension == "gif") {
-    return "image/gif";
-  } else if (fileExtension == "htm" || fileExtension == "html") {
-    return "text/html";
-  } else if (fileExtension == "ico") {
-    return "image/vnd.microsoft.icon";
-  } else if (fileExtension == "jpg" || fileExtension == "jpeg") {
-    return "image/jpeg";
-  } else if (fileExtension == "js") {
-    return "text/javascript";
-  } else if (fileExtension == "json") {
-    return "application/json";
-  } else if (fileExtension == "png") {
-    return "image/png";
-  } else if (fileExtension == "pdf") {
-    return "application/pdf";
-  } else if (fileExtension == "php") {
-    return "application/x-httpd-php";
-  } else if (fileExtension == "svg") {
-    return "image/svg+xml";
-  } else if (fileExtension == "tif" || fileExtension == "tiff") {
-    return "image/tiff";
-  } else if (fileExtension == "txt") {
-    return "text/plain";
-  } else {
-    return "application/octet-stream";
-  }
-}
\ No newline at end of file
+
+bool uploadPath(std::string_view path, FilePath& file) {
+  path = path.substr(6); //remove the leading files/ from the path
+  return filesRoot().resolve(path, file); //in --directory, or where the server runs if it isn't set
+}
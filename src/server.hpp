@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "http_parser.hpp"
+#include "response.hpp"
+#include "upload.hpp"
+#include "log.hpp"
+#include "arena.hpp"
+#include "compression.hpp"
+#include "conditional.hpp"
+#include "http2.hpp"
+#include "proxy.hpp"
+
+
+enum class ByteRange {
+  Whole, //no (usable) Range header - send the whole file
+  Partial, //send just the requested bytes with 206 Partial Content
+  Unsatisfiable //the range starts beyond the end of the file - 416
+};
+
+struct ServerConfig {
+  std::string configFile = ""; //--config, a file of settings the other flags override, refer config.hpp
+  std::string directory = ""; //--directory, where files/ are read from and POSTed to
+  int port = 4221; //--port
+  std::string bindAddress = "0.0.0.0"; //--bind, the IPv4 address the port (and --admin-port) listens on. Every interface by default
+  std::string tlsCertificate = ""; //--tls-cert, a PEM certificate chain. With it (and --tls-key) the port speaks HTTPS, refer tls.hpp
+  std::string tlsKey = ""; //--tls-key, the PEM private key of --tls-cert
+  std::size_t tlsThreads = 2; //--tls-threads, threads doing the TLS handshakes for the epoll and coroutine workers
+  int adminPort = 0; //--admin-port, where GET /metrics is answered (refer metrics.hpp). 0 leaves it closed
+  int connectionBacklog = 511; //--backlog, max size of the queue of pending connections, see listen(). The kernel caps it at net.core.somaxconn
+  std::string ioMode = "threads"; //--io, "threads" (one thread per client), "epoll" (event loop workers) or "uring" (io_uring workers, epoll if unavailable) or "coroutines" (coroutine handlers on epoll reactors)
+  long workerCount = 1; //--workers, number of epoll/io_uring/coroutine workers
+  long threadCount = 64; //--threads, client threads in the threads mode. Each one serves one connection at a time
+  std::size_t queueSize = 1024; //--queue-size, accepted connections that may wait for a free thread before we answer 503
+  int keepAliveTimeout = 5; //--keep-alive-timeout, seconds an idle persistent connection is kept open
+  int headerTimeout = 10; //--header-timeout, seconds a client gets to send a request's line and headers, however it spreads them out
+  int bodyTimeout = 30; //--body-timeout, seconds a request body (or taking in a response) may stall before the connection is closed
+  int drainTimeout = 10; //--drain-timeout, seconds open connections get to finish after SIGTERM (refer drain.hpp)
+  std::string controlSocket = ""; //--control-socket, unix socket a replacement takes the listeners over from (refer takeover.hpp)
+  std::string takeOver = ""; //--take-over, the running server's --control-socket, to take its listeners from instead of binding
+  std::size_t maxConnections = 0; //--max-connections, clients open at once before the next one gets a 503. 0 for no limit
+  std::size_t maxConnectionsPerAddress = 0; //--max-connections-per-ip, the same for the clients of one address
+  std::size_t maxHeaderSize = 8192; //--max-header-size, bytes allowed for the request line + headers (414/431 beyond that)
+  std::size_t maxBodySize = 16 * 1024 * 1024; //--max-body-size, bytes allowed for a request body (413 beyond that)
+  std::size_t readSize = 16 * 1024; //--read-size, bytes asked for per recv() call - and the size of each io_uring receive buffer
+  std::size_t cacheSize = 64 * 1024 * 1024; //--cache-size, bytes of small files kept in memory, 0 turns the file cache off
+  std::size_t cacheMaxFileSize = 1024 * 1024; //--cache-max-file-size, larger files are always sent with sendfile()
+  std::string largeFileMode = "sendfile"; //--large-files, "sendfile" or "mmap" for files too big for the cache
+  std::size_t mmapMinSize = 8 * 1024 * 1024; //--mmap-min-size, files this big or bigger are mapped in mmap mode
+  long statCacheTtl = 1000; //--stat-cache-ttl, milliseconds what stat() said about a path (or that it's missing) is trusted. 0 turns it off
+  std::size_t compressMinSize = 1024; //--compress-min-size, smaller files aren't compressed on the fly. 0 only sends precompressed .br/.gz siblings
+  std::vector<std::string> proxyRoutes; //--proxy, "/prefix=host:port,host:port" forwards the paths under prefix to those upstreams (refer proxy.hpp). Each one adds a route
+  ProxyBalance proxyBalance = ProxyBalance::RoundRobin; //--proxy-balance, "round-robin" or "least-connections" - which of a route's upstreams a request goes to
+  int proxyTimeout = 10; //--proxy-timeout, seconds an upstream gets to accept a connection, answer, or send the next part of its response
+  std::size_t proxyPoolSize = 16; //--proxy-pool-size, idle keep-alive connections each worker keeps to each upstream
+  std::size_t proxyThreads = 16; //--proxy-threads, threads relaying proxied responses for the epoll and coroutine workers
+  std::size_t maxUploadSize = 1024 * 1024 * 1024; //--max-upload-size, bytes allowed for a file POSTed to files/ (413 beyond that)
+  UploadSync uploadSync = UploadSync::None; //--upload-sync, "none", "file" or "full" - how hard to flush uploads to disk
+  LogLevel logLevel = LogLevel::Info; //--log-level, "debug" also logs every request's headers
+  std::string logFile = ""; //--log-file, appended to. stdout if not set
+  std::string mimeTypesFile = ""; //--mime-types, a mime.types file adding to/overriding the built in content types
+  std::string traceFile = ""; //--trace-file, where sampled requests' phases are written as a Chrome trace. Needs a -DTRACING=ON build
+  std::size_t traceSample = 100; //--trace-sample, 1 in this many batches of a connection's requests are traced
+
+  bool operator==(const ServerConfig&) const = default; //for telling what a reload changed
+};
+
+struct ClientSession {
+  explicit ClientSession(const ServerConfig& config) : pending(acquireBuffer()), parser(config.maxHeaderSize, config.maxBodySize) {}
+  ~ClientSession() { releaseBuffer(std::move(pending)); }
+  std::string pending; //bytes received but not yet answered - may hold several pipelined requests, or part of one
+  HttpParser parser;
+  Arena arena; //for building responses, reset whenever all of them have been sent
+  FileUpload upload; //the POST to files/ whose body is currently arriving, if any
+  bool keepAlive = true;
+  bool readingHeaders = false; //pending holds the start of a request whose headers haven't all arrived
+  std::chrono::steady_clock::time_point headersStarted; //when they started arriving
+  bool answered = false; //a request has been answered on the connection
+  std::unique_ptr<Http2Session> http2; //once the connection turned out to speak HTTP/2, which takes over from parser and upload
+
+  bool idle() const { return pending.empty() && !parser.headersParsed() && (http2 == nullptr || http2->idle()); } /*nothing
+    of the next request has arrived*/
+  bool betweenRequests() const { return answered && idle(); } /*what a drain closes straight away, refer drain.hpp. A new
+    connection's first request is on its way*/
+  std::chrono::steady_clock::time_point readDeadline(std::chrono::steady_clock::time_point now, const ServerConfig& config); /*how
+    long to wait for the client's next bytes, after answering what it sent: the keep-alive timeout between requests,
+    what's left of the header timeout in the middle of one, the body timeout in the middle of its body - or, over
+    HTTP/2, while any stream is open*/
+}; //per connection request state, shared by every --io mode
+
+std::pmr::string formulateEchoResponse(std::string_view text); //text is what came after echo/
+std::pmr::string formulateUserAgentResponse(std::string_view userAgent);
+HttpResponse fetchFileContents(const FilePath& file, std::string_view contentType, const HttpRequest& request);
+HttpResponse openedFileResponse(int file_fd, const struct stat& info, std::string_view path, std::string_view contentType,
+  const FileConditions& conditions); //the rest of fetchFileContents() once the file is open
+bool deferFileOpens(bool defer); /*for the calling thread - fetchFileContents() leaves cache misses to the caller, refer
+  HttpResponse::deferred. Returns what it was before*/
+HttpResponse codeCraftersGetFile(std::string_view file, const HttpRequest& request); //exclusively a code crafters requirement if file is required from the "files" folder
+bool isFileUpload(const HttpRequest& request); //a POST to files/ that isn't proxied, whose body is streamed to disk instead of buffered
+bool uploadPath(std::string_view path, FilePath& file); //where a POST to files/ is stored. false if path leads out of --directory
+HttpResponse finishUpload(FileUpload& upload, const HttpRequest& request); //201 once the whole body is on disk
+extern const std::uint8_t uploadRoute; //HttpResponse::route of POSTs to files/
+extern const std::uint8_t proxyRoute; //HttpResponse::route of proxied requests, refer proxy.hpp
+void finishRelay(ClientSession& session, ResponseQueue& responses); /*once the proxied response at the front of responses
+  has been relayed (refer proxy.hpp): pops it, and over HTTP/2 queues what was fetched for its stream*/
+bool wantsKeepAlive(const HttpRequest& request); //whether the connection should stay open after this request
+std::pmr::string emptyResponse(std::string_view statusLine); //status line + "Content-Length: 0", for responses without a body
+std::pmr::string markConnectionClose(std::pmr::string response); //adds a "Connection: close" header
+std::pmr::string parseErrorResponse(ParseResult result); //400, 413, 414, 431 or 501 for a rejected request
+ssize_t receiveInto(int client_fd, std::string& buffer, std::size_t readSize); //recv() appending to buffer
+void answerRequests(int client_fd, ClientSession& session, ResponseQueue& responses, const ServerConfig& config); //responses for every complete request in session.pending
+HttpResponse routeRequest(const HttpRequest& request, std::string_view body, const std::string& directory); //builds the HTTP response for one request
+void nameRouteMetrics(); //labels the routes' counts on /metrics with their method and pattern
+int openListeningSocket(const std::string& address, int port, int connection_backlog); //socket() + setsockopt() + bind() + listen()
+void handleClient(int client_fd, const ServerConfig& config); //config outlives the connection - main()'s, shared by every worker
+void rejectClient(int client_fd); //503 and close, for when there's no room for another connection
+bool isValidFilePath(std::string_view path);
+bool readWholeFile(int file_fd, std::size_t size, std::string& contents);
+ByteRange parseByteRange(std::string_view header, std::size_t fileSize, std::size_t& start, std::size_t& length); //from a Range header
+std::pmr::string fileResponseHead(std::string_view contentType, ContentCoding coding, const FileValidators& validators,
+  std::size_t fileSize, std::size_t start, std::size_t length, bool partial);
+std::pmr::string notModifiedResponse(std::string_view contentType, const FileValidators& validators); //304
+HttpResponse rangeNotSatisfiableResponse(std::size_t fileSize); //416
+
+const std::string CRLF = "\r\n";
+const std::string HTTP100 = "HTTP/1.1 100 Continue" + CRLF;
+const std::string HTTP200 = "HTTP/1.1 200 OK" + CRLF;
+const std::string HTTP201 = "HTTP/1.1 201 Created" + CRLF;
+const std::string HTTP206 = "HTTP/1.1 206 Partial Content" + CRLF;
+const std::string HTTP304 = "HTTP/1.1 304 Not Modified" + CRLF;
+const std::string HTTP400 = "HTTP/1.1 400 Bad Request" + CRLF;
+const std::string HTTP404 = "HTTP/1.1 404 Not Found" + CRLF;
+const std::string HTTP413 = "HTTP/1.1 413 Content Too Large" + CRLF;
+const std::string HTTP414 = "HTTP/1.1 414 URI Too Long" + CRLF;
+const std::string HTTP416 = "HTTP/1.1 416 Range Not Satisfiable" + CRLF;
+const std::string HTTP431 = "HTTP/1.1 431 Request Header Fields Too Large" + CRLF;
+const std::string HTTP500 = "HTTP/1.1 500 Internal Server Error" + CRLF;
+const std::string HTTP501 = "HTTP/1.1 501 Not Implemented" + CRLF;
+const std::string HTTP502 = "HTTP/1.1 502 Bad Gateway" + CRLF;
+const std::string HTTP503 = "HTTP/1.1 503 Service Unavailable" + CRLF;
+const std::string HTTP504 = "HTTP/1.1 504 Gateway Timeout" + CRLF;
@@ -0,0 +1,145 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "takeover.hpp"
+#include "drain.hpp"
+#include "log.hpp"
+
+
+static bool controlAddress(const std::string& path, struct sockaddr_un& address);
+static bool sendListeners(int connection_fd, const std::vector<int>& listeners);
+
+static constexpr std::size_t maxListeners = 253; //SCM_MAX_FD, the most fds one message can carry
+static constexpr char readyByte = 'R';
+
+
+int openControlSocket(const std::string& path) {
+  struct sockaddr_un address;
+  if (!controlAddress(path, address)) { return -1; }
+  int control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (control_fd < 0) { return -1; }
+  unlink(path.c_str()); //the previous server's - it keeps its own socket open, just not the name
+  mode_t previous = umask(0177);
+  bool bound = bind(control_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+  umask(previous);
+  if (!bound || listen(control_fd, 1) != 0) {
+    int error = errno;
+    close(control_fd);
+    errno = error;
+    return -1;
+  }
+  return control_fd;
+}
+
+
+void serveTakeovers(int control_fd, std::vector<int> listeners) {
+  while (!draining()) {
+    int connection_fd = accept4(control_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection_fd < 0) {
+      if (errno != EINTR) { logError("accept failed on control socket ", control_fd, ": ", std::strerror(errno)); }
+      continue;
+    }
+    struct timeval timeout = { 60, 0 }; //for the replacement to get ready. It has its caches and workers to set up
+    setsockopt(connection_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    logInfo("handing the listeners over to a new server");
+
+    char ready = 0;
+    if (!sendListeners(connection_fd, listeners) || recv(connection_fd, &ready, 1, 0) != 1 || ready != readyByte) {
+      logWarning("the new server didn't take over, carrying on"); //it failed to start, or was stopped halfway
+      close(connection_fd);
+      continue;
+    }
+    close(connection_fd);
+    logInfo("a new server has taken over the listeners");
+    beginDrain();
+  }
+  close(control_fd); //not unlinked - the name belongs to the replacement by now
+}
+
+
+int requestTakeover(const std::string& path, std::vector<int>& listeners) {
+  struct sockaddr_un address;
+  if (!controlAddress(path, address)) {
+    logError("--take-over path ", path, " is too long for a unix socket");
+    return -1;
+  }
+  int connection_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection_fd < 0 || connect(connection_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+    logError("can't reach the running server at ", path, ": ", std::strerror(errno));
+    if (connection_fd >= 0) { close(connection_fd); }
+    return -1;
+  }
+
+  std::uint32_t count = 0;
+  struct iovec part = { &count, sizeof(count) };
+  alignas(struct cmsghdr) char control[CMSG_SPACE(maxListeners * sizeof(int))];
+  struct msghdr message = {};
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = recvmsg(connection_fd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  } while (received < 0 && errno == EINTR);
+
+  listeners.clear();
+  for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) { continue; }
+    std::size_t fdCount = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int* fds = reinterpret_cast<const int*>(CMSG_DATA(header));
+    listeners.insert(listeners.end(), fds, fds + fdCount);
+  }
+  if (received != sizeof(count) || (message.msg_flags & MSG_CTRUNC) || listeners.size() != count || count == 0) {
+    logError("the running server at ", path, " didn't hand over its listeners");
+    for (int listen_fd : listeners) { close(listen_fd); }
+    listeners.clear();
+    close(connection_fd);
+    return -1;
+  }
+  return connection_fd;
+}
+
+
+bool confirmTakeover(int connection_fd) {
+  bool sent = send(connection_fd, &readyByte, 1, MSG_NOSIGNAL) == 1;
+  close(connection_fd);
+  return sent;
+}
+
+
+static bool controlAddress(const std::string& path, struct sockaddr_un& address) {
+  address = {};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  std::memcpy(address.sun_path, path.data(), path.size());
+  return true;
+}
+
+
+static bool sendListeners(int connection_fd, const std::vector<int>& listeners) {
+  if (listeners.empty() || listeners.size() > maxListeners) { return false; }
+  std::uint32_t count = listeners.size();
+  struct iovec part = { &count, sizeof(count) };
+  alignas(struct cmsghdr) char control[CMSG_SPACE(maxListeners * sizeof(int))] = {};
+  struct msghdr message = {};
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(listeners.size() * sizeof(int));
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(listeners.size() * sizeof(int));
+  std::memcpy(CMSG_DATA(header), listeners.data(), listeners.size() * sizeof(int));
+  return sendmsg(connection_fd, &message, MSG_NOSIGNAL) == sizeof(count);
+} //the count goes with them, so a receiver whose fd table is full can tell it got fewer
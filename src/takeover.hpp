@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+/**
+ * Restarting without refusing or resetting a connection: the new server takes over the running one's listening
+ *    sockets instead of binding its own.
+ *
+ *    server --control-socket /run/http.sock ...                            the running server
+ *    server --take-over /run/http.sock --control-socket /run/http.sock ...  its replacement
+ *
+ * The replacement connects to the running server's control socket, a unix socket, and is handed its listeners over
+ *    it (SCM_RIGHTS, refer unix(7)). They are the very same sockets, with the same queues of connections the kernel
+ *    has accepted on our behalf - so nothing waiting in them is lost, as it would be if the old server closed its
+ *    listeners and the new one bound fresh ones. Once the replacement is ready to accept, it says so, and the old
+ *    server drains (refer drain.hpp): both accept from the same queues for a moment, then only the new one does.
+ *    The old server finishes the requests it has, and exits. The caches are the replacement's own, and start cold.
+ *
+ * If the replacement fails before it said it's ready, the old server carries on as though nothing happened.
+ *
+ * The control socket is as good as the listeners themselves, so it's made accessible to its owner only (0600).
+*/
+int openControlSocket(const std::string& path); //-1 if it can't be made, with errno set. Replaces whatever socket was at path
+void serveTakeovers(int control_fd, std::vector<int> listeners); //until one succeeds, then drains. On a thread of its own
+int requestTakeover(const std::string& path, std::vector<int>& listeners); /*the running server's listeners, and the
+  connection to tell it we're ready on. -1 if it couldn't be reached, with the reason logged*/
+bool confirmTakeover(int connection_fd); //the running server starts draining. Closes the connection
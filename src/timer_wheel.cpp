@@ -0,0 +1,66 @@
+#include <algorithm>
+
+#include "timer_wheel.hpp"
+
+
+TimerWheel::TimerWheel() {
+  for (Timer& slot : inner) { slot.wheel = this; }
+  for (Timer& slot : outer) { slot.wheel = this; }
+}
+
+
+TimerWheel::~TimerWheel() {
+  for (Timer& slot : inner) { while (slot.next != nullptr) { slot.next->cancel(); } }
+  for (Timer& slot : outer) { while (slot.next != nullptr) { slot.next->cancel(); } }
+} //the timers left behind won't reach for the wheel when they're destroyed
+
+
+void TimerWheel::schedule(Timer& timer, Clock::time_point deadline) {
+  timer.cancel();
+  std::uint64_t tick = tickOf(deadline + tickLength - std::chrono::nanoseconds(1)); //rounded up, so it never fires early
+  timer.expires = std::clamp(tick, current + 1, current + innerSlots * outerSlots - 1);
+  timer.wheel = this;
+  insert(timer);
+  count++;
+}
+
+
+void TimerWheel::Timer::cancel() {
+  if (previous == nullptr) { return; }
+  previous->next = next;
+  if (next != nullptr) { next->previous = previous; }
+  previous = next = nullptr;
+  wheel->count--;
+}
+
+
+std::uint64_t TimerWheel::tickOf(Clock::time_point time) const {
+  if (time <= start) { return 0; }
+  return (time - start) / tickLength;
+}
+
+
+void TimerWheel::insert(Timer& timer) {
+  Timer* slot;
+  if (timer.expires - current < innerSlots) {
+    slot = &inner[timer.expires & innerMask];
+  } else {
+    slot = &outer[(timer.expires / innerSlots) % outerSlots];
+  }
+  timer.previous = slot;
+  timer.next = slot->next;
+  if (slot->next != nullptr) { slot->next->previous = &timer; }
+  slot->next = &timer;
+}
+
+
+void TimerWheel::cascade() {
+  Timer& slot = outer[(current / innerSlots) % outerSlots];
+  Timer* timer = slot.next;
+  slot.next = nullptr;
+  while (timer != nullptr) {
+    Timer* next = timer->next;
+    insert(*timer); //all due in this turn of the inner wheel now
+    timer = next;
+  }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Deadlines for thousands of connections, where scheduling, moving and cancelling one is a couple of pointer writes
+ *    and nothing is ever scanned that isn't due - the event loops used to walk every connection once a second.
+ *
+ * Time is cut into ticks of tickLength. A deadline in the next 256 ticks goes straight into that tick's slot of the
+ *    inner wheel. Later ones go into the outer wheel, a slot per 256 ticks, and get moved to the inner wheel when
+ *    their turn comes around (Varghese & Lauck's hierarchical timing wheels, the way the Linux kernel did it). So a
+ *    deadline fires up to a tick late, never early. Deadlines beyond the outer wheel (about 68 minutes) are cut to it.
+ *
+ * A Timer is a node of its slot's list, kept inside whatever it times (a connection) - the wheel allocates nothing.
+ *    It takes itself off the wheel when it's destroyed, so the wheel has to outlive its timers.
+ *
+ * Not thread safe: every event loop has its own.
+*/
+class TimerWheel {
+  public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds tickLength{250};
+
+    class Timer {
+      public:
+        Timer() = default;
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() { cancel(); }
+
+        bool scheduled() const { return previous != nullptr; }
+        void cancel(); //fine if it isn't scheduled
+        std::uint64_t owner = 0; //what the timer is for (a fd, a slot), for whoever gets it back from advance()
+
+      private:
+        Timer* previous = nullptr; //the slot's list head, or the timer before this one
+        Timer* next = nullptr;
+        std::uint64_t expires = 0; //the tick
+        TimerWheel* wheel = nullptr;
+
+        friend class TimerWheel;
+    };
+
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    ~TimerWheel();
+
+    void schedule(Timer& timer, Clock::time_point deadline); //moves the timer if it was scheduled already
+    bool empty() const { return count == 0; }
+
+    template <typename Expired>
+    void advance(Clock::time_point now, Expired expired) {
+      std::uint64_t target = tickOf(now);
+      while (current < target) {
+        if (count == 0) { current = target; return; } //eg. after a night with no connections, not 100000 empty ticks
+        current++;
+        if ((current & innerMask) == 0) { cascade(); }
+        Timer& slot = inner[current & innerMask];
+        while (slot.next != nullptr) { //taken one at a time - expired() may cancel or reschedule the others
+          Timer& timer = *slot.next;
+          timer.cancel();
+          expired(timer);
+        }
+      }
+    } //calls expired(Timer&) for every timer due by now, already off the wheel
+
+  private:
+    static constexpr std::size_t innerSlots = 256;
+    static constexpr std::size_t outerSlots = 64;
+    static constexpr std::uint64_t innerMask = innerSlots - 1;
+
+    Clock::time_point start = Clock::now();
+    std::uint64_t current = 0; //the last tick advance() has handled
+    std::size_t count = 0;
+    std::array<Timer, innerSlots> inner; //list heads. Only next is used, previous marks a timer as scheduled
+    std::array<Timer, outerSlots> outer;
+
+    std::uint64_t tickOf(Clock::time_point time) const;
+    void insert(Timer& timer);
+    void cascade(); //moves the outer slot whose turn it is into the inner wheel
+};
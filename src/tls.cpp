@@ -0,0 +1,294 @@
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+
+static std::string openSslError(); //the oldest error on the thread's queue, which is emptied
+static char* recordBuffer();
+static int selectProtocol(SSL* ssl, const unsigned char** selected, unsigned char* selectedLength, const unsigned char* offered,
+                          unsigned int offeredLength, void*); //ALPN
+
+static constexpr std::size_t maxRecord = 16 * 1024; //the most plaintext one TLS record holds
+static const unsigned char sessionContext[] = "http-server"; //sessions are only resumed with the server that made them
+static const unsigned char protocols[] = "\x02h2\x08http/1.1"; //ALPN's wire format, length prefixed. The one we'd rather comes first
+
+
+/* The threads acceptLater() runs handshakes on, refer tls.hpp. */
+class Tls::HandshakePool {
+  public:
+    HandshakePool(Tls& tls, std::size_t threads) : tls(tls) {
+      for (std::size_t i = 0; i < threads; i++) { std::thread(&HandshakePool::work, this).detach(); }
+    }
+
+    void submit(Handshake handshake) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        handshakes.push_back(std::move(handshake));
+      }
+      wake.notify_one();
+    }
+
+  private:
+    Tls& tls;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Handshake> handshakes;
+
+    void work() {
+      while (true) {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return !handshakes.empty(); });
+        Handshake handshake = std::move(handshakes.front());
+        handshakes.pop_front();
+        guard.unlock();
+        handshake.done(tls.accept(handshake.client_fd, handshake.deadline));
+      }
+    } //one handshake at a time. Each waits on its client with poll(), so a slow client holds up only its own thread
+};
+
+
+Tls& tls() {
+  static Tls instance;
+  return instance;
+}
+
+
+bool Tls::configure(const std::string& certificateFile, const std::string& keyFile, std::size_t handshakeThreads,
+                    std::string& error) {
+  SSL_CTX* made = SSL_CTX_new(TLS_server_method());
+  if (made == nullptr) {
+    error = "can't set up OpenSSL: " + openSslError();
+    return false;
+  }
+  bool loaded = false;
+  if (SSL_CTX_use_certificate_chain_file(made, certificateFile.c_str()) != 1) {
+    error = "can't load --tls-cert " + certificateFile + ": " + openSslError();
+  }
+  else if (SSL_CTX_use_PrivateKey_file(made, keyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+    error = "can't load --tls-key " + keyFile + ": " + openSslError();
+  }
+  else if (SSL_CTX_check_private_key(made) != 1) {
+    error = "--tls-key " + keyFile + " isn't the key of --tls-cert " + certificateFile;
+  }
+  else { loaded = true; }
+  if (!loaded) {
+    SSL_CTX_free(made);
+    return false;
+  }
+
+  SSL_CTX_set_min_proto_version(made, TLS1_2_VERSION);
+  SSL_CTX_set_options(made, SSL_OP_ENABLE_KTLS //refer tls.hpp
+                      | SSL_OP_IGNORE_UNEXPECTED_EOF //a client closing without a close_notify is just a closed connection, as it is without TLS
+                      | SSL_OP_NO_RENEGOTIATION
+                      | SSL_OP_CIPHER_SERVER_PREFERENCE);
+  SSL_CTX_set_mode(made, SSL_MODE_ENABLE_PARTIAL_WRITE //send() returns after each record, like a short sendmsg()
+                   | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER //a retried write comes from wherever the bytes are by then
+                   | SSL_MODE_RELEASE_BUFFERS); //an idle keep-alive connection doesn't hold on to 34 KiB of buffers
+  SSL_CTX_set_session_cache_mode(made, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(made, sessionContext, sizeof(sessionContext) - 1);
+  SSL_CTX_set_timeout(made, 3600); //seconds a session (and a ticket) may be resumed for
+  SSL_CTX_set_alpn_select_cb(made, selectProtocol, nullptr);
+
+  struct rlimit limit = {};
+  sessionCount = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) { sessionCount = limit.rlim_cur; }
+  sessions = std::make_unique<Session[]>(sessionCount); //no fd can be at or above the limit
+  pool = new HandshakePool(*this, handshakeThreads);
+  context = made;
+  return true;
+}
+
+
+bool Tls::accept(int client_fd, std::chrono::steady_clock::time_point deadline) {
+  if (client_fd < 0 || static_cast<std::size_t>(client_fd) >= sessionCount) { return false; } //only if the limit was raised since
+  SSL* ssl = SSL_new(context);
+  if (ssl == nullptr || SSL_set_fd(ssl, client_fd) != 1) {
+    logError("can't set up TLS for client ", client_fd, ": ", openSslError());
+    SSL_free(ssl);
+    return false;
+  }
+
+  int flags = fcntl(client_fd, F_GETFL, 0); //non-blocking, so the handshake can't wait past the deadline
+  bool blocking = flags >= 0 && !(flags & O_NONBLOCK);
+  if (blocking) { fcntl(client_fd, F_SETFL, flags | O_NONBLOCK); }
+  bool shookHands = false;
+  while (true) {
+    int result = SSL_accept(ssl);
+    if (result == 1) {
+      shookHands = true;
+      break;
+    }
+    int error = SSL_get_error(ssl, result);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+      logDebug("TLS handshake with client ", client_fd, " failed: ", error == SSL_ERROR_SSL ? openSslError() : "connection lost");
+      break;
+    }
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    if (left <= std::chrono::milliseconds(0)) {
+      logDebug("client ", client_fd, " took too long to shake hands");
+      break;
+    }
+    struct pollfd waiting = { client_fd, static_cast<short>(error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT), 0 };
+    poll(&waiting, 1, left.count()); //whatever it says, SSL_accept() finds out what happened
+  }
+  if (blocking) { fcntl(client_fd, F_SETFL, flags); }
+  ERR_clear_error();
+  if (!shookHands) {
+    SSL_free(ssl);
+    metrics().tlsHandshakeFailed();
+    return false;
+  }
+
+  Session& session = sessions[client_fd];
+  session.ssl = ssl;
+  session.kernelSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+  session.kernelReceive = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+  session.failed = false;
+  const unsigned char* protocol;
+  unsigned int protocolLength;
+  SSL_get0_alpn_selected(ssl, &protocol, &protocolLength);
+  session.http2 = protocolLength == 2 && std::equal(protocol, protocol + 2, "h2");
+  metrics().countTlsHandshake(SSL_session_reused(ssl), session.kernelSend, session.kernelReceive);
+  logDebug("client ", client_fd, " shook hands with ", SSL_get_version(ssl), " ", SSL_get_cipher_name(ssl),
+           SSL_session_reused(ssl) ? ", resumed" : "", session.kernelSend ? ", kernel sends" : "",
+           session.kernelReceive ? ", kernel receives" : "", session.http2 ? ", HTTP/2" : "");
+  return true;
+}
+
+
+void Tls::acceptLater(int client_fd, std::chrono::steady_clock::time_point deadline, std::function<void(bool)> done) {
+  pool->submit(Handshake{ client_fd, deadline, std::move(done) });
+}
+
+
+void Tls::release(int client_fd) {
+  Session* session = sessionOf(client_fd);
+  if (session == nullptr) { return; }
+  if (!session->failed) { SSL_shutdown(session->ssl); } //sends our close_notify, if the socket takes it. Not waiting for the client's
+  ERR_clear_error();
+  SSL_free(session->ssl);
+  *session = Session();
+}
+
+
+bool Tls::userlandReceive(int client_fd) const {
+  Session* session = sessionOf(client_fd);
+  return session != nullptr && !session->kernelReceive;
+}
+
+
+bool Tls::userlandSend(int client_fd) const {
+  Session* session = sessionOf(client_fd);
+  return session != nullptr && !session->kernelSend;
+}
+
+
+bool Tls::negotiatedHttp2(int client_fd) const {
+  Session* session = sessionOf(client_fd);
+  return session != nullptr && session->http2;
+}
+
+
+ssize_t Tls::receive(int client_fd, char* buffer, std::size_t size) {
+  Session& session = *sessionOf(client_fd);
+  int result = SSL_read(session.ssl, buffer, std::min<std::size_t>(size, INT_MAX));
+  if (result > 0) { return result; }
+  return failure(session, result);
+}
+
+
+ssize_t Tls::send(int client_fd, const struct iovec* parts, std::size_t count) {
+  Session& session = *sessionOf(client_fd);
+  char* record = recordBuffer();
+  std::size_t length = 0;
+  for (std::size_t i = 0; i < count && length < maxRecord; i++) {
+    std::size_t taken = std::min(parts[i].iov_len, maxRecord - length);
+    std::copy_n(static_cast<const char*>(parts[i].iov_base), taken, record + length);
+    length += taken;
+  }
+  int result = SSL_write(session.ssl, record, length);
+  if (result > 0) { return result; }
+  if (failure(session, result) == 0) { errno = EPIPE; } //the client's close_notify - it won't read any more
+  return -1;
+} /*copied into one record's worth of buffer, as SSL_write() takes one buffer - and the copy is what makes a retry
+  after EAGAIN the same bytes again, however the parts were split up the first time*/
+
+
+ssize_t Tls::sendFile(int client_fd, int file_fd, off_t offset, std::size_t length) {
+  Session& session = *sessionOf(client_fd);
+  char* record = recordBuffer();
+  ssize_t bytes_read = pread(file_fd, record, std::min(length, maxRecord), offset);
+  if (bytes_read <= 0) { return bytes_read; }
+  int result = SSL_write(session.ssl, record, bytes_read);
+  if (result > 0) { return result; }
+  if (failure(session, result) == 0) { errno = EPIPE; }
+  return -1;
+}
+
+
+Tls::Session* Tls::sessionOf(int client_fd) const {
+  if (client_fd < 0 || static_cast<std::size_t>(client_fd) >= sessionCount || sessions[client_fd].ssl == nullptr) { return nullptr; }
+  return &sessions[client_fd];
+}
+
+
+ssize_t Tls::failure(Session& session, int result) {
+  int error = errno;
+  switch (SSL_get_error(session.ssl, result)) {
+    case SSL_ERROR_ZERO_RETURN: return 0; //the client's close_notify
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_SYSCALL:
+      session.failed = true;
+      ERR_clear_error();
+      errno = error != 0 ? error : ECONNRESET;
+      return -1;
+    default:
+      session.failed = true;
+      logDebug("TLS error on client ", SSL_get_fd(session.ssl), ": ", openSslError());
+      ERR_clear_error();
+      errno = EPROTO;
+      return -1;
+  }
+} //EAGAIN is what a timeout looks like in the threads mode, as it does without TLS
+
+
+static std::string openSslError() {
+  char text[256];
+  ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+  ERR_clear_error();
+  return text;
+}
+
+
+static char* recordBuffer() {
+  thread_local std::unique_ptr<char[]> record = std::make_unique<char[]>(maxRecord);
+  return record.get();
+} //what's sent is encrypted into OpenSSL's own buffer, so the next connection on the thread may have it right away
+
+
+static int selectProtocol(SSL*, const unsigned char** selected, unsigned char* selectedLength, const unsigned char* offered,
+                          unsigned int offeredLength, void*) {
+  unsigned char* chosen;
+  if (SSL_select_next_proto(&chosen, selectedLength, protocols, sizeof(protocols) - 1, offered, offeredLength) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK; //nothing we speak - carry on without ALPN, which is HTTP/1.1
+  }
+  *selected = chosen;
+  return SSL_TLSEXT_ERR_OK;
+} //ours in our order of preference, the first the client offers too
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ssl_st; //OpenSSL's SSL and SSL_CTX, so this header doesn't pull in all of OpenSSL
+struct ssl_ctx_st;
+
+
+/**
+ * HTTPS on the listeners, with --tls-cert and --tls-key (PEM files: the certificate chain, and its private key).
+ *
+ * OpenSSL does the handshakes. Once one is done, the kernel takes the connection's encryption over if it can (kTLS,
+ *    refer https://docs.kernel.org/networking/tls.html): OpenSSL hands it the keys, and from then on send(), sendfile()
+ *    and recv() on the socket carry plaintext while the kernel makes and opens the records. So files/ still go out
+ *    with sendfile(), without their bytes ever coming up to us, and nothing in the workers changes. It takes the tls
+ *    kernel module (modprobe tls) and a cipher the kernel knows, AES-GCM or ChaCha20-Poly1305 - and OpenSSL 3.0 only
+ *    hands over the sending side of TLS 1.3.
+ * Whatever the kernel doesn't take over, OpenSSL does: receiveInto() and sendResponses() go through SSL_read() and
+ *    SSL_write() (refer receive() and send()), and a file is read into a buffer to be encrypted (refer sendFile()).
+ *
+ * A handshake is a few milliseconds of public key crypto, so the epoll and coroutine workers don't do them - that
+ *    would stall every other connection on the worker meanwhile. They run on a pool of threads of their own
+ *    (--tls-threads, refer acceptLater()), and the worker gets the connection once it's ready to carry requests. In
+ *    the threads mode a connection shakes hands on its own thread. The io_uring workers receive and send in the kernel
+ *    with no room for OpenSSL in between, so with TLS main() starts the epoll workers instead.
+ *
+ * ALPN picks the protocol in the handshake: HTTP/2 if the client offers it (refer http2.hpp), HTTP/1.1 otherwise.
+ *
+ * Sessions are resumed, which skips the certificate and its signature: with tickets (TLS 1.3, and 1.2 clients that
+ *    ask for them - their keys are made at startup, so they don't outlive the process), or out of OpenSSL's session
+ *    cache for 1.2 clients that don't.
+ *
+ * What OpenSSL keeps per connection is found by fd, in a table like admission's: accept() sets it up, and release()
+ *    frees it before the fd is closed. A fd without one is a plain socket.
+*/
+class Tls {
+  public:
+    Tls() = default;
+    Tls(const Tls&) = delete;
+    Tls& operator=(const Tls&) = delete;
+
+    bool configure(const std::string& certificateFile, const std::string& keyFile, std::size_t handshakeThreads,
+                   std::string& error); //before any connection is accepted. false with error saying what's wrong
+    bool enabled() const { return context != nullptr; }
+
+    bool accept(int client_fd, std::chrono::steady_clock::time_point deadline); //the handshake, on the calling thread. false if it failed or didn't finish in time
+    void acceptLater(int client_fd, std::chrono::steady_clock::time_point deadline, std::function<void(bool)> done); /*the
+      same on the handshake threads - done is called there, with what accept() returned*/
+    void release(int client_fd); //before the fd is closed. Fine for fds without TLS
+
+    bool userlandReceive(int client_fd) const; //received through receive(), as the kernel doesn't decrypt for it
+    bool userlandSend(int client_fd) const; //sent through send() and sendFile(), as the kernel doesn't encrypt for it
+    bool negotiatedHttp2(int client_fd) const; //the client and we agreed on "h2" in the handshake, refer http2.hpp
+    ssize_t receive(int client_fd, char* buffer, std::size_t size); //like recv()
+    ssize_t send(int client_fd, const struct iovec* parts, std::size_t count); /*like sendmsg(), but sends at most one
+      record. After EAGAIN, the next call must start with the same bytes - and at least as many of them*/
+    ssize_t sendFile(int client_fd, int file_fd, off_t offset, std::size_t length); //like sendfile(), without moving the offset. The same after EAGAIN
+
+  private:
+    struct Session {
+      ssl_st* ssl = nullptr;
+      bool kernelSend = false;
+      bool kernelReceive = false;
+      bool failed = false; //a fatal error - such a connection doesn't get a close_notify
+      bool http2 = false; //what ALPN settled on
+    };
+    struct Handshake {
+      int client_fd;
+      std::chrono::steady_clock::time_point deadline;
+      std::function<void(bool)> done;
+    };
+    class HandshakePool;
+
+    ssl_ctx_st* context = nullptr;
+    std::unique_ptr<Session[]> sessions; //by fd
+    std::size_t sessionCount = 0;
+    HandshakePool* pool = nullptr; //never destroyed, like the logger - a handshake may still be running while the process exits
+
+    Session* sessionOf(int client_fd) const;
+    ssize_t failure(Session& session, int result); //errno for an SSL_read() or SSL_write() that returned result, and -1
+};
+
+Tls& tls();
@@ -0,0 +1,181 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <charconv>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+
+bool tracingAvailable() {
+#ifdef WITH_TRACING
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+#ifndef WITH_TRACING
+
+bool configureTracing(const std::string& path, std::size_t) { return path.empty(); } //nothing to trace with
+
+#else
+
+/* Each thread keeps the spans of its samples in its own list, under a lock only the writer thread ever competes for -
+  and only while it swaps the list for an empty one. */
+namespace {
+  struct Span {
+    const char* name;
+    std::int64_t start; //nanoseconds, refer traceClock()
+    std::int64_t end;
+    std::string detail;
+  };
+
+  struct ThreadSpans {
+    std::mutex lock;
+    std::vector<Span> spans;
+    pid_t tid = gettid();
+  };
+
+  struct Tracer {
+    std::atomic<std::size_t> sampleEvery{0}; //0 until configured
+    int trace_fd = -1;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex threadsMutex; //guards threads - only taken when a thread is sampled for the first time, and by the writer
+    std::vector<std::shared_ptr<ThreadSpans>> threads; //kept after their thread exits, handfuls of them at most
+  };
+
+  Tracer& tracer() {
+    static Tracer* instance = new Tracer();
+    return *instance;
+  } //never destroyed, like the logger - workers may still be tracing while the process exits
+
+  ThreadSpans& threadSpans() {
+    thread_local std::shared_ptr<ThreadSpans> spans = [] {
+      auto made = std::make_shared<ThreadSpans>();
+      std::lock_guard<std::mutex> guard(tracer().threadsMutex);
+      tracer().threads.push_back(made);
+      return made;
+    }();
+    return *spans;
+  }
+
+  void appendEscaped(std::string& out, std::string_view text) {
+    for (char c : text) {
+      if (c == '"' || c == '\\') { out += '\\'; out += c; }
+      else if (static_cast<unsigned char>(c) < 0x20) { out += ' '; } //nothing in a request target needs them kept
+      else { out += c; }
+    }
+  } //the detail is a request target, straight from the client
+
+  void appendMicroseconds(std::string& out, std::int64_t nanoseconds) {
+    char digits[32];
+    auto [end, error] = std::to_chars(digits, digits + sizeof(digits), nanoseconds / 1000);
+    out.append(digits, end);
+    out += '.';
+    std::int64_t fraction = nanoseconds % 1000;
+    out += static_cast<char>('0' + fraction / 100);
+    out += static_cast<char>('0' + fraction / 10 % 10);
+    out += static_cast<char>('0' + fraction % 10);
+  } //Chrome trace timestamps are microseconds
+
+  void writeSpans() {
+    /* The JSON Array Format: a '[' and one complete event ("ph":"X") per line, each followed by a comma. The closing
+      ']' may be left off, which is what lets the file be appended to until the server stops. */
+    Tracer& state = tracer();
+    std::string batch;
+    std::vector<Span> taken;
+    pid_t pid = getpid();
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      std::vector<std::shared_ptr<ThreadSpans>> threads;
+      {
+        std::lock_guard<std::mutex> guard(state.threadsMutex);
+        threads = state.threads;
+      }
+      batch.clear();
+      for (auto& thread : threads) {
+        {
+          std::lock_guard<std::mutex> guard(thread->lock);
+          taken.swap(thread->spans);
+        }
+        for (const Span& span : taken) {
+          batch += "{\"name\":\"";
+          batch += span.name;
+          batch += "\",\"ph\":\"X\",\"ts\":";
+          appendMicroseconds(batch, span.start);
+          batch += ",\"dur\":";
+          appendMicroseconds(batch, span.end - span.start);
+          batch += ",\"pid\":";
+          batch += std::to_string(pid);
+          batch += ",\"tid\":";
+          batch += std::to_string(thread->tid);
+          if (!span.detail.empty()) {
+            batch += ",\"args\":{\"detail\":\"";
+            appendEscaped(batch, span.detail);
+            batch += "\"}";
+          }
+          batch += "},\n";
+        }
+        taken.clear();
+      }
+      for (std::size_t written = 0; written < batch.size(); ) {
+        ssize_t result = write(state.trace_fd, batch.data() + written, batch.size() - written);
+        if (result <= 0) { break; } //a full disk loses spans, not the server
+        written += result;
+      }
+    }
+  }
+}
+
+
+bool configureTracing(const std::string& path, std::size_t sampleEvery) {
+  if (path.empty()) { return true; }
+  Tracer& state = tracer();
+  state.trace_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (state.trace_fd < 0) { return false; }
+  if (write(state.trace_fd, "[\n", 2) != 2) { return false; }
+  state.epoch = std::chrono::steady_clock::now();
+  state.sampleEvery.store(std::max<std::size_t>(sampleEvery, 1), std::memory_order_relaxed);
+  std::thread(writeSpans).detach();
+  return true;
+}
+
+
+std::int64_t traceClock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tracer().epoch).count();
+} //steady_clock is a vDSO call reading the TSC on x86, no system call
+
+
+void recordSpan(const char* name, std::int64_t start, std::int64_t end, std::string_view detail) {
+  ThreadSpans& spans = threadSpans();
+  std::lock_guard<std::mutex> guard(spans.lock);
+  spans.spans.push_back({ name, start, end, std::string(detail) });
+}
+
+
+TraceSample::TraceSample(const char* name) : name(name) {
+  std::size_t every = tracer().sampleEvery.load(std::memory_order_relaxed);
+  if (every == 0 || traceSampled) { return; } //tracing is off, or this is part of a sample already
+  thread_local std::size_t batches = 0;
+  if (++batches % every != 0) { return; }
+  traceSampled = true;
+  owner = true;
+  start = traceClock();
+}
+
+
+TraceSample::~TraceSample() {
+  if (!owner) { return; }
+  recordSpan(name, start, traceClock(), {});
+  traceSampled = false;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Where a sampled request's time goes: recv(), parsing, routing, path checks, the file and send(), as spans in the
+ *    Chrome trace format - open the --trace-file in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Only a build configured with -DTRACING=ON traces anything (it defines WITH_TRACING). Otherwise TraceSample and
+ *    TraceSpan are empty classes whose constructors do nothing, and the compiler drops them entirely.
+ *
+ * Even then only 1 in --trace-sample batches is traced: a TraceSample marks the work a thread does for one batch of a
+ *    connection's bytes - answering what arrived, and sending the responses - and decides whether it's one of them.
+ *    Spans opened outside a sampled batch cost a thread local load. Spans of a sampled one are collected per thread,
+ *    and a background thread writes them out every 100ms, so the file is never written by a worker.
+ *
+ * A TraceSample must not be held across a co_await - the next coroutine on the thread would be traced as part of it.
+*/
+bool configureTracing(const std::string& path, std::size_t sampleEvery); //an empty path leaves tracing off. false if the file can't be opened
+bool tracingAvailable(); //whether this build has WITH_TRACING
+
+
+#ifdef WITH_TRACING
+
+inline thread_local bool traceSampled = false; //inside a sampled TraceSample
+
+std::int64_t traceClock(); //nanoseconds since tracing was configured
+void recordSpan(const char* name, std::int64_t start, std::int64_t end, std::string_view detail); //from the thread it's about
+
+class TraceSample {
+  public:
+    explicit TraceSample(const char* name);
+    TraceSample(const TraceSample&) = delete;
+    TraceSample& operator=(const TraceSample&) = delete;
+    ~TraceSample();
+
+  private:
+    const char* name;
+    std::int64_t start = 0;
+    bool owner = false; //false if this thread was already in a sample, or this batch isn't traced
+};
+
+class TraceSpan {
+  public:
+    explicit TraceSpan(const char* name) : name(name) { if (traceSampled) { start = traceClock(); } }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan() { if (traceSampled && start >= 0) { recordSpan(name, start, traceClock(), detail); } }
+
+    void describe(std::string_view text) { if (traceSampled) { detail = text; } } //eg. the request target, shown with the span
+
+  private:
+    const char* name;
+    std::int64_t start = -1; //-1 if the span began outside a sample
+    std::string detail;
+};
+
+#else
+
+class TraceSample {
+  public:
+    explicit TraceSample(const char*) {}
+};
+
+class TraceSpan {
+  public:
+    explicit TraceSpan(const char*) {}
+    void describe(std::string_view) {}
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "upload.hpp"
+
+
+FileUpload::~FileUpload() {
+  abort();
+}
+
+
+bool FileUpload::begin(const FilePath& destination, UploadSync sync) {
+  abort();
+  int opened_fd = openDirectoryOf(destination);
+  if (opened_fd < 0) { return false; }
+  std::size_t slash = destination.relative.rfind('/');
+  std::string leaf(slash == std::pmr::string::npos ? destination.relative : destination.relative.substr(slash + 1));
+
+  //a name of our own, created with O_EXCL so concurrent uploads (and whatever else is in the directory) never collide
+  static std::atomic<std::uint64_t> uploads{0};
+  std::string temporary;
+  int fd = -1;
+  for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+    temporary = ".upload-" + std::to_string(getpid()) + "-" + std::to_string(uploads++);
+    fd = openat(opened_fd, temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 && errno != EEXIST) { break; }
+  }
+  if (fd < 0) {
+    int error = errno;
+    close(opened_fd);
+    errno = error;
+    return false;
+  }
+  fchmod(fd, 0644); //whatever the umask, like the files it replaces are expected to be
+
+  file_fd = fd;
+  directory_fd = opened_fd;
+  temporaryName = std::move(temporary);
+  name = std::move(leaf);
+  this->destination = std::string(destination.full);
+  this->sync = sync;
+  failed = false;
+  return true;
+}
+
+
+void FileUpload::write(std::string_view data) {
+  while (!failed && !data.empty()) {
+    ssize_t written = ::write(file_fd, data.data(), data.size());
+    if (written < 0 && errno == EINTR) { continue; }
+    if (written <= 0) {
+      failed = true; //disk full, most likely. We keep accepting the body so the client gets a clean 500 at the end
+      break;
+    }
+    data.remove_prefix(written);
+  }
+}
+
+
+bool FileUpload::finish() {
+  if (!active()) { return false; }
+  bool ok = !failed && (sync == UploadSync::None || fsync(file_fd) == 0);
+  close(file_fd);
+  file_fd = -1;
+
+  //renameat() replaces a symlink called name rather than following it, so this stays in directory_fd too
+  if (ok && renameat(directory_fd, temporaryName.c_str(), directory_fd, name.c_str()) != 0) { ok = false; }
+  if (!ok) { unlinkat(directory_fd, temporaryName.c_str(), 0); }
+
+  if (ok && sync == UploadSync::Full) {
+    int synced_fd = openat(directory_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); //fsync() needs more than O_PATH
+    if (synced_fd >= 0) {
+      fsync(synced_fd);
+      close(synced_fd);
+    }
+  }
+  close(directory_fd);
+  directory_fd = -1;
+  return ok;
+}
+
+
+void FileUpload::abort() {
+  if (!active()) { return; }
+  close(file_fd);
+  file_fd = -1;
+  unlinkat(directory_fd, temporaryName.c_str(), 0);
+  close(directory_fd);
+  directory_fd = -1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "path_resolver.hpp"
+
+
+enum class UploadSync {
+  None, //leave it to the kernel to write the file out eventually (fastest)
+  File, //fsync() the file before it's renamed into place
+  Full //also fsync() the directory, so the rename itself survives a crash
+};
+
+/**
+ * A file being POSTed to files/.
+ * 
+ * The body is written to a temporary file next to the destination as it arrives, so memory use doesn't depend on
+ *    the size of the file. Only once the whole body is in is the temporary file renamed over the destination - rename()
+ *    is atomic, so readers see either the old file or the complete new one, never half an upload.
+ * Both happen in the destination's directory, opened beneath --directory the way a GET opens a file (refer
+ *    path_resolver.hpp) - a symlink can't send an upload anywhere a download couldn't come from.
+ * An upload that is abandoned (client disconnects, body too large...) just deletes its temporary file.
+*/
+class FileUpload {
+  public:
+    FileUpload() = default;
+    FileUpload(const FileUpload&) = delete;
+    FileUpload& operator=(const FileUpload&) = delete;
+    ~FileUpload();
+
+    bool begin(const FilePath& destination, UploadSync sync); //creates the temporary file. false with errno - EXDEV if destination leads out of its directory
+    void write(std::string_view data); //a failed write is remembered and reported by finish()
+    bool finish(); //flushes according to the sync policy and renames into place
+    void abort(); //deletes the temporary file
+    bool active() const { return file_fd >= 0; }
+    const std::string& path() const { return destination; } //where finish() puts the file
+
+  private:
+    int file_fd = -1;
+    int directory_fd = -1; //O_PATH, what the names below are relative to
+    std::string temporaryName;
+    std::string name;
+    std::string destination;
+    UploadSync sync = UploadSync::None;
+    bool failed = false;
+};
@@ -0,0 +1,937 @@
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include "uring_loop.hpp"
+#include "event_loop.hpp"
+#include "server.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "admission.hpp"
+#include "timer_wheel.hpp"
+#include "drain.hpp"
+
+
+/**
+ * io_uring based workers, selected with --io uring.
+ *
+ * With epoll the kernel tells us a socket is ready and we still make the recv()/send() calls ourselves - two system
+ *    calls or more per read. io_uring(7) instead shares two queues with the kernel: we write what we want done into
+ *    the submission queue, the kernel does it and puts the result into the completion queue. One io_uring_enter()
+ *    hands over everything queued since the last one and waits for results, so a busy worker makes about one system
+ *    call per loop no matter how many sockets it serves.
+ *
+ * There's no liburing here - the rings are mapped and driven with the raw system calls, refer Ring.
+ *
+ * Like the epoll workers, every worker is pinned to a core and has its own SO_REUSEPORT listener (refer event_loop.cpp),
+ *    and on top of that its own ring:
+ *  - one multishot accept on the listener keeps producing a completion per new client
+ *  - one multishot recv per client does the same for its data. It doesn't name a buffer - the kernel picks one from
+ *    a ring of buffers we provide (refer ReceiveBuffers), so idle connections don't each hold a receive buffer. It's
+ *    cancelled while the client's responses are backed up (refer ResponseQueue::backedUp()), and armed again once
+ *    they've gone out - a client pipelining requests without reading the responses doesn't get any more answered
+ *  - heads and bodies are sent with sendmsg() from the same iovecs sendResponses() would use. A connection's last send
+ *    is linked to its close(), which the kernel runs only after everything has gone out
+ *  - files aren't opened while answering. fetchFileContents() leaves cache misses to the ring (refer
+ *    HttpResponse::deferred), which opens and stats them, then reads and sends them a chunk at a time - a worker never
+ *    waits on the disk for a file it's sending
+ *  - one timeout a tick long keeps coming back to move the worker's timer wheel along (refer timer_wheel.hpp), which
+ *    holds every connection's deadline, like the epoll workers'
+ *  - one poll on the drain notice (refer drain.hpp) tells the worker to cancel its accept and close its connections as
+ *    they finish their last request
+ *
+ * Before starting, uringAvailable() checks the kernel has all of that (6.0 or newer). If it hasn't, main() uses the
+ *    epoll workers instead.
+ *
+*/
+
+namespace { //internal to this file - event_loop.cpp has a Connection of its own
+  enum class Op : std::uint8_t { Accept, Timer, Drain, StopAccepting, //the worker's own
+                                 Receive, Send, FileRead, FileSend, Open, Stat, Cancel, Close }; //a connection's
+
+  constexpr unsigned ringEntries = 1024;
+  constexpr unsigned receiveBufferCount = 256; //per worker, a power of two
+  constexpr std::uint16_t receiveBufferGroup = 0;
+  constexpr std::size_t fileChunkSize = 64 * 1024; //bytes of a file read and sent at a time
+
+  std::uint64_t userData(std::uint32_t slot, Op op) { return (std::uint64_t(slot) << 8) | std::uint64_t(op); } /*a
+  completion's user_data says which connection (its slot) and which operation it belongs to*/
+
+
+/* The submission and completion queues, mapped from the ring's fd. The kernel moves the submission queue's head and
+  the completion queue's tail, we move the other two - with release stores, so the kernel sees the entries before the
+  index that hands them over (and acquire loads for the same reason the other way round). */
+class Ring {
+  public:
+    Ring() = default;
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring();
+
+    bool setup(unsigned entries); //false with errno set if the kernel won't give us a ring
+    int fd() const { return ring_fd; }
+    struct io_uring_sqe* nextSqe(); //a zeroed entry to fill in. nullptr if the queue is full even after submitting it
+    bool submit(unsigned waitFor = 0); //hands everything queued to the kernel, and waits for waitFor completions
+
+    template <typename Handler>
+    void forEachCompletion(Handler handler) {
+      std::atomic_ref<unsigned> head(*cqHead);
+      std::atomic_ref<unsigned> tail(*cqTail);
+      for (unsigned next = head.load(std::memory_order_relaxed); next != tail.load(std::memory_order_acquire); next++) {
+        struct io_uring_cqe completion = cqes[next & cqMask];
+        head.store(next + 1, std::memory_order_release); //copied, so the kernel may reuse the entry
+        handler(completion);
+      }
+    }
+
+  private:
+    int ring_fd = -1;
+    void* sqRing = MAP_FAILED;
+    std::size_t sqRingSize = 0;
+    void* cqRing = MAP_FAILED;
+    std::size_t cqRingSize = 0;
+    struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    std::size_t sqesSize = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned sqQueued = 0; //our tail - entries up to here have been filled in, the kernel gets them on submit()
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+};
+
+/* Buffers the kernel receives into, registered as a provided buffer ring: a ring of (address, length, id) the kernel
+  takes buffers from and we put them back into once their data has been copied out. */
+class ReceiveBuffers {
+  public:
+    ReceiveBuffers() = default;
+    ReceiveBuffers(const ReceiveBuffers&) = delete;
+    ReceiveBuffers& operator=(const ReceiveBuffers&) = delete;
+    ~ReceiveBuffers();
+
+    bool setup(int ring_fd, unsigned count, std::size_t size); //count must be a power of two
+    const char* data(std::uint16_t id) const { return memory.get() + std::size_t(id) * size; }
+    void recycle(std::uint16_t id); //gives the buffer back to the kernel
+
+  private:
+    struct io_uring_buf_ring* ring = static_cast<struct io_uring_buf_ring*>(MAP_FAILED);
+    std::size_t ringSize = 0;
+    std::unique_ptr<char[]> memory;
+    std::size_t size = 0;
+    unsigned mask = 0;
+    std::uint16_t tail = 0;
+};
+
+struct Connection {
+  Connection(int fd, const ServerConfig& config) : fd(fd), session(config) {}
+
+  int fd;
+  ClientSession session; //received bytes, the parser (which resumes where it stopped) and any upload in progress
+  ResponseQueue out; //responses waiting to be sent, in request order
+  std::array<struct iovec, 64> parts; //what the sendmsg() in flight sends - the kernel reads these when it gets to it
+  struct msghdr message = {};
+  std::unique_ptr<char[]> fileChunk; //a file's bytes on their way from the disk to the socket. Allocated for the first file sent
+  std::size_t chunkLength = 0;
+  std::string openPath; //the deferred file being opened, relative to its directory. A copy, because the response moves whenever out grows
+  int opened_fd = -1; //the file being stat'ed
+  struct statx info = {};
+  TimerWheel::Timer deadline; //owned by the slot
+
+  unsigned inFlight = 0; //operations submitted and not completed yet. The connection can only go once this is 0
+  bool receiving = false; //the multishot recv is armed
+  bool backedUp = false; //out was, so the recv is cancelled - what it still brings waits in pending, refer resumeReceiving()
+  bool sending = false; //a sendmsg() or a file chunk's read + send is in flight - there's only ever one
+  bool opening = false; //a deferred file is being opened or stat'ed
+  bool closeAfterFlush = false; //close once out has been sent
+  bool closing = false; //nothing new gets submitted, the socket is closed as soon as the send in flight is done
+  bool closeSubmitted = false;
+  bool closed = false;
+};
+
+class UringWorker {
+  public:
+    UringWorker(int listen_fd, const ServerConfig& config) : listen_fd(listen_fd), config(config) {}
+    void run();
+
+  private:
+    int listen_fd;
+    ServerConfig config;
+    ReceiveBuffers buffers; //before ring, so the ring is closed before its buffers are freed
+    Ring ring;
+    TimerWheel timers; //before connections, which take their timers off it as they go
+    std::vector<std::unique_ptr<Connection>> connections; //by slot
+    std::vector<std::uint32_t> freeSlots;
+    bool accepting = true; //until the drain begins
+    struct __kernel_timespec tick = { 0, std::chrono::nanoseconds(TimerWheel::tickLength).count() };
+
+    void handle(const struct io_uring_cqe& completion);
+    void onAccept(const struct io_uring_cqe& completion);
+    void onReceive(std::uint32_t slot, const struct io_uring_cqe& completion);
+    void onSend(std::uint32_t slot, const struct io_uring_cqe& completion);
+    void onFileSend(std::uint32_t slot, const struct io_uring_cqe& completion);
+    void onOpen(std::uint32_t slot, const struct io_uring_cqe& completion);
+    void onStat(std::uint32_t slot, const struct io_uring_cqe& completion);
+    void onClose(std::uint32_t slot, const struct io_uring_cqe& completion);
+
+    void advance(std::uint32_t slot); //submits whatever the connection can do next
+    void startOpen(std::uint32_t slot);
+    void finishOpen(Connection& connection, int result); //the opened file, or -errno if it couldn't be opened or stat'ed
+    void startSend(std::uint32_t slot);
+    void holdReceiving(std::uint32_t slot); //once out is backed up
+    void resumeReceiving(std::uint32_t slot); //once enough of it has been sent
+    void beginClose(std::uint32_t slot);
+    void scheduleDeadline(std::uint32_t slot); //after anything happened on the connection
+    void stopAccepting();
+    bool finished(std::uint32_t slot) const; //draining, and the connection is done with its last request
+    void expire(std::uint32_t slot);
+    void release(std::uint32_t slot);
+
+    struct io_uring_sqe* prepare(std::uint32_t slot, Op op);
+    bool submitAccept();
+    bool submitTimer();
+    bool submitDrainPoll();
+    bool submitReceive(std::uint32_t slot);
+    void submitClose(std::uint32_t slot);
+};
+}
+
+static void uringLoop(int listen_fd, ServerConfig config);
+static struct stat toStat(const struct statx& info);
+
+static const struct open_how openBeneath = { O_RDONLY | O_CLOEXEC, 0, RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+
+
+bool uringAvailable() {
+  Ring ring;
+  if (!ring.setup(8)) {
+    logWarning("io_uring isn't available (", std::strerror(errno), "), using epoll instead");
+    return false;
+  }
+
+  constexpr std::size_t probeOps = 256;
+  std::vector<std::uint64_t> storage((sizeof(struct io_uring_probe) + probeOps * sizeof(struct io_uring_probe_op)) / 8 + 1);
+  auto* probe = reinterpret_cast<struct io_uring_probe*>(storage.data());
+  if (syscall(__NR_io_uring_register, ring.fd(), IORING_REGISTER_PROBE, probe, probeOps) < 0) {
+    logWarning("can't ask io_uring what it supports (", std::strerror(errno), "), using epoll instead");
+    return false;
+  }
+  /* IORING_OP_SEND_ZC is never used, it stands in for multishot recv: both came with 6.0, and only opcodes show up in
+    the probe. */
+  for (int op : { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SEND, IORING_OP_READ, IORING_OP_OPENAT2,
+                  IORING_OP_STATX, IORING_OP_CLOSE, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD, IORING_OP_SEND_ZC }) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      logWarning("this kernel's io_uring lacks operation ", op, ", using epoll instead");
+      return false;
+    }
+  }
+
+  ReceiveBuffers buffers;
+  if (!buffers.setup(ring.fd(), 1, 64)) {
+    logWarning("io_uring has no provided buffer rings (", std::strerror(errno), "), using epoll instead");
+    return false;
+  }
+  return true;
+}
+
+
+int runUringLoops(const std::vector<int>& listeners, const ServerConfig& config) {
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpuCount < 1) { cpuCount = 1; }
+
+  logInfo("server ", listeners[0], " is running ", listeners.size(), " io_uring worker(s) on port ", config.port);
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < listeners.size(); i++) {
+    workers.emplace_back(uringLoop, listeners[i], config);
+    pinToCore(workers.back(), i % cpuCount);
+  }
+  for (std::thread& worker : workers) { worker.join(); }
+  for (std::size_t i = 1; i < listeners.size(); i++) { close(listeners[i]); }
+  return 0;
+}
+
+
+static void uringLoop(int listen_fd, ServerConfig config) {
+  UringWorker worker(listen_fd, config);
+  worker.run();
+}
+
+
+void UringWorker::run() {
+  deferFileOpens(true); //the ring opens files, refer finishOpen()
+  if (!ring.setup(ringEntries)) { //in the worker, as the ring is set up for a single thread submitting to it
+    std::cerr << "io_uring_setup failed: " << std::strerror(errno) << "\n";
+    return;
+  }
+  if (!buffers.setup(ring.fd(), receiveBufferCount, config.readSize)) {
+    std::cerr << "Failed to register io_uring receive buffers: " << std::strerror(errno) << "\n";
+    return;
+  }
+  if (!submitAccept() || !submitTimer() || !submitDrainPoll()) {
+    std::cerr << "io_uring submission queue is full before we started\n";
+    return;
+  }
+
+  while (accepting || freeSlots.size() < connections.size()) { //until it's drained
+    if (!ring.submit(1)) {
+      std::cerr << "io_uring_enter failed: " << std::strerror(errno) << "\n";
+      break;
+    }
+    ring.forEachCompletion([this](const struct io_uring_cqe& completion) { handle(completion); });
+  }
+
+  for (auto& connection : connections) {
+    if (connection != nullptr && !connection->closed) { close(connection->fd); }
+  }
+}
+
+
+void UringWorker::handle(const struct io_uring_cqe& completion) {
+  Op op = static_cast<Op>(completion.user_data & 0xff);
+  std::uint32_t slot = completion.user_data >> 8;
+  bool more = completion.flags & IORING_CQE_F_MORE; //a multishot operation that keeps going
+  if (op > Op::StopAccepting && !more) { connections[slot]->inFlight--; } //the others don't belong to a connection
+
+  switch (op) {
+    case Op::Accept: onAccept(completion); return;
+    case Op::Timer:
+      timers.advance(std::chrono::steady_clock::now(), [this](TimerWheel::Timer& timer) { expire(timer.owner); });
+      if (!submitTimer()) { logError("io_uring submission queue full, connections won't time out"); }
+      return;
+    case Op::Drain: stopAccepting(); return;
+    case Op::StopAccepting: return;
+    case Op::Receive: onReceive(slot, completion); break;
+    case Op::Send: onSend(slot, completion); break;
+    case Op::FileRead: break; //its send goes with it - refer onFileSend()
+    case Op::FileSend: onFileSend(slot, completion); break;
+    case Op::Open: onOpen(slot, completion); break;
+    case Op::Stat: onStat(slot, completion); break;
+    case Op::Cancel: break;
+    case Op::Close: onClose(slot, completion); break;
+  }
+  advance(slot);
+  if (connections[slot] == nullptr || connections[slot]->closing) { return; }
+  if (finished(slot)) {
+    beginClose(slot);
+    advance(slot);
+    return;
+  }
+  scheduleDeadline(slot);
+}
+
+
+void UringWorker::onAccept(const struct io_uring_cqe& completion) {
+  if (!(completion.flags & IORING_CQE_F_MORE) && accepting && !submitAccept()) { //the kernel ends a multishot accept on errors
+    logError("io_uring submission queue full, listener ", listen_fd, " stops accepting");
+  }
+  if (completion.res == -ECANCELED && !accepting) { return; } //refer stopAccepting()
+  if (completion.res < 0) {
+    logError("accept failed on listener ", listen_fd, ": ", std::strerror(-completion.res));
+    return;
+  }
+  if (!admission().admit(completion.res)) {
+    logWarning("too many connections for client ", completion.res, ", sending 503");
+    rejectClient(completion.res);
+    return;
+  }
+
+  std::uint32_t slot;
+  if (freeSlots.empty()) {
+    slot = connections.size();
+    connections.emplace_back();
+  } else {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  }
+  connections[slot] = std::make_unique<Connection>(completion.res, config);
+  connections[slot]->deadline.owner = slot;
+  metrics().connectionOpened();
+  logDebug("client ", completion.res, " connected");
+  if (!submitReceive(slot)) {
+    beginClose(slot);
+    advance(slot);
+    return;
+  }
+  scheduleDeadline(slot);
+}
+
+
+void UringWorker::onReceive(std::uint32_t slot, const struct io_uring_cqe& completion) {
+  Connection& connection = *connections[slot];
+  if (!(completion.flags & IORING_CQE_F_MORE)) { connection.receiving = false; }
+
+  if (completion.flags & IORING_CQE_F_BUFFER) {
+    std::uint16_t id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (completion.res > 0 && !connection.closing && connection.session.keepAlive) {
+      connection.session.pending.append(buffers.data(id), completion.res);
+      metrics().bytesReceived(completion.res);
+        }
+    buffers.recycle(id); //copied out, so the kernel can have it back straight away
+  }
+
+  if (completion.res > 0) {
+    if (!connection.closing && connection.session.keepAlive && !connection.backedUp) {
+      TraceSample sample("connection"); //only the answering - the ring does the receiving and sending
+      answerRequests(connection.fd, connection.session, connection.out, config); //after every recv, like the epoll workers
+      if (!connection.session.keepAlive) { connection.closeAfterFlush = true; } //still send whatever was asked for before leaving
+      else if (connection.out.backedUp()) { holdReceiving(slot); }
+    }
+  } else if (completion.res == 0) {
+    connection.closeAfterFlush = true; //orderly shutdown by the client
+  } else if (completion.res != -ENOBUFS && completion.res != -ECANCELED) {
+    logDebug("error receiving from client ", connection.fd, ": ", std::strerror(-completion.res));
+    beginClose(slot);
+  }
+
+  //ENOBUFS - every buffer was in use, and we've just given some back
+  if (!connection.receiving && !connection.closing && !connection.closeAfterFlush && !connection.backedUp && !submitReceive(slot)) {
+    beginClose(slot);
+  }
+}
+
+
+void UringWorker::onSend(std::uint32_t slot, const struct io_uring_cqe& completion) {
+  Connection& connection = *connections[slot];
+  connection.sending = false;
+  if (completion.res < 0) {
+    logDebug("error sending HTTP response to client ", connection.fd); //almost always the client hanging up early
+    beginClose(slot);
+    return;
+  }
+  markSent(connection.out, completion.res);
+  connection.out.popFinished();
+  if (connection.backedUp && !connection.out.backedUp()) { resumeReceiving(slot); }
+}
+
+
+void UringWorker::onFileSend(std::uint32_t slot, const struct io_uring_cqe& completion) {
+  Connection& connection = *connections[slot];
+  connection.sending = false;
+  if (completion.res != static_cast<int>(connection.chunkLength)) { /*the send failed, or was cancelled because the read
+    before it failed or came up short - the file got shorter since we sent its Content-Length*/
+    logDebug("error sending file to client ", connection.fd);
+    beginClose(slot);
+    return;
+  }
+  HttpResponse& front = connection.out.front();
+  front.fileOffset += completion.res;
+  front.fileLength -= completion.res;
+  metrics().bytesSent(completion.res);
+  connection.out.popFinished();
+  if (connection.backedUp && !connection.out.backedUp()) { resumeReceiving(slot); }
+}
+
+
+void UringWorker::onOpen(std::uint32_t slot, const struct io_uring_cqe& completion) {
+  Connection& connection = *connections[slot];
+  if (connection.closing) {
+    if (completion.res >= 0) { close(completion.res); }
+    connection.opening = false;
+    return;
+  }
+  if (completion.res < 0) {
+    connection.opening = false;
+    finishOpen(connection, completion.res);
+    return;
+  }
+
+  connection.opened_fd = completion.res;
+  struct io_uring_sqe* sqe = prepare(slot, Op::Stat);
+  if (sqe == nullptr) {
+    close(connection.opened_fd);
+    connection.opening = false;
+    beginClose(slot);
+    return;
+  }
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = connection.opened_fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(""); //with AT_EMPTY_PATH, the fd itself
+  sqe->statx_flags = AT_EMPTY_PATH;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = reinterpret_cast<std::uint64_t>(&connection.info);
+}
+
+
+void UringWorker::onStat(std::uint32_t slot, const struct io_uring_cqe& completion) {
+  Connection& connection = *connections[slot];
+  connection.opening = false;
+  if (connection.closing || completion.res < 0) {
+    close(connection.opened_fd);
+    if (!connection.closing) { finishOpen(connection, completion.res); }
+    return;
+  }
+  finishOpen(connection, connection.opened_fd);
+}
+
+
+void UringWorker::onClose(std::uint32_t slot, const struct io_uring_cqe& completion) {
+  Connection& connection = *connections[slot];
+  if (completion.res == -ECANCELED) { //the send it was linked to failed, so it never ran
+    connection.closeSubmitted = false;
+    return;
+  }
+  connection.closed = true;
+}
+
+
+void UringWorker::advance(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  if (!connection.closing) {
+    startOpen(slot);
+    startSend(slot);
+    if (!connection.sending && connection.out.empty() && connection.closeAfterFlush) { beginClose(slot); }
+  }
+  if (connection.closing) {
+    if (!connection.sending && !connection.opening && !connection.closeSubmitted) { submitClose(slot); }
+    if (connection.closed && connection.inFlight == 0) { release(slot); }
+  }
+}
+
+
+void UringWorker::startOpen(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  if (connection.opening) { return; }
+  for (HttpResponse& response : connection.out) {
+    if (!response.deferred) { continue; }
+    const FilePath& file = response.deferred->file;
+    connection.openPath.assign(file.relative.data(), file.relative.size());
+    struct io_uring_sqe* sqe = prepare(slot, Op::Open);
+    if (sqe == nullptr) {
+      beginClose(slot);
+      return;
+    }
+    sqe->opcode = IORING_OP_OPENAT2; //beneath the directory, like openFile() - refer path_resolver.hpp
+    sqe->fd = file.directory_fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(connection.openPath.c_str());
+    sqe->len = sizeof(openBeneath);
+    sqe->off = reinterpret_cast<std::uint64_t>(&openBeneath);
+    connection.opening = true;
+    return;
+  } //one at a time, in request order - the same order they're sent in
+}
+
+
+void UringWorker::finishOpen(Connection& connection, int result) {
+  ArenaScope scope(connection.session.arena); //the head goes where it would have gone while answering
+  for (HttpResponse& response : connection.out) {
+    if (!response.deferred) { continue; }
+    HttpResponse::DeferredOpen open = std::move(*response.deferred);
+    const std::pmr::string& path = open.file.full;
+    HttpResponse opened;
+    if (result < 0) {
+      if (result == -ENOENT || result == -ENOTDIR) { statCache().insertMissing(path); } //the next request for it is a 404 straight away
+      opened = HttpResponse(emptyResponse(HTTP404));
+    } else {
+      struct stat info = toStat(connection.info);
+      statCache().insert(path, info);
+      opened = openedFileResponse(result, info, path, open.contentType, open.conditions);
+    }
+    if (open.closeConnection) { opened.head = markConnectionClose(std::move(opened.head)); }
+    opened.route = response.route;
+    metrics().countResponse(opened.route, statusCode(opened.head)); //answerRequests() left that to us
+    logDebug("client ", connection.fd, "'s file ", path, ": ", std::string_view(opened.head).substr(9, 3));
+    response = std::move(opened);
+    return;
+  }
+} //replaces the first deferred response, the one startOpen() opened
+
+
+void UringWorker::startSend(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  if (connection.sending || connection.out.empty()) { return; }
+
+  HttpResponse& front = connection.out.front();
+  if (!front.deferred && front.headSent == front.head.size() && front.bodySent == front.body.size() && front.fileLength > 0) {
+    /* A file body, a chunk at a time: the read is linked to the send, so the kernel starts the send once the read is
+      done - or cancels it if the read failed or came up short. */
+    if (connection.fileChunk == nullptr) { connection.fileChunk = std::make_unique<char[]>(fileChunkSize); }
+    connection.chunkLength = std::min(front.fileLength, fileChunkSize);
+    struct io_uring_sqe* read = prepare(slot, Op::FileRead);
+    struct io_uring_sqe* send = (read != nullptr) ? prepare(slot, Op::FileSend) : nullptr;
+    if (send == nullptr) {
+      if (read != nullptr) { read->opcode = IORING_OP_NOP; } //it's queued already - a linked read would take the next entry along
+      beginClose(slot);
+      return;
+    }
+    read->opcode = IORING_OP_READ;
+    read->flags = IOSQE_IO_LINK;
+    read->fd = front.file_fd;
+    read->addr = reinterpret_cast<std::uint64_t>(connection.fileChunk.get());
+    read->len = connection.chunkLength;
+    read->off = front.fileOffset;
+    send->opcode = IORING_OP_SEND;
+    send->fd = connection.fd;
+    send->addr = reinterpret_cast<std::uint64_t>(connection.fileChunk.get());
+    send->len = connection.chunkLength;
+    send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; //all of it, or the connection is done for
+    connection.sending = true;
+    return;
+  }
+
+  bool everything;
+  std::size_t partCount = gatherResponses(connection.out, connection.parts, everything);
+  if (partCount == 0) { return; } //the front is a deferred file, still being opened
+  bool last = everything && connection.closeAfterFlush;
+  if (last) {
+    connection.closing = true;
+    if (connection.receiving) {
+      struct io_uring_sqe* cancel = prepare(slot, Op::Cancel);
+      if (cancel != nullptr) {
+        cancel->opcode = IORING_OP_ASYNC_CANCEL;
+        cancel->addr = userData(slot, Op::Receive);
+      }
+    }
+  }
+
+  connection.message = {};
+  connection.message.msg_iov = connection.parts.data();
+  connection.message.msg_iovlen = partCount;
+  struct io_uring_sqe* sqe = prepare(slot, Op::Send);
+  if (sqe == nullptr) {
+    beginClose(slot);
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = connection.fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(&connection.message);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  connection.sending = true;
+
+  /* The last send of a connection that's closing takes the close() along: linked, the kernel closes the socket right
+    after everything has been sent, without another trip through this loop. MSG_WAITALL makes a short send count as
+    failed, which cancels the close - onClose() then submits one of its own. */
+  if (last) {
+    struct io_uring_sqe* closing = prepare(slot, Op::Close);
+    if (closing == nullptr) { return; } //advance() closes it once the send is done
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe->msg_flags |= MSG_WAITALL;
+    closing->opcode = IORING_OP_CLOSE;
+    closing->fd = connection.fd;
+    connection.closeSubmitted = true;
+    admission().release(connection.fd); //refer submitClose()
+  }
+}
+
+
+void UringWorker::holdReceiving(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  connection.backedUp = true;
+  if (!connection.receiving) { return; } //it ended anyway, onReceive() won't arm it again
+  struct io_uring_sqe* sqe = prepare(slot, Op::Cancel);
+  if (sqe == nullptr) {
+    beginClose(slot);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = userData(slot, Op::Receive);
+} //completions the kernel already queued still come, and their bytes are kept for resumeReceiving()
+
+
+void UringWorker::resumeReceiving(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  connection.backedUp = false;
+  if (connection.closing || !connection.session.keepAlive) { return; }
+  {
+    TraceSample sample("connection");
+    answerRequests(connection.fd, connection.session, connection.out, config); //what came while it was held
+  }
+  if (!connection.session.keepAlive) { connection.closeAfterFlush = true; }
+  else if (connection.out.backedUp()) { holdReceiving(slot); }
+  else if (!connection.receiving && !submitReceive(slot)) { beginClose(slot); } /*still receiving if the cancel hasn't
+    completed yet - onReceive() arms it again once it has*/
+}
+
+
+void UringWorker::beginClose(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  if (connection.closing) { return; }
+  connection.closing = true;
+  if (connection.receiving) {
+    struct io_uring_sqe* sqe = prepare(slot, Op::Cancel);
+    if (sqe == nullptr) { shutdown(connection.fd, SHUT_RDWR); } //ends the recv just the same
+    else {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = userData(slot, Op::Receive);
+    }
+  }
+} //advance() submits the close once nothing else is in flight
+
+
+void UringWorker::scheduleDeadline(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  auto now = std::chrono::steady_clock::now();
+  if (!connection.out.empty()) { timers.schedule(connection.deadline, now + std::chrono::seconds(config.bodyTimeout)); } //sending, or its file is opening
+  else { timers.schedule(connection.deadline, connection.session.readDeadline(now, config)); }
+}
+
+
+void UringWorker::stopAccepting() {
+  accepting = false;
+  struct io_uring_sqe* sqe = ring.nextSqe();
+  if (sqe != nullptr) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = userData(0, Op::Accept);
+    sqe->user_data = userData(0, Op::StopAccepting);
+  } //if the queue is full, connections that are accepted anyway are served, and closed after their first request
+  for (std::uint32_t slot = 0; slot < connections.size(); slot++) {
+    if (connections[slot] != nullptr && !connections[slot]->closing && finished(slot)) {
+      beginClose(slot);
+      advance(slot);
+    }
+  }
+} //refer drain.hpp. The listener stays open - main() closes it, and a server taking over has its own copy
+
+
+bool UringWorker::finished(std::uint32_t slot) const {
+  const Connection& connection = *connections[slot];
+  return !accepting && !connection.opening && !connection.sending && connection.out.empty() && connection.session.betweenRequests();
+}
+
+
+void UringWorker::expire(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  logDebug("client ", connection.fd, " timed out");
+  /* A send to a client that stopped reading waits in the kernel for as long as it takes - cancelling it (and the close
+    linked to it, which advance() then submits on its own) is what lets the connection go. */
+  if (connection.sending) {
+    for (Op op : { Op::Send, Op::FileRead, Op::FileSend }) {
+      struct io_uring_sqe* sqe = prepare(slot, Op::Cancel);
+      if (sqe == nullptr) { break; }
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = userData(slot, op);
+    } //only one of them is in flight, the others' cancels fail with ENOENT
+  }
+  beginClose(slot);
+  advance(slot);
+}
+
+
+void UringWorker::release(std::uint32_t slot) {
+  logDebug("closed client ", connections[slot]->fd);
+  connections[slot].reset();
+  metrics().connectionClosed();
+  freeSlots.push_back(slot);
+}
+
+
+struct io_uring_sqe* UringWorker::prepare(std::uint32_t slot, Op op) {
+  struct io_uring_sqe* sqe = ring.nextSqe();
+  if (sqe == nullptr) {
+    logError("io_uring submission queue full");
+    return nullptr;
+  }
+  sqe->user_data = userData(slot, op);
+  connections[slot]->inFlight++;
+  return sqe;
+} //an entry for slot's op, counted as in flight
+
+
+bool UringWorker::submitAccept() {
+  struct io_uring_sqe* sqe = ring.nextSqe();
+  if (sqe == nullptr) { return false; }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = userData(0, Op::Accept);
+  return true;
+}
+
+
+bool UringWorker::submitTimer() {
+  struct io_uring_sqe* sqe = ring.nextSqe();
+  if (sqe == nullptr) { return false; }
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = reinterpret_cast<std::uint64_t>(&tick);
+  sqe->len = 1;
+  sqe->user_data = userData(0, Op::Timer);
+  return true;
+} //completes once a tick, so deadlines pass even when nothing else happens
+
+
+bool UringWorker::submitDrainPoll() {
+  struct io_uring_sqe* sqe = ring.nextSqe();
+  if (sqe == nullptr) { return false; }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = drainNotice();
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = userData(0, Op::Drain);
+  return true;
+} //completes once, when the drain begins
+
+
+bool UringWorker::submitReceive(std::uint32_t slot) {
+  struct io_uring_sqe* sqe = prepare(slot, Op::Receive);
+  if (sqe == nullptr) { return false; }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = connections[slot]->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = receiveBufferGroup;
+  connections[slot]->receiving = true;
+  return true;
+}
+
+
+void UringWorker::submitClose(std::uint32_t slot) {
+  Connection& connection = *connections[slot];
+  connection.closeSubmitted = true;
+  admission().release(connection.fd); //now, while the fd is still ours - another worker may be handed the same number once it's closed
+  struct io_uring_sqe* sqe = prepare(slot, Op::Close);
+  if (sqe == nullptr) {
+    close(connection.fd);
+    connection.closed = true;
+    return;
+  }
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = connection.fd;
+}
+
+
+static struct stat toStat(const struct statx& info) {
+  struct stat converted = {};
+  converted.st_mode = info.stx_mode;
+  converted.st_size = info.stx_size;
+  converted.st_ino = info.stx_ino;
+  converted.st_dev = makedev(info.stx_dev_major, info.stx_dev_minor);
+  converted.st_mtim = { static_cast<time_t>(info.stx_mtime.tv_sec), static_cast<long>(info.stx_mtime.tv_nsec) };
+  return converted;
+} //the fields openedFileResponse() and the caches look at
+
+
+
+
+bool Ring::setup(unsigned entries) {
+  struct io_uring_params params = {};
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = entries * 4; //multishot accepts and receives can produce more completions than we submit
+  ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0 && errno == EINVAL) { //kernels before 6.0 don't know the last two
+    params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  }
+  if (ring_fd < 0) { return false; }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMapping = params.features & IORING_FEAT_SINGLE_MMAP; //both rings in one mapping, since 5.4
+  if (singleMapping) { sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize); }
+
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sqRing == MAP_FAILED) { return false; }
+  cqRing = singleMapping ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  if (cqRing == MAP_FAILED) { return false; }
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+  if (sqes == MAP_FAILED) { return false; }
+
+  char* sq = static_cast<char*>(sqRing);
+  sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqEntries = params.sq_entries;
+  sqQueued = *sqTail;
+  char* cq = static_cast<char*>(cqRing);
+  cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+
+Ring::~Ring() {
+  if (sqes != MAP_FAILED) { munmap(sqes, sqesSize); }
+  if (cqRing != MAP_FAILED && cqRing != sqRing) { munmap(cqRing, cqRingSize); }
+  if (sqRing != MAP_FAILED) { munmap(sqRing, sqRingSize); }
+  if (ring_fd >= 0) { close(ring_fd); }
+}
+
+
+struct io_uring_sqe* Ring::nextSqe() {
+  if (sqQueued - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire) >= sqEntries) {
+    submit(); //make room
+    if (sqQueued - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire) >= sqEntries) { return nullptr; }
+  }
+  unsigned index = sqQueued & sqMask;
+  sqes[index] = {};
+  sqArray[index] = index;
+  sqQueued++;
+  return &sqes[index];
+}
+
+
+bool Ring::submit(unsigned waitFor) {
+  std::atomic_ref<unsigned>(*sqTail).store(sqQueued, std::memory_order_release);
+  unsigned toSubmit = sqQueued - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+  unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (syscall(__NR_io_uring_enter, ring_fd, toSubmit, waitFor, flags, nullptr, 0) < 0) {
+    if (errno == EINTR) { return true; } //a signal - the loop comes round again
+    if (errno == EAGAIN || errno == EBUSY) { return true; } //too many completions waiting, they have to be handled first
+    return false;
+  }
+  return true;
+}
+
+
+bool ReceiveBuffers::setup(int ring_fd, unsigned count, std::size_t size) {
+  this->size = size;
+  mask = count - 1;
+  ringSize = count * sizeof(struct io_uring_buf);
+  ring = static_cast<struct io_uring_buf_ring*>(mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)); //page aligned, as the kernel wants
+  if (ring == MAP_FAILED) { return false; }
+
+  struct io_uring_buf_reg registration = {};
+  registration.ring_addr = reinterpret_cast<std::uint64_t>(ring);
+  registration.ring_entries = count;
+  registration.bgid = receiveBufferGroup;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) { return false; }
+
+  memory = std::make_unique<char[]>(count * size);
+  for (unsigned id = 0; id < count; id++) { recycle(id); }
+  return true;
+}
+
+
+ReceiveBuffers::~ReceiveBuffers() {
+  if (ring != MAP_FAILED) { munmap(ring, ringSize); }
+}
+
+
+void ReceiveBuffers::recycle(std::uint16_t id) {
+  /* not ring->bufs[] - compiled as C++, the kernel header's flexible array member starts 8 bytes late. The entries
+    start at the beginning of the ring, the tail overlaying the first one's last field. */
+  struct io_uring_buf& entry = reinterpret_cast<struct io_uring_buf*>(ring)[tail & mask];
+  entry.addr = reinterpret_cast<std::uint64_t>(data(id));
+  entry.len = size;
+  entry.bid = id;
+  tail++;
+  std::atomic_ref<std::uint16_t>(ring->tail).store(tail, std::memory_order_release);
+}
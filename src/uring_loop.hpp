@@ -0,0 +1,9 @@
+#pragma once
+
+#include <vector>
+
+#include "server.hpp"
+
+
+bool uringAvailable(); //whether this kernel has everything the io_uring workers need. Logs what's missing if not
+int runUringLoops(const std::vector<int>& listeners, const ServerConfig& config); //a worker per listener. Blocks until every worker has exited
@@ -0,0 +1,89 @@
+#include "worker_pool.hpp"
+
+
+FdQueue::FdQueue(std::size_t capacity) {
+  std::size_t size = 2;
+  while (size < capacity) { size *= 2; }
+  slots = std::make_unique<Slot[]>(size);
+  for (std::size_t i = 0; i < size; i++) { slots[i].sequence.store(i, std::memory_order_relaxed); }
+  mask = size - 1;
+}
+
+
+bool FdQueue::tryPush(int fd) {
+  std::size_t position = enqueuePosition.load(std::memory_order_relaxed);
+  while (true) {
+    Slot& slot = slots[position & mask];
+    std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+    if (difference == 0) {
+      if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        slot.fd = fd;
+        slot.sequence.store(position + 1, std::memory_order_release); //now readable
+        return true;
+      }
+    } else if (difference < 0) {
+      return false; //the slot still holds an fd from a lap ago - full
+    } else {
+      position = enqueuePosition.load(std::memory_order_relaxed); //another producer got here first
+    }
+  }
+}
+
+
+bool FdQueue::tryPop(int& fd) {
+  std::size_t position = dequeuePosition.load(std::memory_order_relaxed);
+  while (true) {
+    Slot& slot = slots[position & mask];
+    std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    auto difference = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+    if (difference == 0) {
+      if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        fd = slot.fd;
+        slot.sequence.store(position + mask + 1, std::memory_order_release); //writable again on the next lap
+        return true;
+      }
+    } else if (difference < 0) {
+      return false; //nothing written here yet - empty
+    } else {
+      position = dequeuePosition.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+
+WorkerPool::WorkerPool(std::size_t threadCount, std::size_t queueCapacity, std::function<void(int)> handler)
+  : queue(queueCapacity), handler(std::move(handler)) {
+  workers.reserve(threadCount);
+  for (std::size_t i = 0; i < threadCount; i++) {
+    workers.emplace_back(&WorkerPool::work, this);
+  }
+}
+
+
+WorkerPool::~WorkerPool() {
+  stopping.store(true);
+  queued.release(workers.size()); //wake everyone up so they notice
+  for (std::thread& worker : workers) { worker.join(); }
+}
+
+
+bool WorkerPool::submit(int client_fd) {
+  if (!queue.tryPush(client_fd)) { return false; }
+  queued.release();
+  return true;
+}
+
+
+void WorkerPool::work() {
+  while (true) {
+    queued.acquire();
+    int client_fd;
+    while (!queue.tryPop(client_fd)) {
+      if (stopping.load()) { return; } //the queue is drained
+      std::this_thread::yield(); //our fd's producer claimed its slot but hasn't filled it in yet
+    }
+    handler(client_fd);
+  }
+} /* every count on the semaphore stands for an fd, except the ones the destructor adds to wake the workers up - and
+  those only come once nothing more is being submitted, so a worker that finds the queue empty then knows to stop */
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <semaphore>
+#include <thread>
+#include <vector>
+
+
+/**
+ * A bounded multi-producer multi-consumer queue of file descriptors that never takes a lock.
+ * 
+ * It's Dmitry Vyukov's bounded MPMC queue: every slot carries a sequence number saying whether it's ready to be
+ *    written (sequence == position) or read (sequence == position + 1), and producers/consumers claim positions
+ *    with a compare-and-swap on their end of the ring. Capacity is rounded up to a power of two.
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+*/
+class FdQueue {
+  public:
+    explicit FdQueue(std::size_t capacity);
+
+    bool tryPush(int fd); //false if the queue is full
+    bool tryPop(int& fd); //false if the queue is empty
+    std::size_t capacity() const { return mask + 1; }
+
+  private:
+    struct alignas(64) Slot { //one cache line each, so neighbouring slots don't bounce between cores
+      std::atomic<std::size_t> sequence;
+      int fd;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    alignas(64) std::atomic<std::size_t> enqueuePosition{0};
+    alignas(64) std::atomic<std::size_t> dequeuePosition{0};
+};
+
+/**
+ * A fixed number of threads, started up front, that take accepted client sockets off an FdQueue.
+ * 
+ * submit() never blocks and never starts a thread - once the queue is full it returns false, and the caller decides
+ *    what to do with the connection (main() answers 503). So a flood of connections costs queue slots, not threads.
+*/
+class WorkerPool {
+  public:
+    WorkerPool(std::size_t threadCount, std::size_t queueCapacity, std::function<void(int)> handler);
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    ~WorkerPool(); //lets the workers finish the queued connections, then joins them
+
+    bool submit(int client_fd);
+
+  private:
+    FdQueue queue;
+    std::counting_semaphore<> queued{0}; //one count per fd in the queue, workers sleep on it
+    std::function<void(int)> handler;
+    std::atomic<bool> stopping{false};
+    std::vector<std::thread> workers;
+
+    void work();
+};
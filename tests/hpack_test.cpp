@@ -0,0 +1,99 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpack.hpp"
+
+
+/**
+ * HpackDecoder against blocks a client shouldn't send - run by ctest, or on its own:
+ *
+ *    cmake --build . --target hpack_test && ./hpack_test
+ *
+ * Prints what failed, and exits non-zero if anything did.
+*/
+
+namespace {
+  int failures = 0;
+
+  void check(bool passed, std::string_view what) {
+    if (!passed) {
+      std::cerr << "FAILED: " << what << "\n";
+      failures++;
+    }
+  }
+
+  std::string literalWithIndexing(std::string_view name, std::string_view value) {
+    std::string field(1, '\x40'); //literal with incremental indexing, new name
+    for (std::string_view part : { name, value }) {
+      std::size_t length = part.size();
+      if (length < 127) { field += static_cast<char>(length); }
+      else { //7-bit prefix integer, RFC 7541 section 5.1
+        field += '\x7f';
+        for (length -= 127; length >= 128; length /= 128) { field += static_cast<char>(0x80 | (length % 128)); }
+        field += static_cast<char>(length);
+      }
+      field.append(part);
+    }
+    return field;
+  } //not Huffman coded
+}
+
+
+static void decodesWithinLimit() {
+  HpackDecoder decoder;
+  std::string text;
+  std::vector<DecodedHeader> headers;
+  std::string block = "\x82\x84" + literalWithIndexing("x-test", "value"); //:method GET, :path /
+  check(decoder.decode(block, text, headers, 8192) == HpackResult::Decoded, "a small block decodes");
+  check(headers.size() == 3, "a small block has all its fields");
+  check(text == ":methodGET:path/x-testvalue", "a small block's text");
+}
+
+
+static void stopsExpandingPastLimit() {
+  //a 4000 byte field into the dynamic table, then a one byte reference to it over and over
+  std::string block = "\x82\x84" + literalWithIndexing("x-bomb", std::string(4000, 'a'));
+  block.append(44000, '\xbe'); //index 62, the dynamic table's newest entry
+  HpackDecoder decoder;
+  std::string text;
+  std::vector<DecodedHeader> headers;
+  check(decoder.decode(block, text, headers, 8192) == HpackResult::TooLarge, "an expanding block is too large");
+  check(text.size() <= 8192, "an expanding block isn't decoded past the limit");
+  check(headers.size() == 4, "an expanding block's fields stop at the limit"); //the literal and one reference fit, 4038 each
+
+  //the table still kept up with the block, so the connection can go on
+  text.clear();
+  headers.clear();
+  check(decoder.decode("\xbe", text, headers, 8192) == HpackResult::Decoded, "the next block decodes");
+  check(headers.size() == 1 && text == "x-bomb" + std::string(4000, 'a'), "the next block sees the table as it was left");
+}
+
+
+static void countsFieldOverhead() {
+  HpackDecoder decoder;
+  std::string text;
+  std::vector<DecodedHeader> headers;
+  std::string block(300, '\x82'); //300 :method GETs - 10 bytes of text each, 42 as SETTINGS_MAX_HEADER_LIST_SIZE counts them
+  check(decoder.decode(block, text, headers, 8192) == HpackResult::TooLarge, "every field counts 32 bytes on top");
+  check(headers.size() == 8192 / 42, "fields stop where the counted size passes the limit");
+}
+
+
+static void rejectsMalformed() {
+  HpackDecoder decoder;
+  std::string text;
+  std::vector<DecodedHeader> headers;
+  check(decoder.decode("\xff\x7f", text, headers, 8192) == HpackResult::Malformed, "an index past the table is malformed");
+}
+
+
+int main() {
+  decodesWithinLimit();
+  stopsExpandingPastLimit();
+  countsFieldOverhead();
+  rejectsMalformed();
+  if (failures == 0) { std::cout << "hpack_test: all passed\n"; }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <memory_resource>
+#include <filesystem>
+#include <cerrno>
+#include <cstdlib>
+
+#include "path_resolver.hpp"
+#include "upload.hpp"
+
+
+/**
+ * FileUpload against a --directory with symlinks in it - run by ctest, or on its own:
+ *
+ *    cmake --build . --target upload_test && ./upload_test
+ *
+ * Works in a fresh directory under $TMPDIR (or /tmp), and removes it again. Prints what failed, and exits non-zero if
+ *    anything did.
+*/
+
+namespace fs = std::filesystem;
+
+namespace {
+  int failures = 0;
+
+  void check(bool passed, std::string_view what) {
+    if (!passed) {
+      std::cerr << "FAILED: " << what << "\n";
+      failures++;
+    }
+  }
+
+  std::string contents(const fs::path& path) {
+    std::ifstream file(path);
+    std::stringstream read;
+    read << file.rdbuf();
+    return read.str();
+  }
+
+  bool upload(const FileRoot& root, std::string_view requested, std::string_view body) {
+    FilePath destination(std::pmr::get_default_resource());
+    FileUpload upload;
+    if (!root.resolve(requested, destination) || !upload.begin(destination, UploadSync::None)) { return false; }
+    upload.write(body);
+    return upload.finish();
+  }
+
+  bool onlyFileIn(const fs::path& directory, std::string_view name) {
+    std::size_t count = 0;
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory)) {
+      if (entry.path().filename() != name) { return false; }
+      count++;
+    }
+    return count == 1;
+  } //and no .upload- left behind
+}
+
+
+static void savesBeneath(const fs::path& served, const FileRoot& root) {
+  fs::create_directory(served / "sub");
+  check(upload(root, "sub/a.txt", "hello"), "an upload beneath the directory is saved");
+  check(contents(served / "sub/a.txt") == "hello", "an upload's body is what was saved");
+  check(onlyFileIn(served / "sub", "a.txt"), "an upload leaves nothing else behind");
+
+  check(upload(root, "sub/a.txt", "again"), "an upload replaces what was there");
+  check(contents(served / "sub/a.txt") == "again", "a replaced file has the new body");
+}
+
+
+static void refusesSymlinkOut(const fs::path& served, const fs::path& outside, const FileRoot& root) {
+  fs::create_directory_symlink(outside, served / "link");
+  FilePath destination(std::pmr::get_default_resource());
+  FileUpload upload;
+  check(root.resolve("link/pwn.txt", destination), "a symlinked path still resolves");
+  errno = 0;
+  check(!upload.begin(destination, UploadSync::None), "an upload through a symlink out of the directory is refused");
+  check(errno == EXDEV, "a refused upload says it led out of the directory");
+  check(fs::is_empty(outside), "nothing is created outside the directory");
+}
+
+
+static void followsSymlinkWithin(const fs::path& served, const FileRoot& root) {
+  fs::create_directory(served / "real");
+  fs::create_directory_symlink("real", served / "alias");
+  check(upload(root, "alias/b.txt", "within"), "an upload through a symlink that stays beneath is saved");
+  check(contents(served / "real/b.txt") == "within", "it lands where the symlink points");
+}
+
+
+int main() {
+  const char* temporary = std::getenv("TMPDIR");
+  std::string base = (temporary != nullptr && *temporary != '\0') ? temporary : "/tmp";
+  std::string scratch = base + "/upload_test-XXXXXX";
+  if (mkdtemp(scratch.data()) == nullptr) {
+    std::cerr << "can't create a scratch directory in " << base << "\n";
+    return 1;
+  }
+  fs::path served = fs::path(scratch) / "served", outside = fs::path(scratch) / "outside";
+  fs::create_directory(served);
+  fs::create_directory(outside);
+
+  FileRoot root;
+  check(root.open(served.string()), "the served directory opens");
+  savesBeneath(served, root);
+  refusesSymlinkOut(served, outside, root);
+  followsSymlinkWithin(served, root);
+
+  fs::remove_all(scratch);
+  if (failures == 0) { std::cout << "upload_test: all passed\n"; }
+  return failures == 0 ? 0 : 1;
+}